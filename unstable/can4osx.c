@@ -42,16 +42,15 @@
 
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
 
 #include "can4osx.h"
 #include "can4osx_debug.h"
 #include "can4osx_internal.h"
-
-#include <CoreFoundation/CoreFoundation.h>
-#include <IOKit/IOKitLib.h>
-#include <IOKit/IOMessage.h>
-#include <IOKit/IOCFPlugIn.h>
-#include <IOKit/usb/IOUSBLib.h>
+#include "can4osx_usb_core.h"
 
 // Hardeware specific headers
 #include "kvaserLeaf.h"
@@ -60,39 +59,58 @@
 #include "peakUsbFd.h"
 
 
-Can4osxUsbDeviceHandleEntry can4osxUsbDeviceHandle[CAN4OSX_MAX_CHANNEL_COUNT];
+// the channels, see CAN4OSX_EnterChannel. A slot is reused with a new generation
+CAN4OSX_CHANNEL_TABLE_T * _Atomic pCan4osxChannelTable = NULL;
+atomic_uint can4osxChannelCount = 0u;
 
-static UInt32 can4osxMaxChannelCount = 0;
+static pthread_mutex_t can4osxChannelMutex = PTHREAD_MUTEX_INITIALIZER;
 
 
-static CAN4OSX_DEV_ENTRY_T can4osxSupportedDevices[] =
+const CAN4OSX_DEV_ENTRY_T can4osxSupportedDevices[] =
 {
-	// Vendor Id, Product Id
-	{0x0bfd, 0x0120}, //Kvaser Leaf Light v.2
-	{0x0bfd, 0x0107}, //Kvaser Leaf Pro HS v.2
-	{0x0bfd, 0x0108}, //Kvaser USBcan Pro 2xHS v.2
-	{0x0bfd, 0x000E}, //Kvaser Leaf SemiPro HS
-	{0x08d8, 0x0017}, //IXXAT USB-to-CAN FD Automotive
-	{0x08d8, 0x0014}, //IXXAT USB-to-CAN FD compact
-	{0x0c72, 0x0012}, //Peak USB FD
+	// Vendor Id, Product Id, queued bulk in transfers
+	{0x0bfd, 0x0120, 4}, //Kvaser Leaf Light v.2
+	{0x0bfd, 0x0107, 8}, //Kvaser Leaf Pro HS v.2
+	{0x0bfd, 0x0108, 8}, //Kvaser USBcan Pro 2xHS v.2, one pipe for both channels
+	{0x0bfd, 0x000E, 4}, //Kvaser Leaf SemiPro HS
+	{0x08d8, 0x0017, 4}, //IXXAT USB-to-CAN FD Automotive, per channel
+	{0x08d8, 0x0014, 4}, //IXXAT USB-to-CAN FD compact
+	{0x0c72, 0x0012, 4}, //Peak USB FD
 };
 
+const UInt32 can4osxSupportedDeviceCount = (sizeof(can4osxSupportedDevices)/sizeof(CAN4OSX_DEV_ENTRY_T));
+
 
 // Internal stuff
-static IONotificationPortRef can4osxUsbNotificationPortRef = 0;
-static io_iterator_t can4osxIoIterator[(sizeof(can4osxSupportedDevices)/sizeof(CAN4OSX_DEV_ENTRY_T))];
-static dispatch_semaphore_t semaCan4osxStart = NULL;
+static const CAN4OSX_USB_TRANSPORT_T *pCan4osxTransport = &CAN4OSX_DEFAULT_TRANSPORT;
 static dispatch_queue_t queueCan4osx = NULL;
+static dispatch_queue_t queueCan4osxSetup = NULL;
+static dispatch_queue_t queueCan4osxTimeSync = NULL;
+static dispatch_source_t timerCan4osxTimeSync = NULL;
+
+// adapters being set up, the enumeration at startup counts as one
+static pthread_mutex_t can4osxSetupMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t can4osxSetupCond;	// see CAN4OSX_SetupCond
+static pthread_once_t can4osxSetupOnce = PTHREAD_ONCE_INIT;
+static UInt32 can4osxSetupPending = 0u;
 
 
 static void CAN4OSX_CanInitializeLibrary(void);
-static void CAN4OSX_DeviceAdded(void *refCon, io_iterator_t iterator);
-static IOReturn CAN4OSX_ConfigureDevice(IOUSBDeviceInterface182 **dev);
-static IOReturn CAN4OSX_FindInterfaces(Can4osxUsbDeviceHandleEntry *handle);
-static void CAN4OSX_DeviceNotification(void *refCon, io_service_t service, natural_t messageType, void *messageArgument);
-static CanHandle CAN4OSX_CheckHandle(const CanHandle hnd);
-static IOReturn CAN4OSX_CreateEndpointBuffer( const CanHandle hnd );
-static IOReturn CAN4OSX_Dealloc(Can4osxUsbDeviceHandleEntry	*self);
+static canStatus CAN4OSX_WaitStatus(Can4osxUsbDeviceHandleEntry *pSelf, CAN_EVENT_MSG_BUF_T *pBuffer);
+static canStatus CAN4OSX_IoCtl(Can4osxUsbDeviceHandleEntry *pSelf, UInt32 func, void *pBuffer, UInt32 bufferSize);
+static CanHandle CAN4OSX_AllocChannel(void);
+static void CAN4OSX_FreeChannel(const CanHandle hnd);
+static void CAN4OSX_ActivateChannel(const CanHandle hnd);
+static void CAN4OSX_SetupCondInit(void);
+static pthread_cond_t* CAN4OSX_SetupCond(void);
+static void CAN4OSX_WaitChannelReady(int channel);
+static void CAN4OSX_SetupDone(void);
+static void CAN4OSX_TimeSync(void *pContext);
+static canStatus CAN4OSX_MergeRead(CanMergeReader *pReader, CanMsg *pMsg, CanHandle *pHnd, UInt64 *pTime, UInt32 timeout);
+static bool CAN4OSX_MergePeek(CanMergeReader *pReader, UInt32 source);
+static void CAN4OSX_MergeSiftDown(CanMergeReader *pReader, UInt32 pos);
+static void CAN4OSX_MergePush(CanMergeReader *pReader, UInt32 source);
+static void CAN4OSX_MergePop(CanMergeReader *pReader);
 
 bool bIsLoaded = false;
 
@@ -110,28 +128,55 @@ void canInitializeLibrary (
 		void
 	)
 {
-	if (true == bIsLoaded )  {
-		return;
-	}
-	if (queueCan4osx != NULL)  {
-		// If the queue already exist, the this function was already called
-		return;
-	}
-	// Create a queue to run in background, so the driver has his own task
-	queueCan4osx = dispatch_queue_create("can4osx", NULL);
-	semaCan4osxStart = dispatch_semaphore_create(0);
+	(void)canInitializeLibraryEx(0u);
+}
 
-	dispatch_set_target_queue(queueCan4osx, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0));
-	//Get a own thread where the usb stuff runs
-	dispatch_async(queueCan4osx, ^(void) {
-		CAN4OSX_CanInitializeLibrary();
-	});
-	// Wait here until the background usb task is done
-	dispatch_semaphore_wait(semaCan4osxStart, DISPATCH_TIME_FOREVER);
 
-	dispatch_release(semaCan4osxStart);
+/******************************************************************************/
+/**
+ * \brief canInitializeLibraryEx - intializing the driver
+ *
+ * Like canInitializeLibrary. The adapters found are set up in parallel and
+ * the call returns when all of them are ready. With canINIT_NO_WAIT it
+ * returns at once, canGetNumberOfChannels counts the channels known so far
+ * and canOpenChannel waits for a channel whose adapter is still being set up.
+ *
+ * \return canStatus
+ */
+canStatus canInitializeLibraryEx (
+		UInt32 flags
+	)
+{
+	if ( queueCan4osx == NULL )  {
+		// Create a queue to run in background, so the driver has his own task
+		queueCan4osx = dispatch_queue_create("can4osx", NULL);
+		// the adapters are set up side by side
+		queueCan4osxSetup = dispatch_queue_create("com.can4osx.setup", DISPATCH_QUEUE_CONCURRENT);
+
+		dispatch_set_target_queue(queueCan4osx, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0));
+
+		pthread_mutex_lock(&can4osxSetupMutex);
+		can4osxSetupPending++;
+		pthread_mutex_unlock(&can4osxSetupMutex);
+
+		//Get a own thread where the usb stuff runs
+		dispatch_async(queueCan4osx, ^(void) {
+			CAN4OSX_CanInitializeLibrary();
+		});
+	}
+
+	if ( (flags & canINIT_NO_WAIT) == 0u )  {
+		// Wait here until the adapters found at startup are set up
+		pthread_mutex_lock(&can4osxSetupMutex);
+		while ( can4osxSetupPending != 0u )  {
+			pthread_cond_wait(CAN4OSX_SetupCond(), &can4osxSetupMutex);
+		}
+		pthread_mutex_unlock(&can4osxSetupMutex);
+	}
 
 	bIsLoaded = true;
+
+	return(canOK);
 }
 
 
@@ -148,12 +193,24 @@ canStatus canBusOn(
 		const CanHandle hnd /**< handle to the CAN channel */
 	)
 {
-	if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_EnterChannel(hnd);
+canStatus status;
+bool wasOn;
+
+	if ( pSelf == NULL )  {
 		return(canERR_INVHANDLE);
-	} else {
-		Can4osxUsbDeviceHandleEntry *self = &can4osxUsbDeviceHandle[hnd];
-		return(self->hwFunctions.can4osxhwCanBusOnRef(hnd));
 	}
+
+	// set first, the decoder may see frames before the device answers
+	wasOn = atomic_exchange_explicit(&pSelf->busOn, true, memory_order_seq_cst);
+	status = pSelf->hwFunctions.can4osxhwCanBusOnRef(hnd);
+	if ( status != canOK )  {
+		atomic_store_explicit(&pSelf->busOn, wasOn, memory_order_seq_cst);
+	}
+
+	CAN4OSX_LeaveChannel(hnd);
+
+	return(status);
 }
 
 
@@ -170,12 +227,22 @@ canStatus canBusOff(
 		const CanHandle hnd /**< handle to the CAN channel */
 	)
 {
-	if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_EnterChannel(hnd);
+canStatus status;
+
+	if ( pSelf == NULL )  {
 		return(canERR_INVHANDLE);
-	} else {
-		Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
-		return(pSelf->hwFunctions.can4osxhwCanBusOffRef(hnd));
 	}
+
+	status = pSelf->hwFunctions.can4osxhwCanBusOffRef(hnd);
+	// the adapter drops the frames it did not send yet
+	CAN4OSX_FlushTxTrack(&pSelf->txTrack);
+	// cleared last, the settings may change once the bus stopped
+	atomic_store_explicit(&pSelf->busOn, false, memory_order_seq_cst);
+
+	CAN4OSX_LeaveChannel(hnd);
+
+	return(status);
 }
 
 
@@ -193,16 +260,36 @@ CanHandle canOpenChannel(
 		int flags
 	)
 {
-	if ( CAN4OSX_CheckHandle(channel) == -1 )  {
+CAN4OSX_CHANNEL_SLOT_T *pSlot;
+Can4osxUsbDeviceHandleEntry *pSelf;
+CanHandle hnd;
+
+	if ( (channel < 0) || ((UInt32)channel > CAN4OSX_HANDLE_INDEX_MASK) )  {
 		return(canERR_NOCHANNELS);
-	} else {
-		Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[channel];
-		if (pSelf->hwFunctions.can4osxhwCanOpenChannel != NULL)  {
-			pSelf->hwFunctions.can4osxhwCanOpenChannel(channel, flags);
-		}
+	}
+
+	// see canINIT_NO_WAIT
+	CAN4OSX_WaitChannelReady(channel);
 
-		return(CanHandle)channel;
+	pSlot = CAN4OSX_GetChannelSlot(channel);
+	if ( pSlot == NULL )  {
+		return(canERR_NOCHANNELS);
+	}
+
+	// the handle is only good for the adapter that is plugged in now
+	hnd = CAN4OSX_HANDLE(channel, CAN4OSX_SLOT_GENERATION(atomic_load_explicit(&pSlot->state, memory_order_acquire)));
+	pSelf = CAN4OSX_EnterChannel(hnd);
+	if ( pSelf == NULL )  {
+		return(canERR_NOCHANNELS);
 	}
+
+	if ( pSelf->hwFunctions.can4osxhwCanOpenChannel != NULL )  {
+		pSelf->hwFunctions.can4osxhwCanOpenChannel(hnd, flags);
+	}
+
+	CAN4OSX_LeaveChannel(hnd);
+
+	return(hnd);
 }
 
 canStatus canClose(
@@ -220,674 +307,2522 @@ canStatus canSetNotify(
 		void *tag
 	)
 {
-	if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
+Can4osxUsbDeviceHandleEntry *self = CAN4OSX_EnterChannel(hnd);
+
+	if ( self == NULL )  {
 		return(canERR_INVHANDLE);
-	} else {
+	}
 
-		Can4osxUsbDeviceHandleEntry *self = &can4osxUsbDeviceHandle[hnd];
+	self->canNotify.notifyFlags = notifyFlags;
 
-		if ( notifyFlags )  {
-			CFStringRef temp = self->canNotification.notificationString;
+	if ( notifyFlags )  {
+		CFStringRef temp = self->canNotification.notificationString;
 
-			self->canNotification.notifacionCenter = notifyStruct.notifacionCenter;
-			self->canNotification.notificationString = CFStringCreateCopy(kCFAllocatorDefault, notifyStruct.notificationString);
+		self->canNotification.notifacionCenter = notifyStruct.notifacionCenter;
+		self->canNotification.notificationString = CFStringCreateCopy(kCFAllocatorDefault, notifyStruct.notificationString);
 
-			if ( temp )  {
-				CFRelease(temp);
-			}
-		} else {
-			self->canNotification.notifacionCenter = NULL;
-			CFRelease( self->canNotification.notificationString );
+		if ( temp )  {
+			CFRelease(temp);
 		}
-		return(0);
-	}
-}
-
-
-canStatus canSetBusParams(
-		const CanHandle hnd,
-		SInt32 freq,
-		UInt32 tseg1,
-		UInt32 tseg2,
-		UInt32 sjw,
-		UInt32 noSamp,
-		UInt32 syncmode
-	)
-{
-	if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
-		return(canERR_INVHANDLE);
 	} else {
-		Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
-		if (NULL != pSelf->hwFunctions.can4osxhwCanSetBusParamsRef)  {
-			return(pSelf->hwFunctions.can4osxhwCanSetBusParamsRef(hnd,freq,tseg1,tseg2,sjw,noSamp,syncmode));
-		} else {
-			return(canERR_PARAM);
-		}
+		self->canNotification.notifacionCenter = NULL;
+		CFRelease( self->canNotification.notificationString );
 	}
-}
 
+	CAN4OSX_LeaveChannel(hnd);
 
-canStatus canSetBusParamsFd(
-		const CanHandle hnd,
-		SInt32 freq_brs,
-		UInt32 tseg1,
-		UInt32 tseg2,
-		UInt32 sjw
-	)
-{
-	if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
-		return(canERR_INVHANDLE);
-	} else {
-		Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
-		if (NULL != pSelf->hwFunctions.can4osxhwCanSetBusParamsFdRef)  {
-			return(pSelf->hwFunctions.can4osxhwCanSetBusParamsFdRef(hnd,freq_brs,tseg1,tseg2,sjw));
-		} else {
-			return(canERR_PARAM);
-		}
-	}
+	return(0);
 }
 
 
 /******************************************************************************/
 /**
- * \brief canRead - read a CAN message
+ * \brief canSetNotifyCoalescing - limits for the receive notifications
  *
- * This function read a CAN message from the given handle.
+ * Frames are announced with one notification per USB transfer. watermark
+ * forces a notification after that many frames, windowMs keeps collecting
+ * frames over several transfers for up to that time. 0 turns a limit off,
+ * both 0 together with no canNOTIFY_RX_COALESCE restores one notification
+ * per frame. The window needs the run loop timer of the driver thread.
  *
- * \return canStatus
+ * \return canStatus, canERR_NOT_IMPLEMENTED for a window without a run loop
  *
  */
-canStatus canRead (
-		const CanHandle hnd, /**< handle to the CAN channel */
-		UInt32 *id,
-		void *msg,
-		UInt16 *dlc,
-		UInt32 *flag,
-		UInt32 *time
+canStatus canSetNotifyCoalescing(
+		const CanHandle hnd,
+		UInt32 watermark,
+		UInt32 windowMs
 	)
 {
-	if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_EnterChannel(hnd);
+
+	if ( pSelf == NULL )  {
 		return(canERR_INVHANDLE);
-	} else {
-		Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
-		return(pSelf->hwFunctions.can4osxhwCanReadRef(hnd,id,msg,dlc,flag,time));
 	}
+
+#if !CAN4OSX_HAVE_CFRUNLOOP
+	if ( windowMs != 0u )  {
+		CAN4OSX_LeaveChannel(hnd);
+		return(canERR_NOT_IMPLEMENTED);
+	}
+#endif /* CAN4OSX_HAVE_CFRUNLOOP */
+
+	pSelf->canNotify.watermark = watermark;
+	pSelf->canNotify.windowMs = windowMs;
+
+	CAN4OSX_LeaveChannel(hnd);
+
+	return(canOK);
 }
 
 
 /******************************************************************************/
 /**
- * \brief canWrite - write a CAN message
+ * \brief canGetNotifyStatistics - receive notification counters
  *
- * This function writes a CAN message to the given handle.
+ * posted is the number of notifications sent, suppressed the number of
+ * frames announced by another frame's notification. Either may be NULL.
  *
  * \return canStatus
  *
  */
- canStatus canWrite (
-		const CanHandle hnd, /**< handle to the CAN channel */
-		UInt32 id,
-		void *msg,
-		UInt16 dlc,
-		UInt32 flag
+canStatus canGetNotifyStatistics(
+		const CanHandle hnd,
+		UInt32 *posted,
+		UInt32 *suppressed
 	)
 {
-	if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
-		return(canERR_INVHANDLE);
-	} else {
-		Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
-		return(pSelf->hwFunctions.can4osxhwCanWriteRef(hnd,id,msg,dlc,flag));
-	}
-}
-
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_EnterChannel(hnd);
 
-canStatus canReadStatus	(
-		const CanHandle hnd, /**< handle to the CAN channel */
-		UInt32 *const flags
-	)
-{
-	if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
+	if ( pSelf == NULL )  {
 		return(canERR_INVHANDLE);
-	} else {
-		Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+	}
 
-		*flags = 0;
+	if ( posted != NULL )  {
+		*posted = atomic_load_explicit(&pSelf->canNotify.posted, memory_order_relaxed);
+	}
+	if ( suppressed != NULL )  {
+		*suppressed = atomic_load_explicit(&pSelf->canNotify.suppressed, memory_order_relaxed);
+	}
 
-		switch ( pSelf->canState.canState ) {
-			case CHIPSTAT_ERROR_ACTIVE:
-				*flags = canSTAT_ERROR_ACTIVE;
-				break;
-			case CHIPSTAT_BUSOFF:
-				*flags = canSTAT_BUS_OFF;
-				break;
-			case CHIPSTAT_ERROR_PASSIVE:
-				*flags = canSTAT_ERROR_PASSIVE;
-				break;
-			default:
-				break;
-		}
+	CAN4OSX_LeaveChannel(hnd);
 
-		return(canOK);
-	}
+	return(canOK);
 }
 
 
-canStatus canGetChannelData(
+/******************************************************************************/
+/**
+ * \brief canGetTxStatistics - transmit queue depth and latency of a channel
+ *
+ * \return canStatus
+ *
+ */
+canStatus canGetTxStatistics(
 		const CanHandle hnd,
-		SInt32 item,
-		void* pBuffer,
-		size_t bufsize
+		CanTxStatistics *pStatistics
 	)
 {
-	if ( CAN4OSX_CheckHandle(hnd) == -1 )  {
-		return(canERR_INVHANDLE);
-	} else {
-		Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+Can4osxUsbDeviceHandleEntry *pSelf;
 
-		if (NULL == pBuffer)  {
-			return(canERR_NOMEM);
-		}
+	if ( pStatistics == NULL )  {
+		return(canERR_PARAM);
+	}
 
-		if (bufsize <= 0)  {
-			return(canERR_NOMEM);
-		}
+	pSelf = CAN4OSX_EnterChannel(hnd);
+	if ( pSelf == NULL )  {
+		return(canERR_INVHANDLE);
+	}
 
-		memset(pBuffer, 0, bufsize);
+	memset(pStatistics, 0, sizeof(CanTxStatistics));
+	if ( pSelf->usbFunctions.bulkWriteQueued != NULL )  {
+		pStatistics->queued = pSelf->usbFunctions.bulkWriteQueued(pSelf);
+	}
 
-		return(CAN4OSX_GetChannelData(pSelf,item,pBuffer,bufsize));
+	pthread_mutex_lock(&pSelf->bulkOutMutex);
+	pStatistics->inFlight = pSelf->bulkOutInFlight;
+	pStatistics->inFlightMax = pSelf->txStatistics.inFlightMax;
+	pStatistics->transfers = pSelf->txStatistics.transfers;
+	pStatistics->frames = pSelf->txStatistics.frames;
+	pStatistics->latencyLast = (UInt32)(pSelf->txStatistics.latencyLast / 1000u);
+	pStatistics->latencyMax = (UInt32)(pSelf->txStatistics.latencyMax / 1000u);
+	if ( pSelf->txStatistics.transfers != 0u )  {
+		pStatistics->latencyAvg = (UInt32)((pSelf->txStatistics.latencySum / pSelf->txStatistics.transfers) / 1000u);
 	}
+	pthread_mutex_unlock(&pSelf->bulkOutMutex);
+
+	pthread_mutex_lock(&pSelf->txTrack.mutex);
+	pStatistics->pending = pSelf->txTrack.next - pSelf->txTrack.oldest;
+	pStatistics->acked = pSelf->txTrack.acked;
+	pStatistics->lost = pSelf->txTrack.lost;
+	pStatistics->ackLatencyLast = (UInt32)(pSelf->txTrack.latencyLast / 1000u);
+	pStatistics->ackLatencyMax = (UInt32)(pSelf->txTrack.latencyMax / 1000u);
+	if ( pSelf->txTrack.acked != 0u )  {
+		pStatistics->ackLatencyAvg = (UInt32)((pSelf->txTrack.latencySum / pSelf->txTrack.acked) / 1000u);
+	}
+	pthread_mutex_unlock(&pSelf->txTrack.mutex);
+
+	CAN4OSX_LeaveChannel(hnd);
+
+	return(canOK);
 }
 
 
-canStatus canGetNumberOfChannels (int *channelCount)
+/******************************************************************************/
+/**
+ * \brief canRequestBusStatistics - snapshot of the bus statistics of a channel
+ *
+ * The counters are kept by the decoder, the request only reads them. The bus
+ * load is the one since the previous request.
+ *
+ * \return canStatus
+ *
+ */
+canStatus canRequestBusStatistics(
+		const CanHandle hnd
+	)
 {
-	if (NULL == channelCount)  {
-		return(canERR_NOMEM);
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_EnterChannel(hnd);
+
+	if ( pSelf == NULL )  {
+		return(canERR_INVHANDLE);
 	}
 
-	*channelCount = can4osxMaxChannelCount;
+	CAN4OSX_RequestBusStatistics(&pSelf->busStats, CAN4OSX_GetCanEventBufferOverruns(CAN4OSX_GetCanEventBuffer(pSelf), 0u));
+
+	CAN4OSX_LeaveChannel(hnd);
 
 	return(canOK);
 }
 
 
-// Internal
-
-static void CAN4OSX_CanInitializeLibrary(
-		void
+/******************************************************************************/
+/**
+ * \brief canGetBusStatistics - the snapshot of canRequestBusStatistics
+ *
+ * Only the first bufsiz bytes are written, so the shorter struct of canlib
+ * works as well.
+ *
+ * \return canStatus
+ *
+ */
+canStatus canGetBusStatistics(
+		const CanHandle hnd,
+		canBusStatistics *stat,
+		size_t bufsiz
 	)
 {
-UInt16 loopCount = 0;
+Can4osxUsbDeviceHandleEntry *pSelf;
+canBusStatistics statistics;
 
-CFMutableDictionaryRef 	can4osxUsbMatchingDictRef;
-CFRunLoopSourceRef		can4osxRunLoopSourceRef;
-CFNumberRef				numberRef;
+	if ( (stat == NULL) || (bufsiz == 0u) )  {
+		return(canERR_PARAM);
+	}
 
-	//Set all channels inactive
-	for (loopCount = 0; loopCount < CAN4OSX_MAX_CHANNEL_COUNT; loopCount++ ) {
-		can4osxUsbDeviceHandle[loopCount].channelNumber = -1;
+	pSelf = CAN4OSX_EnterChannel(hnd);
+	if ( pSelf == NULL )  {
+		return(canERR_INVHANDLE);
 	}
 
-	can4osxUsbNotificationPortRef = IONotificationPortCreate(kIOMasterPortDefault);
-	can4osxRunLoopSourceRef = IONotificationPortGetRunLoopSource(can4osxUsbNotificationPortRef);
+	CAN4OSX_GetBusStatistics(&pSelf->busStats, &statistics);
+	memcpy(stat, &statistics, (bufsiz < sizeof(canBusStatistics)) ? bufsiz : sizeof(canBusStatistics));
 
-	CFRunLoopAddSource(CFRunLoopGetCurrent(), can4osxRunLoopSourceRef, kCFRunLoopDefaultMode);
+	CAN4OSX_LeaveChannel(hnd);
 
+	return(canOK);
+}
 
-	for ( loopCount = 0; loopCount < (sizeof(can4osxSupportedDevices)/sizeof(CAN4OSX_DEV_ENTRY_T)); loopCount++ ) {
 
-		can4osxUsbMatchingDictRef = IOServiceMatching(kIOUSBDeviceClassName);
 
-		// IOUSBDevice and its subclasses
-		if (can4osxUsbMatchingDictRef == NULL)  {
-			CAN4OSX_DEBUG_PRINT("%s : IOServiceMatching ret: NULL.\n",__func__);
-			return;
-		}
+canStatus canSetBusParams(
+		const CanHandle hnd,
+		SInt32 freq,
+		UInt32 tseg1,
+		UInt32 tseg2,
+		UInt32 sjw,
+		UInt32 noSamp,
+		UInt32 syncmode
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_EnterChannel(hnd);
+canStatus status = canERR_PARAM;
 
-		// Create a CFNumber for the idVendor and set the value in the dictionary
-		numberRef = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &can4osxSupportedDevices[loopCount].vendorId );
-		CFDictionarySetValue(can4osxUsbMatchingDictRef, CFSTR(kUSBVendorID), numberRef);
-		CFRelease(numberRef);
+	if ( pSelf == NULL )  {
+		return(canERR_INVHANDLE);
+	}
 
-		// Create a CFNumber for the idProduct and set the value in the dictionary
-		numberRef = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &can4osxSupportedDevices[loopCount].productId);
-		CFDictionarySetValue(can4osxUsbMatchingDictRef, CFSTR(kUSBProductID), numberRef);
-		CFRelease(numberRef);
+	if (NULL != pSelf->hwFunctions.can4osxhwCanSetBusParamsRef)  {
+		status = pSelf->hwFunctions.can4osxhwCanSetBusParamsRef(hnd,freq,tseg1,tseg2,sjw,noSamp,syncmode);
+	}
 
-		IOServiceAddMatchingNotification(can4osxUsbNotificationPortRef, kIOFirstMatchNotification, can4osxUsbMatchingDictRef, CAN4OSX_DeviceAdded, NULL, &can4osxIoIterator[loopCount]);
+	CAN4OSX_LeaveChannel(hnd);
 
+	return(status);
+}
 
-		numberRef = NULL;
 
-		CAN4OSX_DeviceAdded(NULL, can4osxIoIterator[loopCount]);
+canStatus canSetBusParamsFd(
+		const CanHandle hnd,
+		SInt32 freq_brs,
+		UInt32 tseg1,
+		UInt32 tseg2,
+		UInt32 sjw
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_EnterChannel(hnd);
+canStatus status = canERR_PARAM;
 
+	if ( pSelf == NULL )  {
+		return(canERR_INVHANDLE);
 	}
 
-	dispatch_semaphore_signal(semaCan4osxStart);
-	CFRunLoopRun();
-
-	// if the runloop is stopped release
-	for ( loopCount = 0; loopCount < (sizeof(can4osxSupportedDevices)/sizeof(CAN4OSX_DEV_ENTRY_T)); loopCount++ ) {
-		IOObjectRelease(can4osxIoIterator[loopCount]);
+	if (NULL != pSelf->hwFunctions.can4osxhwCanSetBusParamsFdRef)  {
+		status = pSelf->hwFunctions.can4osxhwCanSetBusParamsFdRef(hnd,freq_brs,tseg1,tseg2,sjw);
 	}
 
-	IONotificationPortDestroy(can4osxUsbNotificationPortRef);
+	CAN4OSX_LeaveChannel(hnd);
 
+	return(status);
 }
 
 
 /******************************************************************************/
 /**
- * \internal
- * \brief CAN4OSX_CheckHandle - checks if the handle is valid
+ * \brief canRead - read a CAN message
  *
- * This function checks if the given handle is valid
+ * This function read a CAN message from the given handle.
  *
  * \return canStatus
  *
  */
-static CanHandle CAN4OSX_CheckHandle(
-		const CanHandle hnd
+canStatus canRead (
+		const CanHandle hnd, /**< handle to the CAN channel */
+		UInt32 *id,
+		void *msg,
+		UInt16 *dlc,
+		UInt32 *flag,
+		UInt32 *time
 	)
 {
-	if (hnd >= CAN4OSX_MAX_CHANNEL_COUNT)  {
-		return(-1);
-	}
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_EnterChannel(hnd);
+canStatus status;
 
-	if (can4osxUsbDeviceHandle[hnd].channelNumber == -1)  {
-		return(-1);
+	if ( pSelf == NULL )  {
+		return(canERR_INVHANDLE);
 	}
 
-	return(hnd);
+	status = pSelf->hwFunctions.can4osxhwCanReadRef(hnd,id,msg,dlc,flag,time);
+
+	CAN4OSX_LeaveChannel(hnd);
+
+	return(status);
 }
 
 
-static void CAN4OSX_DeviceAdded(
-		void *refCon,
-		io_iterator_t iterator
+/******************************************************************************/
+/**
+ * \brief canReadWait - read a CAN message, wait if there is none
+ *
+ * Same as canRead, but sleeps up to timeout ms for a message to arrive.
+ * canWAIT_INFINITE waits forever.
+ *
+ * \return canStatus, canERR_TIMEOUT if nothing arrived
+ *
+ */
+canStatus canReadWait (
+		const CanHandle hnd, /**< handle to the CAN channel */
+		UInt32 *id,
+		void *msg,
+		UInt16 *dlc,
+		UInt32 *flag,
+		UInt32 *time,
+		UInt32 timeout
 	)
 {
-kern_return_t	kernRetVal;
-SInt32			score;
-HRESULT			result;
-UInt16			productId;
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_EnterChannel(hnd);
+CAN_EVENT_MSG_BUF_T *pBuffer;
+struct timespec deadline;
+canStatus status;
+UInt32 seenHead;
 
-io_service_t           can4osxUsbDevice;
-IOCFPlugInInterface  **can4osxPluginInterface = NULL;
-Can4osxUsbDeviceHandleEntry *pDevice;
+	if ( pSelf == NULL )  {
+		return(canERR_INVHANDLE);
+	}
 
-	while ( (can4osxUsbDevice = IOIteratorNext(iterator) ) )  {
+	if ( pSelf->hwFunctions.can4osxhwCanReadRef == NULL )  {
+		CAN4OSX_LeaveChannel(hnd);
+		return(canERR_NOT_IMPLEMENTED);
+	}
+
+	if ( timeout != canWAIT_INFINITE )  {
+		CAN4OSX_GetDeadline(&deadline, timeout);
+	}
 
-		CAN4OSX_DEBUG_PRINT("%s : Device added\n", __func__);
+	for (;;)  {
+		pBuffer = CAN4OSX_GetCanEventBuffer(pSelf);
+		/* sample the head first, a message arriving after the read wakes us */
+		seenHead = CAN4OSX_GetCanEventBufferHead(pBuffer);
 
-		if (can4osxMaxChannelCount >= CAN4OSX_MAX_CHANNEL_COUNT)  {
-			CAN4OSX_DEBUG_PRINT("%s : max Channel reached\n", __func__);
-			return;
+		status = pSelf->hwFunctions.can4osxhwCanReadRef(hnd,id,msg,dlc,flag,time);
+		if ( status != canERR_NOMSG )  {
+			break;
 		}
 
+		if ( !CAN4OSX_WaitCanEventBuffer(pBuffer, seenHead,
+				(timeout != canWAIT_INFINITE) ? &deadline : NULL) )  {
+			status = CAN4OSX_WaitStatus(pSelf, pBuffer);
+			if ( status != canERR_NOMSG )  {
+				break;
+			}
+		}
+	}
 
-		kernRetVal = IOCreatePlugInInterfaceForService(can4osxUsbDevice, kIOUSBDeviceUserClientTypeID, kIOCFPlugInInterfaceID,
-											   &can4osxPluginInterface, &score);
+	CAN4OSX_LeaveChannel(hnd);
 
-		if ((kIOReturnSuccess != kernRetVal) || !can4osxPluginInterface)  {
-			CAN4OSX_DEBUG_PRINT("%s : IOCreatePlugInInterfaceForService ret: 0x%08x.\n",__func__,kernRetVal);
-			IOObjectRelease(can4osxUsbDevice);
+	return(status);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canReadSync - wait until a CAN message is available
+ *
+ * \return canStatus, canERR_TIMEOUT if nothing arrived
+ *
+ */
+canStatus canReadSync (
+		const CanHandle hnd, /**< handle to the CAN channel */
+		UInt32 timeout
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_EnterChannel(hnd);
+CAN_EVENT_MSG_BUF_T *pBuffer;
+struct timespec deadline;
+canStatus status;
+UInt32 seenHead;
+
+	if ( pSelf == NULL )  {
+		return(canERR_INVHANDLE);
+	}
+
+	if ( timeout != canWAIT_INFINITE )  {
+		CAN4OSX_GetDeadline(&deadline, timeout);
+	}
+
+	for (;;)  {
+		pBuffer = CAN4OSX_GetCanEventBuffer(pSelf);
+		seenHead = CAN4OSX_GetCanEventBufferHead(pBuffer);
+
+		if ( CAN4OSX_GetCanEventBufferCount(pBuffer) != 0 )  {
+			status = canOK;
+			break;
+		}
+
+		if ( !CAN4OSX_WaitCanEventBuffer(pBuffer, seenHead,
+				(timeout != canWAIT_INFINITE) ? &deadline : NULL) )  {
+			status = CAN4OSX_WaitStatus(pSelf, pBuffer);
+			if ( status != canERR_NOMSG )  {
+				break;
+			}
+		}
+	}
+
+	CAN4OSX_LeaveChannel(hnd);
+
+	return(status);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canReadSyncSpecific - wait until a CAN message with id is available
+ *
+ * Messages with other ids are left in the receive buffer.
+ *
+ * \return canStatus, canERR_TIMEOUT if the id did not arrive
+ *
+ */
+canStatus canReadSyncSpecific (
+		const CanHandle hnd, /**< handle to the CAN channel */
+		UInt32 id,
+		UInt32 timeout
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_EnterChannel(hnd);
+CAN_EVENT_MSG_BUF_T *pBuffer;
+struct timespec deadline;
+canStatus status;
+UInt32 seenHead;
+
+	if ( pSelf == NULL )  {
+		return(canERR_INVHANDLE);
+	}
+
+	if ( timeout != canWAIT_INFINITE )  {
+		CAN4OSX_GetDeadline(&deadline, timeout);
+	}
+
+	for (;;)  {
+		pBuffer = CAN4OSX_GetCanEventBuffer(pSelf);
+		seenHead = CAN4OSX_GetCanEventBufferHead(pBuffer);
+
+		if ( CAN4OSX_FindCanEventBuffer(pBuffer, id) )  {
+			status = canOK;
+			break;
+		}
+
+		if ( !CAN4OSX_WaitCanEventBuffer(pBuffer, seenHead,
+				(timeout != canWAIT_INFINITE) ? &deadline : NULL) )  {
+			status = CAN4OSX_WaitStatus(pSelf, pBuffer);
+			if ( status != canERR_NOMSG )  {
+				break;
+			}
+		}
+	}
+
+	CAN4OSX_LeaveChannel(hnd);
+
+	return(status);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canReadBatch - read several CAN messages at once
+ *
+ * This function drains up to max messages from the given handle with a
+ * single access to the receive buffer. got returns the number of messages
+ * copied to pMsg.
+ *
+ * \return canStatus, canERR_NOMSG if no message was available
+ *
+ */
+canStatus canReadBatch (
+		const CanHandle hnd, /**< handle to the CAN channel */
+		CanMsg *pMsg,
+		size_t max,
+		size_t *got
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf;
+canStatus status = canERR_NOT_IMPLEMENTED;
+
+	if ( (pMsg == NULL) || (got == NULL) )  {
+		return(canERR_PARAM);
+	}
+
+	*got = 0;
+
+	pSelf = CAN4OSX_EnterChannel(hnd);
+	if ( pSelf == NULL )  {
+		return(canERR_INVHANDLE);
+	}
+
+	if ( pSelf->hwFunctions.can4osxhwCanReadBatchRef != NULL )  {
+		status = pSelf->hwFunctions.can4osxhwCanReadBatchRef(hnd,pMsg,max,got);
+	}
+
+	CAN4OSX_LeaveChannel(hnd);
+
+	return(status);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canReadAcquire - borrow received CAN frames without copying
+ *
+ * ppFrame points to the oldest of got frames inside the receive buffer, the
+ * decoder wrote them there directly. canFrameNext steps to the next one. At
+ * the wrap around of the buffer fewer than available are returned, the next
+ * call continues. The frames must be handed back with canReadRelease before
+ * the next read call. If the adapter is removed meanwhile canReadRelease
+ * fails with canERR_INVHANDLE, the frames stay readable until another adapter
+ * takes the channel.
+ *
+ * \return canStatus, canERR_NOMSG if no message was available
+ *
+ */
+canStatus canReadAcquire (
+		const CanHandle hnd, /**< handle to the CAN channel */
+		const CanFrame **ppFrame,
+		size_t max,
+		size_t *got
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf;
+CAN_EVENT_MSG_BUF_T *pBuffer;
+canStatus status = canOK;
+CanFrame *pFirst;
+
+	if ( (ppFrame == NULL) || (got == NULL) )  {
+		return(canERR_PARAM);
+	}
+
+	*got = 0;
+
+	pSelf = CAN4OSX_EnterChannel(hnd);
+	if ( pSelf == NULL )  {
+		return(canERR_INVHANDLE);
+	}
+
+	if ( max > UINT32_MAX )  {
+		max = UINT32_MAX;
+	}
+
+	pBuffer = CAN4OSX_GetCanEventBuffer(pSelf);
+	if ( pBuffer == NULL )  {
+		status = canERR_INTERNAL;
+	} else {
+		*got = CAN4OSX_AcquireCanEventBuffer(pBuffer, &pFirst, (UInt32)max);
+		if ( *got == 0 )  {
+			status = canERR_NOMSG;
+		} else {
+			*ppFrame = pFirst;
+		}
+	}
+
+	CAN4OSX_LeaveChannel(hnd);
+
+	return(status);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canReadRelease - hand back frames of canReadAcquire
+ *
+ * The first count frames are removed from the receive buffer, 0 keeps
+ * all of them.
+ *
+ * \return canStatus, canERR_PARAM if more than acquired are released
+ *
+ */
+canStatus canReadRelease (
+		const CanHandle hnd, /**< handle to the CAN channel */
+		size_t count
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_EnterChannel(hnd);
+CAN_EVENT_MSG_BUF_T *pBuffer;
+canStatus status = canOK;
+
+	if ( pSelf == NULL )  {
+		return(canERR_INVHANDLE);
+	}
+
+	pBuffer = CAN4OSX_GetCanEventBuffer(pSelf);
+	if ( pBuffer == NULL )  {
+		status = canERR_INTERNAL;
+	} else if ( (count > UINT32_MAX)
+			|| !CAN4OSX_ReleaseCanEventBufferEvents(pBuffer, (UInt32)count) )  {
+		status = canERR_PARAM;
+	}
+
+	CAN4OSX_LeaveChannel(hnd);
+
+	return(status);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canWrite - write a CAN message
+ *
+ * This function writes a CAN message to the given handle.
+ *
+ * \return canStatus
+ *
+ */
+ canStatus canWrite (
+		const CanHandle hnd, /**< handle to the CAN channel */
+		UInt32 id,
+		void *msg,
+		UInt16 dlc,
+		UInt32 flag
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_EnterChannel(hnd);
+canStatus status;
+CanMsg frame;
+UInt32 count;
+UInt16 len = (dlc < CAN4OSX_CAN_MAX_MSG_LEN) ? dlc : CAN4OSX_CAN_MAX_MSG_LEN;
+
+	if ( pSelf == NULL )  {
+		return(canERR_INVHANDLE);
+	}
+
+	// kept until the TX ack, see canWriteSync
+	frame.canId = id;
+	frame.canFlags = flag;
+	frame.canDlc = (UInt8)len;
+	if ( ((flag & canFDMSG_FDF) == 0u) && (len > 8u) )  {
+		len = 8u;
+	}
+	if ( msg != NULL )  {
+		memcpy(frame.canData, msg, len);
+	}
+
+	count = CAN4OSX_BeginTxFrames(&pSelf->txTrack, &frame, 1u);
+	if ( count == 0u )  {
+		status = canERR_TXBUFOFL;
+	} else {
+		status = pSelf->hwFunctions.can4osxhwCanWriteRef(hnd,id,msg,dlc,flag);
+	}
+	CAN4OSX_EndTxFrames(&pSelf->txTrack, count, (status == canOK) ? count : 0u);
+
+	CAN4OSX_LeaveChannel(hnd);
+
+	return(status);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canWriteBatch - write several CAN messages at once
+ *
+ * All messages are queued to the backend first and the bulk out pipe is
+ * started once, so the frames share as few USB transfers as possible.
+ * canId, canFlags, canDlc and canData of each CanMsg are used. accepted
+ * returns the number of messages queued, the rest has to be sent again.
+ *
+ * \return canStatus, canERR_TXBUFOFL if not all messages fitted
+ *
+ */
+canStatus canWriteBatch (
+		const CanHandle hnd, /**< handle to the CAN channel */
+		const CanMsg *pMsg,
+		size_t n,
+		size_t *accepted
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf;
+canStatus status = canERR_NOT_IMPLEMENTED;
+UInt32 count;
+
+	if ( (pMsg == NULL) || (accepted == NULL) )  {
+		return(canERR_PARAM);
+	}
+
+	*accepted = 0;
+
+	pSelf = CAN4OSX_EnterChannel(hnd);
+	if ( pSelf == NULL )  {
+		return(canERR_INVHANDLE);
+	}
+
+	if ( pSelf->hwFunctions.can4osxhwCanWriteBatchRef != NULL )  {
+		count = CAN4OSX_BeginTxFrames(&pSelf->txTrack, pMsg, (n > UINT32_MAX) ? UINT32_MAX : (UInt32)n);
+		if ( count == 0u )  {
+			status = (n == 0u) ? canOK : canERR_TXBUFOFL;
+		} else {
+			status = pSelf->hwFunctions.can4osxhwCanWriteBatchRef(hnd,pMsg,count,accepted);
+			if ( (status == canOK) && (count < n) )  {
+				// the rest waits for the acks of the frames before
+				status = canERR_TXBUFOFL;
+			}
+		}
+		CAN4OSX_EndTxFrames(&pSelf->txTrack, count, (UInt32)*accepted);
+	}
+
+	CAN4OSX_LeaveChannel(hnd);
+
+	return(status);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canWriteSync - wait until the written messages are sent
+ *
+ * Waits for the TX acks of all messages written to the channel so far, the
+ * ones written meanwhile are not waited for. Messages pending when the bus
+ * goes off count as done. An adapter without TX acks reports a message sent
+ * as soon as its USB transfer completed.
+ *
+ * \return canStatus, canERR_TIMEOUT if not all were sent within timeout ms
+ *
+ */
+canStatus canWriteSync (
+		const CanHandle hnd, /**< handle to the CAN channel */
+		UInt32 timeout
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_EnterChannel(hnd);
+canStatus status;
+
+	if ( pSelf == NULL )  {
+		return(canERR_INVHANDLE);
+	}
+
+	status = CAN4OSX_WaitTxFrames(&pSelf->txTrack, timeout);
+
+	CAN4OSX_LeaveChannel(hnd);
+
+	return(status);
+}
+
+
+canStatus canReadStatus	(
+		const CanHandle hnd, /**< handle to the CAN channel */
+		UInt32 *const flags
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_EnterChannel(hnd);
+CAN_EVENT_MSG_BUF_T *pBuffer;
+
+	if ( pSelf == NULL )  {
+		return(canERR_INVHANDLE);
+	}
+
+	*flags = 0;
+
+	switch ( pSelf->canState.canState ) {
+		case CHIPSTAT_ERROR_ACTIVE:
+			*flags = canSTAT_ERROR_ACTIVE;
+			break;
+		case CHIPSTAT_BUSOFF:
+			*flags = canSTAT_BUS_OFF;
+			break;
+		case CHIPSTAT_ERROR_PASSIVE:
+			*flags = canSTAT_ERROR_PASSIVE;
+			break;
+		default:
+			break;
+	}
+
+	pBuffer = CAN4OSX_GetCanEventBuffer(pSelf);
+	if ( pBuffer != NULL )  {
+		if ( CAN4OSX_GetCanEventBufferCount(pBuffer) != 0 )  {
+			*flags |= canSTAT_RX_PENDING;
+		}
+		if ( CAN4OSX_GetCanEventBufferOverruns(pBuffer, 0u) != 0 )  {
+			*flags |= canSTAT_SW_OVERRUN;
+		}
+	}
+
+	CAN4OSX_LeaveChannel(hnd);
+
+	return(canOK);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canIoCtl - receive queue setup of a channel
+ *
+ * canIOCTL_SET_RX_QUEUE_SIZE replaces the receive queue, the frames in it
+ * and the overrun counter are lost. It and the overflow policy can only be
+ * changed while the bus is off. canSTAT_SW_OVERRUN of canReadStatus stays
+ * set until canIOCTL_RESET_OVERRUN_COUNT. canIOCTL_SET_TIMESTAMP_HOST selects
+ * the clock of the receive timestamps. canIOCTL_GET_FILTERED_COUNT are the
+ * frames the acceptance filter dropped. canIOCTL_SET_TXACK puts every sent
+ * frame into the receive queue once the adapter acknowledged it.
+ *
+ * \return canStatus, canERR_NO_ACCESS if the bus is on
+ *
+ */
+canStatus canIoCtl (
+		const CanHandle hnd, /**< handle to the CAN channel */
+		UInt32 func,
+		void *pBuffer,
+		UInt32 bufferSize
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_EnterChannel(hnd);
+canStatus status;
+
+	if ( pSelf == NULL )  {
+		return(canERR_INVHANDLE);
+	}
+
+	status = CAN4OSX_IoCtl(pSelf, func, pBuffer, bufferSize);
+
+	CAN4OSX_LeaveChannel(hnd);
+
+	return(status);
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_IoCtl - canIoCtl of a channel that stays while we are in it
+ */
+static canStatus CAN4OSX_IoCtl(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+		UInt32 func,
+		void *pBuffer,
+		UInt32 bufferSize
+	)
+{
+CAN_EVENT_MSG_BUF_T *pNew;
+CAN_EVENT_MSG_BUF_T *pOld;
+UInt32 value = 0u;
+
+	if ( CAN4OSX_GetCanEventBuffer(pSelf) == NULL )  {
+		return(canERR_INTERNAL);
+	}
+
+	if ( (func != canIOCTL_RESET_OVERRUN_COUNT) && (func != canIOCTL_RESET_FILTERED_COUNT) )  {
+		if ( (pBuffer == NULL) || (bufferSize < sizeof(UInt32)) )  {
+			return(canERR_PARAM);
+		}
+		memcpy(&value, pBuffer, sizeof(UInt32));
+	}
+
+	switch ( func )  {
+		case canIOCTL_GET_RX_BUFFER_LEVEL:
+			value = CAN4OSX_GetCanEventBufferCount(CAN4OSX_GetCanEventBuffer(pSelf));
+			break;
+
+		case canIOCTL_SET_RX_QUEUE_SIZE:
+			if ( (value < CAN4OSX_FRAME_MAX_CELLS) || (value > (UINT32_MAX / CAN_FRAME_CELL_SIZE)) )  {
+				return(canERR_PARAM);
+			}
+			if ( atomic_load_explicit(&pSelf->busOn, memory_order_seq_cst) || atomic_load_explicit(&pSelf->rxMerged, memory_order_seq_cst) )  {
+				return(canERR_NO_ACCESS);
+			}
+			pNew = CAN4OSX_CreateCanEventBuffer(value * CAN_FRAME_CELL_SIZE);
+			if ( pNew == NULL )  {
+				return(canERR_NOMEM);
+			}
+			CAN4OSX_SetCanEventBufferPolicy(pNew, pSelf->rxOverflowPolicy, pSelf->rxBlockMs);
+			CAN4OSX_TRACE_BUFFER_CHANNEL(pNew, pSelf->channelNumber);
+			pOld = CAN4OSX_GetCanEventBuffer(pSelf);
+			pNew->bufferOutgrown = pOld;
+			if ( !atomic_compare_exchange_strong_explicit(&pSelf->canEventMsgBuff, &pOld, pNew,
+					memory_order_acq_rel, memory_order_relaxed) )  {
+				// resized by another thread meanwhile
+				pNew->bufferOutgrown = NULL;
+				CAN4OSX_ReleaseCanEventBuffer(pNew);
+				return(canERR_NO_ACCESS);
+			}
+			pSelf->rxQueueBytes = value * CAN_FRAME_CELL_SIZE;
+			// readers still on the old one move over, it is freed with the channel
+			CAN4OSX_CloseCanEventBuffer(pOld);
+			return(canOK);
+
+		case canIOCTL_SET_RX_OVERFLOW_POLICY:
+			if ( value > canRX_OVERFLOW_BLOCK )  {
+				return(canERR_PARAM);
+			}
+			if ( atomic_load_explicit(&pSelf->busOn, memory_order_seq_cst) )  {
+				return(canERR_NO_ACCESS);
+			}
+			pSelf->rxOverflowPolicy = value;
+			CAN4OSX_SetCanEventBufferPolicy(CAN4OSX_GetCanEventBuffer(pSelf), pSelf->rxOverflowPolicy, pSelf->rxBlockMs);
+			return(canOK);
+
+		case canIOCTL_SET_RX_BLOCK_TIMEOUT:
+			pSelf->rxBlockMs = value;
+			CAN4OSX_SetCanEventBufferPolicy(CAN4OSX_GetCanEventBuffer(pSelf), pSelf->rxOverflowPolicy, pSelf->rxBlockMs);
+			return(canOK);
+
+		case canIOCTL_GET_OVERRUN_COUNT:
+			value = CAN4OSX_GetCanEventBufferOverruns(CAN4OSX_GetCanEventBuffer(pSelf), 0u);
+			break;
+
+		case canIOCTL_RESET_OVERRUN_COUNT:
+			(void)CAN4OSX_GetCanEventBufferOverruns(CAN4OSX_GetCanEventBuffer(pSelf), 1u);
+			return(canOK);
+
+		case canIOCTL_SET_TIMESTAMP_HOST:
+			if ( atomic_load_explicit(&pSelf->busOn, memory_order_seq_cst) )  {
+				return(canERR_NO_ACCESS);
+			}
+			pSelf->rxHostTime = (value != 0u);
+			return(canOK);
+
+		case canIOCTL_GET_TIMESTAMP_DRIFT:
+			if ( pSelf->pTimestamp == NULL )  {
+				return(canERR_INTERNAL);
+			}
+			value = (UInt32)CAN4OSX_GetTimestampDrift(pSelf->pTimestamp);
+			break;
+
+		case canIOCTL_GET_FILTERED_COUNT:
+			value = atomic_load_explicit(&pSelf->rxFilter.rejected, memory_order_relaxed);
+			break;
+
+		case canIOCTL_RESET_FILTERED_COUNT:
+			atomic_store_explicit(&pSelf->rxFilter.rejected, 0u, memory_order_relaxed);
+			return(canOK);
+
+		case canIOCTL_SET_TXACK:
+			pthread_mutex_lock(&pSelf->txTrack.mutex);
+			pSelf->txTrack.echo = (value != 0u);
+			pthread_mutex_unlock(&pSelf->txTrack.mutex);
+			return(canOK);
+
+		default:
+			return(canERR_NOT_IMPLEMENTED);
+	}
+
+	memcpy(pBuffer, &value, sizeof(UInt32));
+
+	return(canOK);
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_PushFilter - hands a changed acceptance filter to the device
+ */
+static canStatus CAN4OSX_PushFilter(
+		Can4osxUsbDeviceHandleEntry *pSelf
+	)
+{
+	if ( pSelf->hwFunctions.can4osxhwCanSetFilterRef == NULL )  {
+		return(canOK);
+	}
+
+	return(pSelf->hwFunctions.can4osxhwCanSetFilterRef(pSelf->channelNumber));
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canSetAcceptanceFilter - code and mask of the 11 or 29 bit ids
+ *
+ * A received frame passes if the bits set in mask are the same in its id and
+ * in code. A mask of 0 lets every id of the type pass, a code with bits above
+ * the id none. The filter is applied by the driver before a frame is queued,
+ * devices that can filter themselves get it as well. Only while the bus is off.
+ *
+ * \return canStatus, canERR_NO_ACCESS if the bus is on
+ *
+ */
+canStatus canSetAcceptanceFilter (
+		const CanHandle hnd, /**< handle to the CAN channel */
+		unsigned int code,
+		unsigned int mask,
+		int is_extended
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_EnterChannel(hnd);
+canStatus status;
+
+	if ( pSelf == NULL )  {
+		return(canERR_INVHANDLE);
+	}
+
+	if ( atomic_load_explicit(&pSelf->busOn, memory_order_seq_cst) )  {
+		status = canERR_NO_ACCESS;
+	} else {
+		CAN4OSX_SetFilterMask(&pSelf->rxFilter, code, mask, (is_extended != 0));
+		status = CAN4OSX_PushFilter(pSelf);
+	}
+
+	CAN4OSX_LeaveChannel(hnd);
+
+	return(status);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canAccept - sets code or mask of the acceptance filter
+ *
+ * The canlib way to canSetAcceptanceFilter, one of code and mask at a time.
+ * canFILTER_ACCEPT and canFILTER_REJECT are not supported.
+ *
+ * \return canStatus, canERR_NO_ACCESS if the bus is on
+ *
+ */
+canStatus canAccept (
+		const CanHandle hnd, /**< handle to the CAN channel */
+		const long envelope,
+		const unsigned int flag
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_EnterChannel(hnd);
+CAN4OSX_FILTER_T *pFilter;
+canStatus status = canOK;
+
+	if ( pSelf == NULL )  {
+		return(canERR_INVHANDLE);
+	}
+
+	pFilter = &pSelf->rxFilter;
+
+	if ( atomic_load_explicit(&pSelf->busOn, memory_order_seq_cst) )  {
+		CAN4OSX_LeaveChannel(hnd);
+		return(canERR_NO_ACCESS);
+	}
+
+	switch ( flag )  {
+		case canFILTER_SET_CODE_STD:
+			CAN4OSX_SetFilterMask(pFilter, (UInt32)envelope, pFilter->mask[0], false);
+			break;
+		case canFILTER_SET_MASK_STD:
+			CAN4OSX_SetFilterMask(pFilter, pFilter->code[0], (UInt32)envelope, false);
+			break;
+		case canFILTER_SET_CODE_EXT:
+			CAN4OSX_SetFilterMask(pFilter, (UInt32)envelope, pFilter->mask[1], true);
+			break;
+		case canFILTER_SET_MASK_EXT:
+			CAN4OSX_SetFilterMask(pFilter, pFilter->code[1], (UInt32)envelope, true);
+			break;
+		case canFILTER_ACCEPT:
+		case canFILTER_REJECT:
+			status = canERR_NOT_IMPLEMENTED;
+			break;
+		default:
+			status = canERR_PARAM;
+			break;
+	}
+
+	if ( status == canOK )  {
+		status = CAN4OSX_PushFilter(pSelf);
+	}
+
+	CAN4OSX_LeaveChannel(hnd);
+
+	return(status);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canAddAcceptanceRange - lets the ids first to last pass
+ *
+ * Once a range or an id of a type is added, a frame of that type has to hit
+ * one of them besides code and mask. Only while the bus is off.
+ *
+ * \return canStatus, canERR_NOMEM if all ranges are used
+ *
+ */
+canStatus canAddAcceptanceRange (
+		const CanHandle hnd, /**< handle to the CAN channel */
+		UInt32 first,
+		UInt32 last,
+		int is_extended
+	)
+{
+UInt32 maxId = (is_extended != 0) ? CAN4OSX_FILTER_EXT_IDS : CAN4OSX_FILTER_STD_IDS;
+Can4osxUsbDeviceHandleEntry *pSelf;
+canStatus status;
+
+	if ( (first > last) || (last > maxId) )  {
+		return(canERR_PARAM);
+	}
+
+	pSelf = CAN4OSX_EnterChannel(hnd);
+	if ( pSelf == NULL )  {
+		return(canERR_INVHANDLE);
+	}
+
+	if ( atomic_load_explicit(&pSelf->busOn, memory_order_seq_cst) )  {
+		status = canERR_NO_ACCESS;
+	} else if ( CAN4OSX_AddFilterRange(&pSelf->rxFilter, first, last, (is_extended != 0)) == 0u )  {
+		status = canERR_NOMEM;
+	} else {
+		status = CAN4OSX_PushFilter(pSelf);
+	}
+
+	CAN4OSX_LeaveChannel(hnd);
+
+	return(status);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canAddAcceptanceIds - lets count single ids pass
+ *
+ * For long lists of ids spread over the id space, a lookup costs the same
+ * however many there are. See canAddAcceptanceRange. Only while the bus is off.
+ *
+ * \return canStatus
+ *
+ */
+canStatus canAddAcceptanceIds (
+		const CanHandle hnd, /**< handle to the CAN channel */
+		const UInt32 *pIds,
+		size_t count,
+		int is_extended
+	)
+{
+UInt32 maxId = (is_extended != 0) ? CAN4OSX_FILTER_EXT_IDS : CAN4OSX_FILTER_STD_IDS;
+Can4osxUsbDeviceHandleEntry *pSelf;
+canStatus status;
+size_t loopCount;
+
+	if ( (pIds == NULL) || (count > UINT32_MAX) )  {
+		return(canERR_PARAM);
+	}
+
+	for (loopCount = 0u; loopCount < count; loopCount++)  {
+		if ( pIds[loopCount] > maxId )  {
+			return(canERR_PARAM);
+		}
+	}
+
+	pSelf = CAN4OSX_EnterChannel(hnd);
+	if ( pSelf == NULL )  {
+		return(canERR_INVHANDLE);
+	}
+
+	if ( atomic_load_explicit(&pSelf->busOn, memory_order_seq_cst) )  {
+		status = canERR_NO_ACCESS;
+	} else if ( CAN4OSX_AddFilterIds(&pSelf->rxFilter, pIds, (UInt32)count, (is_extended != 0)) == 0u )  {
+		status = canERR_NOMEM;
+	} else {
+		status = CAN4OSX_PushFilter(pSelf);
+	}
+
+	CAN4OSX_LeaveChannel(hnd);
+
+	return(status);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canClearAcceptanceFilter - every frame passes again
+ *
+ * Removes code, mask, ranges and ids of both types. Only while the bus is off.
+ *
+ * \return canStatus, canERR_NO_ACCESS if the bus is on
+ *
+ */
+canStatus canClearAcceptanceFilter (
+		const CanHandle hnd /**< handle to the CAN channel */
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_EnterChannel(hnd);
+canStatus status;
+
+	if ( pSelf == NULL )  {
+		return(canERR_INVHANDLE);
+	}
+
+	if ( atomic_load_explicit(&pSelf->busOn, memory_order_seq_cst) )  {
+		status = canERR_NO_ACCESS;
+	} else {
+		CAN4OSX_ClearFilter(&pSelf->rxFilter);
+		status = CAN4OSX_PushFilter(pSelf);
+	}
+
+	CAN4OSX_LeaveChannel(hnd);
+
+	return(status);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canGetHostTimestamp - device time to host time
+ *
+ * Converts a receive timestamp taken on the device clock to CLOCK_MONOTONIC.
+ * The offset and drift are estimated from the received frames, before the
+ * first one the device time is returned unchanged.
+ *
+ * \return canStatus
+ *
+ */
+canStatus canGetHostTimestamp (
+		const CanHandle hnd, /**< handle to the CAN channel */
+		UInt64 deviceTime,
+		UInt64 *hostTime
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_EnterChannel(hnd);
+canStatus status = canOK;
+
+	if ( pSelf == NULL )  {
+		return(canERR_INVHANDLE);
+	}
+
+	if ( hostTime == NULL )  {
+		status = canERR_PARAM;
+	} else if ( pSelf->pTimestamp == NULL )  {
+		status = canERR_INTERNAL;
+	} else {
+		*hostTime = CAN4OSX_GetHostTimestamp(pSelf->pTimestamp, deviceTime);
+	}
+
+	CAN4OSX_LeaveChannel(hnd);
+
+	return(status);
+}
+
+/******************************************************************************/
+/**
+ * \brief canSetTimeSync - periodic clock reads of all devices
+ *
+ * Every periodMs each device with a clock read is asked for its clock, the
+ * answers replace the received frames as samples of the host alignment. The
+ * reads run on an own queue, a new period replaces the old one.
+ *
+ * \return canStatus
+ *
+ */
+canStatus canSetTimeSync (
+		UInt32 periodMs
+	)
+{
+UInt64 period = (UInt64)periodMs * NSEC_PER_MSEC;
+
+	if ( queueCan4osx == NULL )  {
+		return(canERR_NOTINITIALIZED);
+	}
+
+	if ( queueCan4osxTimeSync == NULL )  {
+		queueCan4osxTimeSync = dispatch_queue_create("com.can4osx.timesync", NULL);
+		if ( queueCan4osxTimeSync == NULL )  {
+			return(canERR_NOMEM);
+		}
+	}
+
+	if ( timerCan4osxTimeSync != NULL )  {
+		dispatch_source_cancel(timerCan4osxTimeSync);
+		dispatch_release(timerCan4osxTimeSync);
+		timerCan4osxTimeSync = NULL;
+	}
+
+	if ( periodMs == 0u )  {
+		return(canOK);
+	}
+
+	timerCan4osxTimeSync = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, queueCan4osxTimeSync);
+	if ( timerCan4osxTimeSync == NULL )  {
+		return(canERR_NOMEM);
+	}
+
+	dispatch_source_set_timer(timerCan4osxTimeSync, dispatch_time(DISPATCH_TIME_NOW, 0), period, period / 10u);
+	dispatch_source_set_event_handler_f(timerCan4osxTimeSync, CAN4OSX_TimeSync);
+	dispatch_resume(timerCan4osxTimeSync);
+
+	return(canOK);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canGetTimeSyncStatus - host alignment of a device
+ *
+ * All channels of a device report the same.
+ *
+ * \return canStatus
+ *
+ */
+canStatus canGetTimeSyncStatus (
+		const CanHandle hnd, /**< handle to the CAN channel */
+		CanTimeSyncStatus *pStatus
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_EnterChannel(hnd);
+canStatus status = canOK;
+
+	if ( pSelf == NULL )  {
+		return(canERR_INVHANDLE);
+	}
+
+	if ( pStatus == NULL )  {
+		status = canERR_PARAM;
+	} else if ( pSelf->pTimestamp == NULL )  {
+		status = canERR_INTERNAL;
+	} else {
+		CAN4OSX_GetTimestampSync(pSelf->pTimestamp, pStatus);
+	}
+
+	CAN4OSX_LeaveChannel(hnd);
+
+	return(status);
+}
+
+/* one channel of a CanMergeReader */
+typedef struct {
+	CanHandle hnd;
+	bool pending;			// in the heap, the oldest frame is described below
+	UInt64 frameHost;		// host time in ns, the heap key
+	UInt32 frameTail;		// read position of the frame, tells if it was evicted meanwhile
+} CAN4OSX_MERGE_SOURCE_T;
+
+/* binary min heap over the channels with a received frame */
+struct CanMergeReader_s {
+	UInt32 count;
+	UInt64 windowNs;
+	UInt32 heapCount;
+	UInt32 *pHeap;
+	CAN4OSX_WAIT_SET_T waitSet;
+	CAN_EVENT_MSG_BUF_T **ppWait;	// buffers of the channels without a frame
+	UInt32 *pWaitHeads;
+	CAN4OSX_MERGE_SOURCE_T *pSource;
+};
+
+
+/******************************************************************************/
+/**
+ * \brief canMergeOpen - read several channels in timestamp order
+ *
+ * The channels may belong to different devices, their frames are compared
+ * on the host clock, see canSetTimeSync. A frame is handed out once each
+ * channel has one that is newer, or after it is windowUs old, which has to
+ * cover the different USB latencies. Every channel can only be in one reader.
+ *
+ * \return canStatus
+ *
+ */
+canStatus canMergeOpen (
+		const CanHandle *pHnd,
+		UInt32 count,
+		UInt32 windowUs,
+		CanMergeReader **ppReader
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf;
+CanMergeReader *pReader = NULL;
+canStatus status = canOK;
+UInt32 entered;
+UInt32 loopCount;
+UInt32 other;
+bool merged;
+
+	if ( (pHnd == NULL) || (count == 0u) || (ppReader == NULL) )  {
+		return(canERR_PARAM);
+	}
+
+	for (loopCount = 0; loopCount < count; loopCount++)  {
+		for (other = 0; other < loopCount; other++)  {
+			if ( pHnd[other] == pHnd[loopCount] )  {
+				return(canERR_PARAM);
+			}
+		}
+	}
+
+	// the channels stay until the reader is set up
+	for (entered = 0; entered < count; entered++)  {
+		pSelf = CAN4OSX_EnterChannel(pHnd[entered]);
+		if ( pSelf == NULL )  {
+			status = canERR_INVHANDLE;
+			break;
+		}
+		merged = false;
+		if ( CAN4OSX_GetCanEventBuffer(pSelf) == NULL )  {
+			status = canERR_INTERNAL;
+		} else if ( !atomic_compare_exchange_strong_explicit(&pSelf->rxMerged, &merged, true,
+				memory_order_seq_cst, memory_order_relaxed) )  {
+			// claimed by another reader
+			status = canERR_NO_ACCESS;
+		}
+		if ( status != canOK )  {
+			CAN4OSX_LeaveChannel(pHnd[entered]);
+			break;
+		}
+	}
+
+	if ( status == canOK )  {
+		pReader = calloc(1, sizeof(CanMergeReader));
+		if ( pReader == NULL )  {
+			status = canERR_NOMEM;
+		}
+	}
+
+	if ( pReader != NULL )  {
+		pReader->pHeap = calloc(count, sizeof(UInt32));
+		pReader->ppWait = calloc(count, sizeof(CAN_EVENT_MSG_BUF_T *));
+		pReader->pWaitHeads = calloc(count, sizeof(UInt32));
+		pReader->pSource = calloc(count, sizeof(CAN4OSX_MERGE_SOURCE_T));
+		if ( (pReader->pHeap == NULL) || (pReader->ppWait == NULL) || (pReader->pWaitHeads == NULL) || (pReader->pSource == NULL) )  {
+			free(pReader->pHeap);
+			free(pReader->ppWait);
+			free(pReader->pWaitHeads);
+			free(pReader->pSource);
+			free(pReader);
+			pReader = NULL;
+			status = canERR_NOMEM;
+		}
+	}
+
+	if ( pReader != NULL )  {
+		pReader->count = count;
+		pReader->windowNs = (UInt64)windowUs * 1000u;
+		pthread_mutex_init(&pReader->waitSet.waitMutex, NULL);
+		CAN4OSX_CondInit(&pReader->waitSet.waitCond);
+
+		for (loopCount = 0; loopCount < count; loopCount++)  {
+			pSelf = CAN4OSX_GetChannel(pHnd[loopCount]);
+
+			pReader->pSource[loopCount].hnd = pHnd[loopCount];
+			// fails if the device just went away, canMergeRead tells
+			(void)CAN4OSX_SetCanEventBufferWaitSet(CAN4OSX_GetCanEventBuffer(pSelf), &pReader->waitSet);
+		}
+
+		*ppReader = pReader;
+	}
+
+	for (loopCount = 0; loopCount < entered; loopCount++)  {
+		if ( status != canOK )  {
+			atomic_store_explicit(&CAN4OSX_GetChannel(pHnd[loopCount])->rxMerged, false, memory_order_seq_cst);
+		}
+		CAN4OSX_LeaveChannel(pHnd[loopCount]);
+	}
+
+	return(status);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canMergeRead - the oldest frame of the merged channels
+ *
+ * Each call costs O(log count) for the channel of the frame plus a look at
+ * the channels without a frame. timeout 0 does not wait.
+ *
+ * \return canStatus, canERR_NOMSG or canERR_TIMEOUT if no frame is due
+ *
+ */
+canStatus canMergeRead (
+		CanMergeReader *pReader,
+		CanMsg *pMsg,
+		CanHandle *pHnd,
+		UInt64 *pTime,
+		UInt32 timeout
+	)
+{
+canStatus status = canOK;
+UInt32 entered;
+UInt32 loopCount;
+
+	if ( (pReader == NULL) || (pMsg == NULL) )  {
+		return(canERR_PARAM);
+	}
+
+	for (entered = 0; entered < pReader->count; entered++)  {
+		if ( CAN4OSX_EnterChannel(pReader->pSource[entered].hnd) == NULL )  {
+			status = canERR_INVHANDLE;
+			break;
+		}
+	}
+
+	if ( status == canOK )  {
+		status = CAN4OSX_MergeRead(pReader, pMsg, pHnd, pTime, timeout);
+	}
+
+	for (loopCount = 0; loopCount < entered; loopCount++)  {
+		CAN4OSX_LeaveChannel(pReader->pSource[loopCount].hnd);
+	}
+
+	return(status);
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_MergeRead - canMergeRead with all channels entered
+ *
+ * A removed device closes the buffer of its channel, which wakes us up.
+ */
+static canStatus CAN4OSX_MergeRead(
+		CanMergeReader *pReader,
+		CanMsg *pMsg,
+		CanHandle *pHnd,
+		UInt64 *pTime,
+		UInt32 timeout
+	)
+{
+CAN4OSX_MERGE_SOURCE_T *pSource;
+CAN_EVENT_MSG_BUF_T *pBuffer;
+CanFrame *pFrame;
+struct timespec deadline;
+UInt64 end = CAN4OSX_GetNanoseconds() + ((UInt64)timeout * 1000000u);
+UInt64 now;
+UInt64 wait;
+UInt32 waitCount;
+UInt32 loopCount;
+
+	for (;;)  {
+		now = CAN4OSX_GetNanoseconds();
+
+		/* sample the heads first, a frame arriving after the look wakes us */
+		waitCount = 0u;
+		for (loopCount = 0; loopCount < pReader->count; loopCount++)  {
+			pBuffer = CAN4OSX_GetCanEventBuffer(CAN4OSX_GetChannel(pReader->pSource[loopCount].hnd));
+			if ( CAN4OSX_IsCanEventBufferClosed(pBuffer) )  {
+				return(canERR_INVHANDLE);
+			}
+			if ( pReader->pSource[loopCount].pending )  {
+				continue;
+			}
+			pReader->pWaitHeads[waitCount] = CAN4OSX_GetCanEventBufferHead(pBuffer);
+			if ( CAN4OSX_MergePeek(pReader, loopCount) )  {
+				CAN4OSX_MergePush(pReader, loopCount);
+			} else {
+				pReader->ppWait[waitCount++] = pBuffer;
+			}
+		}
+
+		wait = UINT64_MAX;
+		if ( pReader->heapCount != 0u )  {
+			pSource = &pReader->pSource[pReader->pHeap[0]];
+
+			if ( (waitCount == 0u) || ((pSource->frameHost + pReader->windowNs) <= now) )  {
+				pBuffer = CAN4OSX_GetCanEventBuffer(CAN4OSX_GetChannel(pSource->hnd));
+
+				if ( CAN4OSX_AcquireCanEventBuffer(pBuffer, &pFrame, 1u) == 0u )  {
+					CAN4OSX_MergePop(pReader);
+					continue;
+				}
+				if ( CAN4OSX_GetCanEventBufferTail(pBuffer) != pSource->frameTail )  {
+					// evicted by canRX_OVERFLOW_DROP_OLDEST, sort the new oldest one in
+					CAN4OSX_ReleaseCanEventBufferEvents(pBuffer, 0u);
+					pSource->pending = false;
+					CAN4OSX_MergePop(pReader);
+					continue;
+				}
+
+				CAN4OSX_FrameToMsg(pFrame, pMsg);
+				pMsg->canTimestamp = (UInt32)(pSource->frameHost / 1000u);
+				if ( pHnd != NULL )  {
+					*pHnd = pSource->hnd;
+				}
+				if ( pTime != NULL )  {
+					*pTime = pSource->frameHost;
+				}
+				CAN4OSX_ReleaseCanEventBufferEvents(pBuffer, 1u);
+
+				if ( CAN4OSX_MergePeek(pReader, pReader->pHeap[0]) )  {
+					CAN4OSX_MergeSiftDown(pReader, 0u);
+				} else {
+					CAN4OSX_MergePop(pReader);
+				}
+
+				return(canOK);
+			}
+
+			wait = pSource->frameHost + pReader->windowNs - now;
+		}
+
+		if ( timeout == 0u )  {
+			return(canERR_NOMSG);
+		}
+		if ( timeout != canWAIT_INFINITE )  {
+			if ( now >= end )  {
+				return(canERR_TIMEOUT);
+			}
+			if ( (end - now) < wait )  {
+				wait = end - now;
+			}
+		}
+
+		if ( wait != UINT64_MAX )  {
+			CAN4OSX_GetDeadlineNs(&deadline, wait);
+		}
+		(void)CAN4OSX_WaitCanEventBufferSet(&pReader->waitSet, pReader->ppWait, pReader->pWaitHeads,
+				waitCount, (wait != UINT64_MAX) ? &deadline : NULL);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canMergeClose - counterpart of canMergeOpen
+ *
+ * Frames not read yet stay in the buffers of the channels.
+ *
+ * \return canStatus
+ *
+ */
+canStatus canMergeClose (
+		CanMergeReader *pReader
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf;
+UInt32 loopCount;
+
+	if ( pReader == NULL )  {
+		return(canERR_PARAM);
+	}
+
+	for (loopCount = 0; loopCount < pReader->count; loopCount++)  {
+		// a removed channel already left the wait set
+		pSelf = CAN4OSX_EnterChannel(pReader->pSource[loopCount].hnd);
+		if ( pSelf == NULL )  {
 			continue;
 		}
 
-		pDevice = &can4osxUsbDeviceHandle[can4osxMaxChannelCount];
+		CAN4OSX_SetCanEventBufferWaitSet(CAN4OSX_GetCanEventBuffer(pSelf), NULL);
+		atomic_store_explicit(&pSelf->rxMerged, false, memory_order_seq_cst);
+
+		CAN4OSX_LeaveChannel(pReader->pSource[loopCount].hnd);
+	}
+
+	pthread_cond_destroy(&pReader->waitSet.waitCond);
+	pthread_mutex_destroy(&pReader->waitSet.waitMutex);
+	free(pReader->pHeap);
+	free(pReader->ppWait);
+	free(pReader->pWaitHeads);
+	free(pReader->pSource);
+	free(pReader);
+
+	return(canOK);
+}
+
+
+canStatus canGetChannelData(
+		const CanHandle hnd,
+		SInt32 item,
+		void* pBuffer,
+		size_t bufsize
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_EnterChannel(hnd);
+canStatus status;
+
+	if ( pSelf == NULL )  {
+		return(canERR_INVHANDLE);
+	}
+
+	if ( (NULL == pBuffer) || (bufsize <= 0) )  {
+		status = canERR_NOMEM;
+	} else {
+		memset(pBuffer, 0, bufsize);
+		status = CAN4OSX_GetChannelData(pSelf,item,pBuffer,bufsize);
+	}
+
+	CAN4OSX_LeaveChannel(hnd);
+
+	return(status);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canGetLatency - distribution of one of the latency histograms
+ *
+ * \return canStatus, canERR_NOT_IMPLEMENTED without CAN4OSX_TRACE
+ */
+canStatus canGetLatency (
+		UInt32 latency,
+		CanLatencyStatus *pStatus
+	)
+{
+	if ( (latency >= canLATENCY_COUNT) || (pStatus == NULL) )  {
+		return(canERR_PARAM);
+	}
+
+#if CAN4OSX_TRACE
+	CAN4OSX_GetLatency(latency, pStatus);
+
+	return(canOK);
+#else /* CAN4OSX_TRACE */
+	return(canERR_NOT_IMPLEMENTED);
+#endif /* CAN4OSX_TRACE */
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canResetLatency - empty the latency histograms
+ *
+ * \return canStatus, canERR_NOT_IMPLEMENTED without CAN4OSX_TRACE
+ */
+canStatus canResetLatency (
+		void
+	)
+{
+#if CAN4OSX_TRACE
+	CAN4OSX_ResetLatency();
+
+	return(canOK);
+#else /* CAN4OSX_TRACE */
+	return(canERR_NOT_IMPLEMENTED);
+#endif /* CAN4OSX_TRACE */
+}
+
+
+/******************************************************************************/
+/**
+ * \brief canDumpTrace - write the histograms and the trace events to a file
+ *
+ * \return canStatus, canERR_NOT_IMPLEMENTED without CAN4OSX_TRACE
+ */
+canStatus canDumpTrace (
+		const char *pPath
+	)
+{
+	if ( pPath == NULL )  {
+		return(canERR_PARAM);
+	}
+
+#if CAN4OSX_TRACE
+	return(CAN4OSX_DumpTrace(pPath));
+#else /* CAN4OSX_TRACE */
+	return(canERR_NOT_IMPLEMENTED);
+#endif /* CAN4OSX_TRACE */
+}
+
+
+canStatus canGetNumberOfChannels (int *channelCount)
+{
+	if (NULL == channelCount)  {
+		return(canERR_NOMEM);
+	}
+
+	*channelCount = (int)atomic_load_explicit(&can4osxChannelCount, memory_order_acquire);
+
+	return(canOK);
+}
+
+
+// Internal
+
+static void CAN4OSX_CanInitializeLibrary(
+		void
+	)
+{
+IOReturn retVal;
+
+	CAN4OSX_DEBUG_PRINT("%s : using %s transport\n",__func__, pCan4osxTransport->name);
 
-		// Use the plugin interface to retrieve the device interface.
-		result = (*can4osxPluginInterface)->QueryInterface(can4osxPluginInterface, CFUUIDGetUUIDBytes(kIOUSBDeviceInterfaceID),
-												 (LPVOID*) &(pDevice->can4osxDeviceInterface));
+	// the transport reports the devices already plugged in with CAN4OSX_DeviceSetup
+	retVal = pCan4osxTransport->start();
 
-		// Now done with the plugin interface.
-		(*can4osxPluginInterface)->Release(can4osxPluginInterface);
+	// the enumeration is done, their setups are counted on their own
+	CAN4OSX_SetupDone();
 
-		if (result || (pDevice->can4osxDeviceInterface == NULL) )  {
-			CAN4OSX_DEBUG_PRINT("%s : Could not create interface\n", __func__);
-			IODestroyPlugInInterface(can4osxPluginInterface);
-			IOObjectRelease(can4osxUsbDevice);
-			continue;
-		}
+	if (retVal != kIOReturnSuccess)  {
+		CAN4OSX_DEBUG_PRINT("%s : transport start failed (%08x)\n",__func__, retVal);
+		return;
+	}
+
+	// runs until the transport is stopped
+	pCan4osxTransport->run();
+}
 
 
-		// Open the device to change its state
-		kernRetVal = (*can4osxUsbDeviceHandle[can4osxMaxChannelCount].can4osxDeviceInterface)->USBDeviceOpen(can4osxUsbDeviceHandle[can4osxMaxChannelCount].can4osxDeviceInterface);
-		if (kernRetVal != kIOReturnSuccess)  {
-			CAN4OSX_DEBUG_PRINT("%s : Unable to open device: %08x\n", __func__,kernRetVal);
-			(void) (*can4osxUsbDeviceHandle[can4osxMaxChannelCount].can4osxDeviceInterface)->Release(can4osxUsbDeviceHandle[can4osxMaxChannelCount].can4osxDeviceInterface);
-			IODestroyPlugInInterface(can4osxPluginInterface);
-			IOObjectRelease(can4osxUsbDevice);
-			continue;
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_WaitStatus - why waiting for a frame ended without one
+ *
+ * \return canERR_INVHANDLE if the device was removed meanwhile,
+ * canERR_NOMSG if canIOCTL_SET_RX_QUEUE_SIZE replaced pBuffer and the new
+ * one has to be looked at, else canERR_TIMEOUT
+ */
+static canStatus CAN4OSX_WaitStatus(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+		CAN_EVENT_MSG_BUF_T *pBuffer
+	)
+{
+	if ( CAN4OSX_IsCanEventBufferClosed(pBuffer) )  {
+		if ( pBuffer != CAN4OSX_GetCanEventBuffer(pSelf) )  {
+			return(canERR_NOMSG);
 		}
+		return(canERR_INVHANDLE);
+	}
 
-		//Configure device
-		kernRetVal = CAN4OSX_ConfigureDevice(can4osxUsbDeviceHandle[can4osxMaxChannelCount].can4osxDeviceInterface);
-		if (kernRetVal != kIOReturnSuccess)  {
-			CAN4OSX_DEBUG_PRINT("%s : Unable to configure device: %08x\n", __func__,kernRetVal);
-			(void) (*can4osxUsbDeviceHandle[can4osxMaxChannelCount].can4osxDeviceInterface)->USBDeviceClose(can4osxUsbDeviceHandle[can4osxMaxChannelCount].can4osxDeviceInterface);
-			(void) (*can4osxUsbDeviceHandle[can4osxMaxChannelCount].can4osxDeviceInterface)->Release(can4osxUsbDeviceHandle[can4osxMaxChannelCount].can4osxDeviceInterface);
-			IODestroyPlugInInterface(can4osxPluginInterface);
-			IOObjectRelease(can4osxUsbDevice);
-			continue;
+	return(canERR_TIMEOUT);
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_AllocChannel - a slot in the channel table
+ *
+ * A slot a removed adapter left is taken first, else one at the end. The
+ * slots come in blocks, a full table is replaced by one of twice the size.
+ * The outgrown table is kept because a reader may still look at it, the slots
+ * themselves never move. The slot stays inactive until
+ * CAN4OSX_ActivateChannel.
+ *
+ * \return the handle with the generation of the slot or -1
+ */
+static CanHandle CAN4OSX_AllocChannel(
+		void
+	)
+{
+CAN4OSX_CHANNEL_TABLE_T *pTable;
+CAN4OSX_CHANNEL_TABLE_T *pGrown;
+CAN4OSX_CHANNEL_SLOT_T *pSlot;
+CAN4OSX_CHANNEL_SLOT_T *pBlock;
+UInt32 count;
+UInt32 index;
+UInt32 block;
+UInt32 loopCount;
+
+	pthread_mutex_lock(&can4osxChannelMutex);
+
+	count = atomic_load_explicit(&can4osxChannelCount, memory_order_relaxed);
+	pTable = atomic_load_explicit(&pCan4osxChannelTable, memory_order_relaxed);
+
+	// the slot of a removed adapter first, the index stays small
+	for (index = 0; index < count; index++)  {
+		pSlot = CAN4OSX_GetChannelSlot((CanHandle)index);
+		if (!pSlot->allocated)  {
+			break;
 		}
+	}
 
+	if (index == count)  {
+		block = count >> CAN4OSX_CHANNEL_BLOCK_SHIFT;
 
-		/*kernRetVal = */CAN4OSX_FindInterfaces(pDevice);
+		if (count > CAN4OSX_HANDLE_INDEX_MASK)  {
+			pthread_mutex_unlock(&can4osxChannelMutex);
+			return(-1);
+		}
+
+		if ((pTable == NULL) || (block >= pTable->blockCount))  {
+		UInt32 blockCount = (pTable == NULL) ? CAN4OSX_CHANNEL_TABLE_MIN : (pTable->blockCount * 2u);
 
-		kernRetVal = IOServiceAddInterestNotification(can4osxUsbNotificationPortRef,			// notifyPort
-											  can4osxUsbDevice,                                 // service
-											  kIOGeneralInterest,                               // interestType
-											  CAN4OSX_DeviceNotification,                       // callback
-											  &can4osxUsbDeviceHandle[can4osxMaxChannelCount],	// refCon
-											  &(can4osxUsbDeviceHandle[can4osxMaxChannelCount].can4osxNotification)	// notification
-											  );
+			pGrown = calloc(1, sizeof(CAN4OSX_CHANNEL_TABLE_T) + (blockCount * sizeof(CAN4OSX_CHANNEL_SLOT_T *)));
+			if (pGrown == NULL)  {
+				pthread_mutex_unlock(&can4osxChannelMutex);
+				return(-1);
+			}
+			pGrown->blockCount = blockCount;
+			pGrown->pOutgrown = pTable;
+			if (pTable != NULL)  {
+				memcpy(pGrown->pBlock, pTable->pBlock, pTable->blockCount * sizeof(CAN4OSX_CHANNEL_SLOT_T *));
+			}
+			atomic_store_explicit(&pCan4osxChannelTable, pGrown, memory_order_release);
+			pTable = pGrown;
+		}
 
-		if (KERN_SUCCESS != kernRetVal)  {
-			CAN4OSX_DEBUG_PRINT("%s : IOServiceAddInterestNotification ret: 0x%08x.\n",__func__,kernRetVal);
+		if (pTable->pBlock[block] == NULL)  {
+			pBlock = calloc(CAN4OSX_CHANNEL_BLOCK_SIZE, sizeof(CAN4OSX_CHANNEL_SLOT_T));
+			if (pBlock == NULL)  {
+				pthread_mutex_unlock(&can4osxChannelMutex);
+				return(-1);
+			}
+			for (loopCount = 0; loopCount < CAN4OSX_CHANNEL_BLOCK_SIZE; loopCount++)  {
+				atomic_init(&pBlock[loopCount].state, CAN4OSX_SLOT_STATE(0u, false));
+				atomic_init(&pBlock[loopCount].users, 0u);
+				pBlock[loopCount].allocated = false;
+				pBlock[loopCount].pRetiredBuffer = NULL;
+			}
+			// not reachable until the count is raised
+			pTable->pBlock[block] = pBlock;
 		}
 
-		pDevice->channelNumber = can4osxMaxChannelCount;
+		atomic_store_explicit(&can4osxChannelCount, count + 1u, memory_order_release);
+		pSlot = CAN4OSX_GetChannelSlot((CanHandle)index);
+	}
 
-		// Done with this USB device; release the reference added by IOIteratorNext
-		(void)IOObjectRelease(can4osxUsbDevice);
+	// the handles of the old device are invalid for a while already
+	CAN4OSX_ReleaseCanEventBuffer(pSlot->pRetiredBuffer);
+	pSlot->pRetiredBuffer = NULL;
 
-		// Set up buffer for sending and receiving
-		(void)CAN4OSX_CreateEndpointBuffer(can4osxMaxChannelCount);
+	// inactive, an API call of an old handle leaves the entry alone
+	pSlot->allocated = true;
+	memset(&pSlot->entry, 0, sizeof(Can4osxUsbDeviceHandleEntry));
+	pSlot->entry.channelNumber = -1;
 
-		pDevice->canEventMsgBuff = CAN4OSX_CreateCanEventBuffer(1000);
+	pthread_mutex_unlock(&can4osxChannelMutex);
 
-		pDevice->endpoitBulkOutBusy = FALSE;
+	return(CAN4OSX_HANDLE(index, CAN4OSX_SLOT_GENERATION(atomic_load_explicit(&pSlot->state, memory_order_relaxed))));
+}
 
-		// FIXME
 
-		// Read out the product ID of the device
-		productId = 0u;
-		(*can4osxUsbDeviceHandle[can4osxMaxChannelCount].can4osxDeviceInterface)->GetDeviceProduct(pDevice->can4osxDeviceInterface, &productId);
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_FreeChannel - give back a slot that was never activated
+ *
+ * Nobody has seen a valid handle of it, the generation stays.
+ */
+static void CAN4OSX_FreeChannel(
+		const CanHandle hnd
+	)
+{
+	pthread_mutex_lock(&can4osxChannelMutex);
+	CAN4OSX_GetChannelSlot(hnd)->allocated = false;
+	pthread_mutex_unlock(&can4osxChannelMutex);
+}
 
-		CAN4OSX_DEBUG_PRINT("Found a Device with productId: %X\n", (UInt16)productId);
 
-		switch (productId) {
-			case 0x0120: /* Kvaser Leaf Light v.2 */
-				pDevice->hwFunctions = leafHardwareFunctions;
-				break;
-			case 0x0107:
-			case 0x0108:
-				pDevice->hwFunctions = leafProHardwareFunctions;
-				break;
-			case 0x0017: /* IXXAT USB-TO-CAN FD Automotive  */
-			case 0x0014: /* IXXAT USB-TO_CAN FD Compact */
-				pDevice->hwFunctions = ixxUsbFdHardwareFunctions;
-			 	break;
-			case 0x0012: /* Peak USB FD */
-				pDevice->hwFunctions = peakUsbFdHardwareFunctions;
-				break;
-			default:
-				pDevice->hwFunctions = leafHardwareFunctions;
-				break;
-		}
-		if (pDevice->hwFunctions.can4osxhwInitRef != NULL)  {
-			can4osxUsbDeviceHandle[can4osxMaxChannelCount].deviceChannelCount = 0u;
-		 	can4osxUsbDeviceHandle[can4osxMaxChannelCount].deviceChannel = 0u;
-			pDevice->hwFunctions.can4osxhwInitRef(can4osxMaxChannelCount, productId);
-		 	if (can4osxUsbDeviceHandle[can4osxMaxChannelCount].deviceChannelCount > 1u)  {
-			UInt8 maxChannel = can4osxUsbDeviceHandle[can4osxMaxChannelCount].deviceChannelCount;
-				CAN4OSX_DEBUG_PRINT("Multichannel device found with %d channels\n", maxChannel);
-				for (UInt8 i = 1u; i < maxChannel; i++)  {
-			        can4osxMaxChannelCount++;
-					if (can4osxMaxChannelCount >= CAN4OSX_MAX_CHANNEL_COUNT)  {
-						CAN4OSX_DEBUG_PRINT("%s : max Channel reached\n", __func__);
-						return;
-					}
-		   			memcpy(&can4osxUsbDeviceHandle[can4osxMaxChannelCount], &can4osxUsbDeviceHandle[can4osxMaxChannelCount - 1], sizeof(Can4osxUsbDeviceHandleEntry));
-			  		can4osxUsbDeviceHandle[can4osxMaxChannelCount].deviceChannel++;
-					can4osxUsbDeviceHandle[can4osxMaxChannelCount].channelNumber = can4osxMaxChannelCount;
-				 	pDevice++;
-				  	pDevice->canEventMsgBuff = CAN4OSX_CreateCanEventBuffer(1000);
-				  	pDevice->hwFunctions.can4osxhwInitRef(can4osxMaxChannelCount, productId);
-				}
-			}
-		}
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_ActivateChannel - the handle is usable from now on
+ *
+ * Called once the channel is set up completely.
+ */
+static void CAN4OSX_ActivateChannel(
+		const CanHandle hnd
+	)
+{
+	atomic_store_explicit(&CAN4OSX_GetChannelSlot(hnd)->state,
+			CAN4OSX_SLOT_STATE(CAN4OSX_HANDLE_GENERATION(hnd), true), memory_order_release);
 
-		can4osxMaxChannelCount++;
+	// a canOpenChannel may wait for it
+	pthread_mutex_lock(&can4osxSetupMutex);
+	pthread_cond_broadcast(CAN4OSX_SetupCond());
+	pthread_mutex_unlock(&can4osxSetupMutex);
+}
 
-	}
+
+/******************************************************************************/
+static void CAN4OSX_SetupCondInit(
+		void
+	)
+{
+	CAN4OSX_CondInit(&can4osxSetupCond);
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_SetupCond - the setup condition, on the monotonic clock
+ *
+ * A static initializer can not choose the clock, see CAN4OSX_CondInit.
+ */
+static pthread_cond_t* CAN4OSX_SetupCond(
+		void
+	)
+{
+	(void)pthread_once(&can4osxSetupOnce, CAN4OSX_SetupCondInit);
+	return(&can4osxSetupCond);
 }
 
 
-static IOReturn CAN4OSX_ConfigureDevice(
-		IOUSBDeviceInterface182 **dev
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_WaitChannelReady - wait for a channel still being set up
+ *
+ * Only while adapters are set up and at most CAN4OSX_SETUP_WAIT_MS, a channel
+ * nobody sets up is waited for until the last setup is done.
+ */
+static void CAN4OSX_WaitChannelReady(
+		int channel
 	)
 {
-UInt8 numConfig;
-IOReturn kr;
-IOUSBConfigurationDescriptorPtr configDesc;
+CAN4OSX_CHANNEL_SLOT_T *pSlot;
+struct timespec deadline;
 
-	/*kr = */(*dev)->GetNumberOfConfigurations(dev, &numConfig);
-	if (!numConfig)  {
-		return(-1);
-	}
-	//Get the configuration descriptor for index 0
-	kr = (*dev)->GetConfigurationDescriptorPtr(dev, 0, &configDesc);
-	if (kr)  {
-		CAN4OSX_DEBUG_PRINT("%s : Could not get configuration descriptor for index %d (err = %08x)\n",__func__, 0, (unsigned int)kr);
-		return(-1);
-	}
-	//Set the device’s configuration.
-	kr = (*dev)->SetConfiguration(dev, configDesc->bConfigurationValue);
-	if (kr)  {
-		CAN4OSX_DEBUG_PRINT("%s : Could not set configuration to value %d (err = %08x)\n",__func__, 0, (unsigned int)kr);
-		return(-1);
+	CAN4OSX_GetDeadline(&deadline, CAN4OSX_SETUP_WAIT_MS);
+
+	pthread_mutex_lock(&can4osxSetupMutex);
+
+	while (can4osxSetupPending != 0u)  {
+		pSlot = CAN4OSX_GetChannelSlot(channel);
+		if ((pSlot != NULL) && ((atomic_load_explicit(&pSlot->state, memory_order_acquire) & CAN4OSX_SLOT_ACTIVE) != 0u))  {
+			break;
+		}
+		if (CAN4OSX_CondTimedWait(CAN4OSX_SetupCond(), &can4osxSetupMutex, &deadline) == ETIMEDOUT)  {
+			break;
+		}
 	}
-	return(kIOReturnSuccess);
+
+	pthread_mutex_unlock(&can4osxSetupMutex);
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_SetupDone - one setup less, see CAN4OSX_DeviceSetup
+ */
+static void CAN4OSX_SetupDone(
+		void
+	)
+{
+	pthread_mutex_lock(&can4osxSetupMutex);
+	can4osxSetupPending--;
+	pthread_cond_broadcast(CAN4OSX_SetupCond());
+	pthread_mutex_unlock(&can4osxSetupMutex);
 }
 
 
-static IOReturn CAN4OSX_FindInterfaces(
-		Can4osxUsbDeviceHandleEntry *handle
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_MergePeek - look at the oldest frame of a channel
+ *
+ * The frame stays in the buffer, only its time is noted.
+ *
+ * \return true if the channel has a frame
+ */
+static bool CAN4OSX_MergePeek(
+		CanMergeReader *pReader,
+		UInt32 source
 	)
 {
-IOReturn ret, ret2;
-IOUSBFindInterfaceRequest request;
-io_iterator_t iterator;
-io_service_t usbInterface;
-IOCFPlugInInterface **plugInInterface = NULL;
-CAN4OSX_USB_INTERFACE **interface = NULL;
-HRESULT result;
-SInt32 score;
-UInt8 interfaceNumEndpoints;
-IOUSBDeviceInterface182 **device = handle->can4osxDeviceInterface;
-int loopCount = 1;
+CAN4OSX_MERGE_SOURCE_T *pSource = &pReader->pSource[source];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(pSource->hnd);
+CAN_EVENT_MSG_BUF_T *pBuffer = CAN4OSX_GetCanEventBuffer(pSelf);
+CanFrame *pFrame;
+UInt64 frameDevice;
+
+	if ( CAN4OSX_AcquireCanEventBuffer(pBuffer, &pFrame, 1u) == 0u )  {
+		pSource->pending = false;
+		return(false);
+	}
+
+	frameDevice = pFrame->canTimestamp;
+	pSource->frameTail = CAN4OSX_GetCanEventBufferTail(pBuffer);
+	CAN4OSX_ReleaseCanEventBufferEvents(pBuffer, 0u);
 
-CFRunLoopSourceRef runLoopSource;
+	if ( pSelf->rxHostTime || (pSelf->pTimestamp == NULL) )  {
+		pSource->frameHost = frameDevice;
+	} else {
+		pSource->frameHost = CAN4OSX_GetHostTimestamp(pSelf->pTimestamp, frameDevice);
+	}
+	pSource->pending = true;
 
-	request.bInterfaceClass	= kIOUSBFindInterfaceDontCare;
-	request.bInterfaceSubClass = kIOUSBFindInterfaceDontCare;
-	request.bInterfaceProtocol = kIOUSBFindInterfaceDontCare;
-	request.bAlternateSetting  = kIOUSBFindInterfaceDontCare;
+	return(true);
+}
 
-	//Get an iterator for the interfaces on the device
-	ret = (*device)->CreateInterfaceIterator(device, &request, &iterator);
 
-	if ( ret != kIOReturnSuccess )  {
-		CAN4OSX_DEBUG_PRINT("%s : Could not create InterfaceIterator\n",__func__);
-		return(ret);
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_MergeBefore - heap order, the channel order breaks a tie
+ */
+static inline bool CAN4OSX_MergeBefore(
+		CanMergeReader *pReader,
+		UInt32 a,
+		UInt32 b
+	)
+{
+	if ( pReader->pSource[a].frameHost != pReader->pSource[b].frameHost )  {
+		return(pReader->pSource[a].frameHost < pReader->pSource[b].frameHost);
 	}
 
-	while ((usbInterface = IOIteratorNext(iterator)))  {
-		//Create an intermediate plug-in
-		ret = IOCreatePlugInInterfaceForService(usbInterface,
-											   kIOUSBInterfaceUserClientTypeID,
-											   kIOCFPlugInInterfaceID,
-											   &plugInInterface, &score);
-		//Release the usbInterface object after getting the plug-in
-		(void)IOObjectRelease(usbInterface);
+	return(a < b);
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_MergeSiftDown(
+		CanMergeReader *pReader,
+		UInt32 pos
+	)
+{
+UInt32 child;
+UInt32 tmp;
 
-		if ((ret != kIOReturnSuccess) || !plugInInterface)  {
-			CAN4OSX_DEBUG_PRINT("%s : Unable to create a plug-in\n", __func__);
+	for (;;)  {
+		child = (2u * pos) + 1u;
+		if ( child >= pReader->heapCount )  {
 			break;
 		}
-
-		//Now create the device interface for the interface
-		result = (*plugInInterface)->QueryInterface(plugInInterface, CFUUIDGetUUIDBytes(kIOUSBInterfaceInterfaceID), (LPVOID *) &interface);
-		//No longer need the intermediate plug-in
-		(*plugInInterface)->Release(plugInInterface);
-		if (result || !interface)  {
-			CAN4OSX_DEBUG_PRINT("%s : Could not create a device interface for the interface (%08x)\n", __func__,(int) result);
+		if ( ((child + 1u) < pReader->heapCount)
+				&& CAN4OSX_MergeBefore(pReader, pReader->pHeap[child + 1u], pReader->pHeap[child]) )  {
+			child++;
+		}
+		if ( !CAN4OSX_MergeBefore(pReader, pReader->pHeap[child], pReader->pHeap[pos]) )  {
 			break;
 		}
+		tmp = pReader->pHeap[pos];
+		pReader->pHeap[pos] = pReader->pHeap[child];
+		pReader->pHeap[child] = tmp;
+		pos = child;
+	}
+}
 
-		//Now open the interface. This will cause the pipes associated with
-		//the endpoints in the interface descriptor to be instantiated
-		ret = (*interface)->USBInterfaceOpen(interface);
-		if (ret != kIOReturnSuccess)  {
-			CAN4OSX_DEBUG_PRINT("%s : Unable to open interface (%08x)\n", __func__,ret);
-			(void) (*interface)->Release(interface);
-			continue;
-		}
 
-		//Get the number of endpoints associated with this interface
-		ret = (*interface)->GetNumEndpoints(interface, &interfaceNumEndpoints);
-		if (ret != kIOReturnSuccess)  {
-			CAN4OSX_DEBUG_PRINT("%s : Unable to get number of endpoints (%08x)\n",__func__ ,ret);
-			(void) (*interface)->USBInterfaceClose(interface);
-			(void) (*interface)->Release(interface);
-			continue;
-		}
+/******************************************************************************/
+static void CAN4OSX_MergePush(
+		CanMergeReader *pReader,
+		UInt32 source
+	)
+{
+UInt32 pos = pReader->heapCount++;
+UInt32 parent;
 
-		CAN4OSX_DEBUG_PRINT("%s : Interface has %d endpoints\n",__func__, interfaceNumEndpoints);
+	pReader->pHeap[pos] = source;
 
-		// Reset the endpoint numbers
-		handle->endpointNumberBulkIn = 0u;
-		handle->endpointNumberBulkOut = 0u;
+	while ( pos != 0u )  {
+		parent = (pos - 1u) / 2u;
+		if ( !CAN4OSX_MergeBefore(pReader, pReader->pHeap[pos], pReader->pHeap[parent]) )  {
+			break;
+		}
+		pReader->pHeap[pos] = pReader->pHeap[parent];
+		pReader->pHeap[parent] = source;
+		pos = parent;
+	}
+}
 
-		for (loopCount = 1; loopCount <= interfaceNumEndpoints; loopCount++ ) {
-			UInt8 direction;
-			UInt8 number;
-			UInt8 transferType;
-			UInt16 maxPacketSize;
-			UInt8 interval;
 
-			ret2 = (*interface)->GetPipeProperties(interface, loopCount, &direction, &number, &transferType, &maxPacketSize, &interval);
+/******************************************************************************/
+static void CAN4OSX_MergePop(
+		CanMergeReader *pReader
+	)
+{
+	pReader->pSource[pReader->pHeap[0]].pending = false;
+	pReader->heapCount--;
+	pReader->pHeap[0] = pReader->pHeap[pReader->heapCount];
+	CAN4OSX_MergeSiftDown(pReader, 0u);
+}
 
-			if (ret2 != kIOReturnSuccess)  {
-				CAN4OSX_DEBUG_PRINT("%s : Unable to get properties of pipe %d (%08x)\n",__func__ ,loopCount, ret2);
-			} else {
-				if ( (direction == kUSBOut) && (transferType == kUSBBulk) )  {
-					CAN4OSX_DEBUG_PRINT("%s : Found BulkOut endpoint %d - maxPack: %d\n",__func__ ,loopCount, maxPacketSize);
-					if (handle->endpointNumberBulkOut == 0)  {
-						handle->endpointNumberBulkOut = loopCount;
-						handle->endpointMaxSizeBulkOut = maxPacketSize;
-					}
-				}
 
-				if ( (direction == kUSBIn) && (transferType == kUSBBulk) )  {
-					CAN4OSX_DEBUG_PRINT("%s : Found BulkIn endpoint %d - maxPack: %d\n",__func__ ,loopCount, maxPacketSize);
-					if (handle->endpointNumberBulkIn == 0u)  {
-						handle->endpointNumberBulkIn = loopCount;
-						handle->endpointMaxSizeBulkIn = maxPacketSize;
-					}
-				}
-			}
-		}
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_TimeSync - one round of clock reads
+ *
+ * The first channel of a device sends the request, its answer is decoded on
+ * the driver thread. Runs on queueCan4osxTimeSync.
+ */
+static void CAN4OSX_TimeSync(
+		void *pContext
+	)
+{
+CAN4OSX_CHANNEL_SLOT_T *pSlot;
+Can4osxUsbDeviceHandleEntry *pSelf;
+CanHandle hnd;
+UInt32 index;
 
-		ret = (*interface)->CreateInterfaceAsyncEventSource(interface, &runLoopSource);
+	(void)pContext;
 
-		if (ret != kIOReturnSuccess)  {
-			CAN4OSX_DEBUG_PRINT("%s : Unable to create asynchronous event source (%08x)\n", __func__,ret);
-			(void) (*interface)->USBInterfaceClose(interface);
-			(void) (*interface)->Release(interface);
+	for (index = 0; (pSlot = CAN4OSX_GetChannelSlot((CanHandle)index)) != NULL; index++)  {
+		hnd = CAN4OSX_HANDLE(index, CAN4OSX_SLOT_GENERATION(atomic_load_explicit(&pSlot->state, memory_order_relaxed)));
+		pSelf = CAN4OSX_EnterChannel(hnd);
+		if (pSelf == NULL)  {
 			continue;
 		}
-		CFRunLoopAddSource(CFRunLoopGetCurrent(), runLoopSource, kCFRunLoopDefaultMode);
-		CAN4OSX_DEBUG_PRINT("%s : Asynchronous event source added to run loop\n", __func__);
-
-		//Save the interface
-		handle->can4osxInterfaceInterface = interface;
-
-		//Right now only the first interface is supported
-		break;
+		if ((pSelf->deviceChannel == 0) && (pSelf->pTimestamp != NULL) && (pSelf->hwFunctions.can4osxhwReadClockRef != NULL))  {
+			CAN4OSX_TimestampClockRequest(pSelf->pTimestamp);
+			(void)pSelf->hwFunctions.can4osxhwReadClockRef(hnd);
+		}
+		CAN4OSX_LeaveChannel(hnd);
 	}
-	return(ret);
 }
 
 
-static void CAN4OSX_DeviceNotification(
-		void *refCon, io_service_t service,
-		natural_t messageType,
-		void *messageArgument
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_SetTransport - selects the usb transport
+ *
+ * The default transport is the one of the platform, the simulation replaces
+ * it. Only possible before canInitializeLibrary.
+ *
+ * \return canStatus
+ */
+canStatus CAN4OSX_SetTransport(
+		const CAN4OSX_USB_TRANSPORT_T *pTransport
 	)
 {
-Can4osxUsbDeviceHandleEntry	*pSelf = (Can4osxUsbDeviceHandleEntry *) refCon;
+	if (pTransport == NULL)  {
+		return(canERR_PARAM);
+	}
+
+	if (queueCan4osx != NULL)  {
+		return(canERR_NO_ACCESS);
+	}
+
+	pCan4osxTransport = pTransport;
 
-	if (messageType == kIOMessageServiceIsTerminated)  {
-		CAN4OSX_DEBUG_PRINT("%s : Device removed. Channel number %d\n",__func__, pSelf->channelNumber);
+	return(canOK);
+}
 
-		CAN4OSX_Dealloc(pSelf);
 
-		pSelf->channelNumber = -1;
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_IsSupportedDevice - checks the vendor and product id
+ *
+ * \return 1 if the device is handled by the driver, else 0
+ */
+UInt8 CAN4OSX_IsSupportedDevice(
+		UInt16 vendorId,
+		UInt16 productId
+	)
+{
+UInt32 loopCount;
+
+	for (loopCount = 0; loopCount < can4osxSupportedDeviceCount; loopCount++)  {
+		if ((can4osxSupportedDevices[loopCount].vendorId == vendorId) && (can4osxSupportedDevices[loopCount].productId == productId))  {
+			return(1);
+		}
 	}
+	return(0);
 }
 
 
-static IOReturn CAN4OSX_CreateEndpointBuffer(
-		const CanHandle hnd
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_DeviceSetup - a transport found a new adapter
+ *
+ * Opening the adapter and the handshake of its device driver take a while,
+ * so each adapter is set up by setup on a worker of its own. The first
+ * channel is reserved here, the channels keep the order the adapters were
+ * found in. Called on the driver thread.
+ */
+void CAN4OSX_DeviceSetup(
+		CAN4OSX_SETUP_FUNC_T setup,
+		void *pContext
 	)
 {
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+CanHandle hnd = CAN4OSX_AllocChannel();
+
+	pthread_mutex_lock(&can4osxSetupMutex);
+	can4osxSetupPending++;
+	pthread_mutex_unlock(&can4osxSetupMutex);
 
-	pSelf->endpointBufferBulkInRef = calloc( 1 , pSelf->endpointMaxSizeBulkIn);
+	dispatch_async(queueCan4osxSetup, ^(void) {
+		if ((setup(pContext, hnd) == NULL) && (hnd != -1))  {
+			CAN4OSX_FreeChannel(hnd);
+		}
+		CAN4OSX_SetupDone();
+	});
+}
 
-	pSelf->endpointBufferBulkOutRef = calloc( 1 , pSelf->endpointMaxSizeBulkOut);
 
-	return(kIOReturnSuccess);
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_InitChannel - set up what every channel of an adapter owns
+ *
+ * pSelf comes zeroed from CAN4OSX_AllocChannel, transport, endpoints and the
+ * device wide parts are filled in by the caller. The receive buffers come
+ * with the first read.
+ */
+static void CAN4OSX_InitChannel(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+		CanHandle hnd
+	)
+{
+	pSelf->channelNumber = hnd;
+
+	pSelf->bulkOutDepth = CAN4OSX_USB_BULK_OUT_DEPTH;
+	(void)CAN4OSX_usbCreateBulkOut(pSelf);
+
+	pSelf->rxQueueBytes = CAN4OSX_RX_BUFFER_BYTES;
+	pSelf->rxOverflowPolicy = canRX_OVERFLOW_DROP_NEWEST;
+	pSelf->rxBlockMs = CAN4OSX_RX_BLOCK_MS;
+	atomic_store_explicit(&pSelf->busOn, false, memory_order_relaxed);
+	pSelf->rxHostTime = false;
+	atomic_store_explicit(&pSelf->rxMerged, false, memory_order_relaxed);
+	memset(&pSelf->canNotify, 0, sizeof(pSelf->canNotify));
+	memset(pSelf->bulkIn, 0, sizeof(pSelf->bulkIn));
+	CAN4OSX_InitFilter(&pSelf->rxFilter);
+	CAN4OSX_InitBusStatistics(&pSelf->busStats);
+	(void)CAN4OSX_InitTxTrack(&pSelf->txTrack);
+	atomic_store_explicit(&pSelf->canEventMsgBuff, CAN4OSX_CreateCanEventBuffer(pSelf->rxQueueBytes), memory_order_release);
+	CAN4OSX_TRACE_BUFFER_CHANNEL(CAN4OSX_GetCanEventBuffer(pSelf), hnd);
 }
 
 
-static IOReturn CAN4OSX_Dealloc(
-		Can4osxUsbDeviceHandleEntry	*pSelf
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_DeviceAttach - the transport has opened a new adapter
+ *
+ * The device is opened and configured by the transport, here the channels are
+ * allocated and the hardware specific part is selected. The first channel
+ * goes to hnd if CAN4OSX_DeviceSetup reserved one. Called on the worker of
+ * CAN4OSX_DeviceSetup.
+ *
+ * \return the handle entry of the first channel or NULL
+ */
+Can4osxUsbDeviceHandleEntry* CAN4OSX_DeviceAttach(
+		const CAN4OSX_USB_TRANSPORT_T *pTransport,
+		const CAN4OSX_USB_DEVICE_DESC_T *pDesc,
+		CanHandle hnd
 	)
 {
-kern_return_t retval;
+Can4osxUsbDeviceHandleEntry *pDevice;
+Can4osxUsbDeviceHandleEntry *pFirst;
+UInt16 productId = pDesc->productId;
+UInt32 loopCount;
 
-	// Release the usb stuff
+	CAN4OSX_DEBUG_PRINT("%s : Device added\n", __func__);
 
-	if (pSelf->can4osxDeviceInterface)  {
-		/*retval = */(*pSelf->can4osxDeviceInterface)->Release(pSelf->can4osxDeviceInterface);
+	if (hnd == -1)  {
+		hnd = CAN4OSX_AllocChannel();
+	}
+	if (hnd == -1)  {
+		CAN4OSX_DEBUG_PRINT("%s : no memory for the channel\n", __func__);
+		return(NULL);
+	}
+	pDevice = CAN4OSX_GetChannel(hnd);
+	pFirst = pDevice;
+
+	pDevice->usbTransport = pTransport;
+	pDevice->usbTransportRef = pDesc->usbTransportRef;
+	pDevice->endpointNumberBulkIn = pDesc->endpointNumberBulkIn;
+	pDevice->endpointMaxSizeBulkIn = pDesc->endpointMaxSizeBulkIn;
+	pDevice->endpointNumberBulkOut = pDesc->endpointNumberBulkOut;
+	pDevice->endpointMaxSizeBulkOut = pDesc->endpointMaxSizeBulkOut;
+
+	CAN4OSX_InitChannel(pDevice, hnd);
+	pDevice->pTimestamp = CAN4OSX_CreateTimestamp();
+	pDevice->pTransactions = CAN4OSX_CreateTransactions();
+
+	pDevice->bulkInDepth = CAN4OSX_USB_BULK_IN_DEPTH;
+	for (loopCount = 0; loopCount < can4osxSupportedDeviceCount; loopCount++)  {
+		if ((can4osxSupportedDevices[loopCount].vendorId == pDesc->vendorId) && (can4osxSupportedDevices[loopCount].productId == productId))  {
+			pDevice->bulkInDepth = can4osxSupportedDevices[loopCount].bulkInDepth;
+		}
 	}
 
-	//if(self->can4osxInterfaceInterface) {
-	//	(void)(*self->can4osxInterfaceInterface)->Release(self->can4osxInterfaceInterface);
-	//}
-
+	CAN4OSX_DEBUG_PRINT("Found a Device with productId: %X\n", (UInt16)productId);
 
-	if(pSelf->endpointBufferBulkInRef)  {
-		free(pSelf->endpointBufferBulkInRef);
+	switch (productId) {
+		case 0x0120: /* Kvaser Leaf Light v.2 */
+			pDevice->hwFunctions = leafHardwareFunctions;
+			break;
+		case 0x0107:
+		case 0x0108:
+			pDevice->hwFunctions = leafProHardwareFunctions;
+			break;
+		case 0x0017: /* IXXAT USB-TO-CAN FD Automotive  */
+		case 0x0014: /* IXXAT USB-TO_CAN FD Compact */
+			pDevice->hwFunctions = ixxUsbFdHardwareFunctions;
+		 	break;
+		case 0x0012: /* Peak USB FD */
+			pDevice->hwFunctions = peakUsbFdHardwareFunctions;
+			break;
+		default:
+			pDevice->hwFunctions = leafHardwareFunctions;
+			break;
 	}
-
-	if(pSelf->endpointBufferBulkOutRef)  {
-		free(pSelf->endpointBufferBulkOutRef);
+	if (pDevice->hwFunctions.can4osxhwInitRef != NULL)  {
+		pDevice->deviceChannelCount = 0u;
+		pDevice->deviceChannel = 0u;
+		pDevice->hwFunctions.can4osxhwInitRef(hnd, productId);
+	}
+	CAN4OSX_ActivateChannel(hnd);
+
+	if (pDevice->deviceChannelCount > 1u)  {
+	UInt8 maxChannel = pDevice->deviceChannelCount;
+		CAN4OSX_DEBUG_PRINT("Multichannel device found with %d channels\n", maxChannel);
+		for (UInt8 i = 1u; i < maxChannel; i++)  {
+		Can4osxUsbDeviceHandleEntry *pPrevious = pDevice;
+			// the next handle, not necessarily in the same block
+			hnd = CAN4OSX_AllocChannel();
+			if (hnd == -1)  {
+				CAN4OSX_DEBUG_PRINT("%s : no memory for the channel\n", __func__);
+				return(pFirst);
+			}
+			pDevice = CAN4OSX_GetChannel(hnd);
+
+			// only the device wide parts are taken over, the init of the
+			// hardware steps the endpoints on from the previous channel
+			pDevice->usbTransport = pPrevious->usbTransport;
+			pDevice->usbTransportRef = pPrevious->usbTransportRef;
+			pDevice->endpointNumberBulkIn = pPrevious->endpointNumberBulkIn;
+			pDevice->endpointMaxSizeBulkIn = pPrevious->endpointMaxSizeBulkIn;
+			pDevice->endpointNumberBulkOut = pPrevious->endpointNumberBulkOut;
+			pDevice->endpointMaxSizeBulkOut = pPrevious->endpointMaxSizeBulkOut;
+			pDevice->bulkInDepth = pPrevious->bulkInDepth;
+			pDevice->privateData = pPrevious->privateData;
+			pDevice->pTimestamp = pPrevious->pTimestamp;
+			pDevice->pTransactions = pPrevious->pTransactions;
+			pDevice->hwFunctions = pPrevious->hwFunctions;
+			pDevice->usbFunctions = pPrevious->usbFunctions;
+			pDevice->deviceChannelCount = pPrevious->deviceChannelCount;
+			pDevice->deviceChannel = pPrevious->deviceChannel + 1;
+
+			CAN4OSX_InitChannel(pDevice, hnd);
+			pDevice->hwFunctions.can4osxhwInitRef(hnd, productId);
+			CAN4OSX_ActivateChannel(hnd);
+		}
 	}
 
-	// Release the notification
+	return(pFirst);
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_IsDeviceChannel - pChannel is a channel of the adapter of pSelf
+ */
+static inline bool CAN4OSX_IsDeviceChannel(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+		void *pTransportRef,
+		Can4osxUsbDeviceHandleEntry *pChannel
+	)
+{
+	return((pChannel == pSelf) || ((pTransportRef != NULL) && (pChannel->usbTransportRef == pTransportRef)));
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_DeviceDetach - the adapter was removed
+ *
+ * The handles of all its channels turn invalid first, the API calls still
+ * inside a channel are waited for and only then everything
+ * CAN4OSX_DeviceAttach set up is released. The slots are free for the next
+ * adapter afterwards, the transport releases its own device data. Called on
+ * the driver thread.
+ */
+void CAN4OSX_DeviceDetach(
+		Can4osxUsbDeviceHandleEntry	*pSelf
+	)
+{
+void *pTransportRef = pSelf->usbTransportRef;
+CAN4OSX_CHANNEL_SLOT_T *pSlot;
+UInt32 count = atomic_load_explicit(&can4osxChannelCount, memory_order_acquire);
+UInt32 state;
+UInt32 loopCount;
 
-	retval = IOObjectRelease(pSelf->can4osxNotification);
+	CAN4OSX_DEBUG_PRINT("%s : Device removed. Channel number %d\n",__func__, pSelf->channelNumber);
 
-	// FIXME test return value
-	if (0)  {
-		return(retval);
+	// an API call waiting for a response gives up
+	CAN4OSX_CloseTransactions(pSelf->pTransactions);
+
+	// a sleeping reader wakes up, a new one sees the closed buffer or the state
+	for (loopCount = 0; loopCount < count; loopCount++)  {
+		pSlot = CAN4OSX_GetChannelSlot((CanHandle)loopCount);
+		if (!CAN4OSX_IsDeviceChannel(pSelf, pTransportRef, &pSlot->entry))  {
+			continue;
+		}
+		CAN4OSX_CloseCanEventBuffer(CAN4OSX_GetCanEventBuffer(&pSlot->entry));
+		CAN4OSX_CloseTxTrack(&pSlot->entry.txTrack);
+		state = atomic_load_explicit(&pSlot->state, memory_order_relaxed);
+		atomic_store_explicit(&pSlot->state, CAN4OSX_SLOT_STATE(CAN4OSX_SLOT_GENERATION(state) + 1u, false), memory_order_seq_cst);
 	}
 
-	// Now release  the dive internal stuff
+	// the grace period, see CAN4OSX_EnterChannel
+	for (loopCount = 0; loopCount < count; loopCount++)  {
+		pSlot = CAN4OSX_GetChannelSlot((CanHandle)loopCount);
+		if (!CAN4OSX_IsDeviceChannel(pSelf, pTransportRef, &pSlot->entry))  {
+			continue;
+		}
+		while (atomic_load_explicit(&pSlot->users, memory_order_acquire) != 0u)  {
+			usleep(CAN4OSX_DETACH_POLL_US);
+		}
+	}
 
-	// FIXME with the channelnumber
+	for (loopCount = 0; loopCount < count; loopCount++)  {
+		pSlot = CAN4OSX_GetChannelSlot((CanHandle)loopCount);
+		if (!CAN4OSX_IsDeviceChannel(pSelf, pTransportRef, &pSlot->entry))  {
+			continue;
+		}
+		CAN4OSX_NotifyRelease(&pSlot->entry);
+		CAN4OSX_usbReleaseBulkIn(&pSlot->entry);
+		CAN4OSX_usbReleaseBulkOut(&pSlot->entry);
+		CAN4OSX_ReleaseFilter(&pSlot->entry.rxFilter);
+		CAN4OSX_ReleaseBusStatistics(&pSlot->entry.busStats);
+		CAN4OSX_ReleaseTxTrack(&pSlot->entry.txTrack);
+	}
 
+	// Now release  the dive internal stuff
 	if (pSelf->hwFunctions.can4osxhwCanCloseRef != NULL)  {
 		pSelf->hwFunctions.can4osxhwCanCloseRef(pSelf->channelNumber);
 	}
-	return(retval);
 
+	// the channels share the timestamp and the transactions of the first one
+	CAN4OSX_ReleaseTimestamp(pSelf->pTimestamp);
+	CAN4OSX_ReleaseTransactions(pSelf->pTransactions);
+
+	pthread_mutex_lock(&can4osxChannelMutex);
+	for (loopCount = 0; loopCount < count; loopCount++)  {
+		pSlot = CAN4OSX_GetChannelSlot((CanHandle)loopCount);
+		if (!CAN4OSX_IsDeviceChannel(pSelf, pTransportRef, &pSlot->entry))  {
+			continue;
+		}
+		// the frames of a canReadAcquire are not covered by users, see pRetiredBuffer
+		pSlot->pRetiredBuffer = CAN4OSX_GetCanEventBuffer(&pSlot->entry);
+		atomic_store_explicit(&pSlot->entry.canEventMsgBuff, NULL, memory_order_relaxed);
+		pSlot->entry.pTimestamp = NULL;
+		pSlot->entry.pTransactions = NULL;
+		pSlot->entry.usbTransportRef = NULL;
+		pSlot->entry.channelNumber = -1;
+		pSlot->allocated = false;
+	}
+	pthread_mutex_unlock(&can4osxChannelMutex);
 }
 
 
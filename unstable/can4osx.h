@@ -45,9 +45,12 @@
 #ifndef CAN4OSX_H
 # define CAN4OSX_H
 
-#include <CoreFoundation/CoreFoundation.h>
+#include "can4osx_platform.h"
 
-#define CAN4OSX_MAX_CHANNEL_COUNT 5
+#define CAN4OSX_CAN_MAX_MSG_LEN 64
+
+/* timeout value for the blocking read functions to wait forever */
+#define canWAIT_INFINITE 0xFFFFFFFFu
 
 // KVASER LEAF STUFF
 
@@ -113,6 +116,7 @@
 #define canNOTIFY_ERROR         0x0004      // Notify on error
 #define canNOTIFY_STATUS        0x0008      // Notify on (some) status changes
 #define canNOTIFY_ENVVAR        0x0010      // Notify on Envvar change
+#define canNOTIFY_RX_COALESCE   0x0100      // Notify on receive only once per USB transfer
 
 
 #define canMSG_MASK             0x00ff      // Used to mask the non-info bits
@@ -148,6 +152,10 @@
 
 # define canOPEN_CAN_FD             0x0400
 
+/* canInitializeLibraryEx: return before the adapters are set up, a channel
+ * is opened as soon as its adapter is ready */
+#define canINIT_NO_WAIT             0x0001
+
 
 #define canCHANNELDATA_CHANNEL_CAP                1
 #define canCHANNELDATA_TRANS_CAP                  2
@@ -165,6 +173,41 @@
 #define canCHANNELDATA_DEVDESCR_ASCII             26
 
 
+/* canIoCtl functions */
+#define canIOCTL_GET_RX_BUFFER_LEVEL              8   // UInt32, cells in use, a classic frame is one cell
+#define canIOCTL_SET_RX_QUEUE_SIZE                0x1000  // UInt32, receive queue in cells, only while the bus is off and not merged
+#define canIOCTL_SET_RX_OVERFLOW_POLICY           0x1001  // UInt32, canRX_OVERFLOW_xxx
+#define canIOCTL_SET_RX_BLOCK_TIMEOUT             0x1002  // UInt32, ms canRX_OVERFLOW_BLOCK waits at most
+#define canIOCTL_GET_OVERRUN_COUNT                0x1003  // UInt32, received frames the queue could not hold
+#define canIOCTL_RESET_OVERRUN_COUNT              0x1004  // no buffer
+#define canIOCTL_SET_TIMESTAMP_HOST               0x1005  // UInt32, != 0 receive timestamps on the host clock, only while the bus is off
+#define canIOCTL_GET_TIMESTAMP_DRIFT              0x1006  // SInt32, ppb the device clock runs slower than the host clock
+#define canIOCTL_GET_FILTERED_COUNT               0x1007  // UInt32, received frames the acceptance filter dropped
+#define canIOCTL_RESET_FILTERED_COUNT             0x1008  // no buffer
+#define canIOCTL_SET_TXACK                        0x1009  // UInt32, != 0 sent frames are received flagged canMSG_TXACK
+
+/* canAccept flags */
+#define canFILTER_ACCEPT                          1
+#define canFILTER_REJECT                          2
+#define canFILTER_SET_CODE_STD                    3
+#define canFILTER_SET_MASK_STD                    4
+#define canFILTER_SET_CODE_EXT                    5
+#define canFILTER_SET_MASK_EXT                    6
+
+#define canFILTER_NULL_MASK                       0L
+
+/* latencies of canGetLatency, measured if the driver is built with CAN4OSX_TRACE */
+#define canLATENCY_RX                             0   // USB completion to the read of the frame
+#define canLATENCY_TX_ACK                         1   // canWrite to the TX ack of the adapter
+#define canLATENCY_COMMAND                        2   // command to the response of the adapter
+#define canLATENCY_COUNT                          3
+
+/* what happens to a received frame if the receive queue is full */
+#define canRX_OVERFLOW_DROP_NEWEST                0   // the new frame is lost
+#define canRX_OVERFLOW_DROP_OLDEST                1   // the oldest frames make room
+#define canRX_OVERFLOW_BLOCK                      2   // the USB thread waits for room, then drops the new frame
+
+
 #define canCHANNEL_CAP_CAN_FD            0x00080000L ///< CAN-FD ISO compliant channel
 #define canCHANNEL_CAP_CAN_FD_NONISO     0x00100000L ///< CAN-FD NON-ISO compliant channel
 #define canCHANNEL_CAP_SILENT_MODE       0x00200000L ///< Channel supports Silent mode
@@ -223,6 +266,109 @@ typedef enum {
 
 typedef int CanHandle;
 
+/* a CAN message as used by canReadBatch and canWriteBatch, the timestamp is
+ * in us and wraps like the one of canRead */
+typedef struct {
+    UInt32 canTimestamp;
+    UInt32 canId;
+    UInt32  canFlags;
+    UInt8  canDlc;
+    UInt8  canChannel;
+    UInt8  padding;
+    UInt8  canData[CAN4OSX_CAN_MAX_MSG_LEN];
+} __attribute__ ((packed)) CanMsg;
+
+/* a received CAN message as it is stored in the receive buffer, see
+ * canReadAcquire. A frame occupies canCells cells of CAN_FRAME_CELL_SIZE
+ * bytes, canData holds canDlc bytes. The timestamp is in ns of the device
+ * clock and does not wrap, see canGetHostTimestamp and
+ * canIOCTL_SET_TIMESTAMP_HOST for the host clock */
+#define CAN_FRAME_CELL_SIZE     32
+#define CAN_FRAME_CELLS(len)    ((sizeof(CanFrame) + (len) + CAN_FRAME_CELL_SIZE - 1u) / CAN_FRAME_CELL_SIZE)
+
+typedef struct {
+    UInt64 canTimestamp;
+    UInt32 canId;
+    UInt32 canFlags;
+    UInt8  canDlc;
+    UInt8  canChannel;
+    UInt8  canCells;
+    UInt8  padding;
+    UInt32 reserved;        // used by the driver
+    UInt8  canData[];
+} CanFrame;
+
+/* the frame following pFrame in a run of canReadAcquire */
+#define canFrameNext(pFrame)    ((const CanFrame *)((const UInt8 *)(pFrame) + ((pFrame)->canCells * CAN_FRAME_CELL_SIZE)))
+
+/* transmit path of a channel as returned by canGetTxStatistics, the latency
+ * is the time in us from queueing a bulk out transfer to its completion, the
+ * ack latency the one from canWrite to the TX ack of the adapter */
+typedef struct {
+    UInt32 queued;          // frames waiting in the transmit buffer
+    UInt32 inFlight;        // bulk out transfers queued at the usb stack
+    UInt32 inFlightMax;
+    UInt32 latencyLast;
+    UInt32 latencyAvg;
+    UInt32 latencyMax;
+    UInt64 transfers;       // completed bulk out transfers
+    UInt64 frames;          // frames sent with them
+    UInt32 pending;         // frames written and not acknowledged yet
+    UInt32 ackLatencyLast;
+    UInt32 ackLatencyAvg;
+    UInt32 ackLatencyMax;
+    UInt64 acked;           // frames the adapter reported as sent
+    UInt64 lost;            // frames whose ack never came or dropped by canBusOff
+} CanTxStatistics;
+
+/* host alignment of the clock of a device as returned by canGetTimeSyncStatus,
+ * all times in ns. The residuals are the ones of the linear fit over the last
+ * samples, errorBound adds the uncertainty of the clock read */
+typedef struct {
+    UInt32 samples;         // samples in the fit
+    SInt32 driftPpb;        // the device clock runs this much slower than the host clock
+    UInt32 residualRms;
+    UInt32 residualMax;
+    UInt32 roundTrip;       // of the clock read of the newest sample, 0 if the frames are the samples
+    UInt32 errorBound;
+    UInt64 lastSample;      // host time of the newest sample
+} CanTimeSyncStatus;
+
+/* bus statistics of a channel as returned by canGetBusStatistics, the first
+ * fields are the ones of canlib. Frames are counted as the adapter sees them
+ * on the bus, the own ones as far as it reports them back */
+typedef struct {
+    unsigned long stdData;
+    unsigned long stdRemote;
+    unsigned long extData;
+    unsigned long extRemote;
+    unsigned long errFrame;
+    unsigned long busLoad;      // in 0.01 % between the last two canRequestBusStatistics
+    unsigned long overruns;     // of the adapter and of the receive buffer
+    unsigned long fdData;       // of the data frames the CAN FD ones
+    unsigned long txAck;
+    unsigned long errorEvents;  // errors the adapter reported, not the bus
+    unsigned long busLoadData;  // part of busLoad in the data phase of CAN FD frames
+    UInt64 dataBytes;
+} canBusStatistics;
+
+/* distribution of a latency as returned by canGetLatency, all times in ns.
+ * The percentiles are the upper bound of their histogram bucket, at most
+ * 1/16 above the true value */
+typedef struct {
+    UInt64 count;
+    UInt64 min;
+    UInt64 mean;
+    UInt64 p50;
+    UInt64 p90;
+    UInt64 p99;
+    UInt64 p999;
+    UInt64 max;
+} CanLatencyStatus;
+
+/* several channels read as one stream in the order of the host time of their
+ * frames, see canMergeOpen */
+typedef struct CanMergeReader_s CanMergeReader;
 
 
 
@@ -237,6 +383,8 @@ typedef struct {
 
 void canInitializeLibrary (void);
 
+canStatus canInitializeLibraryEx (UInt32 flags);
+
 CanHandle canOpenChannel(int channel, int flags);
 
 canStatus canClose (const CanHandle hndl);
@@ -248,18 +396,121 @@ canStatus canBusOff (const CanHandle hndl);
 /* Needed to setup a notififaction to the nofication center */
 canStatus canSetNotify (const CanHandle hnd, CanNotificationType notifyStruct, unsigned int notifyFlags, void *tag);
 
+/* Receive notification coalescing, implies canNOTIFY_RX_COALESCE. A notification
+ * is posted after watermark frames at the latest, windowMs delays it beyond the
+ * USB transfer up to that time after the first unposted frame. 0 disables either.
+ * A window gives canERR_NOT_IMPLEMENTED if the driver thread runs no CFRunLoop,
+ * i.e. with CAN4OSX_USE_LIBUSB or off macOS */
+canStatus canSetNotifyCoalescing (const CanHandle hnd, UInt32 watermark, UInt32 windowMs);
+
+/* Number of receive notifications posted and the number of frames that did not get an own one */
+canStatus canGetNotifyStatistics (const CanHandle hnd, UInt32 *posted, UInt32 *suppressed);
+
 canStatus canSetBusParams (const CanHandle hnd, SInt32 freq, UInt32 tseg1, UInt32 tseg2, UInt32 sjw, UInt32 noSamp, UInt32 syncmode);
 
 canStatus canSetBusParamsFd(const CanHandle hnd, SInt32 freq_brs, UInt32 tseg1, UInt32 tseg2, UInt32 sjw);
 
+/* time in us, see CanFrame for the full timestamp */
 canStatus canRead (const CanHandle hnd, UInt32 *id, void *msg, UInt16 *dlc, UInt32 *flag, UInt32 *time);
 
+/* Blocking variants of canRead, timeout in ms */
+canStatus canReadWait (const CanHandle hnd, UInt32 *id, void *msg, UInt16 *dlc, UInt32 *flag, UInt32 *time, UInt32 timeout);
+
+/* Waits until a message is available, the message is not read */
+canStatus canReadSync (const CanHandle hnd, UInt32 timeout);
+
+/* Waits until a message with the given id is available, the message is not read */
+canStatus canReadSyncSpecific (const CanHandle hnd, UInt32 id, UInt32 timeout);
+
+/* Reads up to max messages at once, got returns the number of messages read */
+canStatus canReadBatch (const CanHandle hnd, CanMsg *pMsg, size_t max, size_t *got);
+
+/* Zero copy read, ppFrame points to up to max frames inside the receive buffer,
+ * walk them with canFrameNext. They stay valid until canReadRelease, no other
+ * read call in between. After an unplug until another adapter takes the channel */
+canStatus canReadAcquire (const CanHandle hnd, const CanFrame **ppFrame, size_t max, size_t *got);
+
+/* Hands back the first count acquired frames, the others are acquired again */
+canStatus canReadRelease (const CanHandle hnd, size_t count);
+
 canStatus canWrite (const CanHandle hnd,UInt32 id, void *msg, UInt16 dlc, UInt32 flag);
 
+/* Queues n messages at once, accepted returns the number of queued messages */
+canStatus canWriteBatch (const CanHandle hnd, const CanMsg *pMsg, size_t n, size_t *accepted);
+
+/* Waits up to timeout ms until the adapter sent all messages written so far,
+ * canWAIT_INFINITE waits as long as it takes */
+canStatus canWriteSync (const CanHandle hnd, UInt32 timeout);
+
+/* Counters of the transmit path, see CanTxStatistics */
+canStatus canGetTxStatistics (const CanHandle hnd, CanTxStatistics *pStatistics);
+
 canStatus canReadStatus	(const CanHandle hnd, UInt32 *const flags);
 
+/* Takes a snapshot of the bus statistics of a channel, the bus load is the
+ * one since the previous request. Cheap enough to be polled at 10 Hz */
+canStatus canRequestBusStatistics (const CanHandle hnd);
+
+/* The snapshot of the last canRequestBusStatistics, bufsiz may be the one of
+ * the shorter canlib struct */
+canStatus canGetBusStatistics (const CanHandle hnd, canBusStatistics *stat, size_t bufsiz);
+
+/* Receive queue size, overflow policy and overrun counter, see canIOCTL_xxx */
+canStatus canIoCtl (const CanHandle hnd, UInt32 func, void *pBuffer, UInt32 bufferSize);
+
+/* Acceptance filter of a channel, applied before a frame is queued and only
+ * changed while the bus is off. A frame passes if the bits set in mask match
+ * code, a mask of 0 lets every id of the type pass */
+canStatus canSetAcceptanceFilter (const CanHandle hnd, unsigned int code, unsigned int mask, int is_extended);
+
+canStatus canAccept (const CanHandle hnd, const long envelope, const unsigned int flag);
+
+/* Once ranges or ids of a type are added a frame of that type has to hit one
+ * of them as well. Up to 16 ranges, any number of ids */
+canStatus canAddAcceptanceRange (const CanHandle hnd, UInt32 first, UInt32 last, int is_extended);
+
+canStatus canAddAcceptanceIds (const CanHandle hnd, const UInt32 *pIds, size_t count, int is_extended);
+
+/* Every frame passes again */
+canStatus canClearAcceptanceFilter (const CanHandle hnd);
+
+/* Device timestamp in ns to the host clock (CLOCK_MONOTONIC) with the current
+ * offset and drift estimate of the device */
+canStatus canGetHostTimestamp (const CanHandle hnd, UInt64 deviceTime, UInt64 *hostTime);
+
+/* Reads the clock of every device each periodMs, so all of them share the host
+ * timeline with a bounded error. Devices without a clock read use the received
+ * frames. 0 stops it */
+canStatus canSetTimeSync (UInt32 periodMs);
+
+/* Fit and residuals of the clock of the device of a channel */
+canStatus canGetTimeSyncStatus (const CanHandle hnd, CanTimeSyncStatus *pStatus);
+
+/* Merges the frames of count channels by their host time. A frame is handed
+ * out once every channel has a newer one or it is windowUs old, a channel
+ * delivering later than that is out of order. The channels must not be read
+ * otherwise until canMergeClose */
+canStatus canMergeOpen (const CanHandle *pHnd, UInt32 count, UInt32 windowUs, CanMergeReader **ppReader);
+
+/* The next frame of the merged channels, its canTimestamp is the host time in
+ * us. pHnd and pTime, the host time in ns, may be NULL. timeout in ms */
+canStatus canMergeRead (CanMergeReader *pReader, CanMsg *pMsg, CanHandle *pHnd, UInt64 *pTime, UInt32 timeout);
+
+canStatus canMergeClose (CanMergeReader *pReader);
+
 canStatus canGetChannelData(const CanHandle hnd, SInt32 item, void* pBuffer, size_t bufsize);
 
+/* Latency histograms of all channels, see canLATENCY_xxx. canERR_NOT_IMPLEMENTED
+ * unless the driver is built with CAN4OSX_TRACE */
+canStatus canGetLatency (UInt32 latency, CanLatencyStatus *pStatus);
+
+/* Starts all latency histograms from scratch */
+canStatus canResetLatency (void);
+
+/* Writes the latency histograms and the events of the trace rings as text
+ * to the file at pPath */
+canStatus canDumpTrace (const char *pPath);
+
 canStatus canGetNumberOfChannels(int *channelCount);
 
 #endif /* CAN4OSX_H */
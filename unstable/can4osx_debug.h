@@ -56,5 +56,12 @@
 # define CAN4OSX_DEBUG_PRINT(...)
 #endif /* CAN4OSX_DEBUG */
 
+/* binary tracepoints and latency histograms instead of prints, cheap enough
+ * for the receive path, see canGetLatency and canDumpTrace. Also selectable
+ * with -DCAN4OSX_TRACE=1 */
+#ifndef CAN4OSX_TRACE
+# define CAN4OSX_TRACE 0
+#endif /* CAN4OSX_TRACE */
+
 
 #endif
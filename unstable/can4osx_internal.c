@@ -44,67 +44,89 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-
-#include <CoreFoundation/CoreFoundation.h>
-#include <IOKit/IOKitLib.h>
-#include <IOKit/IOMessage.h>
-#include <IOKit/IOCFPlugIn.h>
-#include <IOKit/usb/IOUSBLib.h>
+#include <string.h>
+#include <math.h>
 
 #include <sys/time.h>
+#include <errno.h>
 
 #include "can4osx_internal.h"
 #include "can4osx_usb_core.h"
 #include "can4osx_debug.h"
 
 
-static UInt8 CAN4OSX_TestFullCanEventBuffer(CAN_EVENT_MSG_BUF_T* bufferRef);
-static UInt8 CAN4OSX_TestEmptyCanEventBuffer(CAN_EVENT_MSG_BUF_T* bufferRef);
-
-
 /******************************************************************************/
+/**
+ * \brief CAN4OSX_CreateCanEventBuffer - create a receive event buffer
+ *
+ * bufferBytes is the memory of the ring, rounded up to a power of two of
+ * cells so the ring index is a simple mask. The cells start on a cache line.
+ *
+ * \return pointer to the buffer or NULL
+ */
 CAN_EVENT_MSG_BUF_T* CAN4OSX_CreateCanEventBuffer(
-		UInt32 bufferSize
+		UInt32 bufferBytes
 	)
 {
-	CAN_EVENT_MSG_BUF_T* bufferRef = malloc(sizeof(CAN_EVENT_MSG_BUF_T));
-	if ( bufferRef == NULL )  {
-		return(NULL);
+CAN_EVENT_MSG_BUF_T* bufferRef = NULL;
+UInt32 cells = bufferBytes / CAN_FRAME_CELL_SIZE;
+UInt32 size = 1u;
+
+	while (((size < cells) || (size < CAN4OSX_FRAME_MAX_CELLS)) && (size < 0x08000000u))  {
+		size <<= 1u;
 	}
 
-	bufferRef->bufferSize = bufferSize;
-	bufferRef->bufferCount = 0;
-	bufferRef->bufferFirst = 0;
+	if (posix_memalign((void **)&bufferRef, CAN4OSX_CACHE_LINE_SIZE, sizeof(CAN_EVENT_MSG_BUF_T)) != 0)  {
+		return(NULL);
+	}
+	memset(bufferRef, 0, sizeof(CAN_EVENT_MSG_BUF_T));
 
-	bufferRef->canMsgRef = malloc(bufferSize * sizeof(CanMsg));
+	bufferRef->bufferSize = size;
+	bufferRef->bufferMask = size - 1u;
+	atomic_init(&bufferRef->bufferHead, 0u);
+	atomic_init(&bufferRef->bufferTail, 0u);
+	atomic_init(&bufferRef->bufferOverruns, 0u);
+	atomic_init(&bufferRef->bufferWaiters, 0u);
+	atomic_init(&bufferRef->bufferSpaceWaiters, 0u);
+	atomic_init(&bufferRef->bufferClosed, 0u);
+	atomic_init(&bufferRef->bufferPinned, 0u);
+	bufferRef->bufferPolicy = canRX_OVERFLOW_DROP_NEWEST;
+	bufferRef->bufferBlockMs = CAN4OSX_RX_BLOCK_MS;
 
-	if ( bufferRef->canMsgRef == NULL )  {
+	if (posix_memalign((void **)&bufferRef->cellRef, CAN4OSX_CACHE_LINE_SIZE, size * CAN_FRAME_CELL_SIZE) != 0)  {
 		free(bufferRef);
-		bufferRef = NULL;
 		return(NULL);
 	}
 
-	bufferRef->bufferGDCqueueRef = dispatch_queue_create("com.can4osx.caneventqueue", 0);
-	if ( bufferRef->bufferGDCqueueRef == NULL )  {
-		CAN4OSX_ReleaseCanEventBuffer(bufferRef);
-		return(NULL);
-	}
+	pthread_mutex_init(&bufferRef->bufferPolicyMutex, NULL);
+	pthread_mutex_init(&bufferRef->bufferWaitMutex, NULL);
+	CAN4OSX_CondInit(&bufferRef->bufferWaitCond);
+	CAN4OSX_CondInit(&bufferRef->bufferSpaceCond);
 
 	return(bufferRef);
 }
 
 
 /******************************************************************************/
+/**
+ * \brief CAN4OSX_ReleaseCanEventBuffer - free the buffer
+ *
+ * The buffers it replaced go with it.
+ */
 void CAN4OSX_ReleaseCanEventBuffer(
 		CAN_EVENT_MSG_BUF_T* bufferRef
 	)
 {
 	if ( bufferRef != NULL )  {
-		if (bufferRef->bufferGDCqueueRef != NULL)  {
-			dispatch_release(bufferRef->bufferGDCqueueRef);
-		}
-		free(bufferRef->canMsgRef);
-		bufferRef->canMsgRef = NULL;
+		CAN4OSX_ReleaseCanEventBuffer(bufferRef->bufferOutgrown);
+
+		pthread_cond_destroy(&bufferRef->bufferSpaceCond);
+		pthread_cond_destroy(&bufferRef->bufferWaitCond);
+		pthread_mutex_destroy(&bufferRef->bufferWaitMutex);
+		pthread_mutex_destroy(&bufferRef->bufferPolicyMutex);
+
+		free(bufferRef->cellRef);
+		bufferRef->cellRef = NULL;
 
 		free(bufferRef);
 		bufferRef = NULL;
@@ -113,178 +135,3388 @@ void CAN4OSX_ReleaseCanEventBuffer(
 
 
 /******************************************************************************/
-static UInt8 CAN4OSX_TestFullCanEventBuffer(
+/**
+ * \brief CAN4OSX_CloseCanEventBuffer - wake up everybody waiting for good
+ *
+ * Called when the device is removed or canIOCTL_SET_RX_QUEUE_SIZE replaced
+ * the buffer. Readers and a blocked producer return at once and do not sleep
+ * on the buffer again, the buffer can be released once they left. The buffer leaves its wait set, the owner of the set may
+ * free it without looking at the buffer.
+ */
+void CAN4OSX_CloseCanEventBuffer(
 		CAN_EVENT_MSG_BUF_T* bufferRef
 	)
 {
-	if (bufferRef->bufferCount == bufferRef->bufferSize)  {
-		return(1);
-	} else {
-		return(0);
+	if ( bufferRef == NULL )  {
+		return;
+	}
+
+	atomic_store_explicit(&bufferRef->bufferClosed, 1u, memory_order_seq_cst);
+
+	pthread_mutex_lock(&bufferRef->bufferWaitMutex);
+	pthread_cond_broadcast(&bufferRef->bufferWaitCond);
+	pthread_cond_broadcast(&bufferRef->bufferSpaceCond);
+	if (bufferRef->bufferWaitSet != NULL)  {
+		pthread_mutex_lock(&bufferRef->bufferWaitSet->waitMutex);
+		bufferRef->bufferWaitSet->waitSequence++;
+		pthread_cond_broadcast(&bufferRef->bufferWaitSet->waitCond);
+		pthread_mutex_unlock(&bufferRef->bufferWaitSet->waitMutex);
+		bufferRef->bufferWaitSet = NULL;
 	}
+	pthread_mutex_unlock(&bufferRef->bufferWaitMutex);
 }
 
 
 /******************************************************************************/
-static UInt8 CAN4OSX_TestEmptyCanEventBuffer(
+/**
+ * \brief CAN4OSX_IsCanEventBufferClosed - see CAN4OSX_CloseCanEventBuffer
+ *
+ * \return 1 if the device of the buffer is gone
+ */
+UInt8 CAN4OSX_IsCanEventBufferClosed(
 		CAN_EVENT_MSG_BUF_T* bufferRef
 	)
 {
-	if ( bufferRef->bufferCount == 0 )  {
-		return(1);
-	} else {
-		return(0);
-	}
+	return((atomic_load_explicit(&bufferRef->bufferClosed, memory_order_acquire) != 0u) ? 1u : 0u);
 }
 
 
 /******************************************************************************/
-UInt8 CAN4OSX_WriteCanEventBuffer(
+/**
+ * \brief CAN4OSX_SetCanEventBufferPolicy - what to do if the buffer is full
+ *
+ * The policy must not change while the buffer is in use, blockMs may.
+ */
+void CAN4OSX_SetCanEventBufferPolicy(
 		CAN_EVENT_MSG_BUF_T* bufferRef,
-		CanMsg newEvent
+		UInt32 policy,
+		UInt32 blockMs
 	)
 {
-__block UInt8 retval = 1;
+	bufferRef->bufferPolicy = policy;
+	bufferRef->bufferBlockMs = blockMs;
+}
 
-	dispatch_sync(bufferRef->bufferGDCqueueRef, ^{
-		if (CAN4OSX_TestFullCanEventBuffer(bufferRef))  {
-			retval = 0;
-		} else {
-			bufferRef->canMsgRef[(bufferRef->bufferFirst + bufferRef->bufferCount++) % bufferRef->bufferSize] = newEvent;
-		}
-	});
 
-	return(retval);
+/******************************************************************************/
+static inline CanFrame* CAN4OSX_CanEventBufferFrame(
+		CAN_EVENT_MSG_BUF_T* bufferRef,
+		UInt32 cell
+	)
+{
+	return((CanFrame *)(bufferRef->cellRef + ((cell & bufferRef->bufferMask) * CAN_FRAME_CELL_SIZE)));
 }
 
 
 /******************************************************************************/
-UInt8 CAN4OSX_ReadCanEventBuffer(
+/**
+ * \brief CAN4OSX_CanEventBufferSkipPad - step over the pad at the ring end
+ *
+ * Consumer side only.
+ *
+ * \return tail index of the next real frame
+ */
+static inline UInt32 CAN4OSX_CanEventBufferSkipPad(
 		CAN_EVENT_MSG_BUF_T* bufferRef,
-		CanMsg* readEvent
+		UInt32 tail,
+		UInt32 head
 	)
 {
-__block UInt8 retval = 1;
+CanFrame *pFrame;
 
-	dispatch_sync(bufferRef->bufferGDCqueueRef, ^{
-		if (CAN4OSX_TestEmptyCanEventBuffer(bufferRef))  {
-			retval = 0;
-		} else {
-			bufferRef->bufferCount--;
-			*readEvent = bufferRef->canMsgRef[bufferRef->bufferFirst++ % bufferRef->bufferSize];
+	if (tail != head)  {
+		pFrame = CAN4OSX_CanEventBufferFrame(bufferRef, tail);
+		if ((pFrame->canFlags & CAN4OSX_FRAME_PAD) != 0u)  {
+			tail += pFrame->canCells;
 		}
+	}
+
+	return(tail);
+}
 
-	});
 
-	return(retval);
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_CanEventBufferLock - keep the producer away from the tail
+ *
+ * Only needed with canRX_OVERFLOW_DROP_OLDEST and only held inside one call.
+ * Consumer side only.
+ *
+ * \return true if locked, pass it to CAN4OSX_CanEventBufferUnlock
+ */
+static inline bool CAN4OSX_CanEventBufferLock(
+		CAN_EVENT_MSG_BUF_T* bufferRef
+	)
+{
+	if (bufferRef->bufferPolicy != canRX_OVERFLOW_DROP_OLDEST)  {
+		return(false);
+	}
 
+	pthread_mutex_lock(&bufferRef->bufferPolicyMutex);
+	return(true);
 }
 
 
 /******************************************************************************/
-canStatus CAN4OSX_GetChannelData(
-		Can4osxUsbDeviceHandleEntry* pSelf,
-		SInt32 cmd,
-		void* pBuffer,
-		size_t bufsize
+static inline void CAN4OSX_CanEventBufferUnlock(
+		CAN_EVENT_MSG_BUF_T* bufferRef,
+		bool locked
+	)
+{
+	if (locked)  {
+		pthread_mutex_unlock(&bufferRef->bufferPolicyMutex);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_CanEventBufferSetTail - publish the consumer index
+ *
+ * Wakes up a producer waiting for room. Consumer side only.
+ */
+static inline void CAN4OSX_CanEventBufferSetTail(
+		CAN_EVENT_MSG_BUF_T* bufferRef,
+		UInt32 tail
 	)
 {
+	atomic_store_explicit(&bufferRef->bufferTail, tail, memory_order_release);
 
-	switch(cmd) {
-		case canCHANNELDATA_CARD_SERIAL_NO:
-			if (bufsize < 8)  {
-				return(canERR_NOMEM);
+	if (bufferRef->bufferPolicy == canRX_OVERFLOW_BLOCK)  {
+		/* pairs with the fence in CAN4OSX_CanEventBufferMakeRoom */
+		atomic_thread_fence(memory_order_seq_cst);
+		if (atomic_load_explicit(&bufferRef->bufferSpaceWaiters, memory_order_relaxed) != 0u)  {
+			pthread_mutex_lock(&bufferRef->bufferWaitMutex);
+			pthread_cond_broadcast(&bufferRef->bufferSpaceCond);
+			pthread_mutex_unlock(&bufferRef->bufferWaitMutex);
+		}
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_CanEventBufferMakeRoom - overflow policy of a full buffer
+ *
+ * Frees the cells up to end, either by evicting the oldest frames or by
+ * waiting bufferBlockMs for the consumer. Producer side only.
+ *
+ * \return 1 if there is room now, 0 if the new frame has to be dropped
+ */
+static UInt8 CAN4OSX_CanEventBufferMakeRoom(
+		CAN_EVENT_MSG_BUF_T* bufferRef,
+		UInt32 end
+	)
+{
+struct timespec deadline;
+CanFrame *pFrame;
+UInt32 evicted = 0u;
+UInt32 tail;
+
+	switch (bufferRef->bufferPolicy)  {
+		case canRX_OVERFLOW_DROP_OLDEST:
+			/* the reader works on the oldest frames, lose the new one instead */
+			if (pthread_mutex_trylock(&bufferRef->bufferPolicyMutex) != 0)  {
+				return(0);
 			}
-			memcpy(pBuffer, &(pSelf->devInfo.serialNumber), 8);
-			break;
-		case canCHANNELDATA_DEVDESCR_ASCII:
-			if (bufsize > 128)  {
-				bufsize = 128;
+			if (atomic_load_explicit(&bufferRef->bufferPinned, memory_order_relaxed) != 0u)  {
+				pthread_mutex_unlock(&bufferRef->bufferPolicyMutex);
+				return(0);
 			}
-			memcpy(pBuffer, pSelf->devInfo.deviceString, bufsize);
-			break;
-		case canCHANNELDATA_CHANNEL_CAP:
-			if (bufsize < 4)  {
-				return(canERR_NOMEM);
+
+			tail = atomic_load_explicit(&bufferRef->bufferTail, memory_order_relaxed);
+			while ((end - tail) > bufferRef->bufferSize)  {
+				pFrame = CAN4OSX_CanEventBufferFrame(bufferRef, tail);
+				if ((pFrame->canFlags & CAN4OSX_FRAME_PAD) == 0u)  {
+					evicted++;
+				}
+				tail += pFrame->canCells;
 			}
-			memcpy(pBuffer, &(pSelf->devInfo.capability), 4);
-			break;
+			atomic_store_explicit(&bufferRef->bufferTail, tail, memory_order_release);
+			pthread_mutex_unlock(&bufferRef->bufferPolicyMutex);
+
+			bufferRef->bufferTailCache = tail;
+			atomic_fetch_add_explicit(&bufferRef->bufferOverruns, evicted, memory_order_relaxed);
+			return(1);
+
+		case canRX_OVERFLOW_BLOCK:
+			CAN4OSX_GetDeadline(&deadline, bufferRef->bufferBlockMs);
+
+			pthread_mutex_lock(&bufferRef->bufferWaitMutex);
+			atomic_fetch_add_explicit(&bufferRef->bufferSpaceWaiters, 1u, memory_order_relaxed);
+			atomic_thread_fence(memory_order_seq_cst);
+
+			tail = atomic_load_explicit(&bufferRef->bufferTail, memory_order_acquire);
+			while (((end - tail) > bufferRef->bufferSize) && (atomic_load_explicit(&bufferRef->bufferClosed, memory_order_relaxed) == 0u))  {
+				if (CAN4OSX_CondTimedWait(&bufferRef->bufferSpaceCond, &bufferRef->bufferWaitMutex, &deadline) == ETIMEDOUT)  {
+					tail = atomic_load_explicit(&bufferRef->bufferTail, memory_order_acquire);
+					break;
+				}
+				tail = atomic_load_explicit(&bufferRef->bufferTail, memory_order_acquire);
+			}
+
+			atomic_fetch_sub_explicit(&bufferRef->bufferSpaceWaiters, 1u, memory_order_relaxed);
+			pthread_mutex_unlock(&bufferRef->bufferWaitMutex);
+
+			bufferRef->bufferTailCache = tail;
+			return((end - tail) <= bufferRef->bufferSize);
+
 		default:
-			break;
+			return(0);
 	}
-	return(canOK);
 }
 
 
 /******************************************************************************/
 /**
-* \brief CAN4OSX_decodeFdDlc - decode the dlc to data length
-*
-* \return the data length code
-*/
-UInt8 CAN4OSX_decodeFdDlc(
-		UInt8 dlc
+ * \brief CAN4OSX_FrameToMsg - copy a received frame into a CanMsg
+ */
+void CAN4OSX_FrameToMsg(
+		const CanFrame *pFrame,
+		CanMsg *pMsg
 	)
 {
-static const UInt8 len[16u] = {0u,1u,2u,3u,4u,5u,6u,7u,8u,12u,16u,20u,24u,32u,48u,64u};
+	pMsg->canTimestamp = (UInt32)(pFrame->canTimestamp / 1000u);
+	pMsg->canId = pFrame->canId;
+	pMsg->canFlags = pFrame->canFlags;
+	pMsg->canDlc = pFrame->canDlc;
+	pMsg->canChannel = pFrame->canChannel;
+	pMsg->padding = 0u;
+	memcpy(pMsg->canData, pFrame->canData, pFrame->canDlc);
+}
 
-	return(len[dlc]);
+
+#if CAN4OSX_TRACE
+/******************************************************************************/
+/* the USB completion the frames being decoded came with, 0 outside of it */
+static _Thread_local UInt64 can4osxTraceRxNs = 0u;
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_TraceRxStamp - arrival of a frame reserved now
+ *
+ * \return the low 32 bit of the completion, 0 outside of one
+ */
+static inline UInt32 CAN4OSX_TraceRxStamp(
+		void
+	)
+{
+	return((UInt32)can4osxTraceRxNs);
 }
 
 
 /******************************************************************************/
 /**
-* \brief CAN4OSX_decodeFdDlc - decode the dlc to data length
-*
-* \return the datalength
-*/
-UInt8 CAN4OSX_encodeFdDlc(
-		UInt8 dlc
+ * \internal
+ * \brief CAN4OSX_TraceRxRead - a frame is read, now is the low 32 bit
+ *
+ * Waits above 4 s wrap, they are not expected from a reader that keeps up.
+ */
+static inline void CAN4OSX_TraceRxRead(
+		const CanFrame *pFrame,
+		UInt32 now
 	)
 {
-	if (dlc == 12u)  {
-		return(0x09);
+	if (pFrame->reserved != 0u)  {
+		CAN4OSX_TraceLatency(canLATENCY_RX, (UInt32)(now - pFrame->reserved));
 	}
-	if (dlc == 16u)  {
-		return(0x0A);
+}
+#endif /* CAN4OSX_TRACE */
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_WriteCanEventBuffer - put a message into the buffer
+ *
+ * Must only be called from the producer, i.e. the USB completion of the
+ * device. A full buffer drops a message according to the overflow policy.
+ *
+ * \return 1 on success, 0 if the buffer was full
+ */
+UInt8 CAN4OSX_WriteCanEventBuffer(
+		CAN_EVENT_MSG_BUF_T* bufferRef,
+		CanMsg newEvent
+	)
+{
+UInt8 len = (newEvent.canDlc > CAN4OSX_CAN_MAX_MSG_LEN) ? CAN4OSX_CAN_MAX_MSG_LEN : newEvent.canDlc;
+CanFrame *pFrame = CAN4OSX_ReserveCanEventBuffer(bufferRef, len);
+
+	if (pFrame == NULL)  {
+		return(0);
 	}
-	if (dlc == 20u)  {
-		return(0x0B);
+
+	pFrame->canTimestamp = (UInt64)newEvent.canTimestamp * 1000u;
+	pFrame->canId = newEvent.canId;
+	pFrame->canFlags = newEvent.canFlags;
+	pFrame->canChannel = newEvent.canChannel;
+	memcpy(pFrame->canData, newEvent.canData, len);
+	CAN4OSX_CommitCanEventBuffer(bufferRef);
+
+	return(1);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_ReserveCanEventBuffer - free frame for len payload bytes
+ *
+ * The decoders build the frame in place and publish it with
+ * CAN4OSX_CommitCanEventBuffer, a frame that is not committed is simply
+ * reserved again for the next message. canDlc and canCells are set, the
+ * other header fields are cleared. A frame never wraps around, the cells
+ * left at the end of the ring are covered by a pad. A full buffer is handled
+ * by the overflow policy and counts an overrun. Producer side only.
+ *
+ * \return pointer to the frame, NULL if the frame has to be dropped
+ */
+CanFrame* CAN4OSX_ReserveCanEventBuffer(
+		CAN_EVENT_MSG_BUF_T* bufferRef,
+		UInt8 len
+	)
+{
+UInt32 head = atomic_load_explicit(&bufferRef->bufferHead, memory_order_relaxed);
+UInt32 cells = CAN_FRAME_CELLS(len);
+UInt32 pad = bufferRef->bufferSize - (head & bufferRef->bufferMask);
+CanFrame *pFrame;
+
+	if (pad >= cells)  {
+		pad = 0u;
 	}
-	if (dlc == 24u)  {
-		return(0x0C);
+
+	if ((head + pad + cells - bufferRef->bufferTailCache) > bufferRef->bufferSize)  {
+		bufferRef->bufferTailCache = atomic_load_explicit(&bufferRef->bufferTail, memory_order_acquire);
+		if ((head + pad + cells - bufferRef->bufferTailCache) > bufferRef->bufferSize)  {
+			if (!CAN4OSX_CanEventBufferMakeRoom(bufferRef, head + pad + cells))  {
+				atomic_fetch_add_explicit(&bufferRef->bufferOverruns, 1u, memory_order_relaxed);
+				return(NULL);
+			}
+		}
 	}
-	if (dlc == 32u)  {
-		return(0x0D);
+
+	if (pad != 0u)  {
+		pFrame = CAN4OSX_CanEventBufferFrame(bufferRef, head);
+		memset(pFrame, 0, sizeof(CanFrame));
+		pFrame->canFlags = CAN4OSX_FRAME_PAD;
+		pFrame->canCells = (UInt8)pad;
 	}
-	if (dlc == 48u)  {
-		return(0x0E);
+
+	pFrame = CAN4OSX_CanEventBufferFrame(bufferRef, head + pad);
+	memset(pFrame, 0, sizeof(CanFrame));
+	pFrame->canDlc = len;
+	pFrame->canCells = (UInt8)cells;
+#if CAN4OSX_TRACE
+	pFrame->reserved = CAN4OSX_TraceRxStamp();
+#endif /* CAN4OSX_TRACE */
+
+	bufferRef->bufferReserved = pad + cells;
+
+	return(pFrame);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_CommitCanEventBuffer - publish the reserved frame
+ *
+ * Wakes up blocking readers. Producer side only.
+ */
+void CAN4OSX_CommitCanEventBuffer(
+		CAN_EVENT_MSG_BUF_T* bufferRef
+	)
+{
+UInt32 head = atomic_load_explicit(&bufferRef->bufferHead, memory_order_relaxed);
+
+	atomic_store_explicit(&bufferRef->bufferHead, head + bufferRef->bufferReserved, memory_order_release);
+	CAN4OSX_TRACE_EVENT(CAN4OSX_TRACE_RX_ENQUEUE, bufferRef->bufferTraceChannel,
+			head + bufferRef->bufferReserved - bufferRef->bufferTailCache);
+
+	/* pairs with the fence in CAN4OSX_WaitCanEventBuffer, either we see the
+	 * waiter or the waiter sees the new head */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&bufferRef->bufferWaiters, memory_order_relaxed) != 0u)  {
+		pthread_mutex_lock(&bufferRef->bufferWaitMutex);
+		pthread_cond_broadcast(&bufferRef->bufferWaitCond);
+		if (bufferRef->bufferWaitSet != NULL)  {
+			pthread_mutex_lock(&bufferRef->bufferWaitSet->waitMutex);
+			bufferRef->bufferWaitSet->waitSequence++;
+			pthread_cond_broadcast(&bufferRef->bufferWaitSet->waitCond);
+			pthread_mutex_unlock(&bufferRef->bufferWaitSet->waitMutex);
+		}
+		pthread_mutex_unlock(&bufferRef->bufferWaitMutex);
 	}
-	if (dlc == 64u)  {
-		return(0x0F);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_ReadCanEventBuffer - get the oldest message from the buffer
+ *
+ * Must only be called from one consumer at a time.
+ *
+ * \return 1 on success, 0 if the buffer was empty
+ */
+UInt8 CAN4OSX_ReadCanEventBuffer(
+		CAN_EVENT_MSG_BUF_T* bufferRef,
+		CanMsg* readEvent
+	)
+{
+	return((UInt8)CAN4OSX_ReadCanEventBufferBatch(bufferRef, readEvent, 1u));
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_ReadCanEventBufferBatch - get up to maxEvents messages
+ *
+ * The producer index is loaded and the consumer index published only once
+ * for the whole batch. Same consumer rules as CAN4OSX_ReadCanEventBuffer.
+ *
+ * \return number of messages copied to readEvents
+ */
+UInt32 CAN4OSX_ReadCanEventBufferBatch(
+		CAN_EVENT_MSG_BUF_T* bufferRef,
+		CanMsg* readEvents,
+		UInt32 maxEvents
+	)
+{
+UInt32 tail;
+UInt32 head;
+UInt32 count = 0u;
+CanFrame *pFrame;
+bool locked;
+#if CAN4OSX_TRACE
+UInt32 now = (UInt32)CAN4OSX_GetNanoseconds();
+#endif /* CAN4OSX_TRACE */
+
+	locked = CAN4OSX_CanEventBufferLock(bufferRef);
+
+	tail = atomic_load_explicit(&bufferRef->bufferTail, memory_order_relaxed);
+	head = atomic_load_explicit(&bufferRef->bufferHead, memory_order_acquire);
+	bufferRef->bufferHeadCache = head;
+
+	/* frames still acquired are read now, the acquire is over */
+	bufferRef->bufferAcquired = 0u;
+	atomic_store_explicit(&bufferRef->bufferPinned, 0u, memory_order_relaxed);
+
+	while (count < maxEvents)  {
+		tail = CAN4OSX_CanEventBufferSkipPad(bufferRef, tail, head);
+		if (tail == head)  {
+			break;
+		}
+		pFrame = CAN4OSX_CanEventBufferFrame(bufferRef, tail);
+		CAN4OSX_FrameToMsg(pFrame, &readEvents[count++]);
+#if CAN4OSX_TRACE
+		CAN4OSX_TraceRxRead(pFrame, now);
+#endif /* CAN4OSX_TRACE */
+		tail += pFrame->canCells;
 	}
-	/* invalid dlc */
-	if (dlc > 8u)  {
-		return(0xff);
+
+	CAN4OSX_CanEventBufferSetTail(bufferRef, tail);
+	CAN4OSX_CanEventBufferUnlock(bufferRef, locked);
+
+	if (count != 0u)  {
+		CAN4OSX_TRACE_EVENT(CAN4OSX_TRACE_RX_DEQUEUE, bufferRef->bufferTraceChannel, count);
 	}
 
-	return(dlc);
+	return(count);
 }
 
 
 /******************************************************************************/
 /**
-* \brief OSX_getMilliseconds - get the actual milliseconds
-*
-* \return milliseconds
-*/
-UInt64 CAN$OSX_getMilliseconds(
-		void
+ * \brief CAN4OSX_AcquireCanEventBuffer - lend pending frames to the reader
+ *
+ * ppFrames points to the oldest frame, the frames up to the end of the
+ * ring are handed out, the rest follows with the next call. Step from one
+ * frame to the next with canFrameNext. They stay owned by the reader until
+ * CAN4OSX_ReleaseCanEventBufferEvents, another acquire hands them out again.
+ * With canRX_OVERFLOW_DROP_OLDEST the producer does not evict them meanwhile
+ * and drops new frames instead, no lock is held. Consumer side only.
+ *
+ * \return number of frames at ppFrames
+ */
+UInt32 CAN4OSX_AcquireCanEventBuffer(
+		CAN_EVENT_MSG_BUF_T* bufferRef,
+		CanFrame** ppFrames,
+		UInt32 maxEvents
 	)
 {
-struct timeval time;
+UInt32 tail;
+UInt32 head = bufferRef->bufferHeadCache;
+UInt32 count = 0u;
+UInt32 cell;
+CanFrame *pFrame;
+bool locked;
 
-	gettimeofday(&time, NULL);
-	return(time.tv_sec * 1000) + (time.tv_usec / 1000);
+	locked = CAN4OSX_CanEventBufferLock(bufferRef);
+
+	/* the producer may have evicted past the cached head */
+	tail = atomic_load_explicit(&bufferRef->bufferTail, memory_order_relaxed);
+	if ((head == tail) || ((head - tail) > bufferRef->bufferSize))  {
+		head = atomic_load_explicit(&bufferRef->bufferHead, memory_order_acquire);
+		bufferRef->bufferHeadCache = head;
+	}
+
+	/* the pad is consumed right away, the reader never sees it */
+	cell = CAN4OSX_CanEventBufferSkipPad(bufferRef, tail, head);
+	if (cell != tail)  {
+		tail = cell;
+		CAN4OSX_CanEventBufferSetTail(bufferRef, tail);
+	}
+
+	*ppFrames = CAN4OSX_CanEventBufferFrame(bufferRef, tail);
+
+	/* stop at the pad or the end of the ring, the frames must be contiguous */
+	while ((count < maxEvents) && (cell != head))  {
+		pFrame = CAN4OSX_CanEventBufferFrame(bufferRef, cell);
+		if ((pFrame->canFlags & CAN4OSX_FRAME_PAD) != 0u)  {
+			break;
+		}
+		cell += pFrame->canCells;
+		count++;
+		if ((cell & bufferRef->bufferMask) == 0u)  {
+			break;
+		}
+	}
+
+	bufferRef->bufferAcquired = count;
+	/* published under the lock, an eviction after it sees the frames pinned */
+	atomic_store_explicit(&bufferRef->bufferPinned, count, memory_order_relaxed);
+
+	CAN4OSX_CanEventBufferUnlock(bufferRef, locked);
+
+	return(count);
 }
 
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_ReleaseCanEventBufferEvents - give acquired frames back
+ *
+ * The first count acquired frames are consumed, the others are handed
+ * out again by the next acquire.
+ *
+ * \return 1 on success, 0 if count exceeds the acquired frames
+ */
+UInt8 CAN4OSX_ReleaseCanEventBufferEvents(
+		CAN_EVENT_MSG_BUF_T* bufferRef,
+		UInt32 count
+	)
+{
+UInt32 tail;
+UInt32 loopCount;
+bool locked;
+#if CAN4OSX_TRACE
+UInt32 now = (UInt32)CAN4OSX_GetNanoseconds();
+#endif /* CAN4OSX_TRACE */
+
+	if (count > bufferRef->bufferAcquired)  {
+		return(0);
+	}
+
+	if (bufferRef->bufferAcquired == 0u)  {
+		return(1);
+	}
+
+	locked = CAN4OSX_CanEventBufferLock(bufferRef);
+
+	tail = atomic_load_explicit(&bufferRef->bufferTail, memory_order_relaxed);
+	bufferRef->bufferAcquired = 0u;
+	atomic_store_explicit(&bufferRef->bufferPinned, 0u, memory_order_relaxed);
+	for (loopCount = 0; loopCount < count; loopCount++)  {
+#if CAN4OSX_TRACE
+		CAN4OSX_TraceRxRead(CAN4OSX_CanEventBufferFrame(bufferRef, tail), now);
+#endif /* CAN4OSX_TRACE */
+		tail += CAN4OSX_CanEventBufferFrame(bufferRef, tail)->canCells;
+	}
+	CAN4OSX_CanEventBufferSetTail(bufferRef, tail);
+	CAN4OSX_CanEventBufferUnlock(bufferRef, locked);
+
+	if (count != 0u)  {
+		CAN4OSX_TRACE_EVENT(CAN4OSX_TRACE_RX_DEQUEUE, bufferRef->bufferTraceChannel, count);
+	}
+
+	return(1);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_FindCanEventBuffer - look for a pending message with canId
+ *
+ * The messages stay in the buffer. Consumer side only.
+ *
+ * \return 1 if found
+ */
+UInt8 CAN4OSX_FindCanEventBuffer(
+		CAN_EVENT_MSG_BUF_T* bufferRef,
+		UInt32 canId
+	)
+{
+UInt32 tail;
+UInt32 head;
+CanFrame *pFrame;
+UInt8 found = 0u;
+bool locked;
+
+	locked = CAN4OSX_CanEventBufferLock(bufferRef);
+
+	tail = atomic_load_explicit(&bufferRef->bufferTail, memory_order_relaxed);
+	head = atomic_load_explicit(&bufferRef->bufferHead, memory_order_acquire);
+	bufferRef->bufferHeadCache = head;
+
+	while (tail != head)  {
+		pFrame = CAN4OSX_CanEventBufferFrame(bufferRef, tail);
+		if (((pFrame->canFlags & CAN4OSX_FRAME_PAD) == 0u) && (pFrame->canId == canId))  {
+			found = 1u;
+			break;
+		}
+		tail += pFrame->canCells;
+	}
+
+	CAN4OSX_CanEventBufferUnlock(bufferRef, locked);
+
+	return(found);
+}
+
+
+/******************************************************************************/
+UInt32 CAN4OSX_GetCanEventBufferHead(
+		CAN_EVENT_MSG_BUF_T* bufferRef
+	)
+{
+	return(atomic_load_explicit(&bufferRef->bufferHead, memory_order_acquire));
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_GetCanEventBufferTail - free running read position
+ *
+ * Moves on with every frame read or evicted, while frames are acquired it is
+ * the one of the first. Consumer side only.
+ */
+UInt32 CAN4OSX_GetCanEventBufferTail(
+		CAN_EVENT_MSG_BUF_T* bufferRef
+	)
+{
+	return(atomic_load_explicit(&bufferRef->bufferTail, memory_order_relaxed));
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_GetCanEventBufferCount - cells in use
+ *
+ * \return 0 if the buffer is empty
+ */
+UInt32 CAN4OSX_GetCanEventBufferCount(
+		CAN_EVENT_MSG_BUF_T* bufferRef
+	)
+{
+UInt32 tail = atomic_load_explicit(&bufferRef->bufferTail, memory_order_acquire);
+
+	return(atomic_load_explicit(&bufferRef->bufferHead, memory_order_acquire) - tail);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_GetCanEventBufferOverruns - frames lost to a full buffer
+ *
+ * Dropped new frames and evicted old ones, reset clears the counter.
+ *
+ * \return number of lost frames
+ */
+UInt32 CAN4OSX_GetCanEventBufferOverruns(
+		CAN_EVENT_MSG_BUF_T* bufferRef,
+		UInt8 reset
+	)
+{
+	if (reset != 0u)  {
+		return(atomic_exchange_explicit(&bufferRef->bufferOverruns, 0u, memory_order_relaxed));
+	}
+
+	return(atomic_load_explicit(&bufferRef->bufferOverruns, memory_order_relaxed));
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_WaitCanEventBuffer - sleep until the producer moved on
+ *
+ * Blocks until the head index differs from seenHead. Pass the tail to wait
+ * for a non empty buffer. pDeadline comes from CAN4OSX_GetDeadline, NULL
+ * waits forever.
+ *
+ * \return 1 if new messages arrived, 0 on timeout or if the buffer is closed
+ */
+UInt8 CAN4OSX_WaitCanEventBuffer(
+		CAN_EVENT_MSG_BUF_T* bufferRef,
+		UInt32 seenHead,
+		const struct timespec *pDeadline
+	)
+{
+UInt8 retval = 1;
+int err = 0;
+
+	if (atomic_load_explicit(&bufferRef->bufferHead, memory_order_acquire) != seenHead)  {
+		return(1);
+	}
+
+	pthread_mutex_lock(&bufferRef->bufferWaitMutex);
+	atomic_fetch_add_explicit(&bufferRef->bufferWaiters, 1u, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	while (atomic_load_explicit(&bufferRef->bufferHead, memory_order_acquire) == seenHead)  {
+		// set before the broadcast under this mutex, it is not missed
+		if (atomic_load_explicit(&bufferRef->bufferClosed, memory_order_relaxed) != 0u)  {
+			retval = 0;
+			break;
+		}
+		if (pDeadline != NULL)  {
+			err = CAN4OSX_CondTimedWait(&bufferRef->bufferWaitCond, &bufferRef->bufferWaitMutex, pDeadline);
+		} else {
+			err = pthread_cond_wait(&bufferRef->bufferWaitCond, &bufferRef->bufferWaitMutex);
+		}
+		if (err == ETIMEDOUT)  {
+			if (atomic_load_explicit(&bufferRef->bufferHead, memory_order_acquire) == seenHead)  {
+				retval = 0;
+			}
+			break;
+		}
+	}
+
+	atomic_fetch_sub_explicit(&bufferRef->bufferWaiters, 1u, memory_order_relaxed);
+	pthread_mutex_unlock(&bufferRef->bufferWaitMutex);
+
+	return(retval);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_SetCanEventBufferWaitSet - wake up pSet as well
+ *
+ * A buffer belongs to one set at most, NULL removes it. A closed buffer
+ * joins no set. Consumer side only.
+ *
+ * \return 1 on success, 0 if the buffer is in another set or closed
+ */
+UInt8 CAN4OSX_SetCanEventBufferWaitSet(
+		CAN_EVENT_MSG_BUF_T* bufferRef,
+		CAN4OSX_WAIT_SET_T *pSet
+	)
+{
+UInt8 retval = 1;
+
+	pthread_mutex_lock(&bufferRef->bufferWaitMutex);
+	if ((pSet != NULL) && (bufferRef->bufferWaitSet != NULL) && (bufferRef->bufferWaitSet != pSet))  {
+		retval = 0;
+	} else if ((pSet != NULL) && (atomic_load_explicit(&bufferRef->bufferClosed, memory_order_relaxed) != 0u))  {
+		retval = 0;
+	} else {
+		bufferRef->bufferWaitSet = pSet;
+	}
+	pthread_mutex_unlock(&bufferRef->bufferWaitMutex);
+
+	return(retval);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_WaitCanEventBufferSet - sleep until one of the buffers moved on
+ *
+ * Like CAN4OSX_WaitCanEventBuffer for count buffers of pSet at once. The
+ * producers only take the slow path while we wait.
+ *
+ * \return 1 if new messages arrived, 0 on timeout
+ */
+UInt8 CAN4OSX_WaitCanEventBufferSet(
+		CAN4OSX_WAIT_SET_T *pSet,
+		CAN_EVENT_MSG_BUF_T **ppBuffers,
+		const UInt32 *pSeenHeads,
+		UInt32 count,
+		const struct timespec *pDeadline
+	)
+{
+UInt32 sequence;
+UInt32 loopCount;
+UInt8 retval = 0;
+int err = 0;
+
+	pthread_mutex_lock(&pSet->waitMutex);
+	sequence = pSet->waitSequence;
+	pthread_mutex_unlock(&pSet->waitMutex);
+
+	for (loopCount = 0; loopCount < count; loopCount++)  {
+		atomic_fetch_add_explicit(&ppBuffers[loopCount]->bufferWaiters, 1u, memory_order_relaxed);
+	}
+
+	/* pairs with the fence in CAN4OSX_CommitCanEventBuffer, a commit after
+	 * the check below bumps the sequence */
+	atomic_thread_fence(memory_order_seq_cst);
+	for (loopCount = 0; loopCount < count; loopCount++)  {
+		if (atomic_load_explicit(&ppBuffers[loopCount]->bufferHead, memory_order_acquire) != pSeenHeads[loopCount])  {
+			retval = 1;
+		}
+	}
+
+	if (retval == 0)  {
+		pthread_mutex_lock(&pSet->waitMutex);
+		while ((pSet->waitSequence == sequence) && (err != ETIMEDOUT))  {
+			if (pDeadline != NULL)  {
+				err = CAN4OSX_CondTimedWait(&pSet->waitCond, &pSet->waitMutex, pDeadline);
+			} else {
+				err = pthread_cond_wait(&pSet->waitCond, &pSet->waitMutex);
+			}
+		}
+		retval = (pSet->waitSequence != sequence) ? 1u : 0u;
+		pthread_mutex_unlock(&pSet->waitMutex);
+	}
+
+	for (loopCount = 0; loopCount < count; loopCount++)  {
+		atomic_fetch_sub_explicit(&ppBuffers[loopCount]->bufferWaiters, 1u, memory_order_relaxed);
+	}
+
+	return(retval);
+}
+
+
+/******************************************************************************/
+void CAN4OSX_GetDeadline(
+		struct timespec *pDeadline,
+		UInt32 timeoutMs
+	)
+{
+	CAN4OSX_GetDeadlineNs(pDeadline, (UInt64)timeoutMs * 1000000u);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_GetDeadlineNs - absolute CLOCK_MONOTONIC time timeoutNs from now
+ *
+ * For CAN4OSX_CondTimedWait, a wall clock step does not move it.
+ */
+void CAN4OSX_GetDeadlineNs(
+		struct timespec *pDeadline,
+		UInt64 timeoutNs
+	)
+{
+struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pDeadline->tv_sec = now.tv_sec + (time_t)(timeoutNs / 1000000000u);
+	pDeadline->tv_nsec = now.tv_nsec + (long)(timeoutNs % 1000000000u);
+	if (pDeadline->tv_nsec >= 1000000000L)  {
+		pDeadline->tv_sec++;
+		pDeadline->tv_nsec -= 1000000000L;
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_CondInit - condition variable for CAN4OSX_CondTimedWait
+ *
+ * It measures on CLOCK_MONOTONIC. macOS has no pthread_condattr_setclock,
+ * the wait is relative there.
+ */
+void CAN4OSX_CondInit(
+		pthread_cond_t *pCond
+	)
+{
+#if defined(__APPLE__)
+	pthread_cond_init(pCond, NULL);
+#else /* __APPLE__ */
+pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(pCond, &attr);
+	pthread_condattr_destroy(&attr);
+#endif /* __APPLE__ */
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_CondTimedWait - wait until pDeadline of CAN4OSX_GetDeadline
+ *
+ * pCond must come from CAN4OSX_CondInit.
+ *
+ * \return like pthread_cond_timedwait
+ */
+int CAN4OSX_CondTimedWait(
+		pthread_cond_t *pCond,
+		pthread_mutex_t *pMutex,
+		const struct timespec *pDeadline
+	)
+{
+#if defined(__APPLE__)
+UInt64 deadline = ((UInt64)pDeadline->tv_sec * 1000000000u) + (UInt64)pDeadline->tv_nsec;
+UInt64 now = CAN4OSX_GetNanoseconds();
+struct timespec wait;
+
+	if (now >= deadline)  {
+		return(ETIMEDOUT);
+	}
+
+	wait.tv_sec = (time_t)((deadline - now) / 1000000000u);
+	wait.tv_nsec = (long)((deadline - now) % 1000000000u);
+
+	return(pthread_cond_timedwait_relative_np(pCond, pMutex, &wait));
+#else /* __APPLE__ */
+	return(pthread_cond_timedwait(pCond, pMutex, pDeadline));
+#endif /* __APPLE__ */
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_NotifyPost(
+		Can4osxUsbDeviceHandleEntry *pSelf
+	)
+{
+CAN4OSX_NOTIFY_T *pNotify = &pSelf->canNotify;
+
+	if (pSelf->canNotification.notifacionCenter)  {
+		CFNotificationCenterPostNotification (pSelf->canNotification.notifacionCenter,
+											  pSelf->canNotification.notificationString, NULL, NULL, true);
+		atomic_fetch_add_explicit(&pNotify->posted, 1u, memory_order_relaxed);
+		if (pNotify->pending > 1u)  {
+			atomic_fetch_add_explicit(&pNotify->suppressed, pNotify->pending - 1u, memory_order_relaxed);
+		}
+	}
+
+	pNotify->pending = 0u;
+}
+
+
+#if CAN4OSX_HAVE_CFRUNLOOP
+/******************************************************************************/
+static void CAN4OSX_NotifyWindowTimer(
+		CFRunLoopTimerRef timer,
+		void *info
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = (Can4osxUsbDeviceHandleEntry *)info;
+
+	(void)timer;
+
+	if (pSelf->canNotify.pending != 0u)  {
+		CAN4OSX_NotifyPost(pSelf);
+	}
+}
+#endif /* CAN4OSX_HAVE_CFRUNLOOP */
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_NotifyRx - a frame was put into the receive buffer
+ *
+ * Called by the decoders for every received frame on the USB event thread.
+ * Without coalescing a notification is posted right away, otherwise it is
+ * deferred to CAN4OSX_NotifyRxFlush or posted when the watermark is hit.
+ */
+void CAN4OSX_NotifyRx(
+		Can4osxUsbDeviceHandleEntry *pSelf
+	)
+{
+CAN4OSX_NOTIFY_T *pNotify = &pSelf->canNotify;
+
+	if (pSelf->canNotification.notifacionCenter == NULL)  {
+		return;
+	}
+
+	if (((pNotify->notifyFlags & canNOTIFY_RX_COALESCE) == 0u)
+			&& (pNotify->watermark == 0u) && (pNotify->windowMs == 0u))  {
+		pNotify->pending = 1u;
+		CAN4OSX_NotifyPost(pSelf);
+		return;
+	}
+
+	if (pNotify->pending++ == 0u)  {
+		pNotify->firstPending = CFAbsoluteTimeGetCurrent();
+	}
+
+	if ((pNotify->watermark != 0u) && (pNotify->pending >= pNotify->watermark))  {
+		CAN4OSX_NotifyPost(pSelf);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_NotifyRxFlush - end of a bulk in transfer
+ *
+ * Posts one notification for all frames decoded since the last one. With a
+ * time window the post is delayed until the window is over, a run loop
+ * timer takes care of it if no further transfer comes in.
+ */
+void CAN4OSX_NotifyRxFlush(
+		Can4osxUsbDeviceHandleEntry *pSelf
+	)
+{
+CAN4OSX_NOTIFY_T *pNotify = &pSelf->canNotify;
+CFAbsoluteTime windowEnd;
+
+	if (pNotify->pending == 0u)  {
+		return;
+	}
+
+#if CAN4OSX_HAVE_CFRUNLOOP
+	if (pNotify->windowMs != 0u)  {
+		windowEnd = pNotify->firstPending + ((CFTimeInterval)pNotify->windowMs / 1000.0);
+
+		if (CFAbsoluteTimeGetCurrent() < windowEnd)  {
+			if (pNotify->windowTimer == NULL)  {
+				CFRunLoopTimerContext context = {0, pSelf, NULL, NULL, NULL};
+
+				/* the timer is only rearmed, it never fires by its interval */
+				pNotify->windowTimer = CFRunLoopTimerCreate(kCFAllocatorDefault, windowEnd, 1.0e9, 0, 0,
+															CAN4OSX_NotifyWindowTimer, &context);
+				if (pNotify->windowTimer == NULL)  {
+					CAN4OSX_NotifyPost(pSelf);
+					return;
+				}
+				CFRunLoopAddTimer(CFRunLoopGetCurrent(), pNotify->windowTimer, kCFRunLoopDefaultMode);
+			} else {
+				CFRunLoopTimerSetNextFireDate(pNotify->windowTimer, windowEnd);
+			}
+			return;
+		}
+	}
+#else
+	/* no run loop timer, canSetNotifyCoalescing refuses a window */
+	(void)windowEnd;
+#endif /* CAN4OSX_HAVE_CFRUNLOOP */
+
+	CAN4OSX_NotifyPost(pSelf);
+}
+
+
+/******************************************************************************/
+void CAN4OSX_NotifyRelease(
+		Can4osxUsbDeviceHandleEntry *pSelf
+	)
+{
+#if CAN4OSX_HAVE_CFRUNLOOP
+	if (pSelf->canNotify.windowTimer != NULL)  {
+		CFRunLoopTimerInvalidate(pSelf->canNotify.windowTimer);
+		CFRelease(pSelf->canNotify.windowTimer);
+		pSelf->canNotify.windowTimer = NULL;
+	}
+#else
+	(void)pSelf;
+#endif /* CAN4OSX_HAVE_CFRUNLOOP */
+}
+
+
+/******************************************************************************/
+canStatus CAN4OSX_GetChannelData(
+		Can4osxUsbDeviceHandleEntry* pSelf,
+		SInt32 cmd,
+		void* pBuffer,
+		size_t bufsize
+	)
+{
+
+	switch(cmd) {
+		case canCHANNELDATA_CARD_SERIAL_NO:
+			if (bufsize < 8)  {
+				return(canERR_NOMEM);
+			}
+			memcpy(pBuffer, &(pSelf->devInfo.serialNumber), 8);
+			break;
+		case canCHANNELDATA_DEVDESCR_ASCII:
+			if (bufsize > 128)  {
+				bufsize = 128;
+			}
+			memcpy(pBuffer, pSelf->devInfo.deviceString, bufsize);
+			break;
+		case canCHANNELDATA_CHANNEL_CAP:
+			if (bufsize < 4)  {
+				return(canERR_NOMEM);
+			}
+			memcpy(pBuffer, &(pSelf->devInfo.capability), 4);
+			break;
+		default:
+			break;
+	}
+	return(canOK);
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_decodeFdDlc - decode the dlc to data length
+*
+* \return the data length code
+*/
+UInt8 CAN4OSX_decodeFdDlc(
+		UInt8 dlc
+	)
+{
+static const UInt8 len[16u] = {0u,1u,2u,3u,4u,5u,6u,7u,8u,12u,16u,20u,24u,32u,48u,64u};
+
+	return(len[dlc]);
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_decodeFdDlc - decode the dlc to data length
+*
+* \return the datalength
+*/
+UInt8 CAN4OSX_encodeFdDlc(
+		UInt8 dlc
+	)
+{
+	if (dlc == 12u)  {
+		return(0x09);
+	}
+	if (dlc == 16u)  {
+		return(0x0A);
+	}
+	if (dlc == 20u)  {
+		return(0x0B);
+	}
+	if (dlc == 24u)  {
+		return(0x0C);
+	}
+	if (dlc == 32u)  {
+		return(0x0D);
+	}
+	if (dlc == 48u)  {
+		return(0x0E);
+	}
+	if (dlc == 64u)  {
+		return(0x0F);
+	}
+	/* invalid dlc */
+	if (dlc > 8u)  {
+		return(0xff);
+	}
+
+	return(dlc);
+}
+
+
+/******************************************************************************/
+/**
+* \brief OSX_getMilliseconds - get the actual milliseconds
+*
+* \return milliseconds
+*/
+UInt64 CAN$OSX_getMilliseconds(
+		void
+	)
+{
+struct timeval time;
+
+	gettimeofday(&time, NULL);
+	return(time.tv_sec * 1000) + (time.tv_usec / 1000);
+}
+
+
+/******************************************************************************/
+/**
+* \brief CAN4OSX_GetNanoseconds - monotonic time for intervals
+*
+* \return time in ns
+*/
+UInt64 CAN4OSX_GetNanoseconds(
+		void
+	)
+{
+struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return(((UInt64)now.tv_sec * 1000000000u) + (UInt64)now.tv_nsec);
+}
+
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_CreateTimestamp - clock reconstruction of a device
+ *
+ * Until CAN4OSX_SetTimestampClock is called raw values are taken as 64 bit ns.
+ *
+ * \return pointer to the clock or NULL
+ */
+CAN4OSX_TIMESTAMP_T* CAN4OSX_CreateTimestamp(
+		void
+	)
+{
+CAN4OSX_TIMESTAMP_T *pTs = calloc(1, sizeof(CAN4OSX_TIMESTAMP_T));
+
+	if (pTs == NULL)  {
+		return(NULL);
+	}
+
+	pTs->clockHz = 1000000000u;
+	pTs->counterMask = ~0ull;
+	pTs->tickNs = 1ull << 32u;
+	pTs->halfPeriodNs = ~0ull;
+	pthread_mutex_init(&pTs->alignMutex, NULL);
+
+	return(pTs);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_ReleaseTimestamp - counterpart of CAN4OSX_CreateTimestamp
+ */
+void CAN4OSX_ReleaseTimestamp(
+		CAN4OSX_TIMESTAMP_T *pTs
+	)
+{
+	if (pTs == NULL)  {
+		return;
+	}
+
+	pthread_mutex_destroy(&pTs->alignMutex);
+	free(pTs);
+}
+
+
+/******************************************************************************/
+static UInt64 CAN4OSX_TicksToNs(
+		const CAN4OSX_TIMESTAMP_T *pTs,
+		UInt64 ticks
+	)
+{
+	return((UInt64)(((unsigned __int128)ticks * pTs->tickNs) >> 32u));
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_SetTimestampClock - describes the counter of the device
+ *
+ * The counter runs with clockHz and wraps after counterBits. The scaling
+ * factor is the only division, the frames get along with a multiplication.
+ * Starts the reconstruction from scratch.
+ */
+void CAN4OSX_SetTimestampClock(
+		CAN4OSX_TIMESTAMP_T *pTs,
+		UInt32 clockHz,
+		UInt32 counterBits
+	)
+{
+	if ((pTs == NULL) || (clockHz == 0u))  {
+		return;
+	}
+
+	pthread_mutex_lock(&pTs->alignMutex);
+
+	pTs->clockHz = clockHz;
+	pTs->counterMask = (counterBits >= 64u) ? ~0ull : ((1ull << counterBits) - 1u);
+	pTs->tickNs = ((1000000000ull << 32u) + (clockHz / 2u)) / clockHz;
+	pTs->halfPeriodNs = (counterBits >= 64u) ? ~0ull : CAN4OSX_TicksToNs(pTs, pTs->counterMask >> 1u);
+
+	pTs->started = false;
+	pTs->windowEnd = 0u;
+	pTs->fitClockRead = false;
+	pTs->fitCount = 0u;
+	pTs->fitNext = 0u;
+	pTs->alignDevice = 0u;
+	pTs->alignOffset = 0;
+	pTs->alignDrift = 0;
+	pTs->alignSamples = 0u;
+	pTs->alignResidualRms = 0u;
+	pTs->alignResidualMax = 0u;
+	pTs->alignLastSample = 0u;
+	pTs->syncRequestNs = 0u;
+	pTs->syncRoundTrip = 0u;
+
+	pthread_mutex_unlock(&pTs->alignMutex);
+}
+
+
+/******************************************************************************/
+static UInt64 CAN4OSX_AlignTimestamp(
+		const CAN4OSX_TIMESTAMP_T *pTs,
+		UInt64 deviceNs
+	)
+{
+SInt64 delta = (SInt64)(deviceNs - pTs->alignDevice);
+
+	return(deviceNs + (UInt64)pTs->alignOffset + (UInt64)(SInt64)(((__int128)delta * pTs->alignDrift) >> 32u));
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_FitTimestamp - adds a sample and fits the host alignment
+ *
+ * Least squares line of the offset over the device time of the samples. The
+ * values are taken relative to the new sample, so a double holds them without
+ * loss. Runs once per sample, the frames only use the result.
+ */
+static void CAN4OSX_FitTimestamp(
+		CAN4OSX_TIMESTAMP_T *pTs,
+		UInt64 deviceNs,
+		SInt64 offset
+	)
+{
+double x[CAN4OSX_TIMESTAMP_SAMPLES];
+double y[CAN4OSX_TIMESTAMP_SAMPLES];
+double meanX = 0.0;
+double meanY = 0.0;
+double sxx = 0.0;
+double sxy = 0.0;
+double slope;
+double intercept;
+double residual;
+double sumSquares = 0.0;
+double maxResidual = 0.0;
+UInt32 count;
+UInt32 loopCount;
+
+	pTs->fitDevice[pTs->fitNext] = deviceNs;
+	pTs->fitOffset[pTs->fitNext] = offset;
+	pTs->fitNext = (pTs->fitNext + 1u) % CAN4OSX_TIMESTAMP_SAMPLES;
+	if (pTs->fitCount < CAN4OSX_TIMESTAMP_SAMPLES)  {
+		pTs->fitCount++;
+	}
+	count = pTs->fitCount;
+
+	for (loopCount = 0; loopCount < count; loopCount++)  {
+		x[loopCount] = (double)(SInt64)(pTs->fitDevice[loopCount] - deviceNs);
+		y[loopCount] = (double)(pTs->fitOffset[loopCount] - offset);
+		meanX += x[loopCount];
+		meanY += y[loopCount];
+	}
+	meanX /= count;
+	meanY /= count;
+
+	for (loopCount = 0; loopCount < count; loopCount++)  {
+		sxx += (x[loopCount] - meanX) * (x[loopCount] - meanX);
+		sxy += (x[loopCount] - meanX) * (y[loopCount] - meanY);
+	}
+
+	// a single sample keeps the drift known so far
+	if (sxx > 0.0)  {
+		slope = sxy / sxx;
+	} else {
+		slope = (double)pTs->alignDrift / 4294967296.0;
+	}
+	intercept = meanY - (slope * meanX);
+
+	for (loopCount = 0; loopCount < count; loopCount++)  {
+		residual = fabs(y[loopCount] - (intercept + (slope * x[loopCount])));
+		sumSquares += residual * residual;
+		if (residual > maxResidual)  {
+			maxResidual = residual;
+		}
+	}
+
+	pthread_mutex_lock(&pTs->alignMutex);
+	pTs->alignDevice = deviceNs;
+	pTs->alignOffset = offset + (SInt64)llround(intercept);
+	pTs->alignDrift = (SInt64)llround(slope * 4294967296.0);
+	pTs->alignSamples = count;
+	pTs->alignResidualRms = (UInt32)fmin(sqrt(sumSquares / count), (double)UINT32_MAX);
+	pTs->alignResidualMax = (UInt32)fmin(maxResidual, (double)UINT32_MAX);
+	pTs->alignLastSample = deviceNs + (UInt64)offset;
+	pthread_mutex_unlock(&pTs->alignMutex);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_SampleTimestamp - the frames as samples of the fit
+ *
+ * The smallest offset of a window belongs to the frame with the least USB
+ * latency, it becomes a sample when the window is over. Devices with a clock
+ * read do not need this.
+ */
+static void CAN4OSX_SampleTimestamp(
+		CAN4OSX_TIMESTAMP_T *pTs,
+		UInt64 deviceNs
+	)
+{
+SInt64 offset = (SInt64)(pTs->transferHostNs - deviceNs);
+
+	if (pTs->fitClockRead)  {
+		return;
+	}
+
+	if (deviceNs >= pTs->windowEnd)  {
+		if (pTs->windowEnd != 0u)  {
+			CAN4OSX_FitTimestamp(pTs, pTs->windowDevice, pTs->windowOffset);
+		}
+		pTs->windowEnd = deviceNs + CAN4OSX_TIMESTAMP_WINDOW_NS;
+	} else if (offset >= pTs->windowOffset)  {
+		return;
+	}
+
+	pTs->windowDevice = deviceNs;
+	pTs->windowOffset = offset;
+
+	// until the first window is over the best sample so far has to do
+	if (pTs->fitCount == 0u)  {
+		pthread_mutex_lock(&pTs->alignMutex);
+		pTs->alignDevice = deviceNs;
+		pTs->alignOffset = offset;
+		pthread_mutex_unlock(&pTs->alignMutex);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_RestartTimestamp - the counter of the device was reset
+ *
+ * The counter starts again at 0, the extended time goes on from where it was.
+ * Only called on the driver thread.
+ */
+void CAN4OSX_RestartTimestamp(
+		CAN4OSX_TIMESTAMP_T *pTs
+	)
+{
+	if ((pTs == NULL) || (pTs->started == false))  {
+		return;
+	}
+
+	pTs->lastRaw = 0u;
+	pTs->lastHostNs = pTs->transferHostNs;
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_ExtendTimestamp - counter value to device time
+ *
+ * raw is extended to 64 bit and scaled to ns. A value a bit older than the
+ * newest one, e.g. from another channel, does not count as a wrap.
+ *
+ * \return the device time in ns
+ */
+static UInt64 CAN4OSX_ExtendTimestamp(
+		CAN4OSX_TIMESTAMP_T *pTs,
+		UInt64 raw
+	)
+{
+UInt64 delta;
+UInt64 ticks;
+UInt64 elapsed;
+UInt64 period;
+
+	raw &= pTs->counterMask;
+
+	if (pTs->started == false)  {
+		pTs->started = true;
+		pTs->lastRaw = raw;
+		pTs->lastHostNs = pTs->transferHostNs;
+		pTs->ticks = raw;
+	}
+
+	delta = (raw - pTs->lastRaw) & pTs->counterMask;
+
+	if ((pTs->transferHostNs - pTs->lastHostNs) > pTs->halfPeriodNs)  {
+		// quiet for longer than the counter can tell, count the wraps with the host clock
+		period = pTs->counterMask + 1u;
+		elapsed = (UInt64)(((unsigned __int128)(pTs->transferHostNs - pTs->lastHostNs) * pTs->clockHz) / 1000000000u);
+		if (elapsed > delta)  {
+			pTs->ticks += ((elapsed - delta + (period >> 1u)) / period) * period;
+		}
+		pTs->ticks += delta;
+		pTs->lastRaw = raw;
+		pTs->lastHostNs = pTs->transferHostNs;
+		ticks = pTs->ticks;
+	} else if (delta <= (pTs->counterMask >> 1u))  {
+		pTs->ticks += delta;
+		pTs->lastRaw = raw;
+		pTs->lastHostNs = pTs->transferHostNs;
+		ticks = pTs->ticks;
+	} else {
+		ticks = pTs->ticks - ((pTs->lastRaw - raw) & pTs->counterMask);
+	}
+
+	return(CAN4OSX_TicksToNs(pTs, ticks));
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_RxTimestamp - timestamp of a received frame
+ *
+ * raw is the counter value of the device, see CAN4OSX_ExtendTimestamp.
+ * hostTime moves the result to the clock of CAN4OSX_GetNanoseconds. Only
+ * called on the driver thread while decoding a bulk in transfer, the frames
+ * also feed the host alignment.
+ *
+ * \return the timestamp in ns
+ */
+UInt64 CAN4OSX_RxTimestamp(
+		CAN4OSX_TIMESTAMP_T *pTs,
+		UInt64 raw,
+		bool hostTime
+	)
+{
+UInt64 ns;
+
+	if (pTs == NULL)  {
+		return(raw);
+	}
+
+	ns = CAN4OSX_ExtendTimestamp(pTs, raw);
+
+	CAN4OSX_SampleTimestamp(pTs, ns);
+
+	if (hostTime)  {
+		return(CAN4OSX_AlignTimestamp(pTs, ns));
+	}
+
+	return(ns);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_TimestampClockRequest - a clock read is sent
+ *
+ * Called right before the request goes to the device.
+ */
+void CAN4OSX_TimestampClockRequest(
+		CAN4OSX_TIMESTAMP_T *pTs
+	)
+{
+	pthread_mutex_lock(&pTs->alignMutex);
+	pTs->syncRequestNs = CAN4OSX_GetNanoseconds();
+	pthread_mutex_unlock(&pTs->alignMutex);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_TimestampClockResponse - the device answered a clock read
+ *
+ * The device read its clock somewhere between sending the request and the
+ * completion of the bulk in transfer with the answer, the middle of both is
+ * taken. The answer with the shortest round trip of a window becomes the
+ * sample, answers taking longer than CAN4OSX_TIMESYNC_MAX_RTT_NS are dropped.
+ * The first answer replaces the samples of the frames. Only called on the
+ * driver thread.
+ */
+void CAN4OSX_TimestampClockResponse(
+		CAN4OSX_TIMESTAMP_T *pTs,
+		UInt64 raw
+	)
+{
+UInt64 requestNs;
+UInt64 roundTrip;
+UInt64 deviceNs;
+SInt64 offset;
+
+	if (pTs == NULL)  {
+		return;
+	}
+
+	pthread_mutex_lock(&pTs->alignMutex);
+	requestNs = pTs->syncRequestNs;
+	pTs->syncRequestNs = 0u;
+	pthread_mutex_unlock(&pTs->alignMutex);
+
+	// not ours or already answered
+	if ((requestNs == 0u) || (pTs->transferHostNs < requestNs))  {
+		return;
+	}
+
+	roundTrip = pTs->transferHostNs - requestNs;
+	deviceNs = CAN4OSX_ExtendTimestamp(pTs, raw);
+
+	if (roundTrip > CAN4OSX_TIMESYNC_MAX_RTT_NS)  {
+		return;
+	}
+
+	if (pTs->fitClockRead == false)  {
+		pTs->fitClockRead = true;
+		pTs->fitCount = 0u;
+		pTs->fitNext = 0u;
+		pTs->windowEnd = 0u;
+	}
+
+	offset = (SInt64)(requestNs + (roundTrip / 2u) - deviceNs);
+
+	if (deviceNs >= pTs->windowEnd)  {
+		if (pTs->windowEnd != 0u)  {
+			pthread_mutex_lock(&pTs->alignMutex);
+			pTs->syncRoundTrip = pTs->windowRoundTrip;
+			pthread_mutex_unlock(&pTs->alignMutex);
+			CAN4OSX_FitTimestamp(pTs, pTs->windowDevice, pTs->windowOffset);
+		}
+		pTs->windowEnd = deviceNs + CAN4OSX_TIMESTAMP_WINDOW_NS;
+	} else if (roundTrip >= pTs->windowRoundTrip)  {
+		return;
+	}
+
+	pTs->windowDevice = deviceNs;
+	pTs->windowOffset = offset;
+	pTs->windowRoundTrip = (UInt32)roundTrip;
+
+	// until the first window is over the best answer so far has to do
+	if (pTs->fitCount == 0u)  {
+		pthread_mutex_lock(&pTs->alignMutex);
+		pTs->alignDevice = deviceNs;
+		pTs->alignOffset = offset;
+		pTs->syncRoundTrip = (UInt32)roundTrip;
+		pthread_mutex_unlock(&pTs->alignMutex);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_GetTimestampSync - state of the host alignment
+ */
+void CAN4OSX_GetTimestampSync(
+		CAN4OSX_TIMESTAMP_T *pTs,
+		CanTimeSyncStatus *pStatus
+	)
+{
+	pthread_mutex_lock(&pTs->alignMutex);
+	pStatus->samples = pTs->alignSamples;
+	pStatus->driftPpb = (SInt32)((pTs->alignDrift * 1000000000) >> 32u);
+	pStatus->residualRms = pTs->alignResidualRms;
+	pStatus->residualMax = pTs->alignResidualMax;
+	pStatus->roundTrip = pTs->syncRoundTrip;
+	pStatus->errorBound = pTs->alignResidualMax + (pTs->syncRoundTrip / 2u);
+	pStatus->lastSample = pTs->alignLastSample;
+	pthread_mutex_unlock(&pTs->alignMutex);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_GetHostTimestamp - device time to host time
+ *
+ * Uses the current offset and drift estimate, callable from any thread.
+ *
+ * \return deviceNs on the clock of CAN4OSX_GetNanoseconds
+ */
+UInt64 CAN4OSX_GetHostTimestamp(
+		CAN4OSX_TIMESTAMP_T *pTs,
+		UInt64 deviceNs
+	)
+{
+UInt64 hostNs;
+
+	pthread_mutex_lock(&pTs->alignMutex);
+	hostNs = CAN4OSX_AlignTimestamp(pTs, deviceNs);
+	pthread_mutex_unlock(&pTs->alignMutex);
+
+	return(hostNs);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_GetDeviceTimestamp - host time to device time
+ *
+ * The inverse of CAN4OSX_GetHostTimestamp, the drift correction is taken at
+ * the host time, which is off by far less than a ns.
+ *
+ * \return hostNs on the clock of the device
+ */
+UInt64 CAN4OSX_GetDeviceTimestamp(
+		CAN4OSX_TIMESTAMP_T *pTs,
+		UInt64 hostNs
+	)
+{
+UInt64 deviceNs;
+SInt64 delta;
+
+	pthread_mutex_lock(&pTs->alignMutex);
+	deviceNs = hostNs - (UInt64)pTs->alignOffset;
+	delta = (SInt64)(deviceNs - pTs->alignDevice);
+	deviceNs -= (UInt64)(SInt64)(((__int128)delta * pTs->alignDrift) >> 32u);
+	pthread_mutex_unlock(&pTs->alignMutex);
+
+	return(deviceNs);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_GetTimestampDrift - drift of the device clock
+ *
+ * \return ppb the device clock runs slower than the host clock
+ */
+SInt32 CAN4OSX_GetTimestampDrift(
+		CAN4OSX_TIMESTAMP_T *pTs
+	)
+{
+SInt64 drift;
+
+	pthread_mutex_lock(&pTs->alignMutex);
+	drift = pTs->alignDrift;
+	pthread_mutex_unlock(&pTs->alignMutex);
+
+	return((SInt32)((drift * 1000000000) >> 32u));
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_CreateTransactions - no request of a device in flight
+ *
+ * \return pointer to the transactions or NULL
+ */
+CAN4OSX_TRANSACTIONS_T* CAN4OSX_CreateTransactions(
+		void
+	)
+{
+CAN4OSX_TRANSACTIONS_T *pTrans = calloc(1, sizeof(CAN4OSX_TRANSACTIONS_T));
+
+	if (pTrans == NULL)  {
+		return(NULL);
+	}
+
+	pthread_mutex_init(&pTrans->mutex, NULL);
+	CAN4OSX_CondInit(&pTrans->doneCond);
+	pthread_mutex_init(&pTrans->writeMutex, NULL);
+
+	return(pTrans);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_ReleaseTransactions - free them
+ *
+ * Nobody may wait anymore, see CAN4OSX_CloseTransactions.
+ */
+void CAN4OSX_ReleaseTransactions(
+		CAN4OSX_TRANSACTIONS_T *pTrans
+	)
+{
+	if (pTrans == NULL)  {
+		return;
+	}
+
+	pthread_mutex_destroy(&pTrans->writeMutex);
+	pthread_cond_destroy(&pTrans->doneCond);
+	pthread_mutex_destroy(&pTrans->mutex);
+	free(pTrans);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_CloseTransactions - the device is gone
+ *
+ * Everything in flight fails with canERR_INVHANDLE, new requests are refused.
+ */
+void CAN4OSX_CloseTransactions(
+		CAN4OSX_TRANSACTIONS_T *pTrans
+	)
+{
+	if (pTrans == NULL)  {
+		return;
+	}
+
+	pthread_mutex_lock(&pTrans->mutex);
+	pTrans->closed = true;
+	pthread_mutex_unlock(&pTrans->mutex);
+
+	CAN4OSX_CancelTransactions(pTrans, canERR_INVHANDLE);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_NextTransactionId - id for the next request
+ *
+ * Counts through idMask, 0 is left out.
+ *
+ * \return the id
+ */
+UInt32 CAN4OSX_NextTransactionId(
+		CAN4OSX_TRANSACTIONS_T *pTrans,
+		UInt32 idMask
+	)
+{
+UInt32 id;
+
+	if (pTrans == NULL)  {
+		return(0u);
+	}
+
+	pthread_mutex_lock(&pTrans->mutex);
+	do {
+		id = ++pTrans->nextId & idMask;
+	} while (id == 0u);
+	pthread_mutex_unlock(&pTrans->mutex);
+
+	return(id);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_BeginTransaction - a request is about to be sent
+ *
+ * Register it before sending, the response may be decoded before the send
+ * returns. With a callback the transaction is done with the call, otherwise
+ * it has to be finished with CAN4OSX_WaitTransaction.
+ *
+ * \return the transaction or NULL if too many are in flight or the device is
+ * gone
+ */
+CAN4OSX_TRANSACTION_T* CAN4OSX_BeginTransaction(
+		CAN4OSX_TRANSACTIONS_T *pTrans,
+		UInt32 key,
+		CAN4OSX_TRANSACTION_CALLBACK_T callback,
+		void *refCon
+	)
+{
+CAN4OSX_TRANSACTION_T *pTransaction = NULL;
+UInt32 loopCount;
+
+	if (pTrans == NULL)  {
+		return(NULL);
+	}
+
+	pthread_mutex_lock(&pTrans->mutex);
+
+	if (!pTrans->closed)  {
+		for (loopCount = 0; loopCount < CAN4OSX_TRANSACTION_MAX; loopCount++)  {
+			if (pTrans->slot[loopCount].state == CAN4OSX_TRANSACTION_FREE)  {
+				pTransaction = &pTrans->slot[loopCount];
+				break;
+			}
+		}
+	}
+
+	if (pTransaction != NULL)  {
+		pTransaction->state = CAN4OSX_TRANSACTION_PENDING;
+		pTransaction->key = key;
+		pTransaction->callback = callback;
+		pTransaction->refCon = refCon;
+		pTransaction->status = canERR_TIMEOUT;
+		pTransaction->size = 0u;
+#if CAN4OSX_TRACE
+		pTransaction->beginNs = CAN4OSX_GetNanoseconds();
+#endif /* CAN4OSX_TRACE */
+		pTrans->pending++;
+	}
+
+	pthread_mutex_unlock(&pTrans->mutex);
+
+	return(pTransaction);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_CompleteTransaction - the decoder got a response
+ *
+ * Goes to the request waiting for key. Called on the driver thread.
+ *
+ * \return 1 if a request waited for the response, otherwise 0
+ */
+UInt8 CAN4OSX_CompleteTransaction(
+		CAN4OSX_TRANSACTIONS_T *pTrans,
+		UInt32 key,
+		const void *pResponse,
+		UInt32 size
+	)
+{
+CAN4OSX_TRANSACTION_T *pTransaction = NULL;
+CAN4OSX_TRANSACTION_CALLBACK_T callback;
+void *refCon;
+UInt32 loopCount;
+
+	if (pTrans == NULL)  {
+		return(0u);
+	}
+
+	pthread_mutex_lock(&pTrans->mutex);
+
+	if (pTrans->pending != 0u)  {
+		for (loopCount = 0; loopCount < CAN4OSX_TRANSACTION_MAX; loopCount++)  {
+			if ((pTrans->slot[loopCount].state == CAN4OSX_TRANSACTION_PENDING) && (pTrans->slot[loopCount].key == key))  {
+				pTransaction = &pTrans->slot[loopCount];
+				break;
+			}
+		}
+	}
+
+	if (pTransaction == NULL)  {
+		pthread_mutex_unlock(&pTrans->mutex);
+		return(0u);
+	}
+
+	pTrans->pending--;
+#if CAN4OSX_TRACE
+	CAN4OSX_TraceLatency(canLATENCY_COMMAND, CAN4OSX_GetNanoseconds() - pTransaction->beginNs);
+	CAN4OSX_TraceEvent(CAN4OSX_TRACE_COMMAND, -1, key);
+#endif /* CAN4OSX_TRACE */
+
+	if (pTransaction->callback == NULL)  {
+		if (size > CAN4OSX_TRANSACTION_RESPONSE_MAX)  {
+			size = CAN4OSX_TRANSACTION_RESPONSE_MAX;
+		}
+		memcpy(pTransaction->response, pResponse, size);
+		pTransaction->size = size;
+		pTransaction->status = canOK;
+		pTransaction->state = CAN4OSX_TRANSACTION_DONE;
+		pthread_cond_broadcast(&pTrans->doneCond);
+		pthread_mutex_unlock(&pTrans->mutex);
+		return(1u);
+	}
+
+	// the callback may start the next request
+	callback = pTransaction->callback;
+	refCon = pTransaction->refCon;
+	pTransaction->state = CAN4OSX_TRANSACTION_FREE;
+	pthread_mutex_unlock(&pTrans->mutex);
+
+	callback(refCon, canOK, pResponse, size);
+
+	return(1u);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_WaitTransaction - wait for the response of a request
+ *
+ * Finishes a transaction begun without a callback, a response arriving after
+ * the timeout is dropped. Not on the driver thread, that one decodes the
+ * responses.
+ *
+ * \return canOK with up to size bytes of the response, canERR_TIMEOUT or
+ * canERR_INVHANDLE if the device is gone
+ */
+canStatus CAN4OSX_WaitTransaction(
+		CAN4OSX_TRANSACTIONS_T *pTrans,
+		CAN4OSX_TRANSACTION_T *pTransaction,
+		UInt32 timeoutMs,
+		void *pResponse,
+		UInt32 size
+	)
+{
+struct timespec deadline;
+canStatus status;
+
+	CAN4OSX_GetDeadline(&deadline, timeoutMs);
+
+	pthread_mutex_lock(&pTrans->mutex);
+
+	while (pTransaction->state == CAN4OSX_TRANSACTION_PENDING)  {
+		if (CAN4OSX_CondTimedWait(&pTrans->doneCond, &pTrans->mutex, &deadline) == ETIMEDOUT)  {
+			break;
+		}
+	}
+
+	if (pTransaction->state == CAN4OSX_TRANSACTION_PENDING)  {
+		pTrans->pending--;
+		status = canERR_TIMEOUT;
+	} else {
+		status = pTransaction->status;
+		if ((status == canOK) && (pResponse != NULL))  {
+			memcpy(pResponse, pTransaction->response, (size < pTransaction->size) ? size : pTransaction->size);
+		}
+	}
+	pTransaction->state = CAN4OSX_TRANSACTION_FREE;
+
+	pthread_mutex_unlock(&pTrans->mutex);
+
+	return(status);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_CancelTransactions - give up on all requests in flight
+ *
+ * Each one fails with status, late responses are dropped.
+ */
+void CAN4OSX_CancelTransactions(
+		CAN4OSX_TRANSACTIONS_T *pTrans,
+		canStatus status
+	)
+{
+CAN4OSX_TRANSACTION_CALLBACK_T callback[CAN4OSX_TRANSACTION_MAX];
+void *refCon[CAN4OSX_TRANSACTION_MAX];
+CAN4OSX_TRANSACTION_T *pTransaction;
+UInt32 count = 0u;
+UInt32 loopCount;
+
+	if (pTrans == NULL)  {
+		return;
+	}
+
+	pthread_mutex_lock(&pTrans->mutex);
+
+	for (loopCount = 0; loopCount < CAN4OSX_TRANSACTION_MAX; loopCount++)  {
+		pTransaction = &pTrans->slot[loopCount];
+		if (pTransaction->state != CAN4OSX_TRANSACTION_PENDING)  {
+			continue;
+		}
+		if (pTransaction->callback != NULL)  {
+			callback[count] = pTransaction->callback;
+			refCon[count++] = pTransaction->refCon;
+			pTransaction->state = CAN4OSX_TRANSACTION_FREE;
+		} else {
+			pTransaction->status = status;
+			pTransaction->state = CAN4OSX_TRANSACTION_DONE;
+		}
+	}
+	pTrans->pending = 0u;
+	pthread_cond_broadcast(&pTrans->doneCond);
+
+	pthread_mutex_unlock(&pTrans->mutex);
+
+	for (loopCount = 0; loopCount < count; loopCount++)  {
+		callback[loopCount](refCon[loopCount], status, NULL, 0u);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_GetPendingTransactions - requests still waiting for a response
+ *
+ * \return number of requests
+ */
+UInt32 CAN4OSX_GetPendingTransactions(
+		CAN4OSX_TRANSACTIONS_T *pTrans
+	)
+{
+UInt32 pending;
+
+	if (pTrans == NULL)  {
+		return(0u);
+	}
+
+	pthread_mutex_lock(&pTrans->mutex);
+	pending = pTrans->pending;
+	pthread_mutex_unlock(&pTrans->mutex);
+
+	return(pending);
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_UpdateFilter - a filter without mask and lists is skipped
+ */
+static void CAN4OSX_UpdateFilter(
+		CAN4OSX_FILTER_T *pFilter
+	)
+{
+	pFilter->active = (pFilter->mask[0] != 0u) || (pFilter->mask[1] != 0u)
+					|| (pFilter->listCount[0] != 0u) || (pFilter->listCount[1] != 0u);
+}
+
+
+/******************************************************************************/
+static UInt32 CAN4OSX_FilterSlot(
+		UInt32 key,
+		UInt32 shift
+	)
+{
+	return((key * 0x9E3779B1u) >> shift);
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_InsertFilterId - puts a key into the id table
+ *
+ * The table has to have a free slot.
+ *
+ * \return 1 if the key is new, 0 if it was there already
+ */
+static UInt8 CAN4OSX_InsertFilterId(
+		UInt32 *pSlot,
+		UInt32 slotMask,
+		UInt32 slot,
+		UInt32 key
+	)
+{
+	while (pSlot[slot] != CAN4OSX_FILTER_EMPTY_KEY)  {
+		if (pSlot[slot] == key)  {
+			return(0u);
+		}
+		slot = (slot + 1u) & slotMask;
+	}
+	pSlot[slot] = key;
+
+	return(1u);
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_RetireFilterIds - keep a replaced id table until the release
+ */
+static void CAN4OSX_RetireFilterIds(
+		CAN4OSX_FILTER_T *pFilter,
+		CAN4OSX_FILTER_IDS_T *pIds
+	)
+{
+	if (pIds != NULL)  {
+		pIds->pRetired = pFilter->pRetired;
+		pFilter->pRetired = pIds;
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_InitFilter - a filter accepting every frame
+ */
+void CAN4OSX_InitFilter(
+		CAN4OSX_FILTER_T *pFilter
+	)
+{
+	memset(pFilter, 0, sizeof(CAN4OSX_FILTER_T));
+	atomic_init(&pFilter->pIds, NULL);
+	atomic_init(&pFilter->rejected, 0u);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_ClearFilter - accepts every frame again
+ *
+ * The id table is retired, the counter of the rejected frames is kept.
+ */
+void CAN4OSX_ClearFilter(
+		CAN4OSX_FILTER_T *pFilter
+	)
+{
+CAN4OSX_FILTER_IDS_T *pIds = atomic_load_explicit(&pFilter->pIds, memory_order_relaxed);
+CAN4OSX_FILTER_IDS_T *pRetired = pFilter->pRetired;
+UInt32 rejected = atomic_load_explicit(&pFilter->rejected, memory_order_relaxed);
+
+	CAN4OSX_InitFilter(pFilter);
+	atomic_store_explicit(&pFilter->rejected, rejected, memory_order_relaxed);
+	pFilter->pRetired = pRetired;
+	CAN4OSX_RetireFilterIds(pFilter, pIds);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_ReleaseFilter - frees the id tables and accepts every frame
+ *
+ * Only once the decoder does not run for the channel anymore. The counter of
+ * the rejected frames is kept.
+ */
+void CAN4OSX_ReleaseFilter(
+		CAN4OSX_FILTER_T *pFilter
+	)
+{
+CAN4OSX_FILTER_IDS_T *pIds;
+
+	CAN4OSX_ClearFilter(pFilter);
+
+	while (pFilter->pRetired != NULL)  {
+		pIds = pFilter->pRetired;
+		pFilter->pRetired = pIds->pRetired;
+		free(pIds);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_SetFilterMask - code and mask of one id type
+ *
+ * A set bit of the mask has to match in the id and the code. A code with set
+ * bits above the id matches no id of that type at all.
+ */
+void CAN4OSX_SetFilterMask(
+		CAN4OSX_FILTER_T *pFilter,
+		UInt32 code,
+		UInt32 mask,
+		bool extended
+	)
+{
+UInt32 type = extended ? 1u : 0u;
+
+	pFilter->code[type] = code;
+	pFilter->mask[type] = mask;
+	CAN4OSX_UpdateFilter(pFilter);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_AddFilterRange - accepts the ids first to last
+ *
+ * \return 1 on success, 0 if all CAN4OSX_FILTER_MAX_RANGES are used
+ */
+UInt8 CAN4OSX_AddFilterRange(
+		CAN4OSX_FILTER_T *pFilter,
+		UInt32 first,
+		UInt32 last,
+		bool extended
+	)
+{
+UInt32 key = extended ? CAN4OSX_FILTER_EXT_KEY : 0u;
+
+	if (pFilter->rangeCount >= CAN4OSX_FILTER_MAX_RANGES)  {
+		return(0u);
+	}
+
+	pFilter->range[pFilter->rangeCount].first = first | key;
+	pFilter->range[pFilter->rangeCount].last = last | key;
+	pFilter->rangeCount++;
+	pFilter->listCount[extended ? 1u : 0u]++;
+	CAN4OSX_UpdateFilter(pFilter);
+
+	return(1u);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_AddFilterIds - accepts count single ids
+ *
+ * The ids go into a hash table kept at most half full, so a lookup of the
+ * decoder stays at about one probe however many ids there are. Growing it
+ * replaces the table, the old one is retired.
+ *
+ * \return 1 on success, 0 if there is no memory
+ */
+UInt8 CAN4OSX_AddFilterIds(
+		CAN4OSX_FILTER_T *pFilter,
+		const UInt32 *pIds,
+		UInt32 count,
+		bool extended
+	)
+{
+CAN4OSX_FILTER_IDS_T *pOld = atomic_load_explicit(&pFilter->pIds, memory_order_relaxed);
+CAN4OSX_FILTER_IDS_T *pTable = pOld;
+UInt32 slots = (pOld != NULL) ? (pOld->slotMask + 1u) : 0u;
+UInt32 key = extended ? CAN4OSX_FILTER_EXT_KEY : 0u;
+UInt32 added = 0u;
+UInt32 loopCount;
+
+	if (count > ((UINT32_MAX / 4u) - pFilter->idCount))  {
+		return(0u);
+	}
+
+	if (((pFilter->idCount + count) * 2u) > slots)  {
+	UInt32 shift = 32u - 4u;
+
+		slots = CAN4OSX_FILTER_MIN_SLOTS;
+		while (slots < ((pFilter->idCount + count) * 2u))  {
+			slots *= 2u;
+			shift--;
+		}
+		pTable = malloc(sizeof(CAN4OSX_FILTER_IDS_T) + (slots * sizeof(UInt32)));
+		if (pTable == NULL)  {
+			return(0u);
+		}
+		pTable->pRetired = NULL;
+		pTable->slotMask = slots - 1u;
+		pTable->shift = shift;
+		memset(pTable->slot, 0xFF, slots * sizeof(UInt32));
+		for (loopCount = 0u; (pOld != NULL) && (loopCount <= pOld->slotMask); loopCount++)  {
+			if (pOld->slot[loopCount] != CAN4OSX_FILTER_EMPTY_KEY)  {
+				(void)CAN4OSX_InsertFilterId(pTable->slot, pTable->slotMask, CAN4OSX_FilterSlot(pOld->slot[loopCount], shift), pOld->slot[loopCount]);
+			}
+		}
+	}
+
+	for (loopCount = 0u; loopCount < count; loopCount++)  {
+		added += CAN4OSX_InsertFilterId(pTable->slot, pTable->slotMask,
+						CAN4OSX_FilterSlot(pIds[loopCount] | key, pTable->shift), pIds[loopCount] | key);
+	}
+
+	// frames in flight may still be decoded against the old table
+	if (pTable != pOld)  {
+		atomic_store_explicit(&pFilter->pIds, pTable, memory_order_release);
+		CAN4OSX_RetireFilterIds(pFilter, pOld);
+	}
+	pFilter->idCount += added;
+	pFilter->listCount[extended ? 1u : 0u] += added;
+	CAN4OSX_UpdateFilter(pFilter);
+
+	return(1u);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_FilterMatch - checks a received frame against a filter
+ *
+ * \return true if the frame passes
+ */
+bool CAN4OSX_FilterMatch(
+		const CAN4OSX_FILTER_T *pFilter,
+		UInt32 canId,
+		UInt32 canFlags
+	)
+{
+UInt32 type = (canFlags & canMSG_EXT) ? 1u : 0u;
+UInt32 key = type ? (canId | CAN4OSX_FILTER_EXT_KEY) : canId;
+const CAN4OSX_FILTER_IDS_T *pIds;
+UInt32 slot;
+UInt32 loopCount;
+
+	if (canFlags & canMSG_ERROR_FRAME)  {
+		return(true);
+	}
+
+	if ((canId & pFilter->mask[type]) != (pFilter->code[type] & pFilter->mask[type]))  {
+		return(false);
+	}
+
+	if (pFilter->listCount[type] == 0u)  {
+		return(true);
+	}
+
+	// the key bit keeps the ranges of the other type apart
+	for (loopCount = 0u; loopCount < pFilter->rangeCount; loopCount++)  {
+		if ((key >= pFilter->range[loopCount].first) && (key <= pFilter->range[loopCount].last))  {
+			return(true);
+		}
+	}
+
+	// mask and shift come with their table
+	pIds = atomic_load_explicit(&pFilter->pIds, memory_order_acquire);
+	if (pIds != NULL)  {
+		slot = CAN4OSX_FilterSlot(key, pIds->shift);
+		while (pIds->slot[slot] != CAN4OSX_FILTER_EMPTY_KEY)  {
+			if (pIds->slot[slot] == key)  {
+				return(true);
+			}
+			slot = (slot + 1u) & pIds->slotMask;
+		}
+	}
+
+	return(false);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_GetFilterIdTypes - the id types a filter lets pass at all
+ *
+ * For devices that can switch off the reception of 11 or 29 bit frames.
+ */
+void CAN4OSX_GetFilterIdTypes(
+		const CAN4OSX_FILTER_T *pFilter,
+		bool *pStandard,
+		bool *pExtended
+	)
+{
+	*pStandard = ((pFilter->code[0] & pFilter->mask[0] & ~CAN4OSX_FILTER_STD_IDS) == 0u);
+	*pExtended = ((pFilter->code[1] & pFilter->mask[1] & ~CAN4OSX_FILTER_EXT_IDS) == 0u);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_InitBusStatistics - counters of a new channel
+ */
+void CAN4OSX_InitBusStatistics(
+		CAN4OSX_BUS_STATS_T *pStats
+	)
+{
+	memset(pStats, 0, sizeof(CAN4OSX_BUS_STATS_T));
+	atomic_init(&pStats->stdData, 0u);
+	atomic_init(&pStats->stdRemote, 0u);
+	atomic_init(&pStats->extData, 0u);
+	atomic_init(&pStats->extRemote, 0u);
+	atomic_init(&pStats->fdData, 0u);
+	atomic_init(&pStats->errFrame, 0u);
+	atomic_init(&pStats->overruns, 0u);
+	atomic_init(&pStats->errorEvents, 0u);
+	atomic_init(&pStats->txAck, 0u);
+	atomic_init(&pStats->dataBytes, 0u);
+	atomic_init(&pStats->nominalBits, 0u);
+	atomic_init(&pStats->dataBits, 0u);
+	atomic_init(&pStats->nominalBitrate, 0u);
+	atomic_init(&pStats->dataBitrate, 0u);
+
+	pthread_mutex_init(&pStats->requestMutex, NULL);
+	pStats->requestNs = CAN4OSX_GetNanoseconds();
+}
+
+
+/******************************************************************************/
+void CAN4OSX_ReleaseBusStatistics(
+		CAN4OSX_BUS_STATS_T *pStats
+	)
+{
+	pthread_mutex_destroy(&pStats->requestMutex);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_SetBusStatisticsBitrate - bit rates of the bus params in bit/s
+ *
+ * 0 keeps a rate. Without a data bit rate the data phase is taken at the
+ * nominal one.
+ */
+void CAN4OSX_SetBusStatisticsBitrate(
+		CAN4OSX_BUS_STATS_T *pStats,
+		UInt32 nominalBitrate,
+		UInt32 dataBitrate
+	)
+{
+	if (nominalBitrate != 0u)  {
+		atomic_store_explicit(&pStats->nominalBitrate, nominalBitrate, memory_order_relaxed);
+	}
+	if (dataBitrate != 0u)  {
+		atomic_store_explicit(&pStats->dataBitrate, dataBitrate, memory_order_relaxed);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_CountBusFrame - a frame the device saw on the bus
+ *
+ * Called by the decoder for every frame ahead of the acceptance filter, len
+ * is the payload in bytes. The length on the bus follows the frame format
+ * with an estimate of the stuff bits, the data phase of a CAN FD frame with
+ * BRS is counted on its own.
+ */
+void CAN4OSX_CountBusFrame(
+		CAN4OSX_BUS_STATS_T *pStats,
+		UInt32 canFlags,
+		UInt8 len
+	)
+{
+UInt32 arbitrationBits;
+UInt32 phaseBits;
+UInt32 nominalBits;
+UInt32 dataBits = 0u;
+
+	if (canFlags & canMSG_ERROR_FRAME)  {
+		CAN4OSX_CountBusStat(&pStats->errFrame, 1u);
+		CAN4OSX_CountBusStat(&pStats->nominalBits, CAN4OSX_BUS_ERROR_FRAME_BITS);
+		return;
+	}
+
+	if (canFlags & canMSG_RTR)  {
+		CAN4OSX_CountBusStat((canFlags & canMSG_EXT) ? &pStats->extRemote : &pStats->stdRemote, 1u);
+		len = 0u;
+	} else {
+		CAN4OSX_CountBusStat((canFlags & canMSG_EXT) ? &pStats->extData : &pStats->stdData, 1u);
+		CAN4OSX_CountBusStat(&pStats->dataBytes, len);
+	}
+	if (canFlags & canMSG_TXACK)  {
+		CAN4OSX_CountBusStat(&pStats->txAck, 1u);
+	}
+
+	if (canFlags & canFDMSG_FDF)  {
+		CAN4OSX_CountBusStat(&pStats->fdData, 1u);
+
+		arbitrationBits = (canFlags & canMSG_EXT) ? CAN4OSX_BUS_FD_EXT_BITS : CAN4OSX_BUS_FD_STD_BITS;
+		arbitrationBits += CAN4OSX_BUS_STUFF_BITS(arbitrationBits);
+		phaseBits = CAN4OSX_BUS_FD_DATA_BITS + (8u * len);
+		phaseBits += CAN4OSX_BUS_STUFF_BITS(phaseBits);
+		phaseBits += (len <= 16u) ? CAN4OSX_BUS_FD_CRC17_BITS : CAN4OSX_BUS_FD_CRC21_BITS;
+
+		if (canFlags & canFDMSG_BRS)  {
+			nominalBits = arbitrationBits + CAN4OSX_BUS_TAIL_BITS;
+			dataBits = phaseBits;
+		} else {
+			nominalBits = arbitrationBits + phaseBits + CAN4OSX_BUS_TAIL_BITS;
+		}
+	} else {
+		nominalBits = ((canFlags & canMSG_EXT) ? CAN4OSX_BUS_EXT_BITS : CAN4OSX_BUS_STD_BITS) + (8u * len);
+		nominalBits += CAN4OSX_BUS_STUFF_BITS(nominalBits) + CAN4OSX_BUS_TAIL_BITS;
+	}
+
+	CAN4OSX_CountBusStat(&pStats->nominalBits, nominalBits);
+	if (dataBits != 0u)  {
+		CAN4OSX_CountBusStat(&pStats->dataBits, dataBits);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_RequestBusStatistics - snapshot for canGetBusStatistics
+ *
+ * The bus load is the time the counted bits took at their bit rates over the
+ * time since the previous request, 0 as long as the bit rate is unknown.
+ * bufferOverruns are the frames the receive buffer lost.
+ */
+void CAN4OSX_RequestBusStatistics(
+		CAN4OSX_BUS_STATS_T *pStats,
+		UInt32 bufferOverruns
+	)
+{
+canBusStatistics *pSnapshot = &pStats->snapshot;
+UInt64 now;
+UInt64 nominalBits;
+UInt64 dataBits;
+UInt32 nominalBitrate = atomic_load_explicit(&pStats->nominalBitrate, memory_order_relaxed);
+UInt32 dataBitrate = atomic_load_explicit(&pStats->dataBitrate, memory_order_relaxed);
+double nominalNs = 0.0;
+double dataNs = 0.0;
+double elapsedNs;
+
+	if (dataBitrate == 0u)  {
+		dataBitrate = nominalBitrate;
+	}
+
+	// a second dashboard must not take its period in between
+	pthread_mutex_lock(&pStats->requestMutex);
+
+	now = CAN4OSX_GetNanoseconds();
+	nominalBits = atomic_load_explicit(&pStats->nominalBits, memory_order_relaxed);
+	dataBits = atomic_load_explicit(&pStats->dataBits, memory_order_relaxed);
+
+	pSnapshot->stdData = (unsigned long)atomic_load_explicit(&pStats->stdData, memory_order_relaxed);
+	pSnapshot->stdRemote = (unsigned long)atomic_load_explicit(&pStats->stdRemote, memory_order_relaxed);
+	pSnapshot->extData = (unsigned long)atomic_load_explicit(&pStats->extData, memory_order_relaxed);
+	pSnapshot->extRemote = (unsigned long)atomic_load_explicit(&pStats->extRemote, memory_order_relaxed);
+	pSnapshot->errFrame = (unsigned long)atomic_load_explicit(&pStats->errFrame, memory_order_relaxed);
+	pSnapshot->overruns = (unsigned long)(atomic_load_explicit(&pStats->overruns, memory_order_relaxed) + bufferOverruns);
+	pSnapshot->fdData = (unsigned long)atomic_load_explicit(&pStats->fdData, memory_order_relaxed);
+	pSnapshot->txAck = (unsigned long)atomic_load_explicit(&pStats->txAck, memory_order_relaxed);
+	pSnapshot->errorEvents = (unsigned long)atomic_load_explicit(&pStats->errorEvents, memory_order_relaxed);
+	pSnapshot->dataBytes = atomic_load_explicit(&pStats->dataBytes, memory_order_relaxed);
+
+	if (nominalBitrate != 0u)  {
+		nominalNs = (double)(nominalBits - pStats->requestNominalBits) * 1e9 / (double)nominalBitrate;
+		dataNs = (double)(dataBits - pStats->requestDataBits) * 1e9 / (double)dataBitrate;
+	}
+
+	pSnapshot->busLoad = 0u;
+	pSnapshot->busLoadData = 0u;
+	elapsedNs = (double)(now - pStats->requestNs);
+	if (elapsedNs > 0.0)  {
+		pSnapshot->busLoad = (unsigned long)fmin((nominalNs + dataNs) * CAN4OSX_BUS_LOAD_FULL / elapsedNs, CAN4OSX_BUS_LOAD_FULL);
+		pSnapshot->busLoadData = (unsigned long)fmin(dataNs * CAN4OSX_BUS_LOAD_FULL / elapsedNs, pSnapshot->busLoad);
+	}
+
+	pStats->requestNs = now;
+	pStats->requestNominalBits = nominalBits;
+	pStats->requestDataBits = dataBits;
+
+	pthread_mutex_unlock(&pStats->requestMutex);
+}
+
+
+/******************************************************************************/
+void CAN4OSX_GetBusStatistics(
+		CAN4OSX_BUS_STATS_T *pStats,
+		canBusStatistics *pStatistics
+	)
+{
+	pthread_mutex_lock(&pStats->requestMutex);
+	*pStatistics = pStats->snapshot;
+	pthread_mutex_unlock(&pStats->requestMutex);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_InitTxTrack - no frame of a channel pending
+ *
+ * \return canOK or canERR_NOMEM, the frames of the channel go untracked then
+ */
+canStatus CAN4OSX_InitTxTrack(
+		CAN4OSX_TX_TRACK_T *pTrack
+	)
+{
+	memset(pTrack, 0, sizeof(CAN4OSX_TX_TRACK_T));
+	pthread_mutex_init(&pTrack->writeMutex, NULL);
+	pthread_mutex_init(&pTrack->mutex, NULL);
+	CAN4OSX_CondInit(&pTrack->doneCond);
+
+	pTrack->pFrame = calloc(CAN4OSX_TX_FRAMES, sizeof(CAN4OSX_TX_FRAME_T));
+	if (pTrack->pFrame == NULL)  {
+		return(canERR_NOMEM);
+	}
+
+	return(canOK);
+}
+
+
+/******************************************************************************/
+void CAN4OSX_ReleaseTxTrack(
+		CAN4OSX_TX_TRACK_T *pTrack
+	)
+{
+	pthread_cond_destroy(&pTrack->doneCond);
+	pthread_mutex_destroy(&pTrack->mutex);
+	pthread_mutex_destroy(&pTrack->writeMutex);
+	free(pTrack->pFrame);
+	pTrack->pFrame = NULL;
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_CloseTxTrack - the device is gone
+ *
+ * A waiting canWriteSync gives up.
+ */
+void CAN4OSX_CloseTxTrack(
+		CAN4OSX_TX_TRACK_T *pTrack
+	)
+{
+	pthread_mutex_lock(&pTrack->mutex);
+	pTrack->closed = true;
+	pthread_cond_broadcast(&pTrack->doneCond);
+	pthread_mutex_unlock(&pTrack->mutex);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_FlushTxTrack - the pending frames will not be sent
+ *
+ * Called when the bus goes off, the frames count as lost and a waiting
+ * canWriteSync returns.
+ */
+void CAN4OSX_FlushTxTrack(
+		CAN4OSX_TX_TRACK_T *pTrack
+	)
+{
+	pthread_mutex_lock(&pTrack->mutex);
+	pTrack->lost += pTrack->next - pTrack->oldest;
+	pTrack->oldest = pTrack->next;
+	if (pTrack->waiters != 0u)  {
+		pthread_cond_broadcast(&pTrack->doneCond);
+	}
+	pthread_mutex_unlock(&pTrack->mutex);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_BeginTxFrames - number the frames of a write
+ *
+ * Takes writeMutex until CAN4OSX_EndTxFrames, the backend encodes the frames
+ * with CAN4OSX_TX_FRAME_ID. The frames are pending before the backend gets
+ * them, an ack may be decoded before the write returns.
+ *
+ * \return the number of frames that fit, 0 if all CAN4OSX_TX_FRAMES wait
+ * for their ack
+ */
+UInt32 CAN4OSX_BeginTxFrames(
+		CAN4OSX_TX_TRACK_T *pTrack,
+		const CanMsg *pMsg,
+		UInt32 count
+	)
+{
+UInt64 now = CAN4OSX_GetNanoseconds();
+CAN4OSX_TX_FRAME_T *pFrame;
+UInt32 room;
+UInt32 loopCount;
+
+	pthread_mutex_lock(&pTrack->writeMutex);
+
+	// next only moves under writeMutex, the acks only take the older frames
+	pTrack->writeBase = pTrack->next;
+	if (pTrack->pFrame == NULL)  {
+		return(count);
+	}
+
+	pthread_mutex_lock(&pTrack->mutex);
+	room = CAN4OSX_TX_FRAMES - (pTrack->next - pTrack->oldest);
+	pthread_mutex_unlock(&pTrack->mutex);
+
+	if (count > room)  {
+		count = room;
+	}
+
+	for (loopCount = 0; loopCount < count; loopCount++)  {
+		pFrame = &pTrack->pFrame[(pTrack->writeBase + loopCount) & CAN4OSX_TX_FRAMES_MASK];
+		pFrame->frame = pMsg[loopCount];
+		pFrame->writeNs = now;
+	}
+
+	pthread_mutex_lock(&pTrack->mutex);
+	pTrack->next += count;
+	pthread_mutex_unlock(&pTrack->mutex);
+
+	return(count);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_EndTxFrames - the backend took accepted of count frames
+ *
+ * The rest is dropped again, no ack can come for them.
+ */
+void CAN4OSX_EndTxFrames(
+		CAN4OSX_TX_TRACK_T *pTrack,
+		UInt32 count,
+		UInt32 accepted
+	)
+{
+	if ((pTrack->pFrame != NULL) && (accepted < count))  {
+		pthread_mutex_lock(&pTrack->mutex);
+		pTrack->next -= count - accepted;
+		// flushed by canBusOff meanwhile
+		if ((SInt32)(pTrack->oldest - pTrack->next) > 0)  {
+			pTrack->oldest = pTrack->next;
+		}
+		pthread_mutex_unlock(&pTrack->mutex);
+	}
+
+	pthread_mutex_unlock(&pTrack->writeMutex);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_TxFrameDone - the oldest pending frame is sent
+ *
+ * Counts the latency and, with canIOCTL_SET_TXACK, puts the frame into the
+ * receive buffer flagged canMSG_TXACK. timestamp is the one of a received
+ * frame, CAN4OSX_TX_TIME_UNKNOWN takes the time of the ack. Driver thread,
+ * called with mutex held, the caller notifies once it is released.
+ *
+ * \return true if the frame went to the receive buffer
+ */
+static bool CAN4OSX_TxFrameDone(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+		UInt64 now,
+		UInt64 timestamp
+	)
+{
+CAN4OSX_TX_TRACK_T *pTrack = &pSelf->txTrack;
+CAN4OSX_TX_FRAME_T *pDone = &pTrack->pFrame[pTrack->oldest & CAN4OSX_TX_FRAMES_MASK];
+UInt64 latency = now - pDone->writeNs;
+CAN_EVENT_MSG_BUF_T *pBuffer;
+CanFrame *pFrame;
+UInt8 len;
+
+	pTrack->oldest++;
+	pTrack->acked++;
+	pTrack->latencyLast = latency;
+	pTrack->latencySum += latency;
+	if (latency > pTrack->latencyMax)  {
+		pTrack->latencyMax = latency;
+	}
+#if CAN4OSX_TRACE
+	CAN4OSX_TraceLatency(canLATENCY_TX_ACK, latency);
+	CAN4OSX_TraceEvent(CAN4OSX_TRACE_TX_ACK, pSelf->channelNumber, (UInt32)latency);
+#endif /* CAN4OSX_TRACE */
+
+	pBuffer = CAN4OSX_GetCanEventBuffer(pSelf);
+	if (!pTrack->echo || (pBuffer == NULL))  {
+		return(false);
+	}
+
+	if (timestamp == CAN4OSX_TX_TIME_UNKNOWN)  {
+		timestamp = now;
+		if (!pSelf->rxHostTime && (pSelf->pTimestamp != NULL))  {
+			timestamp = CAN4OSX_GetDeviceTimestamp(pSelf->pTimestamp, now);
+		}
+	}
+
+	len = pDone->frame.canDlc;
+	if (len > CAN4OSX_CAN_MAX_MSG_LEN)  {
+		len = CAN4OSX_CAN_MAX_MSG_LEN;
+	}
+	if (((pDone->frame.canFlags & canFDMSG_FDF) == 0u) && (len > 8u))  {
+		len = 8u;
+	}
+
+	pFrame = CAN4OSX_ReserveCanEventBuffer(pBuffer, len);
+	if (pFrame == NULL)  {
+		return(false);
+	}
+	pFrame->canId = pDone->frame.canId;
+	pFrame->canFlags = pDone->frame.canFlags | canMSG_TXACK;
+	pFrame->canTimestamp = timestamp;
+	memcpy(pFrame->canData, pDone->frame.canData, len);
+	CAN4OSX_CommitCanEventBuffer(pBuffer);
+
+	return(true);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_AckTxFrame - the adapter reports a frame as sent
+ *
+ * id is the transaction id of the ack, idMask its range. The first pending
+ * frame whose number has these low bits is taken, the older ones lost their
+ * ack. A stray ack or the one of a flushed frame is ignored. timestamp is the
+ * time the frame went over the bus as CAN4OSX_RxTimestamp returns it.
+ * Driver thread.
+ */
+void CAN4OSX_AckTxFrame(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+		UInt32 id,
+		UInt32 idMask,
+		UInt64 timestamp
+	)
+{
+CAN4OSX_TX_TRACK_T *pTrack = &pSelf->txTrack;
+UInt64 now = CAN4OSX_GetNanoseconds();
+bool echoed = false;
+UInt32 seq;
+
+	if (pTrack->pFrame == NULL)  {
+		return;
+	}
+
+	pthread_mutex_lock(&pTrack->mutex);
+
+	seq = pTrack->oldest + ((id - pTrack->oldest) & idMask);
+	if ((SInt32)(seq - pTrack->next) < 0)  {
+		pTrack->lost += seq - pTrack->oldest;
+		pTrack->oldest = seq;
+		echoed = CAN4OSX_TxFrameDone(pSelf, now, timestamp);
+		if (pTrack->waiters != 0u)  {
+			pthread_cond_broadcast(&pTrack->doneCond);
+		}
+	}
+
+	pthread_mutex_unlock(&pTrack->mutex);
+
+	// an observer may write from the notification
+	if (echoed)  {
+		CAN4OSX_NotifyRx(pSelf);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_AckTxFramesInOrder - the oldest count frames are sent
+ *
+ * For adapters without TX acks, they are taken with their bulk out transfer.
+ * Driver thread.
+ */
+void CAN4OSX_AckTxFramesInOrder(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+		UInt32 count
+	)
+{
+CAN4OSX_TX_TRACK_T *pTrack = &pSelf->txTrack;
+UInt64 now = CAN4OSX_GetNanoseconds();
+bool echoed = false;
+UInt32 loopCount;
+
+	if (pTrack->pFrame == NULL)  {
+		return;
+	}
+
+	pthread_mutex_lock(&pTrack->mutex);
+
+	if (count > (pTrack->next - pTrack->oldest))  {
+		count = pTrack->next - pTrack->oldest;
+	}
+	for (loopCount = 0; loopCount < count; loopCount++)  {
+		echoed |= CAN4OSX_TxFrameDone(pSelf, now, CAN4OSX_TX_TIME_UNKNOWN);
+	}
+	if ((count != 0u) && (pTrack->waiters != 0u))  {
+		pthread_cond_broadcast(&pTrack->doneCond);
+	}
+
+	pthread_mutex_unlock(&pTrack->mutex);
+
+	if (echoed)  {
+		CAN4OSX_NotifyRx(pSelf);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_WaitTxFrames - wait for the acks of all frames written
+ *
+ * Frames written while waiting are not waited for. Not on the driver thread,
+ * that one decodes the acks.
+ *
+ * \return canOK, canERR_TIMEOUT or canERR_INVHANDLE if the device is gone
+ */
+canStatus CAN4OSX_WaitTxFrames(
+		CAN4OSX_TX_TRACK_T *pTrack,
+		UInt32 timeoutMs
+	)
+{
+struct timespec deadline;
+canStatus status = canOK;
+UInt32 target;
+
+	// a write in progress is waited for as well
+	pthread_mutex_lock(&pTrack->writeMutex);
+	target = pTrack->next;
+	pthread_mutex_unlock(&pTrack->writeMutex);
+
+	if (timeoutMs != canWAIT_INFINITE)  {
+		CAN4OSX_GetDeadline(&deadline, timeoutMs);
+	}
+
+	pthread_mutex_lock(&pTrack->mutex);
+	pTrack->waiters++;
+
+	while ((SInt32)(pTrack->oldest - target) < 0)  {
+		if (pTrack->closed)  {
+			status = canERR_INVHANDLE;
+			break;
+		}
+		if (timeoutMs == canWAIT_INFINITE)  {
+			(void)pthread_cond_wait(&pTrack->doneCond, &pTrack->mutex);
+		} else if (CAN4OSX_CondTimedWait(&pTrack->doneCond, &pTrack->mutex, &deadline) == ETIMEDOUT)  {
+			if ((SInt32)(pTrack->oldest - target) < 0)  {
+				status = canERR_TIMEOUT;
+			}
+			break;
+		}
+	}
+
+	pTrack->waiters--;
+	pthread_mutex_unlock(&pTrack->mutex);
+
+	return(status);
+}
+
+
+#if CAN4OSX_TRACE
+/******************************************************************************/
+/* the rings of all threads and the latency histograms, see CAN4OSX_TRACE_RING_T */
+static _Atomic(CAN4OSX_TRACE_RING_T *) pCan4osxTraceRings = NULL;
+static _Thread_local CAN4OSX_TRACE_RING_T *pCan4osxTraceRing = NULL;
+static atomic_uint can4osxTraceThreads = 0u;
+static pthread_once_t can4osxTraceOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t can4osxTraceKey;
+static CAN4OSX_TRACE_HISTOGRAM_T can4osxTraceLatency[canLATENCY_COUNT];
+
+static const char *can4osxTraceNames[] = {
+	"none", "bulk_in", "decode", "rx_enqueue", "rx_dequeue",
+	"bulk_out_submit", "bulk_out_done", "tx_ack", "command"
+};
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_TraceThreadEnd - the ring goes back to the list
+ */
+static void CAN4OSX_TraceThreadEnd(
+		void *pContext
+	)
+{
+CAN4OSX_TRACE_RING_T *pRing = (CAN4OSX_TRACE_RING_T *)pContext;
+
+	atomic_store_explicit(&pRing->owned, 0u, memory_order_release);
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_TraceInit(
+		void
+	)
+{
+	(void)pthread_key_create(&can4osxTraceKey, CAN4OSX_TraceThreadEnd);
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_TraceAttachThread - the ring of the calling thread
+ *
+ * Takes the ring of an ended thread or adds a new one. Only done once per
+ * thread.
+ *
+ * \return the ring or NULL without memory
+ */
+static CAN4OSX_TRACE_RING_T* CAN4OSX_TraceAttachThread(
+		void
+	)
+{
+CAN4OSX_TRACE_RING_T *pRing;
+UInt32 unowned;
+
+	(void)pthread_once(&can4osxTraceOnce, CAN4OSX_TraceInit);
+
+	for (pRing = atomic_load_explicit(&pCan4osxTraceRings, memory_order_acquire); pRing != NULL; pRing = pRing->pNext)  {
+		unowned = 0u;
+		if (atomic_compare_exchange_strong_explicit(&pRing->owned, &unowned, 1u, memory_order_acquire, memory_order_relaxed))  {
+			break;
+		}
+	}
+
+	if (pRing == NULL)  {
+		pRing = calloc(1, sizeof(CAN4OSX_TRACE_RING_T));
+		if (pRing == NULL)  {
+			return(NULL);
+		}
+		atomic_init(&pRing->owned, 1u);
+		atomic_init(&pRing->head, 0u);
+		pRing->pNext = atomic_load_explicit(&pCan4osxTraceRings, memory_order_relaxed);
+		while (!atomic_compare_exchange_weak_explicit(&pCan4osxTraceRings, &pRing->pNext, pRing, memory_order_release, memory_order_relaxed))  {
+		}
+	}
+
+	pRing->thread = atomic_fetch_add_explicit(&can4osxTraceThreads, 1u, memory_order_relaxed);
+	(void)pthread_setspecific(can4osxTraceKey, pRing);
+	pCan4osxTraceRing = pRing;
+
+	return(pRing);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_TraceEvent - write an event into the ring of the thread
+ *
+ * The oldest event is overwritten, nothing waits and nothing is shared.
+ * hnd -1 is no channel.
+ */
+void CAN4OSX_TraceEvent(
+		UInt16 event,
+		CanHandle hnd,
+		UInt32 value
+	)
+{
+CAN4OSX_TRACE_RING_T *pRing = pCan4osxTraceRing;
+CAN4OSX_TRACE_EVENT_T *pEvent;
+UInt32 head;
+
+	if (pRing == NULL)  {
+		pRing = CAN4OSX_TraceAttachThread();
+		if (pRing == NULL)  {
+			return;
+		}
+	}
+
+	head = atomic_load_explicit(&pRing->head, memory_order_relaxed);
+	pEvent = &pRing->event[head & (CAN4OSX_TRACE_RING_EVENTS - 1u)];
+	pEvent->timeNs = CAN4OSX_GetNanoseconds();
+	pEvent->event = event;
+	pEvent->channel = (UInt16)CAN4OSX_HANDLE_INDEX(hnd);
+	pEvent->value = value;
+	atomic_store_explicit(&pRing->head, head + 1u, memory_order_release);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_TraceBufferChannel - the channel of the receive buffer events
+ */
+void CAN4OSX_TraceBufferChannel(
+		CAN_EVENT_MSG_BUF_T* bufferRef,
+		CanHandle hnd
+	)
+{
+	if (bufferRef != NULL)  {
+		bufferRef->bufferTraceChannel = hnd;
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_TraceBucket - histogram bucket of ns
+ *
+ * Below 16 ns every ns has its bucket, above each power of two is split
+ * into 16 buckets.
+ */
+static inline UInt32 CAN4OSX_TraceBucket(
+		UInt64 ns
+	)
+{
+UInt32 msb;
+
+	if (ns < CAN4OSX_TRACE_SUB_BUCKETS)  {
+		return((UInt32)ns);
+	}
+
+	msb = 63u - (UInt32)__builtin_clzll(ns);
+
+	return(((msb - CAN4OSX_TRACE_SUB_BITS + 1u) * CAN4OSX_TRACE_SUB_BUCKETS)
+			+ (UInt32)(ns >> (msb - CAN4OSX_TRACE_SUB_BITS)) - CAN4OSX_TRACE_SUB_BUCKETS);
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_TraceBucketLow - smallest ns of a bucket
+ */
+static UInt64 CAN4OSX_TraceBucketLow(
+		UInt32 bucket
+	)
+{
+UInt32 exponent = bucket / CAN4OSX_TRACE_SUB_BUCKETS;
+
+	if (exponent == 0u)  {
+		return(bucket);
+	}
+
+	return((UInt64)(CAN4OSX_TRACE_SUB_BUCKETS + (bucket % CAN4OSX_TRACE_SUB_BUCKETS)) << (exponent - 1u));
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_TraceLatency - count a sample in a histogram
+ *
+ * Any thread, relaxed atomics only.
+ */
+void CAN4OSX_TraceLatency(
+		UInt32 latency,
+		UInt64 ns
+	)
+{
+CAN4OSX_TRACE_HISTOGRAM_T *pHist = &can4osxTraceLatency[latency];
+UInt64 seen;
+
+	atomic_fetch_add_explicit(&pHist->bucket[CAN4OSX_TraceBucket(ns)], 1u, memory_order_relaxed);
+	atomic_fetch_add_explicit(&pHist->count, 1u, memory_order_relaxed);
+	atomic_fetch_add_explicit(&pHist->sumNs, ns, memory_order_relaxed);
+
+	seen = atomic_load_explicit(&pHist->maxNs, memory_order_relaxed);
+	while ((ns > seen) && !atomic_compare_exchange_weak_explicit(&pHist->maxNs, &seen, ns, memory_order_relaxed, memory_order_relaxed))  {
+	}
+	seen = atomic_load_explicit(&pHist->minNsInverted, memory_order_relaxed);
+	while ((~ns > seen) && !atomic_compare_exchange_weak_explicit(&pHist->minNsInverted, &seen, ~ns, memory_order_relaxed, memory_order_relaxed))  {
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_TraceRxTransfer - a bulk in transfer is about to be decoded
+ *
+ * The frames reserved until CAN4OSX_TraceRxTransferDone carry the low 32
+ * bit of now, the read takes the canLATENCY_RX sample from it. Driver thread.
+ */
+void CAN4OSX_TraceRxTransfer(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+		UInt64 now,
+		UInt32 bytes
+	)
+{
+	can4osxTraceRxNs = now;
+	CAN4OSX_TraceEvent(CAN4OSX_TRACE_BULK_IN, pSelf->channelNumber, bytes);
+}
+
+
+/******************************************************************************/
+void CAN4OSX_TraceRxTransferDone(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+		UInt64 now
+	)
+{
+	CAN4OSX_TraceEvent(CAN4OSX_TRACE_DECODE, pSelf->channelNumber, (UInt32)(CAN4OSX_GetNanoseconds() - now));
+	can4osxTraceRxNs = 0u;
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_GetLatency - the distribution of a histogram
+ */
+void CAN4OSX_GetLatency(
+		UInt32 latency,
+		CanLatencyStatus *pStatus
+	)
+{
+CAN4OSX_TRACE_HISTOGRAM_T *pHist = &can4osxTraceLatency[latency];
+UInt64 count[CAN4OSX_TRACE_BUCKETS];
+UInt64 *pPercentile[4] = { &pStatus->p50, &pStatus->p90, &pStatus->p99, &pStatus->p999 };
+const UInt64 permille[4] = { 500u, 900u, 990u, 999u };
+UInt64 total = 0u;
+UInt64 sum = 0u;
+UInt64 top;
+UInt32 bucket;
+UInt32 next = 0u;
+
+	memset(pStatus, 0, sizeof(CanLatencyStatus));
+
+	// recorded meanwhile, the buckets are the count
+	for (bucket = 0; bucket < CAN4OSX_TRACE_BUCKETS; bucket++)  {
+		count[bucket] = atomic_load_explicit(&pHist->bucket[bucket], memory_order_relaxed);
+		total += count[bucket];
+	}
+	if (total == 0u)  {
+		return;
+	}
+
+	pStatus->count = total;
+	pStatus->max = atomic_load_explicit(&pHist->maxNs, memory_order_relaxed);
+	pStatus->min = ~atomic_load_explicit(&pHist->minNsInverted, memory_order_relaxed);
+	pStatus->mean = atomic_load_explicit(&pHist->sumNs, memory_order_relaxed)
+			/ atomic_load_explicit(&pHist->count, memory_order_relaxed);
+
+	for (bucket = 0; (bucket < CAN4OSX_TRACE_BUCKETS) && (next < 4u); bucket++)  {
+		sum += count[bucket];
+		top = (bucket + 1u < CAN4OSX_TRACE_BUCKETS) ? (CAN4OSX_TraceBucketLow(bucket + 1u) - 1u) : UINT64_MAX;
+		if (top > pStatus->max)  {
+			top = pStatus->max;
+		}
+		while ((next < 4u) && ((sum * 1000u) >= (total * permille[next])))  {
+			*pPercentile[next++] = top;
+		}
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_ResetLatency - empty all histograms
+ */
+void CAN4OSX_ResetLatency(
+		void
+	)
+{
+CAN4OSX_TRACE_HISTOGRAM_T *pHist;
+UInt32 latency;
+UInt32 bucket;
+
+	for (latency = 0; latency < canLATENCY_COUNT; latency++)  {
+		pHist = &can4osxTraceLatency[latency];
+		for (bucket = 0; bucket < CAN4OSX_TRACE_BUCKETS; bucket++)  {
+			atomic_store_explicit(&pHist->bucket[bucket], 0u, memory_order_relaxed);
+		}
+		atomic_store_explicit(&pHist->count, 0u, memory_order_relaxed);
+		atomic_store_explicit(&pHist->sumNs, 0u, memory_order_relaxed);
+		atomic_store_explicit(&pHist->maxNs, 0u, memory_order_relaxed);
+		atomic_store_explicit(&pHist->minNsInverted, 0u, memory_order_relaxed);
+	}
+}
+
+
+/******************************************************************************/
+/* an event of the dump with the thread that wrote it */
+typedef struct {
+	CAN4OSX_TRACE_EVENT_T event;
+	UInt32 thread;
+} CAN4OSX_TRACE_DUMP_T;
+
+static int CAN4OSX_TraceCompare(
+		const void *a,
+		const void *b
+	)
+{
+UInt64 timeA = ((const CAN4OSX_TRACE_DUMP_T *)a)->event.timeNs;
+UInt64 timeB = ((const CAN4OSX_TRACE_DUMP_T *)b)->event.timeNs;
+
+	return((timeA > timeB) - (timeA < timeB));
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_DumpTrace - histograms and events as text
+ *
+ * The events of all rings are sorted by time. A ring is copied while its
+ * thread goes on, the events it overwrote during the copy are left out.
+ *
+ * \return canStatus
+ */
+canStatus CAN4OSX_DumpTrace(
+		const char *pPath
+	)
+{
+static const char *pLatencyNames[canLATENCY_COUNT] = { "rx", "tx_ack", "command" };
+CAN4OSX_TRACE_HISTOGRAM_T *pHist;
+CAN4OSX_TRACE_RING_T *pRing;
+CAN4OSX_TRACE_DUMP_T *pDump;
+CanLatencyStatus status;
+FILE *pFile;
+UInt64 count;
+UInt32 rings = 0u;
+UInt32 events = 0u;
+UInt32 copied;
+UInt32 first;
+UInt32 head;
+UInt32 index;
+UInt32 latency;
+UInt32 bucket;
+
+	for (pRing = atomic_load_explicit(&pCan4osxTraceRings, memory_order_acquire); pRing != NULL; pRing = pRing->pNext)  {
+		rings++;
+	}
+
+	pDump = malloc(((size_t)rings * CAN4OSX_TRACE_RING_EVENTS + 1u) * sizeof(CAN4OSX_TRACE_DUMP_T));
+	if (pDump == NULL)  {
+		return(canERR_NOMEM);
+	}
+
+	pFile = fopen(pPath, "w");
+	if (pFile == NULL)  {
+		free(pDump);
+		return(canERR_PARAM);
+	}
+
+	for (latency = 0; latency < canLATENCY_COUNT; latency++)  {
+		pHist = &can4osxTraceLatency[latency];
+		CAN4OSX_GetLatency(latency, &status);
+		fprintf(pFile, "# latency %s count %llu min %llu mean %llu p50 %llu p90 %llu p99 %llu p999 %llu max %llu ns\n",
+				pLatencyNames[latency], (unsigned long long)status.count, (unsigned long long)status.min,
+				(unsigned long long)status.mean, (unsigned long long)status.p50, (unsigned long long)status.p90,
+				(unsigned long long)status.p99, (unsigned long long)status.p999, (unsigned long long)status.max);
+		for (bucket = 0; bucket < CAN4OSX_TRACE_BUCKETS; bucket++)  {
+			count = atomic_load_explicit(&pHist->bucket[bucket], memory_order_relaxed);
+			if (count != 0u)  {
+				fprintf(pFile, "# bucket %s %llu %llu\n", pLatencyNames[latency],
+						(unsigned long long)CAN4OSX_TraceBucketLow(bucket), (unsigned long long)count);
+			}
+		}
+	}
+
+	// not more rings than counted, one added meanwhile has hardly anything
+	pRing = atomic_load_explicit(&pCan4osxTraceRings, memory_order_acquire);
+	for (; (pRing != NULL) && (rings != 0u); pRing = pRing->pNext, rings--)  {
+		head = atomic_load_explicit(&pRing->head, memory_order_acquire);
+		first = (head > CAN4OSX_TRACE_RING_EVENTS) ? (head - CAN4OSX_TRACE_RING_EVENTS) : 0u;
+		copied = events;
+		for (index = first; index != head; index++)  {
+			pDump[events].event = pRing->event[index & (CAN4OSX_TRACE_RING_EVENTS - 1u)];
+			pDump[events].thread = pRing->thread;
+			events++;
+		}
+
+		// drop the events the thread wrote over while they were copied
+		index = atomic_load_explicit(&pRing->head, memory_order_acquire);
+		if ((index != head) && ((index - first) >= CAN4OSX_TRACE_RING_EVENTS))  {
+			index = index - first - CAN4OSX_TRACE_RING_EVENTS + 1u;
+			if (index > (events - copied))  {
+				index = events - copied;
+			}
+			memmove(&pDump[copied], &pDump[copied + index], (events - copied - index) * sizeof(CAN4OSX_TRACE_DUMP_T));
+			events -= index;
+		}
+	}
+
+	qsort(pDump, events, sizeof(CAN4OSX_TRACE_DUMP_T), CAN4OSX_TraceCompare);
+
+	fprintf(pFile, "# time_ns thread event channel value\n");
+	for (index = 0; index < events; index++)  {
+		fprintf(pFile, "%llu %u %s %u %u\n", (unsigned long long)pDump[index].event.timeNs, pDump[index].thread,
+				(pDump[index].event.event < (sizeof(can4osxTraceNames) / sizeof(can4osxTraceNames[0])))
+					? can4osxTraceNames[pDump[index].event.event] : "unknown",
+				pDump[index].event.channel, pDump[index].event.value);
+	}
+
+	fclose(pFile);
+	free(pDump);
+
+	return(canOK);
+}
+#endif /* CAN4OSX_TRACE */
@@ -46,20 +46,42 @@
 #define CAN4OSX_INTERN_H 1
 
 #include <stdio.h>
-
-#include <CoreFoundation/CoreFoundation.h>
-#include <IOKit/IOKitLib.h>
-#include <IOKit/IOMessage.h>
-#include <IOKit/IOCFPlugIn.h>
-#include <IOKit/usb/IOUSBLib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "can4osx.h"
+#include "can4osx_platform.h"
+#include "can4osx_debug.h"
 
 
 /* internal buffers */
-#define CAN4OSX_CAN_MAX_MSG_LEN 64
+#define CAN4OSX_CACHE_LINE_SIZE 64
+
+/* bulk in transfers queued per pipe, default and upper limit of the depth */
+#define CAN4OSX_USB_BULK_IN_DEPTH 4
+#define CAN4OSX_USB_BULK_IN_MAX_DEPTH 16
+
+/* bulk out transfers in flight per channel, default and upper limit */
+#define CAN4OSX_USB_BULK_OUT_DEPTH 2
+#define CAN4OSX_USB_BULK_OUT_MAX_DEPTH 8
+
+/* frames encoded on the stack per step of canWriteBatch */
+#define CAN4OSX_TX_BATCH_CHUNK 32
 
-#define CAN4OSX_USB_INTERFACE IOUSBInterfaceInterface182
+/* bmRequestType parts of a control request */
+#define CAN4OSX_USB_DIR_OUT          0x00u
+#define CAN4OSX_USB_DIR_IN           0x80u
+#define CAN4OSX_USB_TYPE_VENDOR      0x40u
+#define CAN4OSX_USB_RECIP_DEVICE     0x00u
+#define CAN4OSX_USB_RECIP_OTHER      0x03u
+
+/* the transport used by canInitializeLibrary */
+#if defined(__APPLE__) && !defined(CAN4OSX_USE_LIBUSB)
+# define CAN4OSX_DEFAULT_TRANSPORT   can4osxIoKitTransport
+#else
+# define CAN4OSX_DEFAULT_TRANSPORT   can4osxLibUsbTransport
+#endif
 
 /* Structure for CAN_CHIP_STATE */
 #define CHIPSTAT_BUSOFF              0x01
@@ -80,18 +102,9 @@ typedef struct {
 typedef struct{
     UInt32 vendorId;
     UInt32 productId;
+    UInt32 bulkInDepth;
 }CAN4OSX_DEV_ENTRY_T;
 
-typedef struct {
-    UInt32 canTimestamp;
-    UInt32 canId;
-    UInt32  canFlags;
-    UInt8  canDlc;
-    UInt8  canChannel;
-    UInt8  padding;
-    UInt8  canData[CAN4OSX_CAN_MAX_MSG_LEN];
-} __attribute__ ((packed)) CanMsg;
-
 typedef struct {
     UInt8 chipBusStatus;
     UInt8 chipTxErrorCounter;
@@ -103,15 +116,343 @@ typedef union {
     ChipState chipState;
 } EventTagData;
 
-/* holds the actual buffer */
+/* the cells at the end of the ring a frame did not fit in */
+#define CAN4OSX_FRAME_PAD			0x80000000u
+#define CAN4OSX_FRAME_MAX_CELLS		CAN_FRAME_CELLS(CAN4OSX_CAN_MAX_MSG_LEN)
+
+/* receive buffer of a channel, see canIOCTL_SET_RX_QUEUE_SIZE */
+#define CAN4OSX_RX_BUFFER_BYTES		(128u * 1024u)
+#define CAN4OSX_RX_BLOCK_MS			10u
+
+/* wakes up one consumer reading several buffers, see
+ * CAN4OSX_WaitCanEventBufferSet */
 typedef struct {
-	int bufferSize;
-	int bufferFirst;
-	int bufferCount;
-    dispatch_queue_t bufferGDCqueueRef;
-	CanMsg *canMsgRef;
+	pthread_mutex_t waitMutex;
+	pthread_cond_t waitCond;
+	UInt32 waitSequence;		// counts the commits seen while waiting
+} CAN4OSX_WAIT_SET_T;
+
+/* holds the actual buffer
+ * Single producer (the USB completion) / single consumer (canRead) ring.
+ * Head and tail are free running and live on their own cache lines, each side
+ * keeps a cached copy of the other index to avoid touching the foreign line.
+ * The ring is made of CAN_FRAME_CELL_SIZE cells, a CanFrame takes as many as
+ * its payload needs and head and tail count cells.
+ * With canRX_OVERFLOW_DROP_OLDEST the producer moves the tail as well, the
+ * consumer then holds bufferPolicyMutex while it works on the tail and the
+ * producer only evicts if it gets the mutex without waiting. Frames lent by
+ * CAN4OSX_AcquireCanEventBuffer are not evicted, see bufferPinned.
+ */
+typedef struct CAN_EVENT_MSG_BUF_S {
+	/* producer side */
+	_Alignas(CAN4OSX_CACHE_LINE_SIZE) atomic_uint bufferHead;
+	UInt32 bufferTailCache;
+	UInt32 bufferReserved;
+	atomic_uint bufferOverruns;
+	/* consumer side */
+	_Alignas(CAN4OSX_CACHE_LINE_SIZE) atomic_uint bufferTail;
+	UInt32 bufferHeadCache;
+	UInt32 bufferAcquired;
+	atomic_uint bufferPinned;		// frames acquired from the tail, the producer does not evict them
+	/* constant after creation */
+	_Alignas(CAN4OSX_CACHE_LINE_SIZE) UInt32 bufferSize;
+	UInt32 bufferMask;
+	UInt8 *cellRef;
+	/* overflow policy, only changed while the bus is off */
+	UInt32 bufferPolicy;
+	UInt32 bufferBlockMs;
+	pthread_mutex_t bufferPolicyMutex;
+	/* blocking readers, the producer only signals if bufferWaiters != 0 */
+	atomic_uint bufferWaiters;
+	pthread_mutex_t bufferWaitMutex;
+	pthread_cond_t bufferWaitCond;
+	CAN4OSX_WAIT_SET_T *bufferWaitSet;	// woken as well, changed under bufferWaitMutex
+	/* blocking producer, canRX_OVERFLOW_BLOCK */
+	atomic_uint bufferSpaceWaiters;
+	pthread_cond_t bufferSpaceCond;
+	/* the device is gone, nobody waits any more */
+	atomic_uint bufferClosed;
+	/* the buffer this one replaced, kept until the channel is released */
+	struct CAN_EVENT_MSG_BUF_S *bufferOutgrown;
+#if CAN4OSX_TRACE
+	CanHandle bufferTraceChannel;
+#endif /* CAN4OSX_TRACE */
 } CAN_EVENT_MSG_BUF_T;
 
+/* clock reconstruction of a device, see CAN4OSX_RxTimestamp
+ * The wrapping counter of the device is extended to 64 bit ticks and scaled
+ * to ns with a 32.32 fixed point factor. The host alignment is a least
+ * squares fit of the host - device offset over the last samples, one per
+ * window. It is the clock read of canSetTimeSync with the shortest round trip
+ * if the device has one, otherwise the frame with the smallest offset.
+ * Everything but the
+ * align part is only touched on the driver thread, the align part is written
+ * there under alignMutex and read by the API with it.
+ */
+#define CAN4OSX_TIMESTAMP_WINDOW_NS	1000000000u
+#define CAN4OSX_TIMESTAMP_SAMPLES	16u
+/* clock reads taking longer are not used */
+#define CAN4OSX_TIMESYNC_MAX_RTT_NS	5000000u
+
+typedef struct {
+	/* counter of the device, see CAN4OSX_SetTimestampClock */
+	UInt32 clockHz;
+	UInt64 counterMask;
+	UInt64 tickNs;				// ns per tick, 32.32
+	UInt64 halfPeriodNs;		// half a counter period, longer gaps are bridged with the host clock
+	/* wrap extension */
+	bool started;
+	UInt64 lastRaw;
+	UInt64 lastHostNs;
+	UInt64 ticks;
+	/* host time of the bulk in transfer being decoded */
+	UInt64 transferHostNs;
+	/* offset window */
+	UInt64 windowEnd;
+	UInt64 windowDevice;
+	SInt64 windowOffset;
+	UInt32 windowRoundTrip;		// of the clock read in the window
+	/* samples of the fit, the frames stop feeding it with the first clock read */
+	bool fitClockRead;
+	UInt32 fitCount;
+	UInt32 fitNext;
+	UInt64 fitDevice[CAN4OSX_TIMESTAMP_SAMPLES];
+	SInt64 fitOffset[CAN4OSX_TIMESTAMP_SAMPLES];
+	/* host alignment */
+	pthread_mutex_t alignMutex;
+	UInt64 alignDevice;
+	SInt64 alignOffset;
+	SInt64 alignDrift;			// host ns per device ns - 1, 32.32
+	UInt32 alignSamples;
+	UInt32 alignResidualRms;
+	UInt32 alignResidualMax;
+	UInt64 alignLastSample;
+	/* clock read in flight, host time it was sent */
+	UInt64 syncRequestNs;
+	UInt32 syncRoundTrip;
+} CAN4OSX_TIMESTAMP_T;
+
+/* receive notification state of a channel, see CAN4OSX_NotifyRx */
+typedef struct {
+	unsigned int notifyFlags;
+	UInt32 watermark;
+	UInt32 windowMs;
+	/* only touched on the USB event thread */
+	UInt32 pending;
+	CFAbsoluteTime firstPending;
+	CFRunLoopTimerRef windowTimer;
+	/* statistics */
+	atomic_uint posted;
+	atomic_uint suppressed;
+} CAN4OSX_NOTIFY_T;
+
+/* acceptance filter of a channel, see canSetAcceptanceFilter
+ * A frame passes if its id matches code and mask of its id type and, as soon
+ * as there are ranges or ids of that type, one of them as well. Error frames
+ * always pass. It is only changed while the bus is off, the decoder reads it
+ * without a lock. Frames still in flight are decoded after the bus off, so a
+ * replaced id table is retired and only freed when the channel is released */
+#define CAN4OSX_FILTER_MAX_RANGES	16u
+#define CAN4OSX_FILTER_EXT_KEY		0x80000000u	// key of a 29 bit id in the range and id lists
+#define CAN4OSX_FILTER_EMPTY_KEY	0xFFFFFFFFu
+#define CAN4OSX_FILTER_MIN_SLOTS	16u
+#define CAN4OSX_FILTER_STD_IDS		0x000007FFu
+#define CAN4OSX_FILTER_EXT_IDS		0x1FFFFFFFu
+
+typedef struct {
+	UInt32 first;
+	UInt32 last;
+} CAN4OSX_FILTER_RANGE_T;
+
+/* exact ids, open addressing with linear probing */
+typedef struct CAN4OSX_FILTER_IDS_S {
+	struct CAN4OSX_FILTER_IDS_S *pRetired;	// next retired table
+	UInt32 slotMask;
+	UInt32 shift;
+	UInt32 slot[];
+} CAN4OSX_FILTER_IDS_T;
+
+typedef struct {
+	bool active;				// false accepts every frame
+	/* [0] 11 bit, [1] 29 bit ids */
+	UInt32 code[2];
+	UInt32 mask[2];
+	UInt32 listCount[2];		// ranges and ids of the type
+	CAN4OSX_FILTER_RANGE_T range[CAN4OSX_FILTER_MAX_RANGES];
+	UInt32 rangeCount;
+	CAN4OSX_FILTER_IDS_T * _Atomic pIds;
+	CAN4OSX_FILTER_IDS_T *pRetired;	// replaced tables the decoder may still look at
+	UInt32 idCount;
+	/* frames dropped by the filter */
+	atomic_uint rejected;
+} CAN4OSX_FILTER_T;
+
+/* bus statistics of a channel, see canRequestBusStatistics
+ * The decoder counts every frame it sees on the bus ahead of the acceptance
+ * filter, with its length in bits split into the part at the nominal and the
+ * part at the data bit rate. Only the driver thread counts, so a relaxed load
+ * and store does instead of a locked add and the API reads without a lock.
+ * The snapshot of canRequestBusStatistics is taken under requestMutex */
+#define CAN4OSX_BUS_STD_BITS			34u		// SOF to CRC of a classic frame without data
+#define CAN4OSX_BUS_EXT_BITS			54u
+#define CAN4OSX_BUS_FD_STD_BITS			17u		// SOF to BRS of a CAN FD frame
+#define CAN4OSX_BUS_FD_EXT_BITS			36u
+#define CAN4OSX_BUS_FD_DATA_BITS		5u		// ESI and DLC
+#define CAN4OSX_BUS_FD_CRC17_BITS		27u		// stuff count, CRC and their fixed stuff bits
+#define CAN4OSX_BUS_FD_CRC21_BITS		32u
+#define CAN4OSX_BUS_TAIL_BITS			13u		// CRC delimiter, ACK, EOF and intermission
+#define CAN4OSX_BUS_ERROR_FRAME_BITS	17u		// error flag, delimiter and intermission
+/* stuff bits of a stuffed field, half the worst case of (bits - 1) / 4 */
+#define CAN4OSX_BUS_STUFF_BITS(bits)	(((bits) - 1u) / 8u)
+#define CAN4OSX_BUS_LOAD_FULL			10000u	// 100 % in 0.01 %
+
+typedef struct {
+	/* decoder side */
+	atomic_ullong stdData;
+	atomic_ullong stdRemote;
+	atomic_ullong extData;
+	atomic_ullong extRemote;
+	atomic_ullong fdData;			// of the data frames the CAN FD ones
+	atomic_ullong errFrame;
+	atomic_ullong overruns;			// reported by the device
+	atomic_ullong errorEvents;		// reported by the device
+	atomic_ullong txAck;
+	atomic_ullong dataBytes;
+	atomic_ullong nominalBits;
+	atomic_ullong dataBits;			// data phase of the CAN FD frames with BRS
+	/* bit/s of the bus params, 0 as long as unknown */
+	atomic_uint nominalBitrate;
+	atomic_uint dataBitrate;
+	/* canRequestBusStatistics */
+	pthread_mutex_t requestMutex;
+	UInt64 requestNs;
+	UInt64 requestNominalBits;
+	UInt64 requestDataBits;
+	canBusStatistics snapshot;
+} CAN4OSX_BUS_STATS_T;
+
+/* frames of a channel waiting for their TX ack, see CAN4OSX_BeginTxFrames
+ * Every written frame gets the next number of a free running sequence, the
+ * backend sends the low bits of it as transaction id and hands the id of an
+ * ack to CAN4OSX_AckTxFrame. The adapters send in order, so an ack also ends
+ * the older frames still pending, their ack got lost. An id is unambiguous as
+ * long as less acks than its range in a row get lost. writeMutex keeps the
+ * frames of concurrent writes apart, mutex guards the rest */
+#define CAN4OSX_TX_FRAMES				1024u	// power of two
+#define CAN4OSX_TX_FRAMES_MASK			(CAN4OSX_TX_FRAMES - 1u)
+#define CAN4OSX_TX_TIME_UNKNOWN			UINT64_MAX
+
+typedef struct {
+	CanMsg frame;
+	UInt64 writeNs;
+} CAN4OSX_TX_FRAME_T;
+
+typedef struct {
+	pthread_mutex_t writeMutex;
+	pthread_mutex_t mutex;
+	pthread_cond_t doneCond;
+	UInt32 next;				// number of the next frame written
+	UInt32 oldest;				// oldest frame without ack, == next if none
+	UInt32 writeBase;			// first frame of the write in progress
+	bool closed;
+	bool echo;					// sent frames go to the receive buffer, see canIOCTL_SET_TXACK
+	bool byTransfer;			// no acks, a frame is done with its bulk out transfer
+	UInt32 waiters;				// in CAN4OSX_WaitTxFrames
+	UInt64 acked;
+	UInt64 lost;
+	UInt64 latencyLast;			// canWrite to the ack in ns
+	UInt64 latencyMax;
+	UInt64 latencySum;
+	CAN4OSX_TX_FRAME_T *pFrame;	// CAN4OSX_TX_FRAMES
+} CAN4OSX_TX_TRACK_T;
+
+/* transaction id of the offset-th frame of the write in progress */
+#define CAN4OSX_TX_FRAME_ID(pTrack, offset)	((pTrack)->writeBase + (UInt32)(offset))
+
+/* hot path tracing, built in with CAN4OSX_TRACE
+ * Each thread writes its events into a ring of its own, a thread only
+ * touches shared data with its first event, when it takes a ring from the
+ * list. The ring of an ended thread goes to the next new one. The latencies
+ * go into log linear histograms, 16 sub buckets per power of two cover the
+ * whole 64 bit range with an error of at most 1/16. */
+#define CAN4OSX_TRACE_RING_EVENTS		4096u
+#define CAN4OSX_TRACE_SUB_BITS			4u
+#define CAN4OSX_TRACE_SUB_BUCKETS		(1u << CAN4OSX_TRACE_SUB_BITS)
+#define CAN4OSX_TRACE_BUCKETS			((64u - CAN4OSX_TRACE_SUB_BITS + 1u) * CAN4OSX_TRACE_SUB_BUCKETS)
+
+/* the events, value is given in brackets */
+#define CAN4OSX_TRACE_BULK_IN			1u	// bulk in transfer completed (bytes)
+#define CAN4OSX_TRACE_DECODE			2u	// transfer decoded (ns it took)
+#define CAN4OSX_TRACE_RX_ENQUEUE		3u	// frame committed to the receive buffer (cells in use)
+#define CAN4OSX_TRACE_RX_DEQUEUE		4u	// frames read from the receive buffer (frames)
+#define CAN4OSX_TRACE_BULK_OUT_SUBMIT	5u	// bulk out transfer queued (frames)
+#define CAN4OSX_TRACE_BULK_OUT_DONE		6u	// bulk out transfer completed (ns since the submit)
+#define CAN4OSX_TRACE_TX_ACK			7u	// TX ack of the adapter (ns since canWrite, 0 if unknown)
+#define CAN4OSX_TRACE_COMMAND			8u	// response to a command (transaction key)
+
+typedef struct {
+	UInt64 timeNs;
+	UInt16 event;
+	UInt16 channel;			// index of the handle, 0xffff for none
+	UInt32 value;
+} CAN4OSX_TRACE_EVENT_T;
+
+typedef struct CAN4OSX_TRACE_RING_S {
+	struct CAN4OSX_TRACE_RING_S *pNext;		// list of all rings, never shrinks
+	atomic_uint owned;
+	UInt32 thread;			// numbers the threads in the order of their first event
+	atomic_uint head;		// free running, written by the owner only
+	CAN4OSX_TRACE_EVENT_T event[CAN4OSX_TRACE_RING_EVENTS];
+} CAN4OSX_TRACE_RING_T;
+
+typedef struct {
+	atomic_ullong count;
+	atomic_ullong sumNs;
+	atomic_ullong maxNs;
+	atomic_ullong minNsInverted;	// ~min, so 0 works as start value
+	atomic_ullong bucket[CAN4OSX_TRACE_BUCKETS];
+} CAN4OSX_TRACE_HISTOGRAM_T;
+
+/* requests of a device waiting for their response, see CAN4OSX_BeginTransaction
+ * A request is registered under the key its response carries, e.g. command
+ * and transaction id of a Kvaser command, and the decoder hands every
+ * response to CAN4OSX_CompleteTransaction. Any number of requests may be in
+ * flight, each one completes on its own: a callback is called on the driver
+ * thread, a request without one is picked up by CAN4OSX_WaitTransaction. */
+#define CAN4OSX_TRANSACTION_MAX			16u
+#define CAN4OSX_TRANSACTION_RESPONSE_MAX	64u
+
+#define CAN4OSX_TRANSACTION_FREE		0u
+#define CAN4OSX_TRANSACTION_PENDING		1u
+#define CAN4OSX_TRANSACTION_DONE		2u
+
+/* status canOK with the response, otherwise pResponse is NULL */
+typedef void (*CAN4OSX_TRANSACTION_CALLBACK_T)(void *refCon, canStatus status, const void *pResponse, UInt32 size);
+
+typedef struct {
+	UInt32 state;
+	UInt32 key;
+	CAN4OSX_TRANSACTION_CALLBACK_T callback;
+	void *refCon;
+	/* result for CAN4OSX_WaitTransaction */
+	canStatus status;
+	UInt32 size;
+	UInt8 response[CAN4OSX_TRANSACTION_RESPONSE_MAX];
+#if CAN4OSX_TRACE
+	UInt64 beginNs;
+#endif /* CAN4OSX_TRACE */
+} CAN4OSX_TRANSACTION_T;
+
+typedef struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t doneCond;
+	pthread_mutex_t writeMutex;	// one synchronous command write at a time, see CAN4OSX_usbSendCommand
+	bool closed;				// the device is gone, no new requests
+	UInt32 nextId;
+	UInt32 pending;
+	CAN4OSX_TRANSACTION_T slot[CAN4OSX_TRANSACTION_MAX];
+} CAN4OSX_TRANSACTIONS_T;
+
 typedef struct {
     canStatus (*can4osxhwInitRef) (const CanHandle hnd, UInt16 productId);
     CanHandle (*can4osxhwCanOpenChannel)(int channel, int flags);
@@ -120,14 +461,95 @@ typedef struct {
     canStatus (*can4osxhwCanSetBusParamsRef) (const CanHandle hnd, SInt32 freq, UInt32 tseg1, UInt32 tseg2, UInt32 sjw, UInt32 noSamp, UInt32 syncmode);
     canStatus (*can4osxhwCanSetBusParamsFdRef) (const CanHandle hnd, SInt32 freq, UInt32 tseg1, UInt32 tseg2, UInt32 sjw);
     canStatus (*can4osxhwCanWriteRef) (const CanHandle hnd,UInt32 id, void *msg, UInt16 dlc, UInt32 flag);
+    canStatus (*can4osxhwCanWriteBatchRef) (const CanHandle hnd, const CanMsg *pMsg, size_t n, size_t *accepted);
     canStatus (*can4osxhwCanReadRef) (const CanHandle hnd, UInt32 *id, void *msg, UInt16 *dlc, UInt32 *flag, UInt32 *time);
+    canStatus (*can4osxhwCanReadBatchRef) (const CanHandle hnd, CanMsg *pMsg, size_t max, size_t *got);
     canStatus (*can4osxhwCanCloseRef) (const CanHandle hnd);
+    // asks the device for its clock, the answer goes to CAN4OSX_TimestampClockResponse
+    canStatus (*can4osxhwReadClockRef) (const CanHandle hnd);
+    // hands the acceptance filter to the device as far as it can filter, the driver filters anyway
+    canStatus (*can4osxhwCanSetFilterRef) (const CanHandle hnd);
 }CAN4OSX_HW_FUNC_T;
 
+/* completion of an asynchronous transfer, arg0 carries the number of bytes */
+typedef void (*CAN4OSX_USB_COMPLETION_T)(void *refCon, IOReturn result, void *arg0);
+
+typedef struct Can4osxUsbDeviceHandleEntry_s Can4osxUsbDeviceHandleEntry;
+
 typedef struct {
    void (*bulkReadCompletion)(void *refCon, IOReturn result, void *arg0);
+   /* fills one bulk out transfer from the transmit buffer, returns the number
+    * of bytes to send and the number of frames in them */
+   UInt32 (*bulkWriteFill)(Can4osxUsbDeviceHandleEntry *pSelf, UInt8 *pBuf, UInt32 size, UInt32 *pFrames);
+   /* frames waiting in the transmit buffer */
+   UInt32 (*bulkWriteQueued)(Can4osxUsbDeviceHandleEntry *pSelf);
 } CAN4OSX_USB_FUNC_T;
 
+/* one queued bulk in transfer with its own buffer */
+typedef struct {
+    Can4osxUsbDeviceHandleEntry *pSelf;
+    char *pBuf;
+} CAN4OSX_USB_BULK_IN_T;
+
+/* one bulk out transfer with its own buffer */
+typedef struct {
+    Can4osxUsbDeviceHandleEntry *pSelf;
+    UInt8 *pBuf;
+    UInt32 frames;
+    UInt64 submitted;
+} CAN4OSX_USB_BULK_OUT_T;
+
+/* transmit counters of a channel, protected by bulkOutMutex */
+typedef struct {
+    UInt32 inFlightMax;
+    UInt64 transfers;
+    UInt64 frames;
+    UInt64 latencyLast;
+    UInt64 latencyMax;
+    UInt64 latencySum;
+} CAN4OSX_USB_TX_STATISTICS_T;
+
+/* request on the default control pipe */
+typedef struct {
+    UInt8  bmRequestType;
+    UInt8  bRequest;
+    UInt16 wValue;
+    UInt16 wIndex;
+    UInt16 wLength;
+    void   *pData;
+    UInt32 wLenDone;
+} CAN4OSX_USB_CONTROL_T;
+
+/* what a transport found out about a new adapter */
+typedef struct {
+    UInt16 vendorId;
+    UInt16 productId;
+    // pipe references, counted from 1 in the order of the interface endpoints
+    int endpointNumberBulkIn;
+    int endpointMaxSizeBulkIn;
+    int endpointNumberBulkOut;
+    int endpointMaxSizeBulkOut;
+    void *usbTransportRef;
+} CAN4OSX_USB_DEVICE_DESC_T;
+
+/* USB access of the driver, one implementation per host stack
+ * start and run are called on the driver thread, all completions have to
+ * be called on that thread as well. A new adapter is set up on a worker of
+ * CAN4OSX_DeviceSetup, which uses the synchronous functions and submits the
+ * first asynchronous transfers */
+typedef struct {
+    const char *name;
+    IOReturn (*start)(void);
+    void (*run)(void);
+    void (*stop)(void);
+    IOReturn (*readPipeAsync)(Can4osxUsbDeviceHandleEntry *pSelf, UInt8 pipeRef, void *pBuf, UInt32 size, CAN4OSX_USB_COMPLETION_T callback, void *refCon);
+    IOReturn (*writePipeAsync)(Can4osxUsbDeviceHandleEntry *pSelf, UInt8 pipeRef, void *pBuf, UInt32 size, CAN4OSX_USB_COMPLETION_T callback, void *refCon);
+    IOReturn (*readPipe)(Can4osxUsbDeviceHandleEntry *pSelf, UInt8 pipeRef, void *pBuf, UInt32 *pSize, UInt32 timeoutMs);
+    IOReturn (*writePipe)(Can4osxUsbDeviceHandleEntry *pSelf, UInt8 pipeRef, void *pBuf, UInt32 size, UInt32 timeoutMs);
+    IOReturn (*controlRequest)(Can4osxUsbDeviceHandleEntry *pSelf, CAN4OSX_USB_CONTROL_T *pRequest);
+    void (*close)(Can4osxUsbDeviceHandleEntry *pSelf);
+} CAN4OSX_USB_TRANSPORT_T;
+
 
 typedef struct {
     UInt8 rxErrorCounter;
@@ -142,14 +564,32 @@ typedef struct {
 } CAN4OSX_DEV_INFO_T;
 
 
-typedef struct {
-	IOUSBDeviceInterface182 **can4osxDeviceInterface;
-    CAN4OSX_USB_INTERFACE **can4osxInterfaceInterface;
-    io_object_t				can4osxNotification;
+struct Can4osxUsbDeviceHandleEntry_s {
+    const CAN4OSX_USB_TRANSPORT_T *usbTransport;
+    void *usbTransportRef; // device data of the transport, shared by all channels
     
-    CAN_EVENT_MSG_BUF_T* canEventMsgBuff;
+    CAN_EVENT_MSG_BUF_T * _Atomic canEventMsgBuff; // see CAN4OSX_GetCanEventBuffer
+    // receive queue setup of canIoCtl
+    UInt32 rxQueueBytes;
+    UInt32 rxOverflowPolicy;
+    UInt32 rxBlockMs;
+    // set before the bus is started and cleared after it stopped
+    atomic_bool busOn;
+    // receive timestamps aligned to the host clock, see canIOCTL_SET_TIMESTAMP_HOST
+    bool rxHostTime;
+    // the receive buffer is read by a CanMergeReader, claimed in canMergeOpen
+    atomic_bool rxMerged;
+    // applied by the decoder before a frame is queued, see canSetAcceptanceFilter
+    CAN4OSX_FILTER_T rxFilter;
+    // counted by the decoder as well, see canRequestBusStatistics
+    CAN4OSX_BUS_STATS_T busStats;
+    // clock of the device, shared by its channels
+    CAN4OSX_TIMESTAMP_T *pTimestamp;
+    // requests waiting for the device, shared by its channels
+    CAN4OSX_TRANSACTIONS_T *pTransactions;
     
     CanNotificationType     canNotification;
+    CAN4OSX_NOTIFY_T        canNotify;
     
     int deviceChannelCount;
     int deviceChannel;
@@ -158,12 +598,23 @@ typedef struct {
     // BulkIn info/pointer
     int endpointMaxSizeBulkIn;
     int endpointNumberBulkIn;
-    char* endpointBufferBulkInRef;
+    char* endpointBufferBulkInRef; // data of the transfer being decoded
+    // bulkInDepth transfers are queued, the spare one is decoded
+    UInt32 bulkInDepth;
+    UInt32 bulkInSpare;
+    CAN4OSX_USB_BULK_IN_T bulkIn[CAN4OSX_USB_BULK_IN_MAX_DEPTH + 1];
     // BulkOut info/pointer
     int endpointMaxSizeBulkOut;
     int endpointNumberBulkOut;
-    UInt8* endpointBufferBulkOutRef;
-    bool endpoitBulkOutBusy;
+    // up to bulkOutDepth transfers in flight, bit n of bulkOutBusy per transfer
+    pthread_mutex_t bulkOutMutex;
+    UInt32 bulkOutDepth;
+    UInt32 bulkOutBusy;
+    UInt32 bulkOutInFlight;
+    CAN4OSX_USB_BULK_OUT_T bulkOut[CAN4OSX_USB_BULK_OUT_MAX_DEPTH];
+    CAN4OSX_USB_TX_STATISTICS_T txStatistics;
+    // written frames up to their TX ack, see canWriteSync
+    CAN4OSX_TX_TRACK_T txTrack;
     
     void *privateData; //Here every instace can save private stuff
     
@@ -171,24 +622,274 @@ typedef struct {
     CAN4OSX_DEV_INFO_T	devInfo;
     CAN4OSX_HW_FUNC_T	hwFunctions;
     CAN4OSX_USB_FUNC_T	usbFunctions;
-}Can4osxUsbDeviceHandleEntry;
-
-
-
-extern Can4osxUsbDeviceHandleEntry can4osxUsbDeviceHandle[CAN4OSX_MAX_CHANNEL_COUNT];
-
-
-CAN_EVENT_MSG_BUF_T* CAN4OSX_CreateCanEventBuffer( UInt32 bufferSize );
+};
+
+
+
+/* the channel table grows by blocks of slots, a slot never moves */
+#define CAN4OSX_CHANNEL_BLOCK_SHIFT		3u
+#define CAN4OSX_CHANNEL_BLOCK_SIZE		(1u << CAN4OSX_CHANNEL_BLOCK_SHIFT)
+#define CAN4OSX_CHANNEL_TABLE_MIN		4u
+
+/* a handle is the slot index and the generation of the slot. A replugged
+ * adapter may get the slots of an old one, the old handles stay invalid */
+#define CAN4OSX_HANDLE_INDEX_BITS		16u
+#define CAN4OSX_HANDLE_INDEX_MASK		((1u << CAN4OSX_HANDLE_INDEX_BITS) - 1u)
+#define CAN4OSX_HANDLE_GENERATION_MASK	0x7fffu
+#define CAN4OSX_HANDLE(index, generation)	((CanHandle)((((UInt32)(generation) & CAN4OSX_HANDLE_GENERATION_MASK) << CAN4OSX_HANDLE_INDEX_BITS) | (UInt32)(index)))
+#define CAN4OSX_HANDLE_INDEX(hnd)		((UInt32)(hnd) & CAN4OSX_HANDLE_INDEX_MASK)
+#define CAN4OSX_HANDLE_GENERATION(hnd)	(((UInt32)(hnd) >> CAN4OSX_HANDLE_INDEX_BITS) & CAN4OSX_HANDLE_GENERATION_MASK)
+
+/* slot state, the generation and bit 0 set while the channel is usable */
+#define CAN4OSX_SLOT_ACTIVE				0x1u
+#define CAN4OSX_SLOT_STATE(generation, active)	((((UInt32)(generation) & CAN4OSX_HANDLE_GENERATION_MASK) << 1u) | ((active) ? CAN4OSX_SLOT_ACTIVE : 0u))
+#define CAN4OSX_SLOT_GENERATION(state)	(((state) >> 1u) & CAN4OSX_HANDLE_GENERATION_MASK)
+
+/* CAN4OSX_DeviceDetach polls the users of a removed channel, an API call
+ * waiting for the driver thread only does so with a timeout */
+#define CAN4OSX_DETACH_POLL_US			200u
+
+/* canOpenChannel waits this long for a channel of an adapter still being
+ * set up, see canINIT_NO_WAIT */
+#define CAN4OSX_SETUP_WAIT_MS			5000u
+
+/* one place in the channel table
+ * An API call counts itself in users and then checks the state, the removal
+ * of a device first clears the active bit and then waits for users to drop
+ * to 0 before it releases anything, see CAN4OSX_EnterChannel. Users and
+ * state survive the reuse of the slot, the entry is set up again. */
+typedef struct {
+	atomic_uint state;
+	atomic_uint users;
+	bool allocated;				// the entry belongs to a device, under can4osxChannelMutex
+	// receive buffer of the removed device, frames of canReadAcquire may still be read. Freed on reuse
+	CAN_EVENT_MSG_BUF_T *pRetiredBuffer;
+	Can4osxUsbDeviceHandleEntry entry;
+} CAN4OSX_CHANNEL_SLOT_T;
+
+typedef struct CAN4OSX_CHANNEL_TABLE_S {
+	UInt32 blockCount;
+	struct CAN4OSX_CHANNEL_TABLE_S *pOutgrown; // kept, a reader may still use it
+	CAN4OSX_CHANNEL_SLOT_T *pBlock[];
+} CAN4OSX_CHANNEL_TABLE_T;
+
+extern CAN4OSX_CHANNEL_TABLE_T * _Atomic pCan4osxChannelTable;
+extern atomic_uint can4osxChannelCount;
+
+/* handle to slot, lock free. NULL if the index was never allocated */
+static inline CAN4OSX_CHANNEL_SLOT_T* CAN4OSX_GetChannelSlot(
+		const CanHandle hnd
+	)
+{
+CAN4OSX_CHANNEL_TABLE_T *pTable;
+UInt32 index = CAN4OSX_HANDLE_INDEX(hnd);
+
+	// the count is published after the table that holds the slot
+	if ((hnd < 0) || (index >= atomic_load_explicit(&can4osxChannelCount, memory_order_acquire)))  {
+		return(NULL);
+	}
+	pTable = atomic_load_explicit(&pCan4osxChannelTable, memory_order_acquire);
+
+	return(&pTable->pBlock[index >> CAN4OSX_CHANNEL_BLOCK_SHIFT][index & (CAN4OSX_CHANNEL_BLOCK_SIZE - 1u)]);
+}
+
+/* handle to entry without a look at the generation, for the driver thread
+ * and the device drivers that run inside an API call */
+static inline Can4osxUsbDeviceHandleEntry* CAN4OSX_GetChannel(
+		const CanHandle hnd
+	)
+{
+CAN4OSX_CHANNEL_SLOT_T *pSlot = CAN4OSX_GetChannelSlot(hnd);
+
+	return((pSlot != NULL) ? &pSlot->entry : NULL);
+}
+
+/* start of an API call, lock free. NULL if the handle is invalid or stale,
+ * otherwise the entry stays as it is until CAN4OSX_LeaveChannel */
+static inline Can4osxUsbDeviceHandleEntry* CAN4OSX_EnterChannel(
+		const CanHandle hnd
+	)
+{
+CAN4OSX_CHANNEL_SLOT_T *pSlot = CAN4OSX_GetChannelSlot(hnd);
+
+	if (pSlot == NULL)  {
+		return(NULL);
+	}
+
+	// sequentially consistent with the removal, either it sees us or we see it
+	atomic_fetch_add_explicit(&pSlot->users, 1u, memory_order_seq_cst);
+	if (atomic_load_explicit(&pSlot->state, memory_order_seq_cst) != CAN4OSX_SLOT_STATE(CAN4OSX_HANDLE_GENERATION(hnd), true))  {
+		atomic_fetch_sub_explicit(&pSlot->users, 1u, memory_order_release);
+		return(NULL);
+	}
+
+	return(&pSlot->entry);
+}
+
+/* end of an API call of CAN4OSX_EnterChannel */
+static inline void CAN4OSX_LeaveChannel(
+		const CanHandle hnd
+	)
+{
+	atomic_fetch_sub_explicit(&CAN4OSX_GetChannelSlot(hnd)->users, 1u, memory_order_release);
+}
+
+/* the receive buffer of a channel. canIOCTL_SET_RX_QUEUE_SIZE replaces it
+ * and closes the old one, which stays valid until the channel is released.
+ * Whoever pairs calls (reserve and commit, acquire and release) loads it
+ * once for both */
+static inline CAN_EVENT_MSG_BUF_T* CAN4OSX_GetCanEventBuffer(
+		Can4osxUsbDeviceHandleEntry *pSelf
+	)
+{
+	return(atomic_load_explicit(&pSelf->canEventMsgBuff, memory_order_acquire));
+}
+
+extern const CAN4OSX_DEV_ENTRY_T can4osxSupportedDevices[];
+extern const UInt32 can4osxSupportedDeviceCount;
+
+extern const CAN4OSX_USB_TRANSPORT_T can4osxIoKitTransport;
+extern const CAN4OSX_USB_TRANSPORT_T can4osxLibUsbTransport;
+extern const CAN4OSX_USB_TRANSPORT_T can4osxSimTransport;
+
+canStatus CAN4OSX_SetTransport(const CAN4OSX_USB_TRANSPORT_T *pTransport);
+
+/* the setup of a new adapter on a worker, hnd is the channel reserved for
+ * it or -1, returns what CAN4OSX_DeviceAttach returned */
+typedef Can4osxUsbDeviceHandleEntry* (*CAN4OSX_SETUP_FUNC_T)(void *pContext, CanHandle hnd);
+
+/* called by the transports */
+void CAN4OSX_DeviceSetup(CAN4OSX_SETUP_FUNC_T setup, void *pContext);
+Can4osxUsbDeviceHandleEntry* CAN4OSX_DeviceAttach(const CAN4OSX_USB_TRANSPORT_T *pTransport, const CAN4OSX_USB_DEVICE_DESC_T *pDesc, CanHandle hnd);
+void CAN4OSX_DeviceDetach(Can4osxUsbDeviceHandleEntry *pSelf);
+UInt8 CAN4OSX_IsSupportedDevice(UInt16 vendorId, UInt16 productId);
+
+
+CAN_EVENT_MSG_BUF_T* CAN4OSX_CreateCanEventBuffer( UInt32 bufferBytes );
 void CAN4OSX_ReleaseCanEventBuffer( CAN_EVENT_MSG_BUF_T* bufferRef );
+void CAN4OSX_CloseCanEventBuffer( CAN_EVENT_MSG_BUF_T* bufferRef );
+UInt8 CAN4OSX_IsCanEventBufferClosed( CAN_EVENT_MSG_BUF_T* bufferRef );
+void CAN4OSX_SetCanEventBufferPolicy(CAN_EVENT_MSG_BUF_T* bufferRef, UInt32 policy, UInt32 blockMs);
 UInt8 CAN4OSX_WriteCanEventBuffer(CAN_EVENT_MSG_BUF_T* bufferRef, CanMsg newEvent);
+CanFrame* CAN4OSX_ReserveCanEventBuffer(CAN_EVENT_MSG_BUF_T* bufferRef, UInt8 len);
+void CAN4OSX_CommitCanEventBuffer(CAN_EVENT_MSG_BUF_T* bufferRef);
 UInt8 CAN4OSX_ReadCanEventBuffer(CAN_EVENT_MSG_BUF_T* bufferRef, CanMsg* readEvent);
+UInt32 CAN4OSX_ReadCanEventBufferBatch(CAN_EVENT_MSG_BUF_T* bufferRef, CanMsg* readEvents, UInt32 maxEvents);
+void CAN4OSX_FrameToMsg(const CanFrame *pFrame, CanMsg *pMsg);
+UInt32 CAN4OSX_AcquireCanEventBuffer(CAN_EVENT_MSG_BUF_T* bufferRef, CanFrame** ppFrames, UInt32 maxEvents);
+UInt8 CAN4OSX_ReleaseCanEventBufferEvents(CAN_EVENT_MSG_BUF_T* bufferRef, UInt32 count);
+UInt8 CAN4OSX_FindCanEventBuffer(CAN_EVENT_MSG_BUF_T* bufferRef, UInt32 canId);
+UInt32 CAN4OSX_GetCanEventBufferHead(CAN_EVENT_MSG_BUF_T* bufferRef);
+UInt32 CAN4OSX_GetCanEventBufferTail(CAN_EVENT_MSG_BUF_T* bufferRef);
+UInt32 CAN4OSX_GetCanEventBufferCount(CAN_EVENT_MSG_BUF_T* bufferRef);
+UInt32 CAN4OSX_GetCanEventBufferOverruns(CAN_EVENT_MSG_BUF_T* bufferRef, UInt8 reset);
+UInt8 CAN4OSX_WaitCanEventBuffer(CAN_EVENT_MSG_BUF_T* bufferRef, UInt32 seenHead, const struct timespec *pDeadline);
+UInt8 CAN4OSX_SetCanEventBufferWaitSet(CAN_EVENT_MSG_BUF_T* bufferRef, CAN4OSX_WAIT_SET_T *pSet);
+UInt8 CAN4OSX_WaitCanEventBufferSet(CAN4OSX_WAIT_SET_T *pSet, CAN_EVENT_MSG_BUF_T **ppBuffers, const UInt32 *pSeenHeads, UInt32 count, const struct timespec *pDeadline);
+void CAN4OSX_GetDeadline(struct timespec *pDeadline, UInt32 timeoutMs);
+void CAN4OSX_GetDeadlineNs(struct timespec *pDeadline, UInt64 timeoutNs);
+void CAN4OSX_CondInit(pthread_cond_t *pCond);
+int CAN4OSX_CondTimedWait(pthread_cond_t *pCond, pthread_mutex_t *pMutex, const struct timespec *pDeadline);
+
+CAN4OSX_TIMESTAMP_T* CAN4OSX_CreateTimestamp(void);
+void CAN4OSX_ReleaseTimestamp(CAN4OSX_TIMESTAMP_T *pTs);
+void CAN4OSX_SetTimestampClock(CAN4OSX_TIMESTAMP_T *pTs, UInt32 clockHz, UInt32 counterBits);
+void CAN4OSX_RestartTimestamp(CAN4OSX_TIMESTAMP_T *pTs);
+UInt64 CAN4OSX_RxTimestamp(CAN4OSX_TIMESTAMP_T *pTs, UInt64 raw, bool hostTime);
+void CAN4OSX_TimestampClockRequest(CAN4OSX_TIMESTAMP_T *pTs);
+void CAN4OSX_TimestampClockResponse(CAN4OSX_TIMESTAMP_T *pTs, UInt64 raw);
+void CAN4OSX_GetTimestampSync(CAN4OSX_TIMESTAMP_T *pTs, CanTimeSyncStatus *pStatus);
+UInt64 CAN4OSX_GetHostTimestamp(CAN4OSX_TIMESTAMP_T *pTs, UInt64 deviceNs);
+UInt64 CAN4OSX_GetDeviceTimestamp(CAN4OSX_TIMESTAMP_T *pTs, UInt64 hostNs);
+SInt32 CAN4OSX_GetTimestampDrift(CAN4OSX_TIMESTAMP_T *pTs);
+
+CAN4OSX_TRANSACTIONS_T* CAN4OSX_CreateTransactions(void);
+void CAN4OSX_ReleaseTransactions(CAN4OSX_TRANSACTIONS_T *pTrans);
+void CAN4OSX_CloseTransactions(CAN4OSX_TRANSACTIONS_T *pTrans);
+UInt32 CAN4OSX_NextTransactionId(CAN4OSX_TRANSACTIONS_T *pTrans, UInt32 idMask);
+CAN4OSX_TRANSACTION_T* CAN4OSX_BeginTransaction(CAN4OSX_TRANSACTIONS_T *pTrans, UInt32 key, CAN4OSX_TRANSACTION_CALLBACK_T callback, void *refCon);
+UInt8 CAN4OSX_CompleteTransaction(CAN4OSX_TRANSACTIONS_T *pTrans, UInt32 key, const void *pResponse, UInt32 size);
+canStatus CAN4OSX_WaitTransaction(CAN4OSX_TRANSACTIONS_T *pTrans, CAN4OSX_TRANSACTION_T *pTransaction, UInt32 timeoutMs, void *pResponse, UInt32 size);
+void CAN4OSX_CancelTransactions(CAN4OSX_TRANSACTIONS_T *pTrans, canStatus status);
+UInt32 CAN4OSX_GetPendingTransactions(CAN4OSX_TRANSACTIONS_T *pTrans);
+
+void CAN4OSX_InitFilter(CAN4OSX_FILTER_T *pFilter);
+void CAN4OSX_ClearFilter(CAN4OSX_FILTER_T *pFilter);
+void CAN4OSX_ReleaseFilter(CAN4OSX_FILTER_T *pFilter);
+void CAN4OSX_SetFilterMask(CAN4OSX_FILTER_T *pFilter, UInt32 code, UInt32 mask, bool extended);
+UInt8 CAN4OSX_AddFilterRange(CAN4OSX_FILTER_T *pFilter, UInt32 first, UInt32 last, bool extended);
+UInt8 CAN4OSX_AddFilterIds(CAN4OSX_FILTER_T *pFilter, const UInt32 *pIds, UInt32 count, bool extended);
+bool CAN4OSX_FilterMatch(const CAN4OSX_FILTER_T *pFilter, UInt32 canId, UInt32 canFlags);
+void CAN4OSX_GetFilterIdTypes(const CAN4OSX_FILTER_T *pFilter, bool *pStandard, bool *pExtended);
+
+/* decoder check, counts the dropped frames */
+static inline bool CAN4OSX_FilterAccept(
+		CAN4OSX_FILTER_T *pFilter,
+		UInt32 canId,
+		UInt32 canFlags
+	)
+{
+	if (!pFilter->active || CAN4OSX_FilterMatch(pFilter, canId, canFlags))  {
+		return(true);
+	}
+	atomic_fetch_add_explicit(&pFilter->rejected, 1u, memory_order_relaxed);
+
+	return(false);
+}
+
+void CAN4OSX_InitBusStatistics(CAN4OSX_BUS_STATS_T *pStats);
+void CAN4OSX_ReleaseBusStatistics(CAN4OSX_BUS_STATS_T *pStats);
+void CAN4OSX_SetBusStatisticsBitrate(CAN4OSX_BUS_STATS_T *pStats, UInt32 nominalBitrate, UInt32 dataBitrate);
+void CAN4OSX_CountBusFrame(CAN4OSX_BUS_STATS_T *pStats, UInt32 canFlags, UInt8 len);
+void CAN4OSX_RequestBusStatistics(CAN4OSX_BUS_STATS_T *pStats, UInt32 bufferOverruns);
+void CAN4OSX_GetBusStatistics(CAN4OSX_BUS_STATS_T *pStats, canBusStatistics *pStatistics);
+
+canStatus CAN4OSX_InitTxTrack(CAN4OSX_TX_TRACK_T *pTrack);
+void CAN4OSX_ReleaseTxTrack(CAN4OSX_TX_TRACK_T *pTrack);
+void CAN4OSX_CloseTxTrack(CAN4OSX_TX_TRACK_T *pTrack);
+void CAN4OSX_FlushTxTrack(CAN4OSX_TX_TRACK_T *pTrack);
+UInt32 CAN4OSX_BeginTxFrames(CAN4OSX_TX_TRACK_T *pTrack, const CanMsg *pMsg, UInt32 count);
+void CAN4OSX_EndTxFrames(CAN4OSX_TX_TRACK_T *pTrack, UInt32 count, UInt32 accepted);
+void CAN4OSX_AckTxFrame(Can4osxUsbDeviceHandleEntry *pSelf, UInt32 id, UInt32 idMask, UInt64 timestamp);
+void CAN4OSX_AckTxFramesInOrder(Can4osxUsbDeviceHandleEntry *pSelf, UInt32 count);
+canStatus CAN4OSX_WaitTxFrames(CAN4OSX_TX_TRACK_T *pTrack, UInt32 timeoutMs);
+
+/* decoder side counter, see CAN4OSX_BUS_STATS_T */
+static inline void CAN4OSX_CountBusStat(
+		atomic_ullong *pCounter,
+		UInt64 value
+	)
+{
+	atomic_store_explicit(pCounter, atomic_load_explicit(pCounter, memory_order_relaxed) + value, memory_order_relaxed);
+}
 
 /* helper functions for all devices */
+void CAN4OSX_NotifyRx(Can4osxUsbDeviceHandleEntry *pSelf);
+void CAN4OSX_NotifyRxFlush(Can4osxUsbDeviceHandleEntry *pSelf);
+void CAN4OSX_NotifyRelease(Can4osxUsbDeviceHandleEntry *pSelf);
 UInt8 CAN4OSX_decodeFdDlc(UInt8 dlc);
 UInt8 CAN4OSX_encodeFdDlc(UInt8 dlc);
 UInt64 CAN$OSX_getMilliseconds(void);
+UInt64 CAN4OSX_GetNanoseconds(void);
 
 canStatus CAN4OSX_GetChannelData(Can4osxUsbDeviceHandleEntry* pSelf, SInt32 cmd, void* pBuffer, size_t bufsize);
 
+#if CAN4OSX_TRACE
+void CAN4OSX_TraceEvent(UInt16 event, CanHandle hnd, UInt32 value);
+void CAN4OSX_TraceBufferChannel(CAN_EVENT_MSG_BUF_T* bufferRef, CanHandle hnd);
+void CAN4OSX_TraceLatency(UInt32 latency, UInt64 ns);
+void CAN4OSX_TraceRxTransfer(Can4osxUsbDeviceHandleEntry *pSelf, UInt64 now, UInt32 bytes);
+void CAN4OSX_TraceRxTransferDone(Can4osxUsbDeviceHandleEntry *pSelf, UInt64 now);
+void CAN4OSX_GetLatency(UInt32 latency, CanLatencyStatus *pStatus);
+void CAN4OSX_ResetLatency(void);
+canStatus CAN4OSX_DumpTrace(const char *pPath);
+
+# define CAN4OSX_TRACE_EVENT(event, hnd, value)	CAN4OSX_TraceEvent((event), (hnd), (UInt32)(value))
+# define CAN4OSX_TRACE_BUFFER_CHANNEL(bufferRef, hnd)	CAN4OSX_TraceBufferChannel((bufferRef), (hnd))
+#else /* CAN4OSX_TRACE */
+# define CAN4OSX_TRACE_EVENT(event, hnd, value)
+# define CAN4OSX_TRACE_BUFFER_CHANNEL(bufferRef, hnd)
+#endif /* CAN4OSX_TRACE */
+
 
 #endif /* CAN4OSX_INTERN_H */
@@ -0,0 +1,145 @@
+//
+//  can4osx_platform.h
+//
+//
+// Copyright (c) 2014 - 2018 Alexander Philipp. All rights reserved.
+//
+//
+// License: GPLv2
+//
+// =============================================================================
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation version 2
+// of the license.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street,
+// Fifth Floor, Boston, MA  02110-1301, USA.
+//
+// =============================================================================
+//
+// Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE
+// AUTHOR MAKES NO WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+// THE IMPLIED WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR
+// IN COMBINATION WITH YOUR PRODUCTS.
+//
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION
+// AND/OR DISTRIBUTION OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF
+// CONTRACT, TORT (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF
+// THE AUTHOR HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// =============================================================================
+//
+
+#ifndef CAN4OSX_PLATFORM_H
+#define CAN4OSX_PLATFORM_H 1
+
+/* Everything the driver needs from the operating system besides the USB
+ * transport. On macOS this is CoreFoundation, on other systems the few types
+ * and calls that are used are mapped here. The protocol code needs blocks and
+ * libdispatch everywhere (clang -fblocks, libdispatch, BlocksRuntime). */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <dispatch/dispatch.h>
+
+#if defined(__APPLE__)
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <IOKit/IOReturn.h>
+
+/* the driver thread runs a CFRunLoop unless libusb is used on macOS */
+#if !defined(CAN4OSX_USE_LIBUSB)
+# define CAN4OSX_HAVE_CFRUNLOOP 1
+#endif
+
+#else /* __APPLE__ */
+
+#include <time.h>
+
+typedef uint8_t  UInt8;
+typedef int8_t   SInt8;
+typedef uint16_t UInt16;
+typedef int16_t  SInt16;
+typedef uint32_t UInt32;
+typedef int32_t  SInt32;
+typedef uint64_t UInt64;
+typedef int64_t  SInt64;
+typedef unsigned int UInt;
+typedef unsigned char Boolean;
+
+#ifndef TRUE
+# define TRUE 1
+#endif
+#ifndef FALSE
+# define FALSE 0
+#endif
+
+/* there is no notification center, canSetNotify is accepted but never posts */
+typedef const void *CFStringRef;
+typedef const void *CFTypeRef;
+typedef const void *CFAllocatorRef;
+typedef void *CFNotificationCenterRef;
+typedef void *CFRunLoopTimerRef;
+typedef double CFAbsoluteTime;
+typedef double CFTimeInterval;
+
+#define kCFAllocatorDefault NULL
+
+static inline CFStringRef CFStringCreateCopy(CFAllocatorRef alloc, CFStringRef str)
+{
+	(void)alloc;
+	return(str);
+}
+
+static inline void CFRelease(CFTypeRef ref)
+{
+	(void)ref;
+}
+
+static inline void CFNotificationCenterPostNotification(CFNotificationCenterRef center,
+		CFStringRef name, const void *object, const void *userInfo, Boolean deliverImmediately)
+{
+	(void)center; (void)name; (void)object; (void)userInfo; (void)deliverImmediately;
+}
+
+static inline CFAbsoluteTime CFAbsoluteTimeGetCurrent(void)
+{
+struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return((CFAbsoluteTime)now.tv_sec + ((CFAbsoluteTime)now.tv_nsec / 1.0e9));
+}
+
+/* IOKit return codes, the transports translate their errors into these */
+typedef int IOReturn;
+
+#define kIOReturnSuccess         0
+#define kIOReturnError           ((IOReturn)0xe00002bc)
+#define kIOReturnNoMemory        ((IOReturn)0xe00002bd)
+#define kIOReturnNoResources     ((IOReturn)0xe00002be)
+#define kIOReturnBadArgument     ((IOReturn)0xe00002c2)
+#define kIOReturnExclusiveAccess ((IOReturn)0xe00002c5)
+#define kIOReturnUnsupported     ((IOReturn)0xe00002c7)
+#define kIOReturnNoDevice        ((IOReturn)0xe00002c0)
+#define kIOReturnOverrun         ((IOReturn)0xe00002e8)
+#define kIOReturnTimeout         ((IOReturn)0xe00002d6)
+#define kIOReturnNotResponding   ((IOReturn)0xe00002ed)
+#define kIOReturnAborted         ((IOReturn)0xe00002eb)
+
+#endif /* __APPLE__ */
+
+#endif /* CAN4OSX_PLATFORM_H */
@@ -0,0 +1,98 @@
+//
+//  can4osx_sim.h
+//
+//
+// Copyright (c) 2014 - 2018 Alexander Philipp. All rights reserved.
+//
+//
+// License: GPLv2
+//
+// =============================================================================
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation version 2
+// of the license.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street,
+// Fifth Floor, Boston, MA  02110-1301, USA.
+//
+// =============================================================================
+//
+// Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE
+// AUTHOR MAKES NO WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+// THE IMPLIED WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR
+// IN COMBINATION WITH YOUR PRODUCTS.
+//
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION
+// AND/OR DISTRIBUTION OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF
+// CONTRACT, TORT (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF
+// THE AUTHOR HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// =============================================================================
+//
+//
+// Simulated adapters for benchmarks and tests without hardware. The adapters
+// sit below the usb transport and speak the wire protocol of the real ones,
+// so the unmodified device drivers are used.
+//
+
+#ifndef CAN4OSX_SIM_H
+#define CAN4OSX_SIM_H 1
+
+#include "can4osx.h"
+
+
+/* frames are generated as fast as the driver reads them */
+#define CAN4OSX_SIM_RATE_UNLIMITED	0u
+/* frames per second of a saturated bus at the configured bit rate */
+#define CAN4OSX_SIM_RATE_BUS		0xFFFFFFFFu
+/* can4osxSimUnplug: the adapter stays unplugged */
+#define CAN4OSX_SIM_NO_REPLUG		0xFFFFFFFFu
+
+typedef struct {
+	UInt16 productId;		/* one of the supported Kvaser, IXXAT or Peak adapters */
+	UInt8 channelCount;		/* 0 takes the channel count of the real adapter */
+	UInt8 extendedMode;		/* Leaf Pro: firmware uses the extended (CAN FD) commands */
+	UInt8 echo;				/* transmitted frames are received again as TXACK */
+	SInt32 clockDriftPpm;	/* device clock runs fast (+) or slow (-) against the host */
+	UInt32 setupMs;			/* time opening and configuring the adapter takes */
+} CAN4OSX_SIM_ADAPTER_T;
+
+typedef struct {
+	UInt32 framesPerSecond;	/* CAN4OSX_SIM_RATE_xxx or a fixed rate */
+	UInt64 frameCount;		/* 0 generates until the load is changed */
+	UInt32 canId;
+	UInt16 canDlc;			/* length in bytes, up to 64 for CAN FD */
+	UInt32 canFlags;		/* canMSG_EXT, canFDMSG_FDF, canFDMSG_BRS */
+} CAN4OSX_SIM_LOAD_T;
+
+typedef struct {
+	UInt64 rxFrames;		/* frames handed to the driver */
+	UInt64 rxOverruns;		/* frames lost because the driver did not read */
+	UInt64 txFrames;		/* frames the driver transmitted */
+	UInt64 bulkInTransfers;
+	UInt64 bulkOutTransfers;
+	UInt64 bulkOutBytes;
+	UInt64 controlRequests;
+} CAN4OSX_SIM_STATISTICS_T;
+
+
+canStatus can4osxSimEnable(void);
+canStatus can4osxSimAddAdapter(const CAN4OSX_SIM_ADAPTER_T *pAdapter);
+canStatus can4osxSimSetLoad(const CanHandle hnd, const CAN4OSX_SIM_LOAD_T *pLoad);
+canStatus can4osxSimGetStatistics(const CanHandle hnd, CAN4OSX_SIM_STATISTICS_T *pStatistics);
+canStatus can4osxSimUnplug(const CanHandle hnd, UInt32 replugMs);
+
+
+#endif /* CAN4OSX_SIM_H */
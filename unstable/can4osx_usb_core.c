@@ -44,49 +44,202 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-
-#include <CoreFoundation/CoreFoundation.h>
-#include <IOKit/IOKitLib.h>
-#include <IOKit/IOMessage.h>
-#include <IOKit/IOCFPlugIn.h>
-#include <IOKit/usb/IOUSBLib.h>
-
-#include <sys/time.h>
+#include <string.h>
 
 #include "can4osx_internal.h"
+#include "can4osx_usb_core.h"
 #include "can4osx_debug.h"
 
 
+/* list of local defined functions
+------------------------------------------------------------------------------*/
+static void CAN4OSX_usbSubmitBulkIn(CAN4OSX_USB_BULK_IN_T *pXfer);
+static void CAN4OSX_usbBulkInCompletion(void *refCon, IOReturn result, void *arg0);
+static void CAN4OSX_usbBulkOutCompletion(void *refCon, IOReturn result, void *arg0);
 
 
 /******************************************************************************/
+/**
+ * \brief CAN4OSX_usbReadPipeAsync - queue a read on a pipe
+ *
+ * The completion is called on the driver thread, arg0 holds the number of
+ * received bytes.
+ *
+ * \return IOReturn
+ */
+IOReturn CAN4OSX_usbReadPipeAsync(
+		Can4osxUsbDeviceHandleEntry *pSelf,  /**< pointer to my reference */
+		UInt8 pipeRef,
+		void *pBuf,
+		UInt32 size,
+		CAN4OSX_USB_COMPLETION_T callback,
+		void *refCon
+	)
+{
+	if ((pSelf->usbTransport == NULL) || (pSelf->usbTransportRef == NULL))  {
+		return(kIOReturnNoDevice);
+	}
+	return(pSelf->usbTransport->readPipeAsync(pSelf, pipeRef, pBuf, size, callback, refCon));
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_usbWritePipeAsync - queue a write on a pipe
+ *
+ * \return IOReturn
+ */
+IOReturn CAN4OSX_usbWritePipeAsync(
+		Can4osxUsbDeviceHandleEntry *pSelf,  /**< pointer to my reference */
+		UInt8 pipeRef,
+		void *pBuf,
+		UInt32 size,
+		CAN4OSX_USB_COMPLETION_T callback,
+		void *refCon
+	)
+{
+	if ((pSelf->usbTransport == NULL) || (pSelf->usbTransportRef == NULL))  {
+		return(kIOReturnNoDevice);
+	}
+	return(pSelf->usbTransport->writePipeAsync(pSelf, pipeRef, pBuf, size, callback, refCon));
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_usbReadPipe - synchronous read from a pipe
+ *
+ * On entry *pSize is the size of the buffer, on return the number of bytes
+ * read. A timeout of 0 waits forever.
+ *
+ * \return IOReturn
+ */
+IOReturn CAN4OSX_usbReadPipe(
+		Can4osxUsbDeviceHandleEntry *pSelf,  /**< pointer to my reference */
+		UInt8 pipeRef,
+		void *pBuf,
+		UInt32 *pSize,
+		UInt32 timeoutMs
+	)
+{
+	if ((pSelf->usbTransport == NULL) || (pSelf->usbTransportRef == NULL))  {
+		return(kIOReturnNoDevice);
+	}
+	return(pSelf->usbTransport->readPipe(pSelf, pipeRef, pBuf, pSize, timeoutMs));
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_usbWritePipe - synchronous write to a pipe
+ *
+ * A timeout of 0 waits forever.
+ *
+ * \return IOReturn
+ */
+IOReturn CAN4OSX_usbWritePipe(
+		Can4osxUsbDeviceHandleEntry *pSelf,  /**< pointer to my reference */
+		UInt8 pipeRef,
+		void *pBuf,
+		UInt32 size,
+		UInt32 timeoutMs
+	)
+{
+	if ((pSelf->usbTransport == NULL) || (pSelf->usbTransportRef == NULL))  {
+		return(kIOReturnNoDevice);
+	}
+	return(pSelf->usbTransport->writePipe(pSelf, pipeRef, pBuf, size, timeoutMs));
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_usbControlRequest - request on the default control pipe
+ *
+ * \return IOReturn
+ */
+IOReturn CAN4OSX_usbControlRequest(
+		Can4osxUsbDeviceHandleEntry *pSelf,  /**< pointer to my reference */
+		CAN4OSX_USB_CONTROL_T *pRequest
+	)
+{
+	if ((pSelf->usbTransport == NULL) || (pSelf->usbTransportRef == NULL))  {
+		return(kIOReturnNoDevice);
+	}
+	return(pSelf->usbTransport->controlRequest(pSelf, pRequest));
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_usbClose - close the interface after a fatal pipe error
+ *
+ * The pipes can not be used anymore afterwards, the device itself is
+ * released by the transport when it is unplugged.
+ */
+void CAN4OSX_usbClose(
+		Can4osxUsbDeviceHandleEntry *pSelf  /**< pointer to my reference */
+	)
+{
+	if ((pSelf->usbTransport != NULL) && (pSelf->usbTransportRef != NULL))  {
+		pSelf->usbTransport->close(pSelf);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_usbLockCommand - one synchronous command write at a time
+ *
+ * The API threads and the time sync timer write commands to the same pipe,
+ * the channels of an adapter share the lock.
+ */
+void CAN4OSX_usbLockCommand(
+		Can4osxUsbDeviceHandleEntry *pSelf  /**< pointer to my reference */
+	)
+{
+	if (pSelf->pTransactions != NULL)  {
+		pthread_mutex_lock(&pSelf->pTransactions->writeMutex);
+	}
+}
+
+
+/******************************************************************************/
+void CAN4OSX_usbUnlockCommand(
+		Can4osxUsbDeviceHandleEntry *pSelf  /**< pointer to my reference */
+	)
+{
+	if (pSelf->pTransactions != NULL)  {
+		pthread_mutex_unlock(&pSelf->pTransactions->writeMutex);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_usbSendCommand - synchronous write of a command
+ *
+ * Waits for a command of another thread to be written first.
+ */
 canStatus CAN4OSX_usbSendCommand(
 		Can4osxUsbDeviceHandleEntry *pSelf,  /**< pointer to my reference */
 		void *pCmd,
 		size_t cmdLen
 	)
 {
-IOReturn retVal = kIOReturnSuccess;
-CAN4OSX_USB_INTERFACE **ppInterface = pSelf->can4osxInterfaceInterface;
+IOReturn retVal;
 
-	if( pSelf->endpoitBulkOutBusy == FALSE )  {
-		pSelf->endpoitBulkOutBusy = TRUE;
+	CAN4OSX_usbLockCommand(pSelf);
 
-		retVal = (*ppInterface)->WritePipe(ppInterface,
-										 pSelf->endpointNumberBulkOut,
-										 pCmd, (UInt32)cmdLen);
+	retVal = CAN4OSX_usbWritePipe(pSelf, pSelf->endpointNumberBulkOut, pCmd, (UInt32)cmdLen, 0u);
 
-		if (retVal != kIOReturnSuccess)  {
-			CAN4OSX_DEBUG_PRINT("Unable to perform synchronous bulk write (%08x)\n", retVal);
-			(void)(*ppInterface)->USBInterfaceClose(ppInterface);
-			(void)(*ppInterface)->Release(ppInterface);
-		}
-
-		pSelf->endpoitBulkOutBusy = FALSE;
-	} else {
-		retVal = kIOReturnError;
+	if (retVal != kIOReturnSuccess)  {
+		CAN4OSX_DEBUG_PRINT("Unable to perform synchronous bulk write (%08x)\n", retVal);
+		CAN4OSX_usbClose(pSelf);
 	}
 
+	CAN4OSX_usbUnlockCommand(pSelf);
+
 	if (retVal != kIOReturnSuccess)  {
 	    return(canERR_INTERNAL);
 	}
@@ -95,11 +248,74 @@ CAN4OSX_USB_INTERFACE **ppInterface = pSelf->can4osxInterfaceInterface;
 
 
 /******************************************************************************/
+/**
+ * \brief CAN4OSX_usbReadFromBulkInPipe - start reading the bulk in pipe
+ *
+ * Queues bulkInDepth transfers, each with its own buffer. A completed transfer
+ * is replaced by the spare one before its data is decoded, so the adapter
+ * always has a transfer to send to while the driver is busy.
+ */
 void CAN4OSX_usbReadFromBulkInPipe(
-		Can4osxUsbDeviceHandleEntry *pSelf /**< pointer to handle structure */
+		Can4osxUsbDeviceHandleEntry *pSelf /**< pointer to my reference */
+	)
+{
+UInt32 depth = pSelf->bulkInDepth;
+UInt32 loopCount;
+
+	if (depth == 0u)  {
+		depth = CAN4OSX_USB_BULK_IN_DEPTH;
+	} else if (depth > CAN4OSX_USB_BULK_IN_MAX_DEPTH)  {
+		depth = CAN4OSX_USB_BULK_IN_MAX_DEPTH;
+	}
+
+	for (loopCount = 0; loopCount <= depth; loopCount++)  {
+		pSelf->bulkIn[loopCount].pSelf = pSelf;
+		if (pSelf->bulkIn[loopCount].pBuf == NULL)  {
+			pSelf->bulkIn[loopCount].pBuf = calloc(1, pSelf->endpointMaxSizeBulkIn);
+			if (pSelf->bulkIn[loopCount].pBuf == NULL)  {
+				CAN4OSX_DEBUG_PRINT("%s : no memory for the bulk in buffers\n", __func__);
+				CAN4OSX_usbReleaseBulkIn(pSelf);
+				return;
+			}
+		}
+	}
+
+	pSelf->bulkInDepth = depth;
+	pSelf->bulkInSpare = depth;
+
+	for (loopCount = 0; loopCount < depth; loopCount++)  {
+		CAN4OSX_usbSubmitBulkIn(&pSelf->bulkIn[loopCount]);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_usbReleaseBulkIn - free the buffers of the bulk in transfers
+ *
+ * Completions arriving afterwards are ignored.
+ */
+void CAN4OSX_usbReleaseBulkIn(
+		Can4osxUsbDeviceHandleEntry *pSelf /**< pointer to my reference */
 	)
 {
-IOReturn ret = (*(pSelf->can4osxInterfaceInterface))->ReadPipeAsync(pSelf->can4osxInterfaceInterface, pSelf->endpointNumberBulkIn, pSelf->endpointBufferBulkInRef, pSelf->endpointMaxSizeBulkIn, pSelf->usbFunctions.bulkReadCompletion, (void*)pSelf);
+UInt32 loopCount;
+
+	for (loopCount = 0; loopCount <= CAN4OSX_USB_BULK_IN_MAX_DEPTH; loopCount++)  {
+		free(pSelf->bulkIn[loopCount].pBuf);
+	}
+	memset(pSelf->bulkIn, 0, sizeof(pSelf->bulkIn));
+	pSelf->endpointBufferBulkInRef = NULL;
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_usbSubmitBulkIn(
+		CAN4OSX_USB_BULK_IN_T *pXfer
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = pXfer->pSelf;
+IOReturn ret = CAN4OSX_usbReadPipeAsync(pSelf, pSelf->endpointNumberBulkIn, pXfer->pBuf, pSelf->endpointMaxSizeBulkIn, CAN4OSX_usbBulkInCompletion, (void*)pXfer);
 
 	if (ret != kIOReturnSuccess)  {
 		CAN4OSX_DEBUG_PRINT("Unable to read async interface (%08x)\n", ret);
@@ -107,4 +323,238 @@ IOReturn ret = (*(pSelf->can4osxInterfaceInterface))->ReadPipeAsync(pSelf->can4o
 }
 
 
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_usbBulkInCompletion - a bulk in transfer is finished
+ *
+ * The spare buffer is queued first, then the device specific completion
+ * decodes the data at endpointBufferBulkInRef. The completion time is the
+ * host reference of the timestamps in it. Called on the driver thread.
+ */
+static void CAN4OSX_usbBulkInCompletion(
+		void *refCon,
+		IOReturn result,
+		void *arg0
+	)
+{
+CAN4OSX_USB_BULK_IN_T *pXfer = (CAN4OSX_USB_BULK_IN_T *)refCon;
+Can4osxUsbDeviceHandleEntry *pSelf = pXfer->pSelf;
+UInt64 now;
+UInt32 spare;
+
+	// released by CAN4OSX_DeviceDetach
+	if ((pSelf == NULL) || (pXfer->pBuf == NULL))  {
+		return;
+	}
+
+	if (result == kIOReturnSuccess)  {
+		spare = pSelf->bulkInSpare;
+		pSelf->bulkInSpare = (UInt32)(pXfer - pSelf->bulkIn);
+		CAN4OSX_usbSubmitBulkIn(&pSelf->bulkIn[spare]);
+	}
+
+	pSelf->endpointBufferBulkInRef = pXfer->pBuf;
+	now = CAN4OSX_GetNanoseconds();
+	if (pSelf->pTimestamp != NULL)  {
+		pSelf->pTimestamp->transferHostNs = now;
+	}
+#if CAN4OSX_TRACE
+	CAN4OSX_TraceRxTransfer(pSelf, now, (UInt32)(uintptr_t)arg0);
+#endif /* CAN4OSX_TRACE */
+	pSelf->usbFunctions.bulkReadCompletion(pSelf, result, arg0);
+#if CAN4OSX_TRACE
+	CAN4OSX_TraceRxTransferDone(pSelf, now);
+#endif /* CAN4OSX_TRACE */
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_usbCreateBulkOut - buffers of the bulk out transfers
+ *
+ * Every channel gets its own, a cloned channel brings the ones of the
+ * original. bulkOutDepth may be set before, 0 selects the default.
+ *
+ * \return IOReturn
+ */
+IOReturn CAN4OSX_usbCreateBulkOut(
+		Can4osxUsbDeviceHandleEntry *pSelf /**< pointer to my reference */
+	)
+{
+UInt32 depth = pSelf->bulkOutDepth;
+UInt32 loopCount;
+
+	if (depth == 0u)  {
+		depth = CAN4OSX_USB_BULK_OUT_DEPTH;
+	} else if (depth > CAN4OSX_USB_BULK_OUT_MAX_DEPTH)  {
+		depth = CAN4OSX_USB_BULK_OUT_MAX_DEPTH;
+	}
+
+	pthread_mutex_init(&pSelf->bulkOutMutex, NULL);
+	memset(pSelf->bulkOut, 0, sizeof(pSelf->bulkOut));
+	memset(&pSelf->txStatistics, 0, sizeof(pSelf->txStatistics));
+	pSelf->bulkOutBusy = 0u;
+	pSelf->bulkOutInFlight = 0u;
+	pSelf->bulkOutDepth = 0u;
+
+	for (loopCount = 0; loopCount < depth; loopCount++)  {
+		pSelf->bulkOut[loopCount].pSelf = pSelf;
+		pSelf->bulkOut[loopCount].pBuf = calloc(1, pSelf->endpointMaxSizeBulkOut);
+		if (pSelf->bulkOut[loopCount].pBuf == NULL)  {
+			CAN4OSX_DEBUG_PRINT("%s : no memory for the bulk out buffers\n", __func__);
+			CAN4OSX_usbReleaseBulkOut(pSelf);
+			return(kIOReturnNoMemory);
+		}
+	}
+
+	pSelf->bulkOutDepth = depth;
+
+	return(kIOReturnSuccess);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_usbReleaseBulkOut - free the buffers of the bulk out transfers
+ *
+ * Completions arriving afterwards are ignored.
+ */
+void CAN4OSX_usbReleaseBulkOut(
+		Can4osxUsbDeviceHandleEntry *pSelf /**< pointer to my reference */
+	)
+{
+UInt32 loopCount;
+
+	pthread_mutex_lock(&pSelf->bulkOutMutex);
+
+	if (pSelf->bulkOut[0].pSelf == pSelf)  {
+		for (loopCount = 0; loopCount < CAN4OSX_USB_BULK_OUT_MAX_DEPTH; loopCount++)  {
+			free(pSelf->bulkOut[loopCount].pBuf);
+		}
+	}
+	memset(pSelf->bulkOut, 0, sizeof(pSelf->bulkOut));
+	pSelf->bulkOutDepth = 0u;
+	pSelf->bulkOutBusy = 0u;
+	pSelf->bulkOutInFlight = 0u;
+
+	pthread_mutex_unlock(&pSelf->bulkOutMutex);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_usbWriteToBulkOutPipe - send the transmit buffer
+ *
+ * Fills and queues transfers until the transmit buffer is empty or all
+ * bulkOutDepth transfers are in flight, the next batch is staged while the
+ * previous one is still on the wire. Called from the writers and from the
+ * completions.
+ */
+void CAN4OSX_usbWriteToBulkOutPipe(
+		Can4osxUsbDeviceHandleEntry *pSelf /**< pointer to my reference */
+	)
+{
+CAN4OSX_USB_BULK_OUT_T *pXfer;
+UInt32 loopCount;
+UInt32 size;
+UInt32 frames;
+IOReturn ret;
+
+	if (pSelf->usbFunctions.bulkWriteFill == NULL)  {
+		return;
+	}
+
+	pthread_mutex_lock(&pSelf->bulkOutMutex);
+
+	for (loopCount = 0; loopCount < pSelf->bulkOutDepth; loopCount++)  {
+		if ((pSelf->bulkOutBusy & (1u << loopCount)) != 0u)  {
+			continue;
+		}
+
+		pXfer = &pSelf->bulkOut[loopCount];
+		frames = 0u;
+		size = pSelf->usbFunctions.bulkWriteFill(pSelf, pXfer->pBuf, pSelf->endpointMaxSizeBulkOut, &frames);
+		if (size == 0u)  {
+			break;
+		}
+
+		pXfer->frames = frames;
+		pXfer->submitted = CAN4OSX_GetNanoseconds();
+		pSelf->bulkOutBusy |= (1u << loopCount);
+
+		ret = CAN4OSX_usbWritePipeAsync(pSelf, pSelf->endpointNumberBulkOut, pXfer->pBuf, size, CAN4OSX_usbBulkOutCompletion, (void*)pXfer);
+		if (ret != kIOReturnSuccess)  {
+			CAN4OSX_DEBUG_PRINT("Unable to perform asynchronous bulk write (%08x)\n", ret);
+			pSelf->bulkOutBusy &= ~(1u << loopCount);
+			pthread_mutex_unlock(&pSelf->bulkOutMutex);
+			CAN4OSX_usbClose(pSelf);
+			return;
+		}
+
+		CAN4OSX_TRACE_EVENT(CAN4OSX_TRACE_BULK_OUT_SUBMIT, pSelf->channelNumber, frames);
+		pSelf->bulkOutInFlight++;
+		if (pSelf->bulkOutInFlight > pSelf->txStatistics.inFlightMax)  {
+			pSelf->txStatistics.inFlightMax = pSelf->bulkOutInFlight;
+		}
+	}
+
+	pthread_mutex_unlock(&pSelf->bulkOutMutex);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_usbBulkOutCompletion - a bulk out transfer is finished
+ *
+ * Counts the transfer and refills it. Called on the driver thread.
+ */
+static void CAN4OSX_usbBulkOutCompletion(
+		void *refCon,
+		IOReturn result,
+		void *arg0
+	)
+{
+CAN4OSX_USB_BULK_OUT_T *pXfer = (CAN4OSX_USB_BULK_OUT_T *)refCon;
+Can4osxUsbDeviceHandleEntry *pSelf = pXfer->pSelf;
+UInt64 latency;
+UInt32 frames;
+
+	(void)arg0;
+
+	// released by CAN4OSX_DeviceDetach
+	if ((pSelf == NULL) || (pXfer->pBuf == NULL))  {
+		return;
+	}
+
+	latency = CAN4OSX_GetNanoseconds() - pXfer->submitted;
+	CAN4OSX_TRACE_EVENT(CAN4OSX_TRACE_BULK_OUT_DONE, pSelf->channelNumber, latency);
+
+	pthread_mutex_lock(&pSelf->bulkOutMutex);
+	// the transfer may be refilled as soon as it is free
+	frames = pXfer->frames;
+	pSelf->bulkOutBusy &= ~(1u << (pXfer - pSelf->bulkOut));
+	pSelf->bulkOutInFlight--;
+	if (result == kIOReturnSuccess)  {
+		pSelf->txStatistics.transfers++;
+		pSelf->txStatistics.frames += frames;
+		pSelf->txStatistics.latencyLast = latency;
+		pSelf->txStatistics.latencySum += latency;
+		if (latency > pSelf->txStatistics.latencyMax)  {
+			pSelf->txStatistics.latencyMax = latency;
+		}
+	}
+	pthread_mutex_unlock(&pSelf->bulkOutMutex);
 
+	if (result != kIOReturnSuccess)  {
+		CAN4OSX_DEBUG_PRINT("error from asynchronous bulk write (%08x)\n", result);
+		CAN4OSX_usbClose(pSelf);
+		return;
+	}
+
+	// an adapter without TX acks, its frames are done with the transfer
+	if (pSelf->txTrack.byTransfer)  {
+		CAN4OSX_AckTxFramesInOrder(pSelf, frames);
+	}
+
+	CAN4OSX_usbWriteToBulkOutPipe(pSelf);
+}
@@ -47,18 +47,25 @@
 
 #include <stdio.h>
 
-#include <CoreFoundation/CoreFoundation.h>
-#include <IOKit/IOKitLib.h>
-#include <IOKit/IOMessage.h>
-#include <IOKit/IOCFPlugIn.h>
-#include <IOKit/usb/IOUSBLib.h>
-
 #include "can4osx.h"
 #include "can4osx_internal.h"
 
 
+IOReturn CAN4OSX_usbReadPipeAsync(Can4osxUsbDeviceHandleEntry *pSelf, UInt8 pipeRef, void *pBuf, UInt32 size, CAN4OSX_USB_COMPLETION_T callback, void *refCon);
+IOReturn CAN4OSX_usbWritePipeAsync(Can4osxUsbDeviceHandleEntry *pSelf, UInt8 pipeRef, void *pBuf, UInt32 size, CAN4OSX_USB_COMPLETION_T callback, void *refCon);
+IOReturn CAN4OSX_usbReadPipe(Can4osxUsbDeviceHandleEntry *pSelf, UInt8 pipeRef, void *pBuf, UInt32 *pSize, UInt32 timeoutMs);
+IOReturn CAN4OSX_usbWritePipe(Can4osxUsbDeviceHandleEntry *pSelf, UInt8 pipeRef, void *pBuf, UInt32 size, UInt32 timeoutMs);
+IOReturn CAN4OSX_usbControlRequest(Can4osxUsbDeviceHandleEntry *pSelf, CAN4OSX_USB_CONTROL_T *pRequest);
+void CAN4OSX_usbClose(Can4osxUsbDeviceHandleEntry *pSelf);
+
+void CAN4OSX_usbLockCommand(Can4osxUsbDeviceHandleEntry *pSelf);
+void CAN4OSX_usbUnlockCommand(Can4osxUsbDeviceHandleEntry *pSelf);
 canStatus CAN4OSX_usbSendCommand(Can4osxUsbDeviceHandleEntry *pSelf, void *pCmd, size_t cmdLen);
 void CAN4OSX_usbReadFromBulkInPipe(Can4osxUsbDeviceHandleEntry *pSelf);
+void CAN4OSX_usbReleaseBulkIn(Can4osxUsbDeviceHandleEntry *pSelf);
+IOReturn CAN4OSX_usbCreateBulkOut(Can4osxUsbDeviceHandleEntry *pSelf);
+void CAN4OSX_usbReleaseBulkOut(Can4osxUsbDeviceHandleEntry *pSelf);
+void CAN4OSX_usbWriteToBulkOutPipe(Can4osxUsbDeviceHandleEntry *pSelf);
 
 
 #endif /* CAN4OSX_USB_CORE_H */
@@ -0,0 +1,853 @@
+//
+//  can4osx_usb_iokit.c
+//
+//
+// Copyright (c) 2014 - 2018 Alexander Philipp. All rights reserved.
+//
+//
+// License: GPLv2
+//
+// =============================================================================
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation version 2
+// of the license.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street,
+// Fifth Floor, Boston, MA  02110-1301, USA.
+//
+// =============================================================================
+//
+// Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE
+// AUTHOR MAKES NO WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+// THE IMPLIED WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR
+// IN COMBINATION WITH YOUR PRODUCTS.
+//
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION
+// AND/OR DISTRIBUTION OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF
+// CONTRACT, TORT (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF
+// THE AUTHOR HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// =============================================================================
+//
+//
+// USB transport on top of the IOKit user client of macOS
+//
+
+
+#if defined(__APPLE__)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <IOKit/IOKitLib.h>
+#include <IOKit/IOMessage.h>
+#include <IOKit/IOCFPlugIn.h>
+#include <IOKit/usb/IOUSBLib.h>
+
+#include "can4osx_internal.h"
+#include "can4osx_debug.h"
+
+
+#define CAN4OSX_USB_INTERFACE IOUSBInterfaceInterface182
+
+
+/* device data of the transport, referenced by usbTransportRef */
+typedef struct {
+	IOUSBDeviceInterface182 **can4osxDeviceInterface;
+	CAN4OSX_USB_INTERFACE **can4osxInterfaceInterface;
+	io_object_t can4osxNotification;
+	// asynchronous transfers not completed yet, submitted under transferMutex
+	pthread_mutex_t transferMutex;
+	atomic_int pendingTransfers;
+	atomic_bool aborted;		// no more transfers, the pipes are aborted
+	Can4osxUsbDeviceHandleEntry *pEntry;
+	UInt8 setup;				// CAN4OSX_DeviceSetup is running, the worker owns the device
+	UInt8 removed;				// terminated meanwhile
+} CAN4OSX_IOKIT_DEVICE_T;
+
+/* refCon of an asynchronous transfer, the one of the caller is passed on */
+typedef struct {
+	CAN4OSX_IOKIT_DEVICE_T *pDev;
+	CAN4OSX_USB_COMPLETION_T callback;
+	void *refCon;
+} CAN4OSX_IOKIT_XFER_T;
+
+
+static IONotificationPortRef can4osxUsbNotificationPortRef = 0;
+static io_iterator_t *can4osxIoIterator = NULL;
+static CFRunLoopRef can4osxRunLoopRef = NULL;
+static UInt32 can4osxIoKitSetups = 0u;		// driver thread only
+
+
+static IOReturn CAN4OSX_IoKitStart(void);
+static void CAN4OSX_IoKitRun(void);
+static void CAN4OSX_IoKitStop(void);
+static IOReturn CAN4OSX_IoKitReadPipeAsync(Can4osxUsbDeviceHandleEntry *pSelf, UInt8 pipeRef, void *pBuf, UInt32 size, CAN4OSX_USB_COMPLETION_T callback, void *refCon);
+static IOReturn CAN4OSX_IoKitWritePipeAsync(Can4osxUsbDeviceHandleEntry *pSelf, UInt8 pipeRef, void *pBuf, UInt32 size, CAN4OSX_USB_COMPLETION_T callback, void *refCon);
+static IOReturn CAN4OSX_IoKitReadPipe(Can4osxUsbDeviceHandleEntry *pSelf, UInt8 pipeRef, void *pBuf, UInt32 *pSize, UInt32 timeoutMs);
+static IOReturn CAN4OSX_IoKitWritePipe(Can4osxUsbDeviceHandleEntry *pSelf, UInt8 pipeRef, void *pBuf, UInt32 size, UInt32 timeoutMs);
+static IOReturn CAN4OSX_IoKitControlRequest(Can4osxUsbDeviceHandleEntry *pSelf, CAN4OSX_USB_CONTROL_T *pRequest);
+static void CAN4OSX_IoKitClose(Can4osxUsbDeviceHandleEntry *pSelf);
+static IOReturn CAN4OSX_IoKitSubmit(Can4osxUsbDeviceHandleEntry *pSelf, UInt8 pipeRef, void *pBuf, UInt32 size, CAN4OSX_USB_COMPLETION_T callback, void *refCon, bool write);
+static void CAN4OSX_IoKitTransferDone(void *refCon, IOReturn result, void *arg0);
+
+static void CAN4OSX_DeviceAdded(void *refCon, io_iterator_t iterator);
+static Can4osxUsbDeviceHandleEntry* CAN4OSX_IoKitSetup(void *pContext, CanHandle hnd);
+static void CAN4OSX_IoKitSetupDone(CAN4OSX_IOKIT_DEVICE_T *pDev, Can4osxUsbDeviceHandleEntry *pEntry);
+static IOReturn CAN4OSX_ConfigureDevice(IOUSBDeviceInterface182 **dev);
+static IOReturn CAN4OSX_FindInterfaces(CAN4OSX_IOKIT_DEVICE_T *pDev, CAN4OSX_USB_DEVICE_DESC_T *pDesc);
+static void CAN4OSX_DeviceNotification(void *refCon, io_service_t service, natural_t messageType, void *messageArgument);
+static void CAN4OSX_IoKitAbort(CAN4OSX_IOKIT_DEVICE_T *pDev);
+static void CAN4OSX_IoKitCancel(CAN4OSX_IOKIT_DEVICE_T *pDev);
+static void CAN4OSX_IoKitRelease(CAN4OSX_IOKIT_DEVICE_T *pDev);
+
+
+const CAN4OSX_USB_TRANSPORT_T can4osxIoKitTransport = {
+	"IOKit",
+	CAN4OSX_IoKitStart,
+	CAN4OSX_IoKitRun,
+	CAN4OSX_IoKitStop,
+	CAN4OSX_IoKitReadPipeAsync,
+	CAN4OSX_IoKitWritePipeAsync,
+	CAN4OSX_IoKitReadPipe,
+	CAN4OSX_IoKitWritePipe,
+	CAN4OSX_IoKitControlRequest,
+	CAN4OSX_IoKitClose
+};
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_IoKitStart - register the matching notifications
+ *
+ * Devices already plugged in are attached right away.
+ *
+ * \return IOReturn
+ */
+static IOReturn CAN4OSX_IoKitStart(
+		void
+	)
+{
+UInt32 loopCount = 0;
+
+CFMutableDictionaryRef 	can4osxUsbMatchingDictRef;
+CFRunLoopSourceRef		can4osxRunLoopSourceRef;
+CFNumberRef				numberRef;
+
+	can4osxRunLoopRef = CFRunLoopGetCurrent();
+
+	can4osxIoIterator = calloc(can4osxSupportedDeviceCount, sizeof(io_iterator_t));
+	if (can4osxIoIterator == NULL)  {
+		return(kIOReturnNoMemory);
+	}
+
+	can4osxUsbNotificationPortRef = IONotificationPortCreate(kIOMasterPortDefault);
+	can4osxRunLoopSourceRef = IONotificationPortGetRunLoopSource(can4osxUsbNotificationPortRef);
+
+	CFRunLoopAddSource(can4osxRunLoopRef, can4osxRunLoopSourceRef, kCFRunLoopDefaultMode);
+
+
+	for ( loopCount = 0; loopCount < can4osxSupportedDeviceCount; loopCount++ ) {
+
+		can4osxUsbMatchingDictRef = IOServiceMatching(kIOUSBDeviceClassName);
+
+		// IOUSBDevice and its subclasses
+		if (can4osxUsbMatchingDictRef == NULL)  {
+			CAN4OSX_DEBUG_PRINT("%s : IOServiceMatching ret: NULL.\n",__func__);
+			return(kIOReturnError);
+		}
+
+		// Create a CFNumber for the idVendor and set the value in the dictionary
+		numberRef = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &can4osxSupportedDevices[loopCount].vendorId );
+		CFDictionarySetValue(can4osxUsbMatchingDictRef, CFSTR(kUSBVendorID), numberRef);
+		CFRelease(numberRef);
+
+		// Create a CFNumber for the idProduct and set the value in the dictionary
+		numberRef = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &can4osxSupportedDevices[loopCount].productId);
+		CFDictionarySetValue(can4osxUsbMatchingDictRef, CFSTR(kUSBProductID), numberRef);
+		CFRelease(numberRef);
+
+		IOServiceAddMatchingNotification(can4osxUsbNotificationPortRef, kIOFirstMatchNotification, can4osxUsbMatchingDictRef, CAN4OSX_DeviceAdded, NULL, &can4osxIoIterator[loopCount]);
+
+
+		numberRef = NULL;
+
+		CAN4OSX_DeviceAdded(NULL, can4osxIoIterator[loopCount]);
+
+	}
+
+	return(kIOReturnSuccess);
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_IoKitRun(
+		void
+	)
+{
+UInt32 loopCount = 0;
+
+	CFRunLoopRun();
+
+	// the workers still hand their devices back
+	while (can4osxIoKitSetups != 0u)  {
+		(void)CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.1, true);
+	}
+
+	// if the runloop is stopped release
+	for ( loopCount = 0; loopCount < can4osxSupportedDeviceCount; loopCount++ ) {
+		IOObjectRelease(can4osxIoIterator[loopCount]);
+	}
+	free(can4osxIoIterator);
+	can4osxIoIterator = NULL;
+
+	IONotificationPortDestroy(can4osxUsbNotificationPortRef);
+	can4osxUsbNotificationPortRef = 0;
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_IoKitStop(
+		void
+	)
+{
+	if (can4osxRunLoopRef != NULL)  {
+		CFRunLoopStop(can4osxRunLoopRef);
+	}
+}
+
+
+/******************************************************************************/
+static IOReturn CAN4OSX_IoKitReadPipeAsync(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+		UInt8 pipeRef,
+		void *pBuf,
+		UInt32 size,
+		CAN4OSX_USB_COMPLETION_T callback,
+		void *refCon
+	)
+{
+	return(CAN4OSX_IoKitSubmit(pSelf, pipeRef, pBuf, size, callback, refCon, false));
+}
+
+
+/******************************************************************************/
+static IOReturn CAN4OSX_IoKitWritePipeAsync(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+		UInt8 pipeRef,
+		void *pBuf,
+		UInt32 size,
+		CAN4OSX_USB_COMPLETION_T callback,
+		void *refCon
+	)
+{
+	return(CAN4OSX_IoKitSubmit(pSelf, pipeRef, pBuf, size, callback, refCon, true));
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_IoKitSubmit - queue an asynchronous transfer
+ *
+ * Submitted and counted in one go, CAN4OSX_IoKitCancel misses none. Refused
+ * once the pipes are aborted.
+ */
+static IOReturn CAN4OSX_IoKitSubmit(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+		UInt8 pipeRef,
+		void *pBuf,
+		UInt32 size,
+		CAN4OSX_USB_COMPLETION_T callback,
+		void *refCon,
+		bool write
+	)
+{
+CAN4OSX_IOKIT_DEVICE_T *pDev = (CAN4OSX_IOKIT_DEVICE_T *)pSelf->usbTransportRef;
+CAN4OSX_USB_INTERFACE **interface = pDev->can4osxInterfaceInterface;
+CAN4OSX_IOKIT_XFER_T *pXfer;
+IOReturn ret;
+
+	if (interface == NULL)  {
+		return(kIOReturnNoDevice);
+	}
+
+	pXfer = malloc(sizeof(CAN4OSX_IOKIT_XFER_T));
+	if (pXfer == NULL)  {
+		return(kIOReturnNoMemory);
+	}
+	pXfer->pDev = pDev;
+	pXfer->callback = callback;
+	pXfer->refCon = refCon;
+
+	pthread_mutex_lock(&pDev->transferMutex);
+	if (atomic_load_explicit(&pDev->aborted, memory_order_relaxed))  {
+		ret = kIOReturnNoDevice;
+	} else if (write)  {
+		ret = (*interface)->WritePipeAsync(interface, pipeRef, pBuf, size, CAN4OSX_IoKitTransferDone, pXfer);
+	} else {
+		ret = (*interface)->ReadPipeAsync(interface, pipeRef, pBuf, size, CAN4OSX_IoKitTransferDone, pXfer);
+	}
+	if (ret == kIOReturnSuccess)  {
+		atomic_fetch_add_explicit(&pDev->pendingTransfers, 1, memory_order_relaxed);
+	}
+	pthread_mutex_unlock(&pDev->transferMutex);
+
+	if (ret != kIOReturnSuccess)  {
+		free(pXfer);
+	}
+	return(ret);
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_IoKitTransferDone - completion of every asynchronous transfer
+ *
+ * Runs on the driver thread. The count is dropped last, the device data
+ * stays valid while the completion of the caller runs.
+ */
+static void CAN4OSX_IoKitTransferDone(
+		void *refCon,
+		IOReturn result,
+		void *arg0
+	)
+{
+CAN4OSX_IOKIT_XFER_T *pXfer = (CAN4OSX_IOKIT_XFER_T *)refCon;
+CAN4OSX_IOKIT_DEVICE_T *pDev = pXfer->pDev;
+
+	if (pXfer->callback != NULL)  {
+		pXfer->callback(pXfer->refCon, result, arg0);
+	}
+	free(pXfer);
+
+	atomic_fetch_sub_explicit(&pDev->pendingTransfers, 1, memory_order_release);
+}
+
+
+/******************************************************************************/
+static IOReturn CAN4OSX_IoKitReadPipe(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+		UInt8 pipeRef,
+		void *pBuf,
+		UInt32 *pSize,
+		UInt32 timeoutMs
+	)
+{
+CAN4OSX_IOKIT_DEVICE_T *pDev = (CAN4OSX_IOKIT_DEVICE_T *)pSelf->usbTransportRef;
+CAN4OSX_USB_INTERFACE **interface = pDev->can4osxInterfaceInterface;
+
+	if ((interface == NULL) || atomic_load_explicit(&pDev->aborted, memory_order_relaxed))  {
+		return(kIOReturnNoDevice);
+	}
+	if (timeoutMs == 0u)  {
+		return((*interface)->ReadPipe(interface, pipeRef, pBuf, pSize));
+	}
+	return((*interface)->ReadPipeTO(interface, pipeRef, pBuf, pSize, timeoutMs, timeoutMs));
+}
+
+
+/******************************************************************************/
+static IOReturn CAN4OSX_IoKitWritePipe(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+		UInt8 pipeRef,
+		void *pBuf,
+		UInt32 size,
+		UInt32 timeoutMs
+	)
+{
+CAN4OSX_IOKIT_DEVICE_T *pDev = (CAN4OSX_IOKIT_DEVICE_T *)pSelf->usbTransportRef;
+CAN4OSX_USB_INTERFACE **interface = pDev->can4osxInterfaceInterface;
+
+	if ((interface == NULL) || atomic_load_explicit(&pDev->aborted, memory_order_relaxed))  {
+		return(kIOReturnNoDevice);
+	}
+	if (timeoutMs == 0u)  {
+		return((*interface)->WritePipe(interface, pipeRef, pBuf, size));
+	}
+	return((*interface)->WritePipeTO(interface, pipeRef, pBuf, size, timeoutMs, timeoutMs));
+}
+
+
+/******************************************************************************/
+static IOReturn CAN4OSX_IoKitControlRequest(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+		CAN4OSX_USB_CONTROL_T *pRequest
+	)
+{
+CAN4OSX_IOKIT_DEVICE_T *pDev = (CAN4OSX_IOKIT_DEVICE_T *)pSelf->usbTransportRef;
+IOUSBDevRequest request;
+IOReturn retVal;
+
+	if (pDev->can4osxDeviceInterface == NULL)  {
+		return(kIOReturnNoDevice);
+	}
+
+	request.bmRequestType = pRequest->bmRequestType;
+	request.bRequest = pRequest->bRequest;
+	request.wValue = pRequest->wValue;
+	request.wIndex = pRequest->wIndex;
+	request.wLength = pRequest->wLength;
+	request.pData = pRequest->pData;
+	request.wLenDone = 0u;
+
+	retVal = (*(pDev->can4osxDeviceInterface))->DeviceRequest(pDev->can4osxDeviceInterface, &request);
+
+	pRequest->wLenDone = request.wLenDone;
+
+	return(retVal);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_IoKitClose - no more transfers after a fatal pipe error
+ *
+ * The pipes are aborted only, the interface is closed with the device in
+ * CAN4OSX_IoKitRelease once the aborted transfers are back.
+ */
+static void CAN4OSX_IoKitClose(
+		Can4osxUsbDeviceHandleEntry *pSelf
+	)
+{
+	CAN4OSX_IoKitAbort((CAN4OSX_IOKIT_DEVICE_T *)pSelf->usbTransportRef);
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_DeviceAdded(
+		void *refCon,
+		io_iterator_t iterator
+	)
+{
+kern_return_t	kernRetVal;
+SInt32			score;
+HRESULT			result;
+
+io_service_t           can4osxUsbDevice;
+IOCFPlugInInterface  **can4osxPluginInterface = NULL;
+CAN4OSX_IOKIT_DEVICE_T *pDev;
+
+	while ( (can4osxUsbDevice = IOIteratorNext(iterator) ) )  {
+
+		kernRetVal = IOCreatePlugInInterfaceForService(can4osxUsbDevice, kIOUSBDeviceUserClientTypeID, kIOCFPlugInInterfaceID,
+											   &can4osxPluginInterface, &score);
+
+		if ((kIOReturnSuccess != kernRetVal) || !can4osxPluginInterface)  {
+			CAN4OSX_DEBUG_PRINT("%s : IOCreatePlugInInterfaceForService ret: 0x%08x.\n",__func__,kernRetVal);
+			IOObjectRelease(can4osxUsbDevice);
+			continue;
+		}
+
+		pDev = calloc(1, sizeof(CAN4OSX_IOKIT_DEVICE_T));
+		if (pDev == NULL)  {
+			IODestroyPlugInInterface(can4osxPluginInterface);
+			IOObjectRelease(can4osxUsbDevice);
+			continue;
+		}
+		pthread_mutex_init(&pDev->transferMutex, NULL);
+		atomic_init(&pDev->pendingTransfers, 0);
+		atomic_init(&pDev->aborted, false);
+
+		// Use the plugin interface to retrieve the device interface.
+		result = (*can4osxPluginInterface)->QueryInterface(can4osxPluginInterface, CFUUIDGetUUIDBytes(kIOUSBDeviceInterfaceID),
+												 (LPVOID*) &(pDev->can4osxDeviceInterface));
+
+		// Now done with the plugin interface.
+		(*can4osxPluginInterface)->Release(can4osxPluginInterface);
+
+		if (result || (pDev->can4osxDeviceInterface == NULL) )  {
+			CAN4OSX_DEBUG_PRINT("%s : Could not create interface\n", __func__);
+			IODestroyPlugInInterface(can4osxPluginInterface);
+			IOObjectRelease(can4osxUsbDevice);
+			pthread_mutex_destroy(&pDev->transferMutex);
+			free(pDev);
+			continue;
+		}
+
+		kernRetVal = IOServiceAddInterestNotification(can4osxUsbNotificationPortRef,	// notifyPort
+											  can4osxUsbDevice,                         // service
+											  kIOGeneralInterest,                       // interestType
+											  CAN4OSX_DeviceNotification,               // callback
+											  pDev,	                                    // refCon
+											  &(pDev->can4osxNotification)	            // notification
+											  );
+
+		if (KERN_SUCCESS != kernRetVal)  {
+			CAN4OSX_DEBUG_PRINT("%s : IOServiceAddInterestNotification ret: 0x%08x.\n",__func__,kernRetVal);
+		}
+
+		// Done with this USB device; release the reference added by IOIteratorNext
+		(void)IOObjectRelease(can4osxUsbDevice);
+
+		// Opening and configuring takes a while, do it on a worker
+		pDev->setup = 1u;
+		can4osxIoKitSetups++;
+		CAN4OSX_DeviceSetup(CAN4OSX_IoKitSetup, pDev);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_IoKitSetup - open and configure the device and attach it
+ *
+ * Runs on a worker of CAN4OSX_DeviceSetup, the device is handed back to the
+ * run loop with CAN4OSX_IoKitSetupDone.
+ *
+ * \return the first channel or NULL
+ */
+static Can4osxUsbDeviceHandleEntry* CAN4OSX_IoKitSetup(
+		void *pContext,
+		CanHandle hnd
+	)
+{
+CAN4OSX_IOKIT_DEVICE_T *pDev = (CAN4OSX_IOKIT_DEVICE_T *)pContext;
+Can4osxUsbDeviceHandleEntry *pEntry = NULL;
+CAN4OSX_USB_DEVICE_DESC_T desc;
+kern_return_t kernRetVal;
+UInt16 vendorId;
+UInt16 productId;
+
+	// Open the device to change its state
+	kernRetVal = (*pDev->can4osxDeviceInterface)->USBDeviceOpen(pDev->can4osxDeviceInterface);
+	if (kernRetVal != kIOReturnSuccess)  {
+		CAN4OSX_DEBUG_PRINT("%s : Unable to open device: %08x\n", __func__,kernRetVal);
+		(void) (*pDev->can4osxDeviceInterface)->Release(pDev->can4osxDeviceInterface);
+		pDev->can4osxDeviceInterface = NULL;
+	} else {
+		//Configure device
+		kernRetVal = CAN4OSX_ConfigureDevice(pDev->can4osxDeviceInterface);
+		if (kernRetVal != kIOReturnSuccess)  {
+			CAN4OSX_DEBUG_PRINT("%s : Unable to configure device: %08x\n", __func__,kernRetVal);
+		} else {
+			memset(&desc, 0, sizeof(desc));
+
+			/*kernRetVal = */CAN4OSX_FindInterfaces(pDev, &desc);
+
+			// Read out the IDs of the device
+			vendorId = 0u;
+			productId = 0u;
+			(*pDev->can4osxDeviceInterface)->GetDeviceVendor(pDev->can4osxDeviceInterface, &vendorId);
+			(*pDev->can4osxDeviceInterface)->GetDeviceProduct(pDev->can4osxDeviceInterface, &productId);
+
+			desc.vendorId = vendorId;
+			desc.productId = productId;
+			desc.usbTransportRef = pDev;
+
+			pEntry = CAN4OSX_DeviceAttach(&can4osxIoKitTransport, &desc, hnd);
+		}
+	}
+
+	CFRunLoopPerformBlock(can4osxRunLoopRef, kCFRunLoopDefaultMode, ^{
+		CAN4OSX_IoKitSetupDone(pDev, pEntry);
+	});
+	CFRunLoopWakeUp(can4osxRunLoopRef);
+
+	return(pEntry);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_IoKitSetupDone - the run loop takes the device back
+ *
+ * A device that failed or was terminated during its setup is released.
+ */
+static void CAN4OSX_IoKitSetupDone(
+		CAN4OSX_IOKIT_DEVICE_T *pDev,
+		Can4osxUsbDeviceHandleEntry *pEntry
+	)
+{
+	pDev->setup = 0u;
+	can4osxIoKitSetups--;
+
+	if ((pDev->removed == 0u) && (pEntry != NULL))  {
+		pDev->pEntry = pEntry;
+		return;
+	}
+
+	// the buffers of the transfers go with the channels
+	CAN4OSX_IoKitCancel(pDev);
+	if (pEntry != NULL)  {
+		CAN4OSX_DeviceDetach(pEntry);
+	}
+	CAN4OSX_IoKitRelease(pDev);
+}
+
+
+/******************************************************************************/
+static IOReturn CAN4OSX_ConfigureDevice(
+		IOUSBDeviceInterface182 **dev
+	)
+{
+UInt8 numConfig;
+IOReturn kr;
+IOUSBConfigurationDescriptorPtr configDesc;
+
+	/*kr = */(*dev)->GetNumberOfConfigurations(dev, &numConfig);
+	if (!numConfig)  {
+		return(-1);
+	}
+	//Get the configuration descriptor for index 0
+	kr = (*dev)->GetConfigurationDescriptorPtr(dev, 0, &configDesc);
+	if (kr)  {
+		CAN4OSX_DEBUG_PRINT("%s : Could not get configuration descriptor for index %d (err = %08x)\n",__func__, 0, (unsigned int)kr);
+		return(-1);
+	}
+	//Set the device’s configuration.
+	kr = (*dev)->SetConfiguration(dev, configDesc->bConfigurationValue);
+	if (kr)  {
+		CAN4OSX_DEBUG_PRINT("%s : Could not set configuration to value %d (err = %08x)\n",__func__, 0, (unsigned int)kr);
+		return(-1);
+	}
+	return(kIOReturnSuccess);
+}
+
+
+/******************************************************************************/
+static IOReturn CAN4OSX_FindInterfaces(
+		CAN4OSX_IOKIT_DEVICE_T *pDev,
+		CAN4OSX_USB_DEVICE_DESC_T *pDesc
+	)
+{
+IOReturn ret, ret2;
+IOUSBFindInterfaceRequest request;
+io_iterator_t iterator;
+io_service_t usbInterface;
+IOCFPlugInInterface **plugInInterface = NULL;
+CAN4OSX_USB_INTERFACE **interface = NULL;
+HRESULT result;
+SInt32 score;
+UInt8 interfaceNumEndpoints;
+IOUSBDeviceInterface182 **device = pDev->can4osxDeviceInterface;
+int loopCount = 1;
+
+CFRunLoopSourceRef runLoopSource;
+
+	request.bInterfaceClass	= kIOUSBFindInterfaceDontCare;
+	request.bInterfaceSubClass = kIOUSBFindInterfaceDontCare;
+	request.bInterfaceProtocol = kIOUSBFindInterfaceDontCare;
+	request.bAlternateSetting  = kIOUSBFindInterfaceDontCare;
+
+	//Get an iterator for the interfaces on the device
+	ret = (*device)->CreateInterfaceIterator(device, &request, &iterator);
+
+	if ( ret != kIOReturnSuccess )  {
+		CAN4OSX_DEBUG_PRINT("%s : Could not create InterfaceIterator\n",__func__);
+		return(ret);
+	}
+
+	while ((usbInterface = IOIteratorNext(iterator)))  {
+		//Create an intermediate plug-in
+		ret = IOCreatePlugInInterfaceForService(usbInterface,
+											   kIOUSBInterfaceUserClientTypeID,
+											   kIOCFPlugInInterfaceID,
+											   &plugInInterface, &score);
+		//Release the usbInterface object after getting the plug-in
+		(void)IOObjectRelease(usbInterface);
+
+		if ((ret != kIOReturnSuccess) || !plugInInterface)  {
+			CAN4OSX_DEBUG_PRINT("%s : Unable to create a plug-in\n", __func__);
+			break;
+		}
+
+		//Now create the device interface for the interface
+		result = (*plugInInterface)->QueryInterface(plugInInterface, CFUUIDGetUUIDBytes(kIOUSBInterfaceInterfaceID), (LPVOID *) &interface);
+		//No longer need the intermediate plug-in
+		(*plugInInterface)->Release(plugInInterface);
+		if (result || !interface)  {
+			CAN4OSX_DEBUG_PRINT("%s : Could not create a device interface for the interface (%08x)\n", __func__,(int) result);
+			break;
+		}
+
+		//Now open the interface. This will cause the pipes associated with
+		//the endpoints in the interface descriptor to be instantiated
+		ret = (*interface)->USBInterfaceOpen(interface);
+		if (ret != kIOReturnSuccess)  {
+			CAN4OSX_DEBUG_PRINT("%s : Unable to open interface (%08x)\n", __func__,ret);
+			(void) (*interface)->Release(interface);
+			continue;
+		}
+
+		//Get the number of endpoints associated with this interface
+		ret = (*interface)->GetNumEndpoints(interface, &interfaceNumEndpoints);
+		if (ret != kIOReturnSuccess)  {
+			CAN4OSX_DEBUG_PRINT("%s : Unable to get number of endpoints (%08x)\n",__func__ ,ret);
+			(void) (*interface)->USBInterfaceClose(interface);
+			(void) (*interface)->Release(interface);
+			continue;
+		}
+
+		CAN4OSX_DEBUG_PRINT("%s : Interface has %d endpoints\n",__func__, interfaceNumEndpoints);
+
+		// Reset the endpoint numbers
+		pDesc->endpointNumberBulkIn = 0u;
+		pDesc->endpointNumberBulkOut = 0u;
+
+		for (loopCount = 1; loopCount <= interfaceNumEndpoints; loopCount++ ) {
+			UInt8 direction;
+			UInt8 number;
+			UInt8 transferType;
+			UInt16 maxPacketSize;
+			UInt8 interval;
+
+			ret2 = (*interface)->GetPipeProperties(interface, loopCount, &direction, &number, &transferType, &maxPacketSize, &interval);
+
+			if (ret2 != kIOReturnSuccess)  {
+				CAN4OSX_DEBUG_PRINT("%s : Unable to get properties of pipe %d (%08x)\n",__func__ ,loopCount, ret2);
+			} else {
+				if ( (direction == kUSBOut) && (transferType == kUSBBulk) )  {
+					CAN4OSX_DEBUG_PRINT("%s : Found BulkOut endpoint %d - maxPack: %d\n",__func__ ,loopCount, maxPacketSize);
+					if (pDesc->endpointNumberBulkOut == 0)  {
+						pDesc->endpointNumberBulkOut = loopCount;
+						pDesc->endpointMaxSizeBulkOut = maxPacketSize;
+					}
+				}
+
+				if ( (direction == kUSBIn) && (transferType == kUSBBulk) )  {
+					CAN4OSX_DEBUG_PRINT("%s : Found BulkIn endpoint %d - maxPack: %d\n",__func__ ,loopCount, maxPacketSize);
+					if (pDesc->endpointNumberBulkIn == 0u)  {
+						pDesc->endpointNumberBulkIn = loopCount;
+						pDesc->endpointMaxSizeBulkIn = maxPacketSize;
+					}
+				}
+			}
+		}
+
+		ret = (*interface)->CreateInterfaceAsyncEventSource(interface, &runLoopSource);
+
+		if (ret != kIOReturnSuccess)  {
+			CAN4OSX_DEBUG_PRINT("%s : Unable to create asynchronous event source (%08x)\n", __func__,ret);
+			(void) (*interface)->USBInterfaceClose(interface);
+			(void) (*interface)->Release(interface);
+			continue;
+		}
+		// called on a setup worker, the completions belong to the driver thread
+		CFRunLoopAddSource(can4osxRunLoopRef, runLoopSource, kCFRunLoopDefaultMode);
+		CAN4OSX_DEBUG_PRINT("%s : Asynchronous event source added to run loop\n", __func__);
+
+		//Save the interface
+		pDev->can4osxInterfaceInterface = interface;
+
+		//Right now only the first interface is supported
+		break;
+	}
+	return(ret);
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_DeviceNotification(
+		void *refCon, io_service_t service,
+		natural_t messageType,
+		void *messageArgument
+	)
+{
+CAN4OSX_IOKIT_DEVICE_T *pDev = (CAN4OSX_IOKIT_DEVICE_T *) refCon;
+
+	if (messageType == kIOMessageServiceIsTerminated)  {
+		if (pDev->setup != 0u)  {
+			pDev->removed = 1u;
+			return;
+		}
+		CAN4OSX_IoKitCancel(pDev);
+		if (pDev->pEntry != NULL)  {
+			CAN4OSX_DeviceDetach(pDev->pEntry);
+			pDev->pEntry = NULL;
+		}
+		CAN4OSX_IoKitRelease(pDev);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief CAN4OSX_IoKitAbort - refuse new transfers and abort the queued ones
+ *
+ * The aborted transfers complete on the driver thread later on.
+ */
+static void CAN4OSX_IoKitAbort(
+		CAN4OSX_IOKIT_DEVICE_T *pDev
+	)
+{
+CAN4OSX_USB_INTERFACE **interface = pDev->can4osxInterfaceInterface;
+UInt8 numEndpoints = 0u;
+UInt8 pipeRef;
+
+	pthread_mutex_lock(&pDev->transferMutex);
+	atomic_store_explicit(&pDev->aborted, true, memory_order_relaxed);
+	if ((interface != NULL) && ((*interface)->GetNumEndpoints(interface, &numEndpoints) == kIOReturnSuccess))  {
+		for (pipeRef = 1u; pipeRef <= numEndpoints; pipeRef++)  {
+			(void) (*interface)->AbortPipe(interface, pipeRef);
+		}
+	}
+	pthread_mutex_unlock(&pDev->transferMutex);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_IoKitCancel - abort all transfers and wait for them
+ *
+ * Called on the driver thread before the channels are detached, the
+ * transfers point into their buffers. The run loop is run until all the
+ * aborted completions are handled, an aborted transfer always completes.
+ */
+static void CAN4OSX_IoKitCancel(
+		CAN4OSX_IOKIT_DEVICE_T *pDev
+	)
+{
+	CAN4OSX_IoKitAbort(pDev);
+
+	while (atomic_load_explicit(&pDev->pendingTransfers, memory_order_acquire) > 0)  {
+		(void)CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.1, true);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_IoKitRelease - free the device data
+ *
+ * The transfers are gone already, see CAN4OSX_IoKitCancel.
+ */
+static void CAN4OSX_IoKitRelease(
+		CAN4OSX_IOKIT_DEVICE_T *pDev
+	)
+{
+	if (pDev->can4osxInterfaceInterface != NULL)  {
+		(void) (*pDev->can4osxInterfaceInterface)->USBInterfaceClose(pDev->can4osxInterfaceInterface);
+		(void) (*pDev->can4osxInterfaceInterface)->Release(pDev->can4osxInterfaceInterface);
+	}
+
+	if (pDev->can4osxDeviceInterface != NULL)  {
+		(void) (*pDev->can4osxDeviceInterface)->USBDeviceClose(pDev->can4osxDeviceInterface);
+		(void) (*pDev->can4osxDeviceInterface)->Release(pDev->can4osxDeviceInterface);
+	}
+
+	if (pDev->can4osxNotification != 0)  {
+		IOObjectRelease(pDev->can4osxNotification);
+	}
+
+	pthread_mutex_destroy(&pDev->transferMutex);
+	free(pDev);
+}
+
+#endif /* __APPLE__ */
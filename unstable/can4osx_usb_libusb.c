@@ -0,0 +1,843 @@
+//
+//  can4osx_usb_libusb.c
+//
+//
+// Copyright (c) 2014 - 2018 Alexander Philipp. All rights reserved.
+//
+//
+// License: GPLv2
+//
+// =============================================================================
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation version 2
+// of the license.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street,
+// Fifth Floor, Boston, MA  02110-1301, USA.
+//
+// =============================================================================
+//
+// Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE
+// AUTHOR MAKES NO WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+// THE IMPLIED WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR
+// IN COMBINATION WITH YOUR PRODUCTS.
+//
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION
+// AND/OR DISTRIBUTION OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF
+// CONTRACT, TORT (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF
+// THE AUTHOR HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// =============================================================================
+//
+//
+// USB transport on top of libusb-1.0, used on Linux and other systems
+// without IOKit. On macOS it is selected by defining CAN4OSX_USE_LIBUSB.
+//
+
+
+#if !defined(__APPLE__) || defined(CAN4OSX_USE_LIBUSB)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <libusb.h>
+
+#include "can4osx_internal.h"
+#include "can4osx_debug.h"
+
+
+/* highest pipe reference, pipes are counted from 1 like on IOKit */
+#define CAN4OSX_LIBUSB_MAX_PIPES		16u
+
+/* hotplug events are queued and handled outside of the libusb callback */
+#define CAN4OSX_LIBUSB_EVENT_QUEUE		16u
+
+#define CAN4OSX_LIBUSB_CONTROL_TIMEOUT	5000u
+#define CAN4OSX_LIBUSB_EVENT_TIMEOUT_US	100000
+
+
+/* user data of an asynchronous transfer, linked into the submitted ones */
+typedef struct CAN4OSX_LIBUSB_XFER_S {
+	struct CAN4OSX_LIBUSB_DEVICE_S *pDev;
+	struct libusb_transfer *pTransfer;
+	CAN4OSX_USB_COMPLETION_T callback;
+	void *refCon;
+	struct CAN4OSX_LIBUSB_XFER_S *pPrev;
+	struct CAN4OSX_LIBUSB_XFER_S *pNext;
+} CAN4OSX_LIBUSB_XFER_T;
+
+/* device data of the transport, referenced by usbTransportRef */
+typedef struct CAN4OSX_LIBUSB_DEVICE_S {
+	libusb_device *pDevice;
+	libusb_device_handle *pHandle;
+	int interfaceNumber;
+	UInt8 interfaceClaimed;
+	UInt8 pipeEndpoint[CAN4OSX_LIBUSB_MAX_PIPES + 1u];
+	atomic_int pendingTransfers;
+	// the submitted transfers, the list and cancelled under transferMutex
+	pthread_mutex_t transferMutex;
+	CAN4OSX_LIBUSB_XFER_T *pTransfers;
+	UInt8 cancelled;			// no more transfers, the device goes away
+	Can4osxUsbDeviceHandleEntry *pEntry;
+	UInt8 setup;				// CAN4OSX_DeviceSetup is running, the worker owns the device
+	UInt8 removed;				// unplugged meanwhile
+	atomic_int setupDone;
+	struct CAN4OSX_LIBUSB_DEVICE_S *pNext;
+} CAN4OSX_LIBUSB_DEVICE_T;
+
+typedef struct {
+	libusb_device *pDevice;
+	libusb_hotplug_event event;
+} CAN4OSX_LIBUSB_EVENT_T;
+
+
+static libusb_context *can4osxUsbContext = NULL;
+static libusb_hotplug_callback_handle can4osxHotplugHandle;
+static UInt8 can4osxHotplugRegistered = 0u;
+static atomic_int can4osxLibUsbStop;
+static CAN4OSX_LIBUSB_DEVICE_T *pCan4osxLibUsbDevices = NULL;
+static CAN4OSX_LIBUSB_EVENT_T can4osxLibUsbEvents[CAN4OSX_LIBUSB_EVENT_QUEUE];
+static UInt32 can4osxLibUsbEventCount = 0u;
+
+
+static IOReturn CAN4OSX_LibUsbStart(void);
+static void CAN4OSX_LibUsbRun(void);
+static void CAN4OSX_LibUsbStop(void);
+static IOReturn CAN4OSX_LibUsbReadPipeAsync(Can4osxUsbDeviceHandleEntry *pSelf, UInt8 pipeRef, void *pBuf, UInt32 size, CAN4OSX_USB_COMPLETION_T callback, void *refCon);
+static IOReturn CAN4OSX_LibUsbWritePipeAsync(Can4osxUsbDeviceHandleEntry *pSelf, UInt8 pipeRef, void *pBuf, UInt32 size, CAN4OSX_USB_COMPLETION_T callback, void *refCon);
+static IOReturn CAN4OSX_LibUsbReadPipe(Can4osxUsbDeviceHandleEntry *pSelf, UInt8 pipeRef, void *pBuf, UInt32 *pSize, UInt32 timeoutMs);
+static IOReturn CAN4OSX_LibUsbWritePipe(Can4osxUsbDeviceHandleEntry *pSelf, UInt8 pipeRef, void *pBuf, UInt32 size, UInt32 timeoutMs);
+static IOReturn CAN4OSX_LibUsbControlRequest(Can4osxUsbDeviceHandleEntry *pSelf, CAN4OSX_USB_CONTROL_T *pRequest);
+static void CAN4OSX_LibUsbClose(Can4osxUsbDeviceHandleEntry *pSelf);
+
+static int LIBUSB_CALL CAN4OSX_LibUsbHotplug(libusb_context *ctx, libusb_device *device, libusb_hotplug_event event, void *userData);
+static void LIBUSB_CALL CAN4OSX_LibUsbTransferDone(struct libusb_transfer *pTransfer);
+static void CAN4OSX_LibUsbHandleEvents(void);
+static void CAN4OSX_LibUsbDeviceAdded(libusb_device *pDevice);
+static Can4osxUsbDeviceHandleEntry* CAN4OSX_LibUsbSetup(void *pContext, CanHandle hnd);
+static void CAN4OSX_LibUsbFinishSetups(void);
+static void CAN4OSX_LibUsbDeviceRemoved(libusb_device *pDevice);
+static void CAN4OSX_LibUsbCancel(CAN4OSX_LIBUSB_DEVICE_T *pDev);
+static void CAN4OSX_LibUsbRelease(CAN4OSX_LIBUSB_DEVICE_T *pDev);
+static IOReturn CAN4OSX_LibUsbSubmit(Can4osxUsbDeviceHandleEntry *pSelf, UInt8 pipeRef, void *pBuf, UInt32 size, CAN4OSX_USB_COMPLETION_T callback, void *refCon);
+static IOReturn CAN4OSX_LibUsbError(int error);
+static IOReturn CAN4OSX_LibUsbTransferStatus(enum libusb_transfer_status status);
+
+
+const CAN4OSX_USB_TRANSPORT_T can4osxLibUsbTransport = {
+	"libusb",
+	CAN4OSX_LibUsbStart,
+	CAN4OSX_LibUsbRun,
+	CAN4OSX_LibUsbStop,
+	CAN4OSX_LibUsbReadPipeAsync,
+	CAN4OSX_LibUsbWritePipeAsync,
+	CAN4OSX_LibUsbReadPipe,
+	CAN4OSX_LibUsbWritePipe,
+	CAN4OSX_LibUsbControlRequest,
+	CAN4OSX_LibUsbClose
+};
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_LibUsbStart - init libusb and look for adapters
+ *
+ * With hotplug support the plugged in devices are reported by the
+ * enumeration of the hotplug registration, else the bus is scanned once.
+ *
+ * \return IOReturn
+ */
+static IOReturn CAN4OSX_LibUsbStart(
+		void
+	)
+{
+int ret;
+libusb_device **ppList;
+long count;
+long loopCount;
+
+	ret = libusb_init(&can4osxUsbContext);
+	if (ret != LIBUSB_SUCCESS)  {
+		CAN4OSX_DEBUG_PRINT("%s : libusb_init failed (%d)\n",__func__, ret);
+		return(CAN4OSX_LibUsbError(ret));
+	}
+
+	atomic_store(&can4osxLibUsbStop, 0);
+
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))  {
+		ret = libusb_hotplug_register_callback(can4osxUsbContext,
+				LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+				LIBUSB_HOTPLUG_ENUMERATE, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+				LIBUSB_HOTPLUG_MATCH_ANY, CAN4OSX_LibUsbHotplug, NULL, &can4osxHotplugHandle);
+		if (ret == LIBUSB_SUCCESS)  {
+			can4osxHotplugRegistered = 1u;
+			CAN4OSX_LibUsbHandleEvents();
+			return(kIOReturnSuccess);
+		}
+		CAN4OSX_DEBUG_PRINT("%s : hotplug registration failed (%d)\n",__func__, ret);
+	}
+
+	count = libusb_get_device_list(can4osxUsbContext, &ppList);
+	if (count < 0)  {
+		return(CAN4OSX_LibUsbError((int)count));
+	}
+	for (loopCount = 0; loopCount < count; loopCount++)  {
+		CAN4OSX_LibUsbDeviceAdded(ppList[loopCount]);
+	}
+	libusb_free_device_list(ppList, 1);
+
+	return(kIOReturnSuccess);
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_LibUsbRun(
+		void
+	)
+{
+struct timeval timeout;
+
+	while (atomic_load(&can4osxLibUsbStop) == 0)  {
+		timeout.tv_sec = 0;
+		timeout.tv_usec = CAN4OSX_LIBUSB_EVENT_TIMEOUT_US;
+		(void)libusb_handle_events_timeout_completed(can4osxUsbContext, &timeout, NULL);
+		CAN4OSX_LibUsbHandleEvents();
+		CAN4OSX_LibUsbFinishSetups();
+	}
+
+	if (can4osxHotplugRegistered != 0u)  {
+		libusb_hotplug_deregister_callback(can4osxUsbContext, can4osxHotplugHandle);
+		can4osxHotplugRegistered = 0u;
+	}
+
+	while (pCan4osxLibUsbDevices != NULL)  {
+		CAN4OSX_LibUsbDeviceRemoved(pCan4osxLibUsbDevices->pDevice);
+		// a device still being set up is removed when its worker is done
+		if ((pCan4osxLibUsbDevices != NULL) && (pCan4osxLibUsbDevices->setup != 0u))  {
+			timeout.tv_sec = 0;
+			timeout.tv_usec = CAN4OSX_LIBUSB_EVENT_TIMEOUT_US;
+			(void)libusb_handle_events_timeout_completed(can4osxUsbContext, &timeout, NULL);
+			CAN4OSX_LibUsbFinishSetups();
+		}
+	}
+
+	libusb_exit(can4osxUsbContext);
+	can4osxUsbContext = NULL;
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_LibUsbStop(
+		void
+	)
+{
+	atomic_store(&can4osxLibUsbStop, 1);
+}
+
+
+/******************************************************************************/
+static IOReturn CAN4OSX_LibUsbReadPipeAsync(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+		UInt8 pipeRef,
+		void *pBuf,
+		UInt32 size,
+		CAN4OSX_USB_COMPLETION_T callback,
+		void *refCon
+	)
+{
+	return(CAN4OSX_LibUsbSubmit(pSelf, pipeRef, pBuf, size, callback, refCon));
+}
+
+
+/******************************************************************************/
+static IOReturn CAN4OSX_LibUsbWritePipeAsync(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+		UInt8 pipeRef,
+		void *pBuf,
+		UInt32 size,
+		CAN4OSX_USB_COMPLETION_T callback,
+		void *refCon
+	)
+{
+	return(CAN4OSX_LibUsbSubmit(pSelf, pipeRef, pBuf, size, callback, refCon));
+}
+
+
+/******************************************************************************/
+static IOReturn CAN4OSX_LibUsbReadPipe(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+		UInt8 pipeRef,
+		void *pBuf,
+		UInt32 *pSize,
+		UInt32 timeoutMs
+	)
+{
+CAN4OSX_LIBUSB_DEVICE_T *pDev = (CAN4OSX_LIBUSB_DEVICE_T *)pSelf->usbTransportRef;
+int transferred = 0;
+int ret;
+
+	if (pDev->interfaceClaimed == 0u)  {
+		return(kIOReturnNoDevice);
+	}
+	if ((pipeRef == 0u) || (pipeRef > CAN4OSX_LIBUSB_MAX_PIPES) || (pDev->pipeEndpoint[pipeRef] == 0u))  {
+		return(kIOReturnBadArgument);
+	}
+
+	ret = libusb_bulk_transfer(pDev->pHandle, pDev->pipeEndpoint[pipeRef], pBuf, (int)*pSize, &transferred, timeoutMs);
+	*pSize = (UInt32)transferred;
+
+	return(CAN4OSX_LibUsbError(ret));
+}
+
+
+/******************************************************************************/
+static IOReturn CAN4OSX_LibUsbWritePipe(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+		UInt8 pipeRef,
+		void *pBuf,
+		UInt32 size,
+		UInt32 timeoutMs
+	)
+{
+CAN4OSX_LIBUSB_DEVICE_T *pDev = (CAN4OSX_LIBUSB_DEVICE_T *)pSelf->usbTransportRef;
+int transferred = 0;
+int ret;
+
+	if (pDev->interfaceClaimed == 0u)  {
+		return(kIOReturnNoDevice);
+	}
+	if ((pipeRef == 0u) || (pipeRef > CAN4OSX_LIBUSB_MAX_PIPES) || (pDev->pipeEndpoint[pipeRef] == 0u))  {
+		return(kIOReturnBadArgument);
+	}
+
+	ret = libusb_bulk_transfer(pDev->pHandle, pDev->pipeEndpoint[pipeRef], pBuf, (int)size, &transferred, timeoutMs);
+	if ((ret == LIBUSB_SUCCESS) && (transferred != (int)size))  {
+		return(kIOReturnError);
+	}
+
+	return(CAN4OSX_LibUsbError(ret));
+}
+
+
+/******************************************************************************/
+static IOReturn CAN4OSX_LibUsbControlRequest(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+		CAN4OSX_USB_CONTROL_T *pRequest
+	)
+{
+CAN4OSX_LIBUSB_DEVICE_T *pDev = (CAN4OSX_LIBUSB_DEVICE_T *)pSelf->usbTransportRef;
+int ret;
+
+	pRequest->wLenDone = 0u;
+
+	if (pDev->pHandle == NULL)  {
+		return(kIOReturnNoDevice);
+	}
+
+	ret = libusb_control_transfer(pDev->pHandle, pRequest->bmRequestType, pRequest->bRequest,
+								  pRequest->wValue, pRequest->wIndex, pRequest->pData,
+								  pRequest->wLength, CAN4OSX_LIBUSB_CONTROL_TIMEOUT);
+	if (ret < 0)  {
+		return(CAN4OSX_LibUsbError(ret));
+	}
+
+	pRequest->wLenDone = (UInt32)ret;
+
+	return(kIOReturnSuccess);
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_LibUsbClose(
+		Can4osxUsbDeviceHandleEntry *pSelf
+	)
+{
+CAN4OSX_LIBUSB_DEVICE_T *pDev = (CAN4OSX_LIBUSB_DEVICE_T *)pSelf->usbTransportRef;
+
+	if (pDev->interfaceClaimed != 0u)  {
+		(void)libusb_release_interface(pDev->pHandle, pDev->interfaceNumber);
+		pDev->interfaceClaimed = 0u;
+	}
+}
+
+
+/******************************************************************************/
+static IOReturn CAN4OSX_LibUsbSubmit(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+		UInt8 pipeRef,
+		void *pBuf,
+		UInt32 size,
+		CAN4OSX_USB_COMPLETION_T callback,
+		void *refCon
+	)
+{
+CAN4OSX_LIBUSB_DEVICE_T *pDev = (CAN4OSX_LIBUSB_DEVICE_T *)pSelf->usbTransportRef;
+struct libusb_transfer *pTransfer;
+CAN4OSX_LIBUSB_XFER_T *pXfer;
+int ret;
+
+	if (pDev->interfaceClaimed == 0u)  {
+		return(kIOReturnNoDevice);
+	}
+	if ((pipeRef == 0u) || (pipeRef > CAN4OSX_LIBUSB_MAX_PIPES) || (pDev->pipeEndpoint[pipeRef] == 0u))  {
+		return(kIOReturnBadArgument);
+	}
+
+	pTransfer = libusb_alloc_transfer(0);
+	pXfer = malloc(sizeof(CAN4OSX_LIBUSB_XFER_T));
+	if ((pTransfer == NULL) || (pXfer == NULL))  {
+		libusb_free_transfer(pTransfer);
+		free(pXfer);
+		return(kIOReturnNoMemory);
+	}
+
+	pXfer->pDev = pDev;
+	pXfer->pTransfer = pTransfer;
+	pXfer->callback = callback;
+	pXfer->refCon = refCon;
+	pXfer->pPrev = NULL;
+
+	libusb_fill_bulk_transfer(pTransfer, pDev->pHandle, pDev->pipeEndpoint[pipeRef], pBuf, (int)size,
+							  CAN4OSX_LibUsbTransferDone, pXfer, 0u);
+
+	// submitted and linked in one go, CAN4OSX_LibUsbCancel misses none
+	pthread_mutex_lock(&pDev->transferMutex);
+	if (pDev->cancelled != 0u)  {
+		ret = LIBUSB_ERROR_NO_DEVICE;
+	} else {
+		ret = libusb_submit_transfer(pTransfer);
+	}
+	if (ret == LIBUSB_SUCCESS)  {
+		atomic_fetch_add_explicit(&pDev->pendingTransfers, 1, memory_order_relaxed);
+		pXfer->pNext = pDev->pTransfers;
+		if (pDev->pTransfers != NULL)  {
+			pDev->pTransfers->pPrev = pXfer;
+		}
+		pDev->pTransfers = pXfer;
+	}
+	pthread_mutex_unlock(&pDev->transferMutex);
+
+	if (ret != LIBUSB_SUCCESS)  {
+		libusb_free_transfer(pTransfer);
+		free(pXfer);
+		return(CAN4OSX_LibUsbError(ret));
+	}
+
+	return(kIOReturnSuccess);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_LibUsbTransferDone - completion of an async transfer
+ *
+ * Runs inside libusb_handle_events on the driver thread and calls the
+ * completion of the backend like IOKit does, arg0 carries the byte count.
+ */
+static void LIBUSB_CALL CAN4OSX_LibUsbTransferDone(
+		struct libusb_transfer *pTransfer
+	)
+{
+CAN4OSX_LIBUSB_XFER_T *pXfer = (CAN4OSX_LIBUSB_XFER_T *)pTransfer->user_data;
+CAN4OSX_LIBUSB_DEVICE_T *pDev = pXfer->pDev;
+IOReturn result = CAN4OSX_LibUsbTransferStatus(pTransfer->status);
+uintptr_t length = (uintptr_t)pTransfer->actual_length;
+
+	pthread_mutex_lock(&pDev->transferMutex);
+	if (pXfer->pPrev != NULL)  {
+		pXfer->pPrev->pNext = pXfer->pNext;
+	} else {
+		pDev->pTransfers = pXfer->pNext;
+	}
+	if (pXfer->pNext != NULL)  {
+		pXfer->pNext->pPrev = pXfer->pPrev;
+	}
+	pthread_mutex_unlock(&pDev->transferMutex);
+
+	libusb_free_transfer(pTransfer);
+
+	// the device data stays until the count is 0, see CAN4OSX_LibUsbCancel
+	if (pXfer->callback != NULL)  {
+		pXfer->callback(pXfer->refCon, result, (void *)length);
+	}
+
+	free(pXfer);
+
+	atomic_fetch_sub_explicit(&pDev->pendingTransfers, 1, memory_order_release);
+}
+
+
+/******************************************************************************/
+static int LIBUSB_CALL CAN4OSX_LibUsbHotplug(
+		libusb_context *ctx,
+		libusb_device *device,
+		libusb_hotplug_event event,
+		void *userData
+	)
+{
+	(void)ctx;
+	(void)userData;
+
+	if (can4osxLibUsbEventCount >= CAN4OSX_LIBUSB_EVENT_QUEUE)  {
+		CAN4OSX_DEBUG_PRINT("%s : hotplug event lost\n",__func__);
+		return(0);
+	}
+
+	can4osxLibUsbEvents[can4osxLibUsbEventCount].pDevice = libusb_ref_device(device);
+	can4osxLibUsbEvents[can4osxLibUsbEventCount].event = event;
+	can4osxLibUsbEventCount++;
+
+	return(0);
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_LibUsbHandleEvents(
+		void
+	)
+{
+UInt32 loopCount;
+
+	for (loopCount = 0; loopCount < can4osxLibUsbEventCount; loopCount++)  {
+		if (can4osxLibUsbEvents[loopCount].event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)  {
+			CAN4OSX_LibUsbDeviceAdded(can4osxLibUsbEvents[loopCount].pDevice);
+		} else {
+			CAN4OSX_LibUsbDeviceRemoved(can4osxLibUsbEvents[loopCount].pDevice);
+		}
+		libusb_unref_device(can4osxLibUsbEvents[loopCount].pDevice);
+	}
+	can4osxLibUsbEventCount = 0u;
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_LibUsbDeviceAdded - a supported adapter is set up on a worker
+ *
+ * The device is listed right away, an unplug during the setup is handled by
+ * CAN4OSX_LibUsbFinishSetups.
+ */
+static void CAN4OSX_LibUsbDeviceAdded(
+		libusb_device *pDevice
+	)
+{
+struct libusb_device_descriptor devDesc;
+CAN4OSX_LIBUSB_DEVICE_T *pDev;
+
+	if (libusb_get_device_descriptor(pDevice, &devDesc) != LIBUSB_SUCCESS)  {
+		return;
+	}
+	if (CAN4OSX_IsSupportedDevice(devDesc.idVendor, devDesc.idProduct) == 0u)  {
+		return;
+	}
+
+	pDev = calloc(1, sizeof(CAN4OSX_LIBUSB_DEVICE_T));
+	if (pDev == NULL)  {
+		return;
+	}
+	pDev->pDevice = libusb_ref_device(pDevice);
+	pthread_mutex_init(&pDev->transferMutex, NULL);
+	pDev->setup = 1u;
+	atomic_init(&pDev->setupDone, 0);
+
+	pDev->pNext = pCan4osxLibUsbDevices;
+	pCan4osxLibUsbDevices = pDev;
+
+	CAN4OSX_DeviceSetup(CAN4OSX_LibUsbSetup, pDev);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_LibUsbSetup - open and claim the adapter and attach it
+ *
+ * Runs on a worker of CAN4OSX_DeviceSetup, a failed device is released by
+ * CAN4OSX_LibUsbFinishSetups on the driver thread.
+ *
+ * \return the first channel or NULL
+ */
+static Can4osxUsbDeviceHandleEntry* CAN4OSX_LibUsbSetup(
+		void *pContext,
+		CanHandle hnd
+	)
+{
+CAN4OSX_LIBUSB_DEVICE_T *pDev = (CAN4OSX_LIBUSB_DEVICE_T *)pContext;
+libusb_device *pDevice = pDev->pDevice;
+struct libusb_device_descriptor devDesc;
+struct libusb_config_descriptor *pConfig = NULL;
+const struct libusb_interface_descriptor *pInterface;
+CAN4OSX_USB_DEVICE_DESC_T desc;
+int loopCount;
+int ret;
+
+	(void)libusb_get_device_descriptor(pDevice, &devDesc);
+
+	ret = libusb_open(pDevice, &pDev->pHandle);
+	if (ret != LIBUSB_SUCCESS)  {
+		CAN4OSX_DEBUG_PRINT("%s : Unable to open device (%d)\n", __func__, ret);
+		atomic_store(&pDev->setupDone, 1);
+		return(NULL);
+	}
+
+	(void)libusb_set_auto_detach_kernel_driver(pDev->pHandle, 1);
+
+	//Use the configuration with index 0 like the IOKit transport
+	ret = libusb_get_config_descriptor(pDevice, 0, &pConfig);
+	if ((ret != LIBUSB_SUCCESS) || (pConfig->bNumInterfaces == 0u))  {
+		CAN4OSX_DEBUG_PRINT("%s : Could not get configuration descriptor (%d)\n", __func__, ret);
+		if (pConfig != NULL)  {
+			libusb_free_config_descriptor(pConfig);
+		}
+		atomic_store(&pDev->setupDone, 1);
+		return(NULL);
+	}
+
+	ret = libusb_set_configuration(pDev->pHandle, pConfig->bConfigurationValue);
+	if ((ret != LIBUSB_SUCCESS) && (ret != LIBUSB_ERROR_BUSY))  {
+		CAN4OSX_DEBUG_PRINT("%s : Could not set configuration (%d)\n", __func__, ret);
+	}
+
+	//Right now only the first interface is supported
+	pInterface = &pConfig->interface[0].altsetting[0];
+	pDev->interfaceNumber = pInterface->bInterfaceNumber;
+
+	ret = libusb_claim_interface(pDev->pHandle, pDev->interfaceNumber);
+	if (ret != LIBUSB_SUCCESS)  {
+		CAN4OSX_DEBUG_PRINT("%s : Unable to claim interface (%d)\n", __func__, ret);
+		libusb_free_config_descriptor(pConfig);
+		atomic_store(&pDev->setupDone, 1);
+		return(NULL);
+	}
+	pDev->interfaceClaimed = 1u;
+
+	memset(&desc, 0, sizeof(desc));
+
+	for (loopCount = 0; (loopCount < pInterface->bNumEndpoints) && (loopCount < (int)CAN4OSX_LIBUSB_MAX_PIPES); loopCount++)  {
+		const struct libusb_endpoint_descriptor *pEndpoint = &pInterface->endpoint[loopCount];
+		int pipeRef = loopCount + 1;
+
+		pDev->pipeEndpoint[pipeRef] = pEndpoint->bEndpointAddress;
+
+		if ((pEndpoint->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) != LIBUSB_TRANSFER_TYPE_BULK)  {
+			continue;
+		}
+		if ((pEndpoint->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN)  {
+			CAN4OSX_DEBUG_PRINT("%s : Found BulkIn endpoint %d - maxPack: %d\n",__func__ ,pipeRef, pEndpoint->wMaxPacketSize);
+			if (desc.endpointNumberBulkIn == 0)  {
+				desc.endpointNumberBulkIn = pipeRef;
+				desc.endpointMaxSizeBulkIn = pEndpoint->wMaxPacketSize;
+			}
+		} else {
+			CAN4OSX_DEBUG_PRINT("%s : Found BulkOut endpoint %d - maxPack: %d\n",__func__ ,pipeRef, pEndpoint->wMaxPacketSize);
+			if (desc.endpointNumberBulkOut == 0)  {
+				desc.endpointNumberBulkOut = pipeRef;
+				desc.endpointMaxSizeBulkOut = pEndpoint->wMaxPacketSize;
+			}
+		}
+	}
+
+	libusb_free_config_descriptor(pConfig);
+
+	desc.vendorId = devDesc.idVendor;
+	desc.productId = devDesc.idProduct;
+	desc.usbTransportRef = pDev;
+
+	pDev->pEntry = CAN4OSX_DeviceAttach(&can4osxLibUsbTransport, &desc, hnd);
+
+	// the driver thread takes over again
+	atomic_store(&pDev->setupDone, 1);
+
+	return(pDev->pEntry);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_LibUsbFinishSetups - the devices whose workers are done
+ *
+ * A device that failed or was unplugged during its setup is released.
+ */
+static void CAN4OSX_LibUsbFinishSetups(
+		void
+	)
+{
+CAN4OSX_LIBUSB_DEVICE_T **ppDev = &pCan4osxLibUsbDevices;
+CAN4OSX_LIBUSB_DEVICE_T *pDev;
+
+	while (*ppDev != NULL)  {
+		pDev = *ppDev;
+		if ((pDev->setup == 0u) || (atomic_load(&pDev->setupDone) == 0))  {
+			ppDev = &pDev->pNext;
+			continue;
+		}
+		pDev->setup = 0u;
+
+		if ((pDev->removed == 0u) && (pDev->pEntry != NULL))  {
+			ppDev = &pDev->pNext;
+			continue;
+		}
+
+		*ppDev = pDev->pNext;
+		CAN4OSX_LibUsbCancel(pDev);
+		if (pDev->pEntry != NULL)  {
+			CAN4OSX_DeviceDetach(pDev->pEntry);
+			pDev->pEntry = NULL;
+		}
+		CAN4OSX_LibUsbRelease(pDev);
+	}
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_LibUsbDeviceRemoved(
+		libusb_device *pDevice
+	)
+{
+CAN4OSX_LIBUSB_DEVICE_T **ppDev;
+CAN4OSX_LIBUSB_DEVICE_T *pDev;
+
+	for (ppDev = &pCan4osxLibUsbDevices; *ppDev != NULL; ppDev = &(*ppDev)->pNext)  {
+		pDev = *ppDev;
+		if (pDev->pDevice == pDevice)  {
+			if (pDev->setup != 0u)  {
+				pDev->removed = 1u;
+				return;
+			}
+			*ppDev = pDev->pNext;
+			// the buffers of the transfers go with the channels
+			CAN4OSX_LibUsbCancel(pDev);
+			if (pDev->pEntry != NULL)  {
+				CAN4OSX_DeviceDetach(pDev->pEntry);
+				pDev->pEntry = NULL;
+			}
+			CAN4OSX_LibUsbRelease(pDev);
+			return;
+		}
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_LibUsbCancel - cancel all transfers and wait for them
+ *
+ * Called on the driver thread before the channels are detached, the
+ * transfers point into their buffers. The completions still run, the
+ * transfers they submit again are refused. A cancelled transfer always
+ * completes, there is no timeout.
+ */
+static void CAN4OSX_LibUsbCancel(
+		CAN4OSX_LIBUSB_DEVICE_T *pDev
+	)
+{
+CAN4OSX_LIBUSB_XFER_T *pXfer;
+struct timeval timeout;
+
+	pthread_mutex_lock(&pDev->transferMutex);
+	pDev->cancelled = 1u;
+	for (pXfer = pDev->pTransfers; pXfer != NULL; pXfer = pXfer->pNext)  {
+		// fails for one that is completing already
+		(void)libusb_cancel_transfer(pXfer->pTransfer);
+	}
+	pthread_mutex_unlock(&pDev->transferMutex);
+
+	while (atomic_load_explicit(&pDev->pendingTransfers, memory_order_acquire) > 0)  {
+		timeout.tv_sec = 0;
+		timeout.tv_usec = CAN4OSX_LIBUSB_EVENT_TIMEOUT_US;
+		(void)libusb_handle_events_timeout_completed(can4osxUsbContext, &timeout, NULL);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_LibUsbRelease - free the device data
+ *
+ * The transfers are gone already, see CAN4OSX_LibUsbCancel, libusb does
+ * not allow to close a handle with transfers in flight.
+ */
+static void CAN4OSX_LibUsbRelease(
+		CAN4OSX_LIBUSB_DEVICE_T *pDev
+	)
+{
+	if (pDev->interfaceClaimed != 0u)  {
+		(void)libusb_release_interface(pDev->pHandle, pDev->interfaceNumber);
+		pDev->interfaceClaimed = 0u;
+	}
+
+	if (pDev->pHandle != NULL)  {
+		libusb_close(pDev->pHandle);
+	}
+	libusb_unref_device(pDev->pDevice);
+
+	pthread_mutex_destroy(&pDev->transferMutex);
+	free(pDev);
+}
+
+
+/******************************************************************************/
+static IOReturn CAN4OSX_LibUsbError(
+		int error
+	)
+{
+	switch (error) {
+		case LIBUSB_SUCCESS:
+			return(kIOReturnSuccess);
+		case LIBUSB_ERROR_TIMEOUT:
+			return(kIOReturnTimeout);
+		case LIBUSB_ERROR_NO_DEVICE:
+			return(kIOReturnNoDevice);
+		case LIBUSB_ERROR_NO_MEM:
+			return(kIOReturnNoMemory);
+		case LIBUSB_ERROR_ACCESS:
+		case LIBUSB_ERROR_BUSY:
+			return(kIOReturnExclusiveAccess);
+		case LIBUSB_ERROR_INVALID_PARAM:
+			return(kIOReturnBadArgument);
+		case LIBUSB_ERROR_NOT_SUPPORTED:
+			return(kIOReturnUnsupported);
+		case LIBUSB_ERROR_OVERFLOW:
+			return(kIOReturnOverrun);
+		default:
+			return(kIOReturnError);
+	}
+}
+
+
+/******************************************************************************/
+static IOReturn CAN4OSX_LibUsbTransferStatus(
+		enum libusb_transfer_status status
+	)
+{
+	switch (status) {
+		case LIBUSB_TRANSFER_COMPLETED:
+			return(kIOReturnSuccess);
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			return(kIOReturnTimeout);
+		case LIBUSB_TRANSFER_CANCELLED:
+			return(kIOReturnAborted);
+		case LIBUSB_TRANSFER_NO_DEVICE:
+			return(kIOReturnNoDevice);
+		case LIBUSB_TRANSFER_OVERFLOW:
+			return(kIOReturnOverrun);
+		default:
+			return(kIOReturnError);
+	}
+}
+
+#endif /* !__APPLE__ || CAN4OSX_USE_LIBUSB */
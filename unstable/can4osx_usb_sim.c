@@ -0,0 +1,2436 @@
+//
+//  can4osx_usb_sim.c
+//
+//
+// Copyright (c) 2014 - 2018 Alexander Philipp. All rights reserved.
+//
+//
+// License: GPLv2
+//
+// =============================================================================
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation version 2
+// of the license.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street,
+// Fifth Floor, Boston, MA  02110-1301, USA.
+//
+// =============================================================================
+//
+// Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE
+// AUTHOR MAKES NO WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+// THE IMPLIED WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR
+// IN COMBINATION WITH YOUR PRODUCTS.
+//
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION
+// AND/OR DISTRIBUTION OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF
+// CONTRACT, TORT (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF
+// THE AUTHOR HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// =============================================================================
+//
+//
+// Simulated usb transport. Every virtual adapter answers the requests of the
+// device drivers like the real hardware does: the Kvaser Leaf with leafCmd
+// commands, the Leaf Pro with proCommand_t/proCommandExt_t commands and hydra
+// addressing, the IXXAT USB-to-CAN FD with its control requests and
+// IXXUSBFDCANMSG_T frames and the Peak PCAN-USB FD with its command lists and
+// 32 bit aligned records. Frames written by the driver are looped back to
+// the other channels of the adapter, a load generator per channel feeds
+// received frames up to the full bus rate.
+//
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "can4osx.h"
+#include "can4osx_debug.h"
+#include "can4osx_internal.h"
+#include "can4osx_sim.h"
+
+#include "kvaserLeaf.h"
+#include "kvaserLeafPro.h"
+#include "ixxatUsbFd.h"
+#include "peakUsbFd.h"
+
+
+#define CAN4OSX_SIM_MAX_ADAPTERS		16u
+#define CAN4OSX_SIM_MAX_CHANNELS		5u
+#define CAN4OSX_SIM_PACKET_SIZE			512u
+#define CAN4OSX_SIM_PIPE_IN				1u
+#define CAN4OSX_SIM_PIPE_OUT			2u
+
+/* outstanding transfers of one adapter */
+#define CAN4OSX_SIM_MAX_READS			(CAN4OSX_USB_BULK_IN_MAX_DEPTH * CAN4OSX_SIM_MAX_CHANNELS)
+#define CAN4OSX_SIM_MAX_WRITES			64u
+#define CAN4OSX_SIM_RESPONSES			32u
+/* completions delivered per pass of the run loop */
+#define CAN4OSX_SIM_COMPLETIONS			32u
+/* received frames one channel buffers, like the fifo of the real adapters */
+#define CAN4OSX_SIM_RX_FIFO_SIZE		1024u
+/* marks the copy of a sent frame the adapter acks, the tx id is in canTimestamp */
+#define CAN4OSX_SIM_TX_DONE				1u
+
+#define CAN4OSX_SIM_IDLE_MS				100u
+#define CAN4OSX_SIM_DEFAULT_BITRATE		500000u
+#define CAN4OSX_SIM_SERIAL				10000u
+
+/* time a bulk out transfer takes on a high speed bus */
+#define CAN4OSX_SIM_USB_TRANSFER_NS		1000u
+#define CAN4OSX_SIM_USB_BYTE_NS			17u
+
+#define CAN4OSX_SIM_LEAF				0u
+#define CAN4OSX_SIM_LEAFPRO				1u
+#define CAN4OSX_SIM_IXXAT				2u
+#define CAN4OSX_SIM_PEAK				3u
+
+/* Leaf Pro: hydra entity of the first CAN channel and the debug entity */
+#define CAN4OSX_SIM_HE_CAN				0x11u
+#define CAN4OSX_SIM_HE_SYSDBG			0x02u
+#define CAN4OSX_SIM_HE_MAX_CHANNELS		LEAFPRO_MAX_CHANNELS
+
+/* IXXAT: channel type of a CAN FD controller, core clock for the bit rate */
+#define CAN4OSX_SIM_IXX_CHANNEL_FD		0x0101u
+#define CAN4OSX_SIM_IXX_CLOCK			80000000u
+#define CAN4OSX_SIM_IXX_REQUEST			0xffu
+#define CAN4OSX_SIM_IXX_DEVICE_PORT		0xffffu
+
+
+typedef struct {
+	UInt16 vendorId;
+	UInt16 productId;
+	UInt8 protocol;
+	UInt8 channelCount;
+	UInt8 maxChannelCount;
+} CAN4OSX_SIM_PRODUCT_T;
+
+typedef struct {
+	UInt8 pipeRef;
+	void *pBuf;
+	UInt32 size;
+	CAN4OSX_USB_COMPLETION_T callback;
+	void *refCon;
+} CAN4OSX_SIM_XFER_T;
+
+typedef struct {
+	CAN4OSX_USB_COMPLETION_T callback;
+	void *refCon;
+	UInt32 size;
+	UInt64 due;
+} CAN4OSX_SIM_DONE_T;
+
+typedef struct {
+	UInt8 len;
+	UInt8 data[LEAFPRO_COMMAND_SIZE];
+} CAN4OSX_SIM_RESPONSE_T;
+
+typedef struct {
+	UInt8 busOn;
+	UInt32 bitRate;
+	UInt32 ixxRequest;			/* IXXAT: last command sent to the port */
+	UInt8 ixxOpMode;			/* IXXAT: id types received, IXXUSBFD_OPMODE_xxx */
+	UInt32 peakFilterStd[PEAKUSBFD_FILTER_STD_ROWS];	/* Peak: 11 bit ids received */
+	UInt32 dataBitRate;			/* CAN FD data phase, 0 runs it at bitRate */
+	UInt8 loadActive;
+	CAN4OSX_SIM_LOAD_T load;
+	UInt64 loadStart;
+	UInt64 loadGenerated;
+	CanMsg rxFifo[CAN4OSX_SIM_RX_FIFO_SIZE];
+	UInt32 rxFifoFirst;
+	UInt32 rxFifoCount;
+} CAN4OSX_SIM_CHANNEL_T;
+
+/* one virtual adapter, referenced by usbTransportRef */
+typedef struct {
+	CAN4OSX_SIM_ADAPTER_T adapter;
+	const CAN4OSX_SIM_PRODUCT_T *pProduct;
+	UInt8 channelCount;
+	UInt8 attached;
+	UInt8 setup;				/* CAN4OSX_DeviceSetup is still running */
+	UInt8 closed;
+	UInt8 unplug;				/* can4osxSimUnplug, done on the driver thread */
+	UInt64 replugDelay;
+	UInt64 replugAt;			/* plugged in again at this time, 0 never */
+	UInt16 sequence;
+	UInt32 ixxRequest;			/* IXXAT: last device command */
+	Can4osxUsbDeviceHandleEntry *pEntry;
+	CAN4OSX_SIM_CHANNEL_T channel[CAN4OSX_SIM_MAX_CHANNELS];
+	CAN4OSX_SIM_RESPONSE_T response[CAN4OSX_SIM_RESPONSES];
+	UInt32 responseFirst;
+	UInt32 responseCount;
+	CAN4OSX_SIM_XFER_T read[CAN4OSX_SIM_MAX_READS];
+	UInt32 readCount;
+	CAN4OSX_SIM_DONE_T write[CAN4OSX_SIM_MAX_WRITES];
+	UInt32 writeCount;
+	UInt64 bulkOutBusyUntil;
+	UInt64 clockStart;			/* host time the device clock started at zero */
+	CAN4OSX_SIM_STATISTICS_T statistics;
+} CAN4OSX_SIM_DEVICE_T;
+
+
+/* list of local defined functions
+------------------------------------------------------------------------------*/
+static IOReturn CAN4OSX_SimStart(void);
+static void CAN4OSX_SimRun(void);
+static void CAN4OSX_SimStop(void);
+static IOReturn CAN4OSX_SimReadPipeAsync(Can4osxUsbDeviceHandleEntry *pSelf, UInt8 pipeRef, void *pBuf, UInt32 size, CAN4OSX_USB_COMPLETION_T callback, void *refCon);
+static IOReturn CAN4OSX_SimWritePipeAsync(Can4osxUsbDeviceHandleEntry *pSelf, UInt8 pipeRef, void *pBuf, UInt32 size, CAN4OSX_USB_COMPLETION_T callback, void *refCon);
+static IOReturn CAN4OSX_SimReadPipe(Can4osxUsbDeviceHandleEntry *pSelf, UInt8 pipeRef, void *pBuf, UInt32 *pSize, UInt32 timeoutMs);
+static IOReturn CAN4OSX_SimWritePipe(Can4osxUsbDeviceHandleEntry *pSelf, UInt8 pipeRef, void *pBuf, UInt32 size, UInt32 timeoutMs);
+static IOReturn CAN4OSX_SimControlRequest(Can4osxUsbDeviceHandleEntry *pSelf, CAN4OSX_USB_CONTROL_T *pRequest);
+static void CAN4OSX_SimClose(Can4osxUsbDeviceHandleEntry *pSelf);
+
+static void CAN4OSX_SimReset(CAN4OSX_SIM_DEVICE_T *pDev, const CAN4OSX_SIM_ADAPTER_T *pAdapter, const CAN4OSX_SIM_PRODUCT_T *pProduct);
+static void CAN4OSX_SimHotplug(UInt64 now);
+static void CAN4OSX_SimAttachAll(void);
+static Can4osxUsbDeviceHandleEntry* CAN4OSX_SimSetup(void *pContext, CanHandle hnd);
+static CAN4OSX_SIM_DEVICE_T* CAN4OSX_SimGetDevice(Can4osxUsbDeviceHandleEntry *pSelf);
+static void CAN4OSX_SimCondInit(void);
+static pthread_cond_t* CAN4OSX_SimCond(void);
+static UInt32 CAN4OSX_SimCollect(CAN4OSX_SIM_DONE_T *pDone, UInt64 now);
+static UInt64 CAN4OSX_SimNextDue(UInt64 now);
+
+static void CAN4OSX_SimBulkOut(CAN4OSX_SIM_DEVICE_T *pDev, UInt8 pipeRef, const UInt8 *pBuf, UInt32 size, UInt64 now);
+static UInt32 CAN4OSX_SimBulkIn(CAN4OSX_SIM_DEVICE_T *pDev, UInt8 pipeRef, UInt8 *pBuf, UInt32 size, UInt64 now);
+static void CAN4OSX_SimRespond(CAN4OSX_SIM_DEVICE_T *pDev, const void *pCmd, UInt8 len);
+static void CAN4OSX_SimTransmit(CAN4OSX_SIM_DEVICE_T *pDev, UInt8 channel, CanMsg *pMsg);
+static void CAN4OSX_SimBusOn(CAN4OSX_SIM_DEVICE_T *pDev, UInt8 channel, UInt8 busOn, UInt64 now);
+static UInt8 CAN4OSX_SimPeekFrame(CAN4OSX_SIM_DEVICE_T *pDev, UInt8 channel, UInt64 now, CanMsg *pMsg);
+static void CAN4OSX_SimTakeFrame(CAN4OSX_SIM_DEVICE_T *pDev, UInt8 channel, UInt8 source);
+static UInt64 CAN4OSX_SimLoadDue(CAN4OSX_SIM_DEVICE_T *pDev, CAN4OSX_SIM_CHANNEL_T *pChannel, UInt64 now);
+static UInt32 CAN4OSX_SimLoadRate(CAN4OSX_SIM_CHANNEL_T *pChannel);
+static UInt64 CAN4OSX_SimDeviceClock(CAN4OSX_SIM_DEVICE_T *pDev, UInt64 now);
+static UInt8 CAN4OSX_SimReceives(CAN4OSX_SIM_DEVICE_T *pDev, UInt8 channel, const CanMsg *pMsg);
+
+static void CAN4OSX_SimLeafCommand(CAN4OSX_SIM_DEVICE_T *pDev, leafCmd *pCmd, UInt64 now);
+static UInt32 CAN4OSX_SimLeafEncode(UInt8 channel, const CanMsg *pMsg, UInt64 now, UInt8 *pBuf, UInt32 room);
+static UInt32 CAN4OSX_SimLeafEncodeAck(UInt8 channel, const CanMsg *pMsg, UInt64 now, UInt8 *pBuf, UInt32 room);
+static void CAN4OSX_SimLeafProCommand(CAN4OSX_SIM_DEVICE_T *pDev, proCommand_t *pCmd, UInt64 now);
+static UInt32 CAN4OSX_SimLeafProEncode(CAN4OSX_SIM_DEVICE_T *pDev, UInt8 channel, const CanMsg *pMsg, UInt64 now, UInt8 *pBuf, UInt32 room);
+static UInt32 CAN4OSX_SimLeafProEncodeAck(CAN4OSX_SIM_DEVICE_T *pDev, UInt8 channel, const CanMsg *pMsg, UInt64 now, UInt8 *pBuf, UInt32 room);
+static UInt8 CAN4OSX_SimLeafProChannel(CAN4OSX_SIM_DEVICE_T *pDev, UInt8 he);
+static void CAN4OSX_SimIxxMessage(CAN4OSX_SIM_DEVICE_T *pDev, UInt8 channel, IXXUSBFDCANMSG_T *pMsg);
+static UInt32 CAN4OSX_SimIxxEncode(UInt8 channel, const CanMsg *pMsg, UInt64 now, UInt8 *pBuf, UInt32 room);
+static IOReturn CAN4OSX_SimIxxControl(CAN4OSX_SIM_DEVICE_T *pDev, CAN4OSX_USB_CONTROL_T *pRequest, UInt64 now);
+static void CAN4OSX_SimPeakCommand(CAN4OSX_SIM_DEVICE_T *pDev, const PEAKUSBFD_CMD_T *pCmd, UInt64 now);
+static void CAN4OSX_SimPeakMessage(CAN4OSX_SIM_DEVICE_T *pDev, const PEAKUSBFDTXMSG_T *pMsg);
+static UInt32 CAN4OSX_SimPeakEncode(UInt8 channel, const CanMsg *pMsg, UInt64 now, UInt8 *pBuf, UInt32 room);
+static IOReturn CAN4OSX_SimPeakControl(CAN4OSX_SIM_DEVICE_T *pDev, CAN4OSX_USB_CONTROL_T *pRequest);
+
+
+const CAN4OSX_USB_TRANSPORT_T can4osxSimTransport = {
+	"simulation",
+	CAN4OSX_SimStart,
+	CAN4OSX_SimRun,
+	CAN4OSX_SimStop,
+	CAN4OSX_SimReadPipeAsync,
+	CAN4OSX_SimWritePipeAsync,
+	CAN4OSX_SimReadPipe,
+	CAN4OSX_SimWritePipe,
+	CAN4OSX_SimControlRequest,
+	CAN4OSX_SimClose
+};
+
+
+/* local defined variables
+------------------------------------------------------------------------------*/
+static const CAN4OSX_SIM_PRODUCT_T can4osxSimProducts[] = {
+	// Vendor Id, Product Id, protocol, channels, max channels
+	{0x0bfd, 0x0120, CAN4OSX_SIM_LEAF, 1u, 1u},		//Kvaser Leaf Light v.2
+	{0x0bfd, 0x0107, CAN4OSX_SIM_LEAFPRO, 1u, CAN4OSX_SIM_HE_MAX_CHANNELS},	//Kvaser Leaf Pro HS v.2
+	{0x0bfd, 0x0108, CAN4OSX_SIM_LEAFPRO, 2u, CAN4OSX_SIM_HE_MAX_CHANNELS},	//Kvaser USBcan Pro 2xHS v.2
+	{0x08d8, 0x0017, CAN4OSX_SIM_IXXAT, 2u, CAN4OSX_SIM_MAX_CHANNELS},	//IXXAT USB-to-CAN FD Automotive
+	{0x08d8, 0x0014, CAN4OSX_SIM_IXXAT, 1u, CAN4OSX_SIM_MAX_CHANNELS},	//IXXAT USB-to-CAN FD compact
+	{0x0c72, 0x0012, CAN4OSX_SIM_PEAK, 1u, 1u},		//Peak USB FD
+};
+
+static CAN4OSX_SIM_DEVICE_T can4osxSimDevices[CAN4OSX_SIM_MAX_ADAPTERS];
+static UInt32 can4osxSimDeviceCount = 0u;
+static UInt8 can4osxSimStop = 0u;
+static UInt8 can4osxSimStarted = 0u;
+static pthread_mutex_t can4osxSimMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t can4osxSimCond;	// see CAN4OSX_SimCond
+static pthread_once_t can4osxSimOnce = PTHREAD_ONCE_INIT;
+
+
+/******************************************************************************/
+/**
+ * \brief can4osxSimEnable - use the simulated adapters
+ *
+ * Has to be called before canInitializeLibrary, no real hardware is used
+ * afterwards.
+ *
+ * \return canStatus
+ */
+canStatus can4osxSimEnable(
+		void
+	)
+{
+	return(CAN4OSX_SetTransport(&can4osxSimTransport));
+}
+
+
+/******************************************************************************/
+/**
+ * \brief can4osxSimAddAdapter - plug in a virtual adapter
+ *
+ * Adapters added before canInitializeLibrary are found at startup, later ones
+ * are attached like a hotplugged device.
+ *
+ * \return canStatus
+ */
+canStatus can4osxSimAddAdapter(
+		const CAN4OSX_SIM_ADAPTER_T *pAdapter
+	)
+{
+CAN4OSX_SIM_DEVICE_T *pDev;
+const CAN4OSX_SIM_PRODUCT_T *pProduct = NULL;
+UInt32 loopCount;
+
+	if (pAdapter == NULL)  {
+		return(canERR_PARAM);
+	}
+
+	for (loopCount = 0; loopCount < (sizeof(can4osxSimProducts) / sizeof(CAN4OSX_SIM_PRODUCT_T)); loopCount++)  {
+		if (can4osxSimProducts[loopCount].productId == pAdapter->productId)  {
+			pProduct = &can4osxSimProducts[loopCount];
+		}
+	}
+	if (pProduct == NULL)  {
+		return(canERR_NOTFOUND);
+	}
+	if (pAdapter->channelCount > pProduct->maxChannelCount)  {
+		return(canERR_PARAM);
+	}
+
+	pthread_mutex_lock(&can4osxSimMutex);
+
+	if (can4osxSimDeviceCount >= CAN4OSX_SIM_MAX_ADAPTERS)  {
+		pthread_mutex_unlock(&can4osxSimMutex);
+		return(canERR_NOCHANNELS);
+	}
+
+	pDev = &can4osxSimDevices[can4osxSimDeviceCount];
+	CAN4OSX_SimReset(pDev, pAdapter, pProduct);
+	can4osxSimDeviceCount++;
+
+	// a running transport attaches it on the driver thread
+	pthread_cond_broadcast(CAN4OSX_SimCond());
+	pthread_mutex_unlock(&can4osxSimMutex);
+
+	return(canOK);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief can4osxSimSetLoad - configure the frames received on a channel
+ *
+ * The load starts when the channel is bus on. A NULL pointer stops it.
+ *
+ * \return canStatus
+ */
+canStatus can4osxSimSetLoad(
+		const CanHandle hnd,
+		const CAN4OSX_SIM_LOAD_T *pLoad
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf;
+CAN4OSX_SIM_DEVICE_T *pDev;
+CAN4OSX_SIM_CHANNEL_T *pChannel;
+
+	if (pLoad != NULL)  {
+		if ((pLoad->canFlags & canFDMSG_FDF) == 0u)  {
+			if (pLoad->canDlc > 8u)  {
+				return(canERR_PARAM);
+			}
+		} else if (CAN4OSX_encodeFdDlc((UInt8)pLoad->canDlc) == 0xffu)  {
+			return(canERR_PARAM);
+		}
+	}
+
+	pSelf = CAN4OSX_EnterChannel(hnd);
+	pDev = CAN4OSX_SimGetDevice(pSelf);
+	if (pDev == NULL)  {
+		if (pSelf != NULL)  {
+			CAN4OSX_LeaveChannel(hnd);
+		}
+		return(canERR_INVHANDLE);
+	}
+
+	pthread_mutex_lock(&can4osxSimMutex);
+
+	pChannel = &pDev->channel[pSelf->deviceChannel];
+	if (pLoad != NULL)  {
+		pChannel->load = *pLoad;
+		pChannel->loadActive = 1u;
+	} else {
+		pChannel->loadActive = 0u;
+	}
+	pChannel->loadStart = CAN4OSX_GetNanoseconds();
+	pChannel->loadGenerated = 0u;
+
+	pthread_cond_broadcast(CAN4OSX_SimCond());
+	pthread_mutex_unlock(&can4osxSimMutex);
+
+	CAN4OSX_LeaveChannel(hnd);
+
+	return(canOK);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief can4osxSimGetStatistics - counters of the adapter of the channel
+ *
+ * \return canStatus
+ */
+canStatus can4osxSimGetStatistics(
+		const CanHandle hnd,
+		CAN4OSX_SIM_STATISTICS_T *pStatistics
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf;
+CAN4OSX_SIM_DEVICE_T *pDev;
+
+	if (pStatistics == NULL)  {
+		return(canERR_PARAM);
+	}
+
+	pSelf = CAN4OSX_EnterChannel(hnd);
+	pDev = CAN4OSX_SimGetDevice(pSelf);
+	if (pDev == NULL)  {
+		if (pSelf != NULL)  {
+			CAN4OSX_LeaveChannel(hnd);
+		}
+		return(canERR_INVHANDLE);
+	}
+
+	pthread_mutex_lock(&can4osxSimMutex);
+	*pStatistics = pDev->statistics;
+	pthread_mutex_unlock(&can4osxSimMutex);
+
+	CAN4OSX_LeaveChannel(hnd);
+
+	return(canOK);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief can4osxSimUnplug - pull the adapter of the channel
+ *
+ * The driver sees the removal like the one of a real adapter, the handles of
+ * all its channels turn invalid. After replugMs the adapter comes back as a
+ * new one, CAN4OSX_SIM_NO_REPLUG leaves it unplugged.
+ *
+ * \return canStatus
+ */
+canStatus can4osxSimUnplug(
+		const CanHandle hnd,
+		UInt32 replugMs
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_EnterChannel(hnd);
+CAN4OSX_SIM_DEVICE_T *pDev = CAN4OSX_SimGetDevice(pSelf);
+
+	if (pDev == NULL)  {
+		if (pSelf != NULL)  {
+			CAN4OSX_LeaveChannel(hnd);
+		}
+		return(canERR_INVHANDLE);
+	}
+
+	// the removal waits for us to leave, so it runs on the driver thread
+	pthread_mutex_lock(&can4osxSimMutex);
+	pDev->unplug = 1u;
+	pDev->replugDelay = (replugMs == CAN4OSX_SIM_NO_REPLUG) ? 0u : ((UInt64)replugMs * 1000000u);
+	pthread_cond_broadcast(CAN4OSX_SimCond());
+	pthread_mutex_unlock(&can4osxSimMutex);
+
+	CAN4OSX_LeaveChannel(hnd);
+
+	return(canOK);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_SimGetDevice - the adapter of an entered channel
+ *
+ * \return the adapter or NULL if pSelf is NULL or no simulated channel
+ */
+static CAN4OSX_SIM_DEVICE_T* CAN4OSX_SimGetDevice(
+		Can4osxUsbDeviceHandleEntry *pSelf
+	)
+{
+	if (pSelf == NULL)  {
+		return(NULL);
+	}
+	if (pSelf->usbTransport != &can4osxSimTransport)  {
+		return(NULL);
+	}
+
+	return((CAN4OSX_SIM_DEVICE_T *)pSelf->usbTransportRef);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_SimReset - an adapter fresh from the box
+ *
+ * Called with the lock held or before the adapter is visible.
+ */
+static void CAN4OSX_SimReset(
+		CAN4OSX_SIM_DEVICE_T *pDev,
+		const CAN4OSX_SIM_ADAPTER_T *pAdapter,
+		const CAN4OSX_SIM_PRODUCT_T *pProduct
+	)
+{
+UInt32 loopCount;
+
+	memset(pDev, 0, sizeof(CAN4OSX_SIM_DEVICE_T));
+	pDev->adapter = *pAdapter;
+	pDev->pProduct = pProduct;
+	pDev->channelCount = (pAdapter->channelCount != 0u) ? pAdapter->channelCount : pProduct->channelCount;
+	pDev->clockStart = CAN4OSX_GetNanoseconds();
+	for (loopCount = 0; loopCount < CAN4OSX_SIM_MAX_CHANNELS; loopCount++)  {
+		pDev->channel[loopCount].bitRate = CAN4OSX_SIM_DEFAULT_BITRATE;
+		pDev->channel[loopCount].ixxOpMode = IXXUSBFD_OPMODE_STANDARD | IXXUSBFD_OPMODE_EXTENDED;
+		memset(pDev->channel[loopCount].peakFilterStd, 0xff, sizeof(pDev->channel[loopCount].peakFilterStd));
+	}
+}
+
+
+#pragma mark transport
+/******************************************************************************/
+static IOReturn CAN4OSX_SimStart(
+		void
+	)
+{
+	pthread_mutex_lock(&can4osxSimMutex);
+	can4osxSimStop = 0u;
+	can4osxSimStarted = 1u;
+	pthread_mutex_unlock(&can4osxSimMutex);
+
+	CAN4OSX_SimAttachAll();
+
+	return(kIOReturnSuccess);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_SimRun - the device side of all adapters
+ *
+ * Delivers the completions on the driver thread like the run loop of a real
+ * transport, waits for the next transfer or the next frame of a load.
+ */
+static void CAN4OSX_SimRun(
+		void
+	)
+{
+CAN4OSX_SIM_DONE_T done[CAN4OSX_SIM_COMPLETIONS];
+struct timespec deadline;
+UInt32 count;
+UInt32 loopCount;
+UInt64 now;
+UInt64 next;
+
+	pthread_mutex_lock(&can4osxSimMutex);
+
+	while (can4osxSimStop == 0u)  {
+		pthread_mutex_unlock(&can4osxSimMutex);
+		CAN4OSX_SimHotplug(CAN4OSX_GetNanoseconds());
+		CAN4OSX_SimAttachAll();
+		pthread_mutex_lock(&can4osxSimMutex);
+
+		now = CAN4OSX_GetNanoseconds();
+		count = CAN4OSX_SimCollect(done, now);
+
+		if (count != 0u)  {
+			// the callbacks submit new transfers
+			pthread_mutex_unlock(&can4osxSimMutex);
+			for (loopCount = 0; loopCount < count; loopCount++)  {
+				done[loopCount].callback(done[loopCount].refCon, kIOReturnSuccess, (void *)(uintptr_t)done[loopCount].size);
+			}
+			pthread_mutex_lock(&can4osxSimMutex);
+		} else {
+			next = CAN4OSX_SimNextDue(now);
+			if (next == 0u)  {
+				CAN4OSX_GetDeadlineNs(&deadline, (UInt64)CAN4OSX_SIM_IDLE_MS * 1000000u);
+			} else {
+				CAN4OSX_GetDeadlineNs(&deadline, next - now);
+			}
+			(void)CAN4OSX_CondTimedWait(CAN4OSX_SimCond(), &can4osxSimMutex, &deadline);
+		}
+	}
+
+	can4osxSimStarted = 0u;
+
+	// an adapter still being set up is removed once it is attached
+	for (loopCount = 0; loopCount < CAN4OSX_SIM_MAX_ADAPTERS; loopCount++)  {
+		while (can4osxSimDevices[loopCount].setup != 0u)  {
+			(void)pthread_cond_wait(CAN4OSX_SimCond(), &can4osxSimMutex);
+		}
+	}
+	pthread_mutex_unlock(&can4osxSimMutex);
+
+	for (loopCount = 0; loopCount < CAN4OSX_SIM_MAX_ADAPTERS; loopCount++)  {
+		CAN4OSX_SIM_DEVICE_T *pDev = &can4osxSimDevices[loopCount];
+		if (pDev->pEntry != NULL)  {
+			CAN4OSX_SimClose(pDev->pEntry);
+			CAN4OSX_DeviceDetach(pDev->pEntry);
+			pDev->pEntry = NULL;
+		}
+	}
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_SimStop(
+		void
+	)
+{
+	pthread_mutex_lock(&can4osxSimMutex);
+	can4osxSimStop = 1u;
+	pthread_cond_broadcast(CAN4OSX_SimCond());
+	pthread_mutex_unlock(&can4osxSimMutex);
+}
+
+
+/******************************************************************************/
+static IOReturn CAN4OSX_SimReadPipeAsync(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+		UInt8 pipeRef,
+		void *pBuf,
+		UInt32 size,
+		CAN4OSX_USB_COMPLETION_T callback,
+		void *refCon
+	)
+{
+CAN4OSX_SIM_DEVICE_T *pDev = (CAN4OSX_SIM_DEVICE_T *)pSelf->usbTransportRef;
+CAN4OSX_SIM_XFER_T *pXfer;
+
+	pthread_mutex_lock(&can4osxSimMutex);
+
+	if (pDev->closed != 0u)  {
+		pthread_mutex_unlock(&can4osxSimMutex);
+		return(kIOReturnNoDevice);
+	}
+	if (pDev->readCount >= CAN4OSX_SIM_MAX_READS)  {
+		pthread_mutex_unlock(&can4osxSimMutex);
+		return(kIOReturnNoResources);
+	}
+
+	pXfer = &pDev->read[pDev->readCount++];
+	pXfer->pipeRef = pipeRef;
+	pXfer->pBuf = pBuf;
+	pXfer->size = size;
+	pXfer->callback = callback;
+	pXfer->refCon = refCon;
+
+	pthread_cond_broadcast(CAN4OSX_SimCond());
+	pthread_mutex_unlock(&can4osxSimMutex);
+
+	return(kIOReturnSuccess);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_SimWritePipeAsync - the adapter takes the data at once
+ *
+ * The commands are processed here, only the completion is delivered on the
+ * driver thread.
+ */
+static IOReturn CAN4OSX_SimWritePipeAsync(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+		UInt8 pipeRef,
+		void *pBuf,
+		UInt32 size,
+		CAN4OSX_USB_COMPLETION_T callback,
+		void *refCon
+	)
+{
+CAN4OSX_SIM_DEVICE_T *pDev = (CAN4OSX_SIM_DEVICE_T *)pSelf->usbTransportRef;
+CAN4OSX_SIM_DONE_T *pDone;
+UInt64 now = CAN4OSX_GetNanoseconds();
+
+	pthread_mutex_lock(&can4osxSimMutex);
+
+	if (pDev->closed != 0u)  {
+		pthread_mutex_unlock(&can4osxSimMutex);
+		return(kIOReturnNoDevice);
+	}
+	if (pDev->writeCount >= CAN4OSX_SIM_MAX_WRITES)  {
+		pthread_mutex_unlock(&can4osxSimMutex);
+		return(kIOReturnNoResources);
+	}
+
+	CAN4OSX_SimBulkOut(pDev, pipeRef, pBuf, size, now);
+
+	// the transfers of the adapter go over the bus one after the other
+	if (pDev->bulkOutBusyUntil < now)  {
+		pDev->bulkOutBusyUntil = now;
+	}
+	pDev->bulkOutBusyUntil += CAN4OSX_SIM_USB_TRANSFER_NS + ((UInt64)size * CAN4OSX_SIM_USB_BYTE_NS);
+
+	pDone = &pDev->write[pDev->writeCount++];
+	pDone->callback = callback;
+	pDone->refCon = refCon;
+	pDone->size = size;
+	pDone->due = pDev->bulkOutBusyUntil;
+
+	pthread_cond_broadcast(CAN4OSX_SimCond());
+	pthread_mutex_unlock(&can4osxSimMutex);
+
+	return(kIOReturnSuccess);
+}
+
+
+/******************************************************************************/
+static IOReturn CAN4OSX_SimReadPipe(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+		UInt8 pipeRef,
+		void *pBuf,
+		UInt32 *pSize,
+		UInt32 timeoutMs
+	)
+{
+CAN4OSX_SIM_DEVICE_T *pDev = (CAN4OSX_SIM_DEVICE_T *)pSelf->usbTransportRef;
+struct timespec deadline;
+UInt32 size;
+
+	CAN4OSX_GetDeadline(&deadline, timeoutMs);
+
+	pthread_mutex_lock(&can4osxSimMutex);
+
+	for (;;)  {
+		if (pDev->closed != 0u)  {
+			pthread_mutex_unlock(&can4osxSimMutex);
+			*pSize = 0u;
+			return(kIOReturnNoDevice);
+		}
+
+		size = CAN4OSX_SimBulkIn(pDev, pipeRef, pBuf, *pSize, CAN4OSX_GetNanoseconds());
+		if (size != 0u)  {
+			pthread_mutex_unlock(&can4osxSimMutex);
+			*pSize = size;
+			return(kIOReturnSuccess);
+		}
+
+		if (timeoutMs == 0u)  {
+			(void)pthread_cond_wait(CAN4OSX_SimCond(), &can4osxSimMutex);
+		} else if (CAN4OSX_CondTimedWait(CAN4OSX_SimCond(), &can4osxSimMutex, &deadline) == ETIMEDOUT)  {
+			pthread_mutex_unlock(&can4osxSimMutex);
+			*pSize = 0u;
+			return(kIOReturnTimeout);
+		}
+	}
+}
+
+
+/******************************************************************************/
+static IOReturn CAN4OSX_SimWritePipe(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+		UInt8 pipeRef,
+		void *pBuf,
+		UInt32 size,
+		UInt32 timeoutMs
+	)
+{
+CAN4OSX_SIM_DEVICE_T *pDev = (CAN4OSX_SIM_DEVICE_T *)pSelf->usbTransportRef;
+
+	(void)timeoutMs;
+
+	pthread_mutex_lock(&can4osxSimMutex);
+
+	if (pDev->closed != 0u)  {
+		pthread_mutex_unlock(&can4osxSimMutex);
+		return(kIOReturnNoDevice);
+	}
+
+	CAN4OSX_SimBulkOut(pDev, pipeRef, pBuf, size, CAN4OSX_GetNanoseconds());
+
+	pthread_cond_broadcast(CAN4OSX_SimCond());
+	pthread_mutex_unlock(&can4osxSimMutex);
+
+	return(kIOReturnSuccess);
+}
+
+
+/******************************************************************************/
+static IOReturn CAN4OSX_SimControlRequest(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+		CAN4OSX_USB_CONTROL_T *pRequest
+	)
+{
+CAN4OSX_SIM_DEVICE_T *pDev = (CAN4OSX_SIM_DEVICE_T *)pSelf->usbTransportRef;
+IOReturn retVal;
+
+	pRequest->wLenDone = 0u;
+
+	pthread_mutex_lock(&can4osxSimMutex);
+
+	if (pDev->closed != 0u)  {
+		retVal = kIOReturnNoDevice;
+	} else if (pDev->pProduct->protocol == CAN4OSX_SIM_IXXAT)  {
+		pDev->statistics.controlRequests++;
+		retVal = CAN4OSX_SimIxxControl(pDev, pRequest, CAN4OSX_GetNanoseconds());
+		pthread_cond_broadcast(CAN4OSX_SimCond());
+	} else if (pDev->pProduct->protocol == CAN4OSX_SIM_PEAK)  {
+		pDev->statistics.controlRequests++;
+		retVal = CAN4OSX_SimPeakControl(pDev, pRequest);
+	} else {
+		retVal = kIOReturnUnsupported;
+	}
+
+	pthread_mutex_unlock(&can4osxSimMutex);
+
+	return(retVal);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_SimClose - unplug the adapter
+ *
+ * Outstanding transfers are dropped without completion.
+ */
+static void CAN4OSX_SimClose(
+		Can4osxUsbDeviceHandleEntry *pSelf
+	)
+{
+CAN4OSX_SIM_DEVICE_T *pDev = (CAN4OSX_SIM_DEVICE_T *)pSelf->usbTransportRef;
+
+	pthread_mutex_lock(&can4osxSimMutex);
+	pDev->closed = 1u;
+	pDev->readCount = 0u;
+	pDev->writeCount = 0u;
+	pthread_cond_broadcast(CAN4OSX_SimCond());
+	pthread_mutex_unlock(&can4osxSimMutex);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_SimHotplug - pull and plug in adapters, see can4osxSimUnplug
+ *
+ * Runs without the lock like CAN4OSX_SimAttachAll, the removal waits for the
+ * API calls still inside the channels. A replugged adapter is attached by
+ * CAN4OSX_SimAttachAll.
+ */
+static void CAN4OSX_SimHotplug(
+		UInt64 now
+	)
+{
+CAN4OSX_SIM_DEVICE_T *pDev;
+CAN4OSX_SIM_ADAPTER_T adapter;
+Can4osxUsbDeviceHandleEntry *pEntry;
+UInt32 loopCount;
+
+	for (loopCount = 0; loopCount < CAN4OSX_SIM_MAX_ADAPTERS; loopCount++)  {
+		pthread_mutex_lock(&can4osxSimMutex);
+		pDev = &can4osxSimDevices[loopCount];
+		if (loopCount >= can4osxSimDeviceCount)  {
+			pthread_mutex_unlock(&can4osxSimMutex);
+			continue;
+		}
+
+		if ((pDev->replugAt != 0u) && (pDev->replugAt <= now))  {
+			adapter = pDev->adapter;
+			CAN4OSX_SimReset(pDev, &adapter, pDev->pProduct);
+		}
+
+		pEntry = pDev->pEntry;
+		if ((pDev->unplug == 0u) || (pEntry == NULL))  {
+			// pulled while being set up, removed once it is attached
+			if (pDev->setup == 0u)  {
+				pDev->unplug = 0u;
+			}
+			pthread_mutex_unlock(&can4osxSimMutex);
+			continue;
+		}
+		pDev->unplug = 0u;
+		pthread_mutex_unlock(&can4osxSimMutex);
+
+		CAN4OSX_SimClose(pEntry);
+		CAN4OSX_DeviceDetach(pEntry);
+
+		pthread_mutex_lock(&can4osxSimMutex);
+		pDev->pEntry = NULL;
+		if (pDev->replugDelay != 0u)  {
+			pDev->replugAt = CAN4OSX_GetNanoseconds() + pDev->replugDelay;
+		}
+		pthread_mutex_unlock(&can4osxSimMutex);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_SimAttachAll - report the new adapters to the driver
+ *
+ * Each one is set up on a worker, see CAN4OSX_SimSetup.
+ */
+static void CAN4OSX_SimAttachAll(
+		void
+	)
+{
+CAN4OSX_SIM_DEVICE_T *pDev;
+UInt32 loopCount;
+
+	for (loopCount = 0; loopCount < CAN4OSX_SIM_MAX_ADAPTERS; loopCount++)  {
+		pthread_mutex_lock(&can4osxSimMutex);
+		pDev = &can4osxSimDevices[loopCount];
+		if ((loopCount >= can4osxSimDeviceCount) || (pDev->attached != 0u))  {
+			pthread_mutex_unlock(&can4osxSimMutex);
+			continue;
+		}
+		pDev->attached = 1u;
+		pDev->setup = 1u;
+		pthread_mutex_unlock(&can4osxSimMutex);
+
+		CAN4OSX_DeviceSetup(CAN4OSX_SimSetup, pDev);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_SimSetup - open an adapter and attach it
+ *
+ * Runs without the lock, the device drivers talk to the adapter while they
+ * are initialized.
+ *
+ * \return the first channel or NULL
+ */
+static Can4osxUsbDeviceHandleEntry* CAN4OSX_SimSetup(
+		void *pContext,
+		CanHandle hnd
+	)
+{
+CAN4OSX_SIM_DEVICE_T *pDev = (CAN4OSX_SIM_DEVICE_T *)pContext;
+CAN4OSX_USB_DEVICE_DESC_T desc;
+Can4osxUsbDeviceHandleEntry *pEntry;
+
+	// configuration and descriptors of a real adapter
+	if (pDev->adapter.setupMs != 0u)  {
+		usleep(pDev->adapter.setupMs * 1000u);
+	}
+
+	desc.vendorId = pDev->pProduct->vendorId;
+	desc.productId = pDev->pProduct->productId;
+	desc.endpointNumberBulkIn = CAN4OSX_SIM_PIPE_IN;
+	desc.endpointMaxSizeBulkIn = CAN4OSX_SIM_PACKET_SIZE;
+	desc.endpointNumberBulkOut = CAN4OSX_SIM_PIPE_OUT;
+	desc.endpointMaxSizeBulkOut = CAN4OSX_SIM_PACKET_SIZE;
+	desc.usbTransportRef = pDev;
+
+	pEntry = CAN4OSX_DeviceAttach(&can4osxSimTransport, &desc, hnd);
+
+	pthread_mutex_lock(&can4osxSimMutex);
+	pDev->pEntry = pEntry;
+	pDev->setup = 0u;
+	if (pEntry == NULL)  {
+		pDev->closed = 1u;
+	}
+	pthread_cond_broadcast(CAN4OSX_SimCond());
+	pthread_mutex_unlock(&can4osxSimMutex);
+
+	return(pEntry);
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_SimCondInit(
+		void
+	)
+{
+	CAN4OSX_CondInit(&can4osxSimCond);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_SimCond - the condition of the simulation, on the monotonic clock
+ *
+ * A static initializer can not choose the clock, see CAN4OSX_CondInit.
+ */
+static pthread_cond_t* CAN4OSX_SimCond(
+		void
+	)
+{
+	(void)pthread_once(&can4osxSimOnce, CAN4OSX_SimCondInit);
+	return(&can4osxSimCond);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_SimCollect - finish the transfers the adapters can serve
+ *
+ * Called with the lock held. Reads are served in the order of submission.
+ *
+ * \return number of completions in pDone
+ */
+static UInt32 CAN4OSX_SimCollect(
+		CAN4OSX_SIM_DONE_T *pDone,
+		UInt64 now
+	)
+{
+CAN4OSX_SIM_DEVICE_T *pDev;
+CAN4OSX_SIM_XFER_T *pXfer;
+UInt32 count = 0u;
+UInt32 loopCount;
+UInt32 xfer;
+UInt32 size;
+
+	for (loopCount = 0; loopCount < can4osxSimDeviceCount; loopCount++)  {
+		pDev = &can4osxSimDevices[loopCount];
+		if ((pDev->closed != 0u) || (pDev->pEntry == NULL))  {
+			continue;
+		}
+
+		while ((pDev->writeCount != 0u) && (pDev->write[0].due <= now) && (count < CAN4OSX_SIM_COMPLETIONS))  {
+			pDone[count++] = pDev->write[0];
+			pDev->writeCount--;
+			memmove(&pDev->write[0], &pDev->write[1], pDev->writeCount * sizeof(CAN4OSX_SIM_DONE_T));
+		}
+
+		xfer = 0u;
+		while ((xfer < pDev->readCount) && (count < CAN4OSX_SIM_COMPLETIONS))  {
+			pXfer = &pDev->read[xfer];
+			size = CAN4OSX_SimBulkIn(pDev, pXfer->pipeRef, pXfer->pBuf, pXfer->size, now);
+			if (size == 0u)  {
+				xfer++;
+				continue;
+			}
+			pDone[count].callback = pXfer->callback;
+			pDone[count].refCon = pXfer->refCon;
+			pDone[count].size = size;
+			count++;
+			pDev->statistics.bulkInTransfers++;
+
+			pDev->readCount--;
+			memmove(pXfer, pXfer + 1, (pDev->readCount - xfer) * sizeof(CAN4OSX_SIM_XFER_T));
+		}
+	}
+
+	return(count);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_SimNextDue - next bulk out completion, frame of a load or replug
+ *
+ * \return monotonic time in ns, 0 if nothing is waiting
+ */
+static UInt64 CAN4OSX_SimNextDue(
+		UInt64 now
+	)
+{
+CAN4OSX_SIM_CHANNEL_T *pChannel;
+UInt64 next = 0u;
+UInt64 due;
+UInt64 frame;
+UInt32 rate;
+UInt32 loopCount;
+UInt32 channel;
+
+	for (loopCount = 0; loopCount < can4osxSimDeviceCount; loopCount++)  {
+		due = can4osxSimDevices[loopCount].replugAt;
+		if (due != 0u)  {
+			if (due <= now)  {
+				due = now + 1u;
+			}
+			if ((next == 0u) || (due < next))  {
+				next = due;
+			}
+		}
+		if (can4osxSimDevices[loopCount].closed != 0u)  {
+			continue;
+		}
+		if (can4osxSimDevices[loopCount].writeCount != 0u)  {
+			due = can4osxSimDevices[loopCount].write[0].due;
+			if ((next == 0u) || (due < next))  {
+				next = due;
+			}
+		}
+		if (can4osxSimDevices[loopCount].readCount == 0u)  {
+			continue;
+		}
+		for (channel = 0; channel < can4osxSimDevices[loopCount].channelCount; channel++)  {
+			pChannel = &can4osxSimDevices[loopCount].channel[channel];
+			rate = CAN4OSX_SimLoadRate(pChannel);
+			if ((pChannel->busOn == 0u) || (pChannel->loadActive == 0u) || (rate == 0u))  {
+				continue;
+			}
+			frame = pChannel->loadGenerated + 1u;
+			if ((pChannel->load.frameCount != 0u) && (frame > pChannel->load.frameCount))  {
+				continue;
+			}
+			due = pChannel->loadStart + ((frame / rate) * 1000000000u) + ((((frame % rate) * 1000000000u) + rate - 1u) / rate);
+			if (due <= now)  {
+				due = now + 1u;
+			}
+			if ((next == 0u) || (due < next))  {
+				next = due;
+			}
+		}
+	}
+
+	return(next);
+}
+
+
+#pragma mark device side
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_SimBulkOut - the adapter received data on a bulk pipe
+ *
+ * Called with the lock held.
+ */
+static void CAN4OSX_SimBulkOut(
+		CAN4OSX_SIM_DEVICE_T *pDev,
+		UInt8 pipeRef,
+		const UInt8 *pBuf,
+		UInt32 size,
+		UInt64 now
+	)
+{
+UInt32 count = 0u;
+UInt32 len;
+
+	pDev->statistics.bulkOutTransfers++;
+	pDev->statistics.bulkOutBytes += size;
+
+	switch (pDev->pProduct->protocol)  {
+		case CAN4OSX_SIM_LEAF:
+			while (count < size)  {
+			leafCmd cmd;
+
+				len = pBuf[count];
+				if ((len == 0u) || ((count + len) > size) || (len > sizeof(leafCmd)))  {
+					break;
+				}
+				memset(&cmd, 0, sizeof(cmd));
+				memcpy(&cmd, &pBuf[count], len);
+				CAN4OSX_SimLeafCommand(pDev, &cmd, now);
+				count += len;
+			}
+			break;
+
+		case CAN4OSX_SIM_LEAFPRO:
+			while ((count + sizeof(proCmdHead_t)) <= size)  {
+			proCommand_t cmd;
+
+				if (pBuf[count] == 0u)  {
+					break;
+				}
+				len = LEAFPRO_COMMAND_SIZE;
+				if (pBuf[count] == LEAFPRO_CMD_CAN_FD)  {
+					len = pBuf[count + offsetof(proCmdFdHead_t, len)];
+					len |= (UInt32)pBuf[count + offsetof(proCmdFdHead_t, len) + 1u] << 8;
+				}
+				if ((len < sizeof(proCmdHead_t)) || ((count + len) > size) || (len > sizeof(proCommand_t)))  {
+					break;
+				}
+				memset(&cmd, 0, sizeof(cmd));
+				memcpy(&cmd, &pBuf[count], len);
+				CAN4OSX_SimLeafProCommand(pDev, &cmd, now);
+				count += len;
+			}
+			break;
+
+		case CAN4OSX_SIM_IXXAT:
+			// data pipes of the channels follow the command pipes
+			if ((pipeRef < (CAN4OSX_SIM_PIPE_OUT + 2u)) || ((pipeRef & 1u) != 0u))  {
+				break;
+			}
+			while (count < size)  {
+			IXXUSBFDCANMSG_T msg;
+
+				len = pBuf[count] + 1u;
+				if ((len == 1u) || ((count + len) > size) || (len > sizeof(IXXUSBFDCANMSG_T)))  {
+					break;
+				}
+				memset(&msg, 0, sizeof(msg));
+				memcpy(&msg, &pBuf[count], len);
+				CAN4OSX_SimIxxMessage(pDev, (UInt8)((pipeRef - CAN4OSX_SIM_PIPE_OUT - 2u) / 2u), &msg);
+				count += len;
+			}
+			break;
+
+		case CAN4OSX_SIM_PEAK:
+			if (pipeRef == CAN4OSX_SIM_PIPE_OUT)  {
+				// a list of commands, ended by one with all bits set
+				while ((count + PEAKUSBFD_CMD_SIZE) <= size)  {
+				PEAKUSBFD_CMD_T cmd;
+
+					memcpy(&cmd, &pBuf[count], sizeof(cmd));
+					if (PEAKUSBFD_CMD_GET_OPCODE(cmd.std.opcodeChannel) == PEAKUSBFD_CMD_END_OF_COLLECTION)  {
+						break;
+					}
+					CAN4OSX_SimPeakCommand(pDev, &cmd, now);
+					count += PEAKUSBFD_CMD_SIZE;
+				}
+			} else if (pipeRef == (CAN4OSX_SIM_PIPE_OUT + 2u))  {
+				// the records of all channels, a size of 0 ends the transfer
+				while ((count + PEAKUSBFD_TX_MSG_HEAD_SIZE) <= size)  {
+				PEAKUSBFDTXMSG_T msg;
+
+					len = pBuf[count] | ((UInt32)pBuf[count + 1u] << 8);
+					if ((len < PEAKUSBFD_TX_MSG_HEAD_SIZE) || ((count + len) > size) || (len > sizeof(PEAKUSBFDTXMSG_T)))  {
+						break;
+					}
+					memset(&msg, 0, sizeof(msg));
+					memcpy(&msg, &pBuf[count], len);
+					CAN4OSX_SimPeakMessage(pDev, &msg);
+					count += len;
+				}
+			}
+			break;
+
+		default:
+			break;
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_SimBulkIn - the adapter fills a bulk in transfer
+ *
+ * Pending command responses first, then the frames of the channels served by
+ * the pipe, round robin. Called with the lock held.
+ *
+ * \return number of bytes, 0 if the adapter has nothing to send
+ */
+static UInt32 CAN4OSX_SimBulkIn(
+		CAN4OSX_SIM_DEVICE_T *pDev,
+		UInt8 pipeRef,
+		UInt8 *pBuf,
+		UInt32 size,
+		UInt64 now
+	)
+{
+CAN4OSX_SIM_RESPONSE_T *pResponse;
+CanMsg msg;
+UInt32 fill = 0u;
+UInt32 len;
+UInt8 first = 0u;
+UInt8 last = pDev->channelCount;
+UInt8 channel;
+UInt8 source;
+UInt8 progress = 1u;
+UInt64 clock = CAN4OSX_SimDeviceClock(pDev, now);
+
+	if (pDev->pProduct->protocol == CAN4OSX_SIM_IXXAT)  {
+		// one data pipe per channel
+		if ((pipeRef < (CAN4OSX_SIM_PIPE_IN + 2u)) || ((pipeRef & 1u) == 0u))  {
+			return(0u);
+		}
+		first = (pipeRef - CAN4OSX_SIM_PIPE_IN - 2u) / 2u;
+		if (first >= pDev->channelCount)  {
+			return(0u);
+		}
+		last = first + 1u;
+	} else if (pDev->pProduct->protocol == CAN4OSX_SIM_PEAK)  {
+		// the message pipe after the command pipe serves all channels
+		if (pipeRef != (CAN4OSX_SIM_PIPE_IN + 2u))  {
+			return(0u);
+		}
+	} else {
+		if (pipeRef != CAN4OSX_SIM_PIPE_IN)  {
+			return(0u);
+		}
+		while (pDev->responseCount != 0u)  {
+			pResponse = &pDev->response[pDev->responseFirst];
+			if ((fill + pResponse->len) > size)  {
+				return(fill);
+			}
+			memcpy(&pBuf[fill], pResponse->data, pResponse->len);
+			fill += pResponse->len;
+			pDev->responseFirst = (pDev->responseFirst + 1u) % CAN4OSX_SIM_RESPONSES;
+			pDev->responseCount--;
+		}
+	}
+
+	while (progress != 0u)  {
+		progress = 0u;
+		for (channel = first; channel < last; channel++)  {
+			source = CAN4OSX_SimPeekFrame(pDev, channel, now, &msg);
+			if (source == 0u)  {
+				continue;
+			}
+			if ((source != 3u) && (CAN4OSX_SimReceives(pDev, channel, &msg) == 0u))  {
+				// the controller does not receive this id
+				CAN4OSX_SimTakeFrame(pDev, channel, source);
+				progress = 1u;
+				continue;
+			}
+			switch (pDev->pProduct->protocol)  {
+				case CAN4OSX_SIM_LEAF:
+					if (source == 3u)  {
+						len = CAN4OSX_SimLeafEncodeAck(channel, &msg, clock, &pBuf[fill], size - fill);
+						break;
+					}
+					len = CAN4OSX_SimLeafEncode(channel, &msg, clock, &pBuf[fill], size - fill);
+					break;
+				case CAN4OSX_SIM_LEAFPRO:
+					if (source == 3u)  {
+						len = CAN4OSX_SimLeafProEncodeAck(pDev, channel, &msg, clock, &pBuf[fill], size - fill);
+						break;
+					}
+					len = CAN4OSX_SimLeafProEncode(pDev, channel, &msg, clock, &pBuf[fill], size - fill);
+					break;
+				case CAN4OSX_SIM_PEAK:
+					len = CAN4OSX_SimPeakEncode(channel, &msg, clock, &pBuf[fill], size - fill);
+					break;
+				default:
+					len = CAN4OSX_SimIxxEncode(channel, &msg, clock, &pBuf[fill], size - fill);
+					break;
+			}
+			if (len == 0u)  {
+				// transfer is full
+				return(fill);
+			}
+			CAN4OSX_SimTakeFrame(pDev, channel, source);
+			fill += len;
+			progress = 1u;
+		}
+	}
+
+	return(fill);
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_SimRespond(
+		CAN4OSX_SIM_DEVICE_T *pDev,
+		const void *pCmd,
+		UInt8 len
+	)
+{
+CAN4OSX_SIM_RESPONSE_T *pResponse;
+
+	if ((pDev->responseCount >= CAN4OSX_SIM_RESPONSES) || (len > LEAFPRO_COMMAND_SIZE))  {
+		CAN4OSX_DEBUG_PRINT("%s : response dropped\n",__func__);
+		return;
+	}
+
+	pResponse = &pDev->response[(pDev->responseFirst + pDev->responseCount) % CAN4OSX_SIM_RESPONSES];
+	pResponse->len = len;
+	memcpy(pResponse->data, pCmd, len);
+	pDev->responseCount++;
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_SimTransmit - a frame goes out on the bus of the adapter
+ *
+ * All channels of an adapter share one bus, the sender itself receives it
+ * only with echo enabled. The adapters acking their frames queue the ack
+ * behind the frames the sender received so far, pMsg->canTimestamp holds
+ * the tx id. The ack of the Peak adapter is the echo.
+ */
+static void CAN4OSX_SimTransmit(
+		CAN4OSX_SIM_DEVICE_T *pDev,
+		UInt8 channel,
+		CanMsg *pMsg
+	)
+{
+CAN4OSX_SIM_CHANNEL_T *pChannel;
+CanMsg *pEntry;
+UInt8 acked = (pDev->pProduct->protocol != CAN4OSX_SIM_IXXAT) ? 1u : 0u;
+UInt8 copies;
+UInt8 loopCount;
+
+	pDev->statistics.txFrames++;
+
+	if ((pMsg->canFlags & canMSG_EXT) == 0u)  {
+		pMsg->canFlags |= canMSG_STD;
+	}
+
+	for (loopCount = 0; loopCount < pDev->channelCount; loopCount++)  {
+		pChannel = &pDev->channel[loopCount];
+
+		copies = 1u;
+		if (loopCount == channel)  {
+			copies = acked;
+			if ((pDev->adapter.echo != 0u) && (pDev->pProduct->protocol != CAN4OSX_SIM_PEAK))  {
+				copies++;
+			}
+		}
+
+		for (; copies != 0u; copies--)  {
+			if (pChannel->busOn == 0u)  {
+				break;
+			}
+			if (pChannel->rxFifoCount >= CAN4OSX_SIM_RX_FIFO_SIZE)  {
+				pDev->statistics.rxOverruns++;
+				break;
+			}
+
+			pEntry = &pChannel->rxFifo[(pChannel->rxFifoFirst + pChannel->rxFifoCount) % CAN4OSX_SIM_RX_FIFO_SIZE];
+			*pEntry = *pMsg;
+			pEntry->padding = 0u;
+			if (loopCount == channel)  {
+				pEntry->canFlags |= canMSG_TXACK;
+				// the frame first, its ack last
+				if ((copies == 1u) && (acked != 0u))  {
+					pEntry->padding = CAN4OSX_SIM_TX_DONE;
+				}
+			}
+			pChannel->rxFifoCount++;
+		}
+	}
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_SimBusOn(
+		CAN4OSX_SIM_DEVICE_T *pDev,
+		UInt8 channel,
+		UInt8 busOn,
+		UInt64 now
+	)
+{
+CAN4OSX_SIM_CHANNEL_T *pChannel;
+
+	if (channel >= pDev->channelCount)  {
+		return;
+	}
+
+	pChannel = &pDev->channel[channel];
+	if ((busOn != 0u) && (pChannel->busOn == 0u))  {
+		// the load is counted from bus on
+		pChannel->loadStart = now;
+		pChannel->loadGenerated = 0u;
+	}
+	if (busOn == 0u)  {
+		pChannel->rxFifoCount = 0u;
+	}
+	pChannel->busOn = busOn;
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_SimPeekFrame - next frame received on the channel
+ *
+ * \return 0 for none, 1 for a looped back frame, 2 for a frame of the load,
+ *         3 for the ack of a sent frame
+ */
+static UInt8 CAN4OSX_SimPeekFrame(
+		CAN4OSX_SIM_DEVICE_T *pDev,
+		UInt8 channel,
+		UInt64 now,
+		CanMsg *pMsg
+	)
+{
+CAN4OSX_SIM_CHANNEL_T *pChannel = &pDev->channel[channel];
+UInt32 sequence;
+
+	if (pChannel->busOn == 0u)  {
+		return(0u);
+	}
+
+	if (pChannel->rxFifoCount != 0u)  {
+		*pMsg = pChannel->rxFifo[pChannel->rxFifoFirst];
+		return((pMsg->padding == CAN4OSX_SIM_TX_DONE) ? 3u : 1u);
+	}
+
+	if (CAN4OSX_SimLoadDue(pDev, pChannel, now) == 0u)  {
+		return(0u);
+	}
+
+	memset(pMsg, 0, sizeof(CanMsg));
+	pMsg->canId = pChannel->load.canId;
+	pMsg->canDlc = pChannel->load.canDlc;
+	pMsg->canFlags = pChannel->load.canFlags;
+	if ((pMsg->canFlags & canMSG_EXT) == 0u)  {
+		pMsg->canFlags |= canMSG_STD;
+	}
+	// the frames are numbered, lost ones can be detected
+	sequence = (UInt32)pChannel->loadGenerated;
+	memcpy(pMsg->canData, &sequence, (pMsg->canDlc < sizeof(sequence)) ? pMsg->canDlc : sizeof(sequence));
+
+	return(2u);
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_SimTakeFrame(
+		CAN4OSX_SIM_DEVICE_T *pDev,
+		UInt8 channel,
+		UInt8 source
+	)
+{
+CAN4OSX_SIM_CHANNEL_T *pChannel = &pDev->channel[channel];
+
+	if (source == 2u)  {
+		pChannel->loadGenerated++;
+	} else {
+		pChannel->rxFifoFirst = (pChannel->rxFifoFirst + 1u) % CAN4OSX_SIM_RX_FIFO_SIZE;
+		pChannel->rxFifoCount--;
+	}
+
+	// an ack is no received frame
+	if (source != 3u)  {
+		pDev->statistics.rxFrames++;
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_SimLoadDue - frames of the load waiting on the bus
+ *
+ * A driver falling behind the bus loses the frames the fifo of the adapter
+ * can not hold, they are counted as overrun.
+ *
+ * \return number of frames
+ */
+static UInt64 CAN4OSX_SimLoadDue(
+		CAN4OSX_SIM_DEVICE_T *pDev,
+		CAN4OSX_SIM_CHANNEL_T *pChannel,
+		UInt64 now
+	)
+{
+UInt64 elapsed;
+UInt64 due;
+UInt32 rate;
+
+	if (pChannel->loadActive == 0u)  {
+		return(0u);
+	}
+
+	rate = CAN4OSX_SimLoadRate(pChannel);
+	if (rate == 0u)  {
+		due = pChannel->loadGenerated + 1u;
+	} else {
+		elapsed = (now > pChannel->loadStart) ? (now - pChannel->loadStart) : 0u;
+		due = ((elapsed / 1000000000u) * rate) + (((elapsed % 1000000000u) * rate) / 1000000000u);
+	}
+
+	if ((pChannel->load.frameCount != 0u) && (due > pChannel->load.frameCount))  {
+		due = pChannel->load.frameCount;
+	}
+	if (due <= pChannel->loadGenerated)  {
+		return(0u);
+	}
+
+	if ((due - pChannel->loadGenerated) > CAN4OSX_SIM_RX_FIFO_SIZE)  {
+		pDev->statistics.rxOverruns += (due - pChannel->loadGenerated) - CAN4OSX_SIM_RX_FIFO_SIZE;
+		pChannel->loadGenerated = due - CAN4OSX_SIM_RX_FIFO_SIZE;
+	}
+
+	return(due - pChannel->loadGenerated);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_SimLoadRate - frames per second of the load
+ *
+ * A saturated bus is calculated with the frame length without stuff bits.
+ * CAN FD frames with bit rate switch send control, data and crc at the data
+ * bit rate if the adapter got one, everything else counts at the nominal one.
+ *
+ * \return frames per second, 0 for unlimited
+ */
+static UInt32 CAN4OSX_SimLoadRate(
+		CAN4OSX_SIM_CHANNEL_T *pChannel
+	)
+{
+UInt32 bits;
+UInt32 dataBits;
+UInt64 frameNs;
+
+	if (pChannel->load.framesPerSecond != CAN4OSX_SIM_RATE_BUS)  {
+		return(pChannel->load.framesPerSecond);
+	}
+
+	if ((pChannel->dataBitRate != 0u) && ((pChannel->load.canFlags & (canFDMSG_FDF | canFDMSG_BRS)) == (canFDMSG_FDF | canFDMSG_BRS)))  {
+		// arbitration up to brs and ack to ifs, then esi to the crc delimiter
+		bits = ((pChannel->load.canFlags & canMSG_EXT) ? 36u : 17u) + 12u;
+		dataBits = (8u * pChannel->load.canDlc) + ((pChannel->load.canDlc > 16u) ? 31u : 27u);
+		frameNs = ((1000000000ull * bits) / pChannel->bitRate) + ((1000000000ull * dataBits) / pChannel->dataBitRate);
+
+		return((UInt32)(1000000000ull / frameNs) + 1u);
+	}
+
+	bits = ((pChannel->load.canFlags & canMSG_EXT) ? 67u : 47u) + (8u * pChannel->load.canDlc);
+
+	return((pChannel->bitRate / bits) + 1u);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_SimDeviceClock - device time of a host time
+ *
+ * The device clock starts with the adapter and drifts by clockDriftPpm.
+ *
+ * \return device time in ns
+ */
+static UInt64 CAN4OSX_SimDeviceClock(
+		CAN4OSX_SIM_DEVICE_T *pDev,
+		UInt64 now
+	)
+{
+SInt64 elapsed = (SInt64)(now - pDev->clockStart);
+
+	return((UInt64)(elapsed + ((elapsed * pDev->adapter.clockDriftPpm) / 1000000)));
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_SimReceives - the controller of the channel takes the frame
+ *
+ * The IXXAT adapter can switch off 11 or 29 bit ids, the Peak one has a
+ * filter of the 11 bit ids.
+ *
+ * \return 1 if the frame is received
+ */
+static UInt8 CAN4OSX_SimReceives(
+		CAN4OSX_SIM_DEVICE_T *pDev,
+		UInt8 channel,
+		const CanMsg *pMsg
+	)
+{
+CAN4OSX_SIM_CHANNEL_T *pChannel = &pDev->channel[channel];
+
+	switch (pDev->pProduct->protocol)  {
+		case CAN4OSX_SIM_IXXAT:
+			if ((pChannel->ixxOpMode & ((pMsg->canFlags & canMSG_EXT) ? IXXUSBFD_OPMODE_EXTENDED : IXXUSBFD_OPMODE_STANDARD)) == 0u)  {
+				return(0u);
+			}
+			break;
+		case CAN4OSX_SIM_PEAK:
+			if (((pMsg->canFlags & canMSG_EXT) == 0u)
+				&& ((pChannel->peakFilterStd[(pMsg->canId & 0x7ffu) >> 5] & (1u << (pMsg->canId & 0x1fu))) == 0u))  {
+				return(0u);
+			}
+			break;
+		default:
+			break;
+	}
+
+	return(1u);
+}
+
+
+#pragma mark Kvaser Leaf
+/******************************************************************************/
+static void CAN4OSX_SimLeafCommand(
+		CAN4OSX_SIM_DEVICE_T *pDev,
+		leafCmd *pCmd,
+		UInt64 now
+	)
+{
+leafCmd resp;
+CanMsg msg;
+UInt8 *pRaw;
+
+	memset(&resp, 0, sizeof(resp));
+
+	switch (pCmd->head.cmdNo)  {
+		case CMD_TX_STD_MESSAGE:
+		case CMD_TX_EXT_MESSAGE:
+			pRaw = pCmd->txCanMessage.rawMessage;
+			memset(&msg, 0, sizeof(msg));
+			if (pCmd->head.cmdNo == CMD_TX_EXT_MESSAGE)  {
+				msg.canId = ((UInt32)(pRaw[0] & 0x1f) << 24) | ((UInt32)(pRaw[1] & 0x3f) << 18) |
+							((UInt32)(pRaw[2] & 0x0f) << 14) | ((UInt32)pRaw[3] << 6) | (pRaw[4] & 0x3f);
+				msg.canFlags = canMSG_EXT;
+			} else {
+				msg.canId = ((UInt32)(pRaw[0] & 0x1f) << 6) | (pRaw[1] & 0x3f);
+			}
+			if (pCmd->txCanMessage.flags & LEAF_MSG_FLAG_REMOTE_FRAME)  {
+				msg.canFlags |= canMSG_RTR;
+			}
+			msg.canDlc = pRaw[5] & 0x0f;
+			if (msg.canDlc > 8u)  {
+				msg.canDlc = 8u;
+			}
+			memcpy(msg.canData, &pRaw[6], 8);
+			msg.canTimestamp = pCmd->txCanMessage.transId;
+			CAN4OSX_SimTransmit(pDev, pCmd->txCanMessage.channel, &msg);
+			break;
+
+		case CMD_SET_BUSPARAMS_REQ:
+			if (pCmd->setBusparamsReq.channel < pDev->channelCount)  {
+				pDev->channel[pCmd->setBusparamsReq.channel].bitRate = pCmd->setBusparamsReq.bitRate;
+			}
+			break;
+
+		case CMD_START_CHIP_REQ:
+		case CMD_STOP_CHIP_REQ:
+			CAN4OSX_SimBusOn(pDev, pCmd->startChipReq.channel, (pCmd->head.cmdNo == CMD_START_CHIP_REQ) ? 1u : 0u, now);
+
+			resp.startChipReq.cmdLen = sizeof(cmdStartChipReq);
+			resp.startChipReq.cmdNo = pCmd->head.cmdNo + 1u;
+			resp.startChipReq.transId = pCmd->startChipReq.transId;
+			resp.startChipReq.channel = pCmd->startChipReq.channel;
+			CAN4OSX_SimRespond(pDev, &resp, resp.head.cmdLen);
+
+			memset(&resp, 0, sizeof(resp));
+			resp.chipStateEvent.cmdLen = sizeof(cmdChipStateEvent);
+			resp.chipStateEvent.cmdNo = CMD_CHIP_STATE_EVENT;
+			resp.chipStateEvent.channel = pCmd->startChipReq.channel;
+			resp.chipStateEvent.busStatus = (pCmd->head.cmdNo == CMD_START_CHIP_REQ) ? 0u : M16C_BUS_OFF;
+			CAN4OSX_SimRespond(pDev, &resp, resp.head.cmdLen);
+			break;
+
+		case CMD_GET_CARD_INFO_REQ:
+			resp.getCardInfoResp.cmdLen = sizeof(cmdGetCardInfoResp);
+			resp.getCardInfoResp.cmdNo = CMD_GET_CARD_INFO_RESP;
+			resp.getCardInfoResp.transId = pCmd->getCardInfoReq.transId;
+			resp.getCardInfoResp.channelCount = pDev->channelCount;
+			resp.getCardInfoResp.serialNumber = CAN4OSX_SIM_SERIAL;
+			CAN4OSX_SimRespond(pDev, &resp, resp.head.cmdLen);
+			break;
+
+		case CMD_READ_CLOCK_REQ:
+		{
+			UInt64 ticks = (CAN4OSX_SimDeviceClock(pDev, now) * 24u) / 1000u;
+
+			resp.readClockResp.cmdLen = sizeof(cmdReadClockResp);
+			resp.readClockResp.cmdNo = CMD_READ_CLOCK_RESP;
+			resp.readClockResp.transId = pCmd->readClockReq.transId;
+			resp.readClockResp.time[0] = (UInt16)ticks;
+			resp.readClockResp.time[1] = (UInt16)(ticks >> 16);
+			resp.readClockResp.time[2] = (UInt16)(ticks >> 32);
+			CAN4OSX_SimRespond(pDev, &resp, resp.head.cmdLen);
+			break;
+		}
+
+		default:
+			break;
+	}
+}
+
+
+/******************************************************************************/
+static UInt32 CAN4OSX_SimLeafEncode(
+		UInt8 channel,
+		const CanMsg *pMsg,
+		UInt64 now,
+		UInt8 *pBuf,
+		UInt32 room
+	)
+{
+leafCmd cmd;
+UInt64 ticks = (now * 24u) / 1000u;
+
+	if (room < sizeof(cmdLogMessage))  {
+		return(0u);
+	}
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.logMessage.cmdLen = sizeof(cmdLogMessage);
+	cmd.logMessage.cmdNo = CMD_LOG_MESSAGE;
+	cmd.logMessage.channel = channel;
+	if (pMsg->canFlags & canMSG_RTR)  {
+		cmd.logMessage.flags |= LEAF_MSG_FLAG_REMOTE_FRAME;
+	}
+	if (pMsg->canFlags & canMSG_TXACK)  {
+		cmd.logMessage.flags |= LEAF_MSG_FLAG_TXACK;
+	}
+	cmd.logMessage.time[0] = (UInt16)ticks;
+	cmd.logMessage.time[1] = (UInt16)(ticks >> 16);
+	cmd.logMessage.time[2] = (UInt16)(ticks >> 32);
+	cmd.logMessage.dlc = (pMsg->canDlc > 8u) ? 8u : (UInt8)pMsg->canDlc;
+	cmd.logMessage.ident = pMsg->canId;
+	if (pMsg->canFlags & canMSG_EXT)  {
+		cmd.logMessage.ident |= LEAF_EXT_MSG;
+	}
+	memcpy(cmd.logMessage.data, pMsg->canData, cmd.logMessage.dlc);
+
+	memcpy(pBuf, &cmd, sizeof(cmdLogMessage));
+
+	return(sizeof(cmdLogMessage));
+}
+
+
+/******************************************************************************/
+static UInt32 CAN4OSX_SimLeafEncodeAck(
+		UInt8 channel,
+		const CanMsg *pMsg,
+		UInt64 now,
+		UInt8 *pBuf,
+		UInt32 room
+	)
+{
+leafCmd cmd;
+UInt64 ticks = (now * 24u) / 1000u;
+
+	if (room < sizeof(cmdTxAcknowledge))  {
+		return(0u);
+	}
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.txAck.cmdLen = sizeof(cmdTxAcknowledge);
+	cmd.txAck.cmdNo = CMD_TX_ACKNOWLEDGE;
+	cmd.txAck.channel = channel;
+	cmd.txAck.transId = (UInt8)pMsg->canTimestamp;
+	cmd.txAck.time[0] = (UInt16)ticks;
+	cmd.txAck.time[1] = (UInt16)(ticks >> 16);
+	cmd.txAck.time[2] = (UInt16)(ticks >> 32);
+
+	memcpy(pBuf, &cmd, sizeof(cmdTxAcknowledge));
+
+	return(sizeof(cmdTxAcknowledge));
+}
+
+
+#pragma mark Kvaser Leaf Pro
+/******************************************************************************/
+static void CAN4OSX_SimLeafProCommand(
+		CAN4OSX_SIM_DEVICE_T *pDev,
+		proCommand_t *pCmd,
+		UInt64 now
+	)
+{
+proCommand_t resp;
+CanMsg msg;
+UInt8 channel = CAN4OSX_SimLeafProChannel(pDev, pCmd->proCmdHead.address);
+
+	memset(&resp, 0, sizeof(resp));
+	resp.proCmdHead.cmdNo = pCmd->proCmdHead.cmdNo + 1u;
+	resp.proCmdHead.address = pCmd->proCmdHead.address;
+	resp.proCmdHead.transitionId = pCmd->proCmdHead.transitionId;
+
+	switch (pCmd->proCmdHead.cmdNo)  {
+		case LEAFPRO_CMD_MAP_CHANNEL_REQ:
+			if (strncmp(pCmd->proCmdMapChannelReq.name, "CAN", sizeof(pCmd->proCmdMapChannelReq.name)) == 0)  {
+				if (pCmd->proCmdMapChannelReq.channel < pDev->channelCount)  {
+					resp.proCmdMapChannelResp.heAddress = CAN4OSX_SIM_HE_CAN + pCmd->proCmdMapChannelReq.channel;
+					resp.proCmdMapChannelResp.position = pCmd->proCmdMapChannelReq.channel;
+				} else {
+					resp.proCmdMapChannelResp.heAddress = LEAFPRO_HE_ILLEGAL;
+					resp.proCmdMapChannelResp.flags = 1u;
+				}
+			} else {
+				resp.proCmdMapChannelResp.heAddress = CAN4OSX_SIM_HE_SYSDBG;
+			}
+			CAN4OSX_SimRespond(pDev, &resp, LEAFPRO_COMMAND_SIZE);
+			break;
+
+		case LEAFPRO_CMD_GET_CARD_INFO_REQ:
+			resp.proCmdCardInfoResp.serial_number = CAN4OSX_SIM_SERIAL;
+			resp.proCmdCardInfoResp.nchannels = pDev->channelCount;
+			CAN4OSX_SimRespond(pDev, &resp, LEAFPRO_COMMAND_SIZE);
+			break;
+
+		case LEAFPRO_CMD_GET_SOFTWARE_INFO_REQ:
+			CAN4OSX_SimRespond(pDev, &resp, LEAFPRO_COMMAND_SIZE);
+			break;
+
+		case LEAFPRO_CMD_READ_CLOCK_REQ:
+		{
+			UInt64 ticks = (CAN4OSX_SimDeviceClock(pDev, now) * 24u) / 1000u;
+
+			resp.proCmdReadClockResp.time[0] = (UInt16)ticks;
+			resp.proCmdReadClockResp.time[1] = (UInt16)(ticks >> 16);
+			resp.proCmdReadClockResp.time[2] = (UInt16)(ticks >> 32);
+			CAN4OSX_SimRespond(pDev, &resp, LEAFPRO_COMMAND_SIZE);
+			break;
+		}
+
+		case LEAFPRO_CMD_GET_SOFTWARE_DETAILS_REQ:
+			if (pDev->adapter.extendedMode != 0u)  {
+				resp.proCmdSwDetailResp.flags = LEASPRO_SUPPORT_EXTENDED;
+			}
+			CAN4OSX_SimRespond(pDev, &resp, LEAFPRO_COMMAND_SIZE);
+			break;
+
+		case LEAFPRO_CMD_SET_BUSPARAMS_REQ:
+		case LEAFPRO_CMD_SET_BUSPARAMS_FD_REQ:
+			if (channel < pDev->channelCount)  {
+				pDev->channel[channel].bitRate = pCmd->proCmdSetBusparamsReq.bitRate;
+			}
+			break;
+
+		case LEAFPRO_CMD_START_CHIP_REQ:
+			CAN4OSX_SimBusOn(pDev, channel, 1u, now);
+			CAN4OSX_SimRespond(pDev, &resp, LEAFPRO_COMMAND_SIZE);
+			break;
+
+		case LEAFPRO_CMD_TX_CAN_MESSAGE:
+			memset(&msg, 0, sizeof(msg));
+			msg.canId = pCmd->proCmdTxMessage.canId & ~LEAFPRO_EXT_MSG;
+			if (pCmd->proCmdTxMessage.canId & LEAFPRO_EXT_MSG)  {
+				msg.canFlags = canMSG_EXT;
+			}
+			if (pCmd->proCmdTxMessage.flags & LEAFPRO_MSG_FLAG_REMOTE_FRAME)  {
+				msg.canFlags |= canMSG_RTR;
+			}
+			msg.canDlc = (pCmd->proCmdTxMessage.dlc > 8u) ? 8u : pCmd->proCmdTxMessage.dlc;
+			memcpy(msg.canData, pCmd->proCmdTxMessage.data, 8);
+			msg.canTimestamp = pCmd->proCmdHead.transitionId & LEAFPRO_TRANSACTION_ID_MASK;
+			if (channel < pDev->channelCount)  {
+				CAN4OSX_SimTransmit(pDev, channel, &msg);
+			}
+			break;
+
+		case LEAFPRO_CMD_CAN_FD:
+			if (pCmd->proCommandExt.proCmdFdHead.cmd != LEAFPRO_CMD_TX_MESSAGE_FD)  {
+				break;
+			}
+			memset(&msg, 0, sizeof(msg));
+			msg.canId = pCmd->proCommandExt.proCmdFdTxMessage.canId & ~LEAFPRO_EXT_MSG;
+			if ((pCmd->proCommandExt.proCmdFdTxMessage.canId & LEAFPRO_EXT_MSG) ||
+				(pCmd->proCommandExt.proCmdFdTxMessage.flags & LEAFPRO_MSG_FLAG_EXTENDED))  {
+				msg.canFlags = canMSG_EXT;
+			}
+			msg.canDlc = pCmd->proCommandExt.proCmdFdTxMessage.databytes;
+			if (msg.canDlc > CAN4OSX_CAN_MAX_MSG_LEN)  {
+				msg.canDlc = CAN4OSX_CAN_MAX_MSG_LEN;
+			}
+			if ((msg.canDlc > 8u) || (pCmd->proCommandExt.proCmdFdTxMessage.flags & LEAFPRO_MSGFLAG_FDF))  {
+				msg.canFlags |= canFDMSG_FDF;
+			}
+			if (pCmd->proCommandExt.proCmdFdTxMessage.flags & LEAFPRO_MSGFLAG_BRS)  {
+				msg.canFlags |= canFDMSG_BRS;
+			}
+			memcpy(msg.canData, pCmd->proCommandExt.proCmdFdTxMessage.data, msg.canDlc);
+			msg.canTimestamp = pCmd->proCmdHead.transitionId & LEAFPRO_TRANSACTION_ID_MASK;
+			if (channel < pDev->channelCount)  {
+				CAN4OSX_SimTransmit(pDev, channel, &msg);
+			}
+			break;
+
+		default:
+			break;
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_SimLeafProEncode - a received frame as the firmware sends it
+ *
+ * The extended firmware sends every frame as RX_MESSAGE_FD with the hydra
+ * entity of the channel in address and transitionId, the other one uses
+ * LOG_MESSAGE.
+ *
+ * \return number of bytes, 0 if the frame does not fit
+ */
+static UInt32 CAN4OSX_SimLeafProEncode(
+		CAN4OSX_SIM_DEVICE_T *pDev,
+		UInt8 channel,
+		const CanMsg *pMsg,
+		UInt64 now,
+		UInt8 *pBuf,
+		UInt32 room
+	)
+{
+proCommand_t cmd;
+proCmdFdRxMessage_t *pRx = &cmd.proCommandExt.proCmdFdRxMessage;
+UInt64 ticks = (now * 24u) / 1000u;
+UInt8 he = CAN4OSX_SIM_HE_CAN + channel;
+UInt32 len;
+
+	memset(&cmd, 0, sizeof(cmd));
+
+	if (pDev->adapter.extendedMode == 0u)  {
+		if (room < LEAFPRO_COMMAND_SIZE)  {
+			return(0u);
+		}
+		cmd.proCmdLogMessage.header.cmdNo = LEAFPRO_CMD_LOG_MESSAGE;
+		cmd.proCmdLogMessage.header.address = he;
+		cmd.proCmdLogMessage.cmdLen = LEAFPRO_COMMAND_SIZE - sizeof(proCmdHead_t);
+		cmd.proCmdLogMessage.cmdNo = LEAFPRO_CMD_LOG_MESSAGE;
+		cmd.proCmdLogMessage.channel = channel;
+		if (pMsg->canFlags & canMSG_RTR)  {
+			cmd.proCmdLogMessage.flags |= LEAFPRO_MSG_FLAG_REMOTE_FRAME;
+		}
+		if (pMsg->canFlags & canMSG_TXACK)  {
+			cmd.proCmdLogMessage.flags |= LEAFPRO_MSG_FLAG_TXACK;
+		}
+		cmd.proCmdLogMessage.time[0] = (UInt16)ticks;
+		cmd.proCmdLogMessage.time[1] = (UInt16)(ticks >> 16);
+		cmd.proCmdLogMessage.time[2] = (UInt16)(ticks >> 32);
+		cmd.proCmdLogMessage.dlc = (pMsg->canDlc > 8u) ? 8u : (UInt8)pMsg->canDlc;
+		cmd.proCmdLogMessage.canId = pMsg->canId;
+		if (pMsg->canFlags & canMSG_EXT)  {
+			cmd.proCmdLogMessage.canId |= LEAFPRO_EXT_MSG;
+		}
+		memcpy(cmd.proCmdLogMessage.data, pMsg->canData, cmd.proCmdLogMessage.dlc);
+
+		memcpy(pBuf, &cmd, LEAFPRO_COMMAND_SIZE);
+		return(LEAFPRO_COMMAND_SIZE);
+	}
+
+	len = offsetof(proCmdFdRxMessage_t, data) + pMsg->canDlc;
+	if (room < len)  {
+		return(0u);
+	}
+
+	pRx->fdHeader.header.cmdNo = LEAFPRO_CMD_CAN_FD;
+	// destination is the driver, the source entity is split over both fields
+	pRx->fdHeader.header.address = LEAFPRO_HE_ROUTER | ((he & 0x30u) << 2);
+	pRx->fdHeader.header.transitionId = ((UInt16)(he & 0x0fu) << 12) | (pDev->sequence++ & 0x0fffu);
+	pRx->fdHeader.len = (UInt16)len;
+	pRx->fdHeader.cmd = LEAFPRO_CMD_RX_MESSAGE_FD;
+
+	pRx->canId = pMsg->canId;
+	if (pMsg->canFlags & canMSG_EXT)  {
+		pRx->flags |= LEAFPRO_MSG_FLAG_EXTENDED;
+	}
+	if (pMsg->canFlags & canMSG_RTR)  {
+		pRx->flags |= LEAFPRO_MSG_FLAG_REMOTE_FRAME;
+	}
+	if (pMsg->canFlags & canMSG_TXACK)  {
+		pRx->flags |= LEAFPRO_MSG_FLAG_TXACK;
+	}
+	if (pMsg->canFlags & canFDMSG_FDF)  {
+		pRx->flags |= LEAFPRO_MSGFLAG_FDF;
+		pRx->control = (UInt32)CAN4OSX_encodeFdDlc((UInt8)pMsg->canDlc) << 8;
+	} else {
+		pRx->control = (UInt32)pMsg->canDlc << 8;
+	}
+	if (pMsg->canFlags & canFDMSG_BRS)  {
+		pRx->flags |= LEAFPRO_MSGFLAG_BRS;
+	}
+	pRx->timestamp = ticks;
+	memcpy(pRx->data, pMsg->canData, pMsg->canDlc);
+
+	memcpy(pBuf, &cmd, len);
+
+	return(len);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_SimLeafProEncodeAck - the ack of a sent frame
+ *
+ * TX_ACKNOWLEDGE_FD with the time of the bus for the extended firmware, the
+ * classic TX_ACKNOWLEDGE without one otherwise. Both carry the hydra entity
+ * of the channel like the received frames of the extended firmware.
+ *
+ * \return number of bytes, 0 if the ack does not fit
+ */
+static UInt32 CAN4OSX_SimLeafProEncodeAck(
+		CAN4OSX_SIM_DEVICE_T *pDev,
+		UInt8 channel,
+		const CanMsg *pMsg,
+		UInt64 now,
+		UInt8 *pBuf,
+		UInt32 room
+	)
+{
+proCommand_t cmd;
+proCmdFdTxAck_t *pAck = &cmd.proCommandExt.proCmdFdTxAck;
+proCmdHead_t *pHeader = &cmd.proCmdHead;
+UInt8 he = CAN4OSX_SIM_HE_CAN + channel;
+UInt32 len = LEAFPRO_COMMAND_SIZE;
+
+	memset(&cmd, 0, sizeof(cmd));
+
+	if (pDev->adapter.extendedMode != 0u)  {
+		len = sizeof(proCmdFdTxAck_t);
+		pHeader = &pAck->fdHeader.header;
+		pAck->fdHeader.len = (UInt16)len;
+		pAck->fdHeader.cmd = LEAFPRO_CMD_TX_ACKNOWLEDGE_FD;
+		pAck->timestamp = (now * 24u) / 1000u;
+	}
+	if (room < len)  {
+		return(0u);
+	}
+
+	pHeader->cmdNo = (pDev->adapter.extendedMode != 0u) ? LEAFPRO_CMD_CAN_FD : LEAFPRO_CMD_TX_ACKNOWLEDGE;
+	pHeader->address = LEAFPRO_HE_ROUTER | ((he & 0x30u) << 2);
+	pHeader->transitionId = ((UInt16)(he & 0x0fu) << 12) | (UInt16)(pMsg->canTimestamp & LEAFPRO_TRANSACTION_ID_MASK);
+
+	memcpy(pBuf, &cmd, len);
+
+	return(len);
+}
+
+
+/******************************************************************************/
+static UInt8 CAN4OSX_SimLeafProChannel(
+		CAN4OSX_SIM_DEVICE_T *pDev,
+		UInt8 he
+	)
+{
+	he &= 0x3fu;
+
+	if ((he < CAN4OSX_SIM_HE_CAN) || ((he - CAN4OSX_SIM_HE_CAN) >= pDev->channelCount))  {
+		return(0xffu);
+	}
+
+	return(he - CAN4OSX_SIM_HE_CAN);
+}
+
+
+#pragma mark IXXAT USB-to-CAN FD
+/******************************************************************************/
+static void CAN4OSX_SimIxxMessage(
+		CAN4OSX_SIM_DEVICE_T *pDev,
+		UInt8 channel,
+		IXXUSBFDCANMSG_T *pMsg
+	)
+{
+CanMsg msg;
+
+	if ((channel >= pDev->channelCount) || ((pMsg->flags & IXXUSBFD_MSG_FLAG_TYPE) != IXXUSBFD_CAN_DATA))  {
+		return;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.canId = pMsg->canId;
+	msg.canDlc = CAN4OSX_decodeFdDlc((pMsg->flags & IXXUSBFD_MSG_FLAG_DLC) >> 16);
+	if (pMsg->flags & IXXUSBFD_MSG_FLAG_EXT)  {
+		msg.canFlags |= canMSG_EXT;
+	}
+	if (pMsg->flags & IXXUSBFD_MSG_FLAG_RTR)  {
+		msg.canFlags |= canMSG_RTR;
+	}
+	if (pMsg->flags & IXXUSBFD_MSG_FLAG_EDL)  {
+		msg.canFlags |= canFDMSG_FDF;
+	} else if (msg.canDlc > 8u)  {
+		msg.canDlc = 8u;
+	}
+	if (pMsg->flags & IXXUSBFD_MSG_FLAG_FDR)  {
+		msg.canFlags |= canFDMSG_BRS;
+	}
+	memcpy(msg.canData, pMsg->data, msg.canDlc);
+
+	CAN4OSX_SimTransmit(pDev, channel, &msg);
+}
+
+
+/******************************************************************************/
+static UInt32 CAN4OSX_SimIxxEncode(
+		UInt8 channel,
+		const CanMsg *pMsg,
+		UInt64 now,
+		UInt8 *pBuf,
+		UInt32 room
+	)
+{
+IXXUSBFDCANMSG_T msg;
+UInt32 len = sizeof(IXXUSBFDCANMSG_T) - sizeof(msg.data) + pMsg->canDlc;
+
+	(void)channel;
+
+	if (room < len)  {
+		return(0u);
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.size = (UInt8)(len - 1u);
+	msg.time = (UInt32)(now / 1000u);
+	msg.canId = pMsg->canId;
+	msg.flags = IXXUSBFD_CAN_DATA;
+	if (pMsg->canFlags & canFDMSG_FDF)  {
+		msg.flags |= (UInt32)CAN4OSX_encodeFdDlc((UInt8)pMsg->canDlc) << 16;
+		msg.flags |= IXXUSBFD_MSG_FLAG_EDL;
+	} else {
+		msg.flags |= (UInt32)pMsg->canDlc << 16;
+	}
+	if (pMsg->canFlags & canFDMSG_BRS)  {
+		msg.flags |= IXXUSBFD_MSG_FLAG_FDR;
+	}
+	if (pMsg->canFlags & canMSG_EXT)  {
+		msg.flags |= IXXUSBFD_MSG_FLAG_EXT;
+	}
+	if (pMsg->canFlags & canMSG_RTR)  {
+		msg.flags |= IXXUSBFD_MSG_FLAG_RTR;
+	}
+	memcpy(msg.data, pMsg->canData, pMsg->canDlc);
+
+	memcpy(pBuf, &msg, len);
+
+	return(len);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_SimIxxControl - the command interface of the IXXAT adapter
+ *
+ * A command is written with an OUT request to the port, the response is read
+ * with an IN request from the same port.
+ *
+ * \return IOReturn
+ */
+static IOReturn CAN4OSX_SimIxxControl(
+		CAN4OSX_SIM_DEVICE_T *pDev,
+		CAN4OSX_USB_CONTROL_T *pRequest,
+		UInt64 now
+	)
+{
+IXXUSBFDMSGREQHEAD_T reqHead;
+IXXUSBFDMSGRESPHEAD_T *pRespHead = (IXXUSBFDMSGRESPHEAD_T *)pRequest->pData;
+IXXUSBFDCANINITREQ_T initReq;
+UInt32 *pLastRequest;
+UInt32 loopCount;
+
+	if (pRequest->bRequest != CAN4OSX_SIM_IXX_REQUEST)  {
+		return(kIOReturnUnsupported);
+	}
+
+	if (pRequest->wValue == CAN4OSX_SIM_IXX_DEVICE_PORT)  {
+		pLastRequest = &pDev->ixxRequest;
+	} else if (pRequest->wValue < pDev->channelCount)  {
+		pLastRequest = &pDev->channel[pRequest->wValue].ixxRequest;
+	} else {
+		return(kIOReturnBadArgument);
+	}
+
+	if ((pRequest->bmRequestType & CAN4OSX_USB_DIR_IN) == 0u)  {
+		if (pRequest->wLength < sizeof(IXXUSBFDMSGREQHEAD_T))  {
+			return(kIOReturnBadArgument);
+		}
+		memcpy(&reqHead, pRequest->pData, sizeof(reqHead));
+		*pLastRequest = reqHead.reqCode;
+
+		switch (reqHead.reqCode)  {
+			case IXXUSBFD_CMD_START_CHIP:
+			case IXXUSBFD_CMD_STOP_CHIP:
+				CAN4OSX_SimBusOn(pDev, (UInt8)reqHead.reqPort, (reqHead.reqCode == IXXUSBFD_CMD_START_CHIP) ? 1u : 0u, now);
+				break;
+			case IXXUSBFD_CMD_FREQ_CHIP:
+				if ((pRequest->wLength >= sizeof(initReq)) && (reqHead.reqPort < pDev->channelCount))  {
+					memcpy(&initReq, pRequest->pData, sizeof(initReq));
+					if ((initReq.stdBitrate.bps != 0u) && ((1u + initReq.stdBitrate.tseg1 + initReq.stdBitrate.tseg2) != 0u))  {
+						pDev->channel[reqHead.reqPort].bitRate = CAN4OSX_SIM_IXX_CLOCK / (initReq.stdBitrate.bps * (1u + initReq.stdBitrate.tseg1 + initReq.stdBitrate.tseg2));
+					}
+					pDev->channel[reqHead.reqPort].dataBitRate = 0u;
+					if (((initReq.exMode & IXXUSBFD_EXMODE_FASTDATA) != 0u) && (initReq.fdBitrate.bps != 0u))  {
+						pDev->channel[reqHead.reqPort].dataBitRate = CAN4OSX_SIM_IXX_CLOCK / (initReq.fdBitrate.bps * (1u + initReq.fdBitrate.tseg1 + initReq.fdBitrate.tseg2));
+					}
+					pDev->channel[reqHead.reqPort].ixxOpMode = initReq.opMode;
+				}
+				break;
+			default:
+				break;
+		}
+
+		pRequest->wLenDone = pRequest->wLength;
+		return(kIOReturnSuccess);
+	}
+
+	if (pRequest->wLength < sizeof(IXXUSBFDMSGRESPHEAD_T))  {
+		return(kIOReturnOverrun);
+	}
+
+	memset(pRequest->pData, 0, pRequest->wLength);
+	pRespHead->respSize = pRequest->wLength;
+	pRespHead->retSize = pRequest->wLength;
+	pRespHead->retCode = (*pLastRequest != 0u) ? 0u : 0xffFFffFF;
+
+	switch (*pLastRequest)  {
+		case IXXUSBFD_CMD_CAPS_DEV:
+			if (pRequest->wLength >= sizeof(IXXUSBFDDEVICECAPSRESP_T))  {
+			IXXUSBFDDEVICECAPSRESP_T *pCaps = (IXXUSBFDDEVICECAPSRESP_T *)pRequest->pData;
+
+				pCaps->caps.chanCount = pDev->channelCount;
+				for (loopCount = 0; loopCount < pDev->channelCount; loopCount++)  {
+					pCaps->caps.chanTypes[loopCount] = CAN4OSX_SIM_IXX_CHANNEL_FD;
+				}
+			}
+			break;
+		case IXXUSBFD_CMD_START_CHIP:
+			if (pRequest->wLength >= sizeof(IXXUSBFDCANSTARTRESP_T))  {
+				((IXXUSBFDCANSTARTRESP_T *)pRequest->pData)->startTime = (UInt32)(CAN4OSX_SimDeviceClock(pDev, now) / 1000u);
+			}
+			break;
+		default:
+			break;
+	}
+
+	pRequest->wLenDone = pRequest->wLength;
+
+	return(kIOReturnSuccess);
+}
+
+
+#pragma mark Peak PCAN-USB FD
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_SimPeakCommand - one command of a list on the command pipe
+ *
+ * The bit timing values are sent minus one.
+ */
+static void CAN4OSX_SimPeakCommand(
+		CAN4OSX_SIM_DEVICE_T *pDev,
+		const PEAKUSBFD_CMD_T *pCmd,
+		UInt64 now
+	)
+{
+UInt8 channel = (UInt8)PEAKUSBFD_CMD_GET_CHANNEL(pCmd->std.opcodeChannel);
+CAN4OSX_SIM_CHANNEL_T *pChannel;
+
+	if (channel >= pDev->channelCount)  {
+		return;
+	}
+	pChannel = &pDev->channel[channel];
+
+	switch (PEAKUSBFD_CMD_GET_OPCODE(pCmd->std.opcodeChannel))  {
+		case PEAKUSBFD_CMD_RESET_MODE:
+			CAN4OSX_SimBusOn(pDev, channel, 0u, now);
+			break;
+		case PEAKUSBFD_CMD_NORMAL_MODE:
+		case PEAKUSBFD_CMD_LISTEN_ONLY_MODE:
+			CAN4OSX_SimBusOn(pDev, channel, 1u, now);
+			break;
+		case PEAKUSBFD_CMD_TIMING_SLOW:
+			pChannel->bitRate = PEAKUSBFD_CLOCK_HZ / ((pCmd->timingSlow.brp + 1u)
+				* (3u + pCmd->timingSlow.tseg1 + (pCmd->timingSlow.tseg2 & 0x7fu)));
+			break;
+		case PEAKUSBFD_CMD_TIMING_FAST:
+			pChannel->dataBitRate = PEAKUSBFD_CLOCK_HZ / ((pCmd->timingFast.brp + 1u)
+				* (3u + pCmd->timingFast.tseg1 + pCmd->timingFast.tseg2));
+			break;
+		case PEAKUSBFD_CMD_FILTER_STD:
+			if (pCmd->filterStd.idx < PEAKUSBFD_FILTER_STD_ROWS)  {
+				pChannel->peakFilterStd[pCmd->filterStd.idx] = pCmd->filterStd.mask;
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+
+/******************************************************************************/
+static void CAN4OSX_SimPeakMessage(
+		CAN4OSX_SIM_DEVICE_T *pDev,
+		const PEAKUSBFDTXMSG_T *pMsg
+	)
+{
+UInt8 channel = PEAKUSBFD_MSG_CHANNEL(pMsg->channelDlc);
+CanMsg msg;
+
+	if ((channel >= pDev->channelCount) || (pMsg->type != PEAKUSBFD_MSG_CAN_TX))  {
+		return;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.canId = pMsg->canId;
+	msg.canDlc = CAN4OSX_decodeFdDlc(PEAKUSBFD_MSG_DLC(pMsg->channelDlc));
+	if (pMsg->flags & PEAKUSBFD_MSG_FLAG_EXT_ID)  {
+		msg.canFlags |= canMSG_EXT;
+	}
+	if (pMsg->flags & PEAKUSBFD_MSG_FLAG_RTR)  {
+		msg.canFlags |= canMSG_RTR;
+	}
+	if (pMsg->flags & PEAKUSBFD_MSG_FLAG_EXT_DATA_LEN)  {
+		msg.canFlags |= canFDMSG_FDF;
+	} else if (msg.canDlc > 8u)  {
+		msg.canDlc = 8u;
+	}
+	if (pMsg->flags & PEAKUSBFD_MSG_FLAG_BRS)  {
+		msg.canFlags |= canFDMSG_BRS;
+	}
+	memcpy(msg.canData, pMsg->data, msg.canDlc);
+	msg.canTimestamp = pMsg->client;
+
+	CAN4OSX_SimTransmit(pDev, channel, &msg);
+}
+
+
+/******************************************************************************/
+static UInt32 CAN4OSX_SimPeakEncode(
+		UInt8 channel,
+		const CanMsg *pMsg,
+		UInt64 now,
+		UInt8 *pBuf,
+		UInt32 room
+	)
+{
+PEAKUSBFDRXMSG_T msg;
+UInt32 len = PEAKUSBFD_MSG_ALIGN(PEAKUSBFD_RX_MSG_HEAD_SIZE + pMsg->canDlc);
+UInt64 time = now / 1000u;
+
+	if (room < len)  {
+		return(0u);
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.head.size = (UInt16)len;
+	msg.head.type = PEAKUSBFD_MSG_CAN_RX;
+	msg.head.tsLow = (UInt32)time;
+	msg.head.tsHigh = (UInt32)(time >> 32);
+	msg.channelDlc = PEAKUSBFD_MSG_CHANNEL_DLC(channel, CAN4OSX_encodeFdDlc((UInt8)pMsg->canDlc));
+	msg.canId = pMsg->canId;
+	if (pMsg->canFlags & canFDMSG_FDF)  {
+		msg.flags |= PEAKUSBFD_MSG_FLAG_EXT_DATA_LEN;
+	}
+	if (pMsg->canFlags & canFDMSG_BRS)  {
+		msg.flags |= PEAKUSBFD_MSG_FLAG_BRS;
+	}
+	if (pMsg->canFlags & canMSG_EXT)  {
+		msg.flags |= PEAKUSBFD_MSG_FLAG_EXT_ID;
+	}
+	if (pMsg->canFlags & canMSG_RTR)  {
+		msg.flags |= PEAKUSBFD_MSG_FLAG_RTR;
+	}
+	if (pMsg->canFlags & canMSG_TXACK)  {
+		msg.flags |= PEAKUSBFD_MSG_FLAG_SELF_RECEIVE;
+		msg.client = (UInt8)pMsg->canTimestamp;
+	}
+	memcpy(msg.data, pMsg->canData, pMsg->canDlc);
+
+	memcpy(pBuf, &msg, len);
+
+	return(len);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief CAN4OSX_SimPeakControl - vendor requests of the Peak adapter
+ *
+ * Only the driver loaded notification is used.
+ *
+ * \return IOReturn
+ */
+static IOReturn CAN4OSX_SimPeakControl(
+		CAN4OSX_SIM_DEVICE_T *pDev,
+		CAN4OSX_USB_CONTROL_T *pRequest
+	)
+{
+	(void)pDev;
+
+	if ((pRequest->bRequest != PEAKUSBFD_REQ_FCT) || (pRequest->wValue != PEAKUSBFD_FCT_DRVLD)
+		|| ((pRequest->bmRequestType & CAN4OSX_USB_DIR_IN) != 0u))  {
+		return(kIOReturnUnsupported);
+	}
+
+	pRequest->wLenDone = pRequest->wLength;
+
+	return(kIOReturnSuccess);
+}
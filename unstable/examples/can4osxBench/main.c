@@ -0,0 +1,1244 @@
+//
+// main.c
+// can4osxBench
+//
+// Copyright (c) 2014 - 2018 Alexander Philipp. All rights reserved.
+//
+//
+// License: GPLv2
+//
+// ===============================================================================
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation version 2
+// of the license.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+//
+// ===============================================================================
+//
+// Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+// WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+// WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+// COMBINATION WITH YOUR PRODUCTS.
+//
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+//                       GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+// OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+// (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+// BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// ===============================================================================
+//
+// Host side micro benchmark of the internal buffers and of the complete
+// driver with simulated adapters, no hardware needed.
+//
+// Build:
+//   cc -O2 -I../.. -o can4osxBench main.c ../../*.c -framework CoreFoundation -framework IOKit
+// or elsewhere, see the Readme of the sources
+//   clang -O2 -fblocks -I../.. $(pkg-config --cflags libusb-1.0) -o can4osxBench main.c ../../*.c
+//     -ldispatch -lBlocksRuntime -lpthread $(pkg-config --libs libusb-1.0)
+//
+// Usage:
+//   can4osxBench [frames]
+//   can4osxBench rx <product id> [frames] [ext] [zc] [flt] [bus] [stat]
+//   can4osxBench tx <product id> [frames]
+//   can4osxBench sync [seconds]
+//   can4osxBench merge [frames]
+//   can4osxBench hotplug [seconds]
+//   can4osxBench startup [adapters] [lazy]
+//
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <dispatch/dispatch.h>
+
+#include "can4osx_internal.h"
+#include "can4osx_sim.h"
+
+
+#define BENCH_DEFAULT_FRAMES	2000000u
+#define BENCH_BUFFER_SIZE		1000u
+#define BENCH_BATCH_SIZE		64u
+#define BENCH_TIMEOUT_MS		10000u
+#define BENCH_SYNC_SECONDS		10u
+#define BENCH_SYNC_PERIOD_MS	100u
+#define BENCH_SYNC_ADAPTERS		2u
+#define BENCH_MERGE_CHANNELS	4u
+#define BENCH_MERGE_WINDOW_US	5000u
+#define BENCH_FILTER_IDS		1024u
+#define BENCH_HOTPLUG_SECONDS	10u
+#define BENCH_HOTPLUG_CHANNELS	5u
+#define BENCH_HOTPLUG_PERIOD_MS	50u
+#define BENCH_HOTPLUG_REPLUG_MS	20u
+#define BENCH_HOTPLUG_HOLD_US	200u
+#define BENCH_STARTUP_ADAPTERS	8u
+#define BENCH_STARTUP_SETUP_MS	200u
+#define BENCH_STATS_PERIOD_MS	100u
+
+
+/* the former dispatch_sync based event buffer, kept as reference */
+typedef struct {
+	int bufferSize;
+	int bufferFirst;
+	int bufferCount;
+	dispatch_queue_t bufferGDCqueueRef;
+	CanMsg *canMsgRef;
+} BENCH_GCD_BUF_T;
+
+typedef struct {
+	const char *name;
+	void *bufferRef;
+	UInt8 (*write)(void *bufferRef, CanMsg newEvent);
+	UInt8 (*read)(void *bufferRef, CanMsg *readEvent);
+	UInt32 frames;
+	UInt64 *latency;
+} BENCH_RUN_T;
+
+/* one thread of benchSimHotplug, it works on whatever sits at index */
+typedef struct {
+	pthread_t thread;
+	int index;
+	atomic_uint *pStop;
+	UInt64 rxFrames;
+	UInt64 txFrames;
+	UInt32 opens;
+	UInt32 rejected;
+	UInt32 held;			// acquired frames outlived their adapter
+	UInt32 idSum;
+} BENCH_HOTPLUG_T;
+
+/* the dashboard of benchSimRx, polls the bus statistics */
+typedef struct {
+	pthread_t thread;
+	CanHandle hnd;
+	atomic_uint stop;
+	UInt32 polls;
+	UInt64 pollMax;
+	canBusStatistics stat;
+} BENCH_STATS_T;
+
+
+/* list of local defined functions --- */
+static BENCH_GCD_BUF_T* benchGcdCreate(UInt32 bufferSize);
+static void benchGcdRelease(BENCH_GCD_BUF_T* bufferRef);
+static UInt8 benchGcdWrite(void *bufferRef, CanMsg newEvent);
+static UInt8 benchGcdRead(void *bufferRef, CanMsg *readEvent);
+static UInt8 benchSpscWrite(void *bufferRef, CanMsg newEvent);
+static UInt8 benchSpscRead(void *bufferRef, CanMsg *readEvent);
+static void* benchProducer(void *arg);
+static void* benchConsumer(void *arg);
+static int benchCompare(const void *a, const void *b);
+static void benchRun(BENCH_RUN_T *pRun);
+static CanHandle benchSimOpen(UInt16 productId, UInt8 extendedMode, int flags);
+static int benchSimRx(UInt16 productId, UInt32 frames, UInt8 extendedMode, UInt8 zeroCopy, UInt8 filter, UInt8 busRate, UInt8 stats);
+static void* benchStatsPoller(void *arg);
+static int benchSimTx(UInt16 productId, UInt32 frames);
+static int benchSimSync(UInt32 seconds);
+static int benchSimMerge(UInt32 frames);
+static int benchSimHotplug(UInt32 seconds);
+static void* benchHotplugWorker(void *arg);
+static int benchSimStartup(UInt32 adapters, UInt8 lazy);
+static double benchSeconds(UInt64 start, UInt64 stop);
+
+
+int main(int argc, const char * argv[])
+{
+	UInt32 frames = BENCH_DEFAULT_FRAMES;
+	BENCH_RUN_T run;
+
+	if ((argc > 2) && ((strcmp(argv[1], "rx") == 0) || (strcmp(argv[1], "tx") == 0)))  {
+		UInt16 productId = (UInt16)strtoul(argv[2], NULL, 0);
+
+		if (argc > 3)  {
+			frames = (UInt32)strtoul(argv[3], NULL, 0);
+			if (frames == 0)  {
+				frames = BENCH_DEFAULT_FRAMES;
+			}
+		}
+		if (strcmp(argv[1], "rx") == 0)  {
+			UInt8 extendedMode = 0u;
+			UInt8 zeroCopy = 0u;
+			UInt8 filter = 0u;
+			UInt8 busRate = 0u;
+			UInt8 stats = 0u;
+			int arg;
+
+			for (arg = 4; arg < argc; arg++)  {
+				if (strcmp(argv[arg], "ext") == 0)  {
+					extendedMode = 1u;
+				} else if (strcmp(argv[arg], "zc") == 0)  {
+					zeroCopy = 1u;
+				} else if (strcmp(argv[arg], "flt") == 0)  {
+					filter = 1u;
+				} else if (strcmp(argv[arg], "bus") == 0)  {
+					busRate = 1u;
+				} else if (strcmp(argv[arg], "stat") == 0)  {
+					stats = 1u;
+				}
+			}
+			return(benchSimRx(productId, frames, extendedMode, zeroCopy, filter, busRate, stats));
+		}
+		return(benchSimTx(productId, frames));
+	}
+
+	if ((argc > 1) && (strcmp(argv[1], "sync") == 0))  {
+		UInt32 seconds = BENCH_SYNC_SECONDS;
+
+		if (argc > 2)  {
+			seconds = (UInt32)strtoul(argv[2], NULL, 0);
+			if (seconds == 0)  {
+				seconds = BENCH_SYNC_SECONDS;
+			}
+		}
+		return(benchSimSync(seconds));
+	}
+
+	if ((argc > 1) && (strcmp(argv[1], "merge") == 0))  {
+		if (argc > 2)  {
+			frames = (UInt32)strtoul(argv[2], NULL, 0);
+			if (frames == 0)  {
+				frames = BENCH_DEFAULT_FRAMES;
+			}
+		}
+		return(benchSimMerge(frames));
+	}
+
+	if ((argc > 1) && (strcmp(argv[1], "hotplug") == 0))  {
+		UInt32 seconds = BENCH_HOTPLUG_SECONDS;
+
+		if (argc > 2)  {
+			seconds = (UInt32)strtoul(argv[2], NULL, 0);
+			if (seconds == 0)  {
+				seconds = BENCH_HOTPLUG_SECONDS;
+			}
+		}
+		return(benchSimHotplug(seconds));
+	}
+
+	if ((argc > 1) && (strcmp(argv[1], "startup") == 0))  {
+		UInt32 adapters = BENCH_STARTUP_ADAPTERS;
+		UInt8 lazy = 0u;
+
+		if (argc > 2)  {
+			adapters = (UInt32)strtoul(argv[2], NULL, 0);
+			if (adapters == 0)  {
+				adapters = BENCH_STARTUP_ADAPTERS;
+			}
+		}
+		if ((argc > 3) && (strcmp(argv[3], "lazy") == 0))  {
+			lazy = 1u;
+		}
+		return(benchSimStartup(adapters, lazy));
+	}
+
+	if (argc > 1)  {
+		frames = (UInt32)strtoul(argv[1], NULL, 0);
+		if (frames == 0)  {
+			frames = BENCH_DEFAULT_FRAMES;
+		}
+	}
+
+	printf("can4osx event buffer benchmark, %u frames, buffer %u\n", frames, BENCH_BUFFER_SIZE);
+
+	memset(&run, 0, sizeof(run));
+	run.name = "dispatch_sync";
+	run.bufferRef = benchGcdCreate(BENCH_BUFFER_SIZE);
+	run.write = benchGcdWrite;
+	run.read = benchGcdRead;
+	run.frames = frames;
+	benchRun(&run);
+	benchGcdRelease(run.bufferRef);
+
+	memset(&run, 0, sizeof(run));
+	run.name = "spsc ring";
+	run.bufferRef = CAN4OSX_CreateCanEventBuffer(BENCH_BUFFER_SIZE * CAN4OSX_FRAME_MAX_CELLS * CAN_FRAME_CELL_SIZE);
+	run.write = benchSpscWrite;
+	run.read = benchSpscRead;
+	run.frames = frames;
+	benchRun(&run);
+	CAN4OSX_ReleaseCanEventBuffer(run.bufferRef);
+
+	return(0);
+}
+
+
+/******************************************************************************/
+static void benchRun(
+		BENCH_RUN_T *pRun
+	)
+{
+pthread_t producer;
+pthread_t consumer;
+UInt64 start;
+UInt64 stop;
+double seconds;
+double p99;
+
+	if (pRun->bufferRef == NULL)  {
+		printf("%-14s: buffer creation failed\n", pRun->name);
+		return;
+	}
+
+	pRun->latency = malloc(pRun->frames * sizeof(UInt64));
+	if (pRun->latency == NULL)  {
+		printf("%-14s: out of memory\n", pRun->name);
+		return;
+	}
+
+	start = CAN4OSX_GetNanoseconds();
+	pthread_create(&consumer, NULL, benchConsumer, pRun);
+	pthread_create(&producer, NULL, benchProducer, pRun);
+	pthread_join(producer, NULL);
+	pthread_join(consumer, NULL);
+	stop = CAN4OSX_GetNanoseconds();
+
+	seconds = benchSeconds(start, stop);
+
+	qsort(pRun->latency, pRun->frames, sizeof(UInt64), benchCompare);
+	p99 = (double)pRun->latency[(pRun->frames * 99u) / 100u];
+
+	printf("%-14s: %12.0f frames/s, p99 enqueue %8.1f ns\n", pRun->name, (double)pRun->frames / seconds, p99);
+
+	free(pRun->latency);
+	pRun->latency = NULL;
+}
+
+
+/******************************************************************************/
+static double benchSeconds(
+		UInt64 start,
+		UInt64 stop
+	)
+{
+	return((double)(stop - start) / 1e9);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief benchSimOpen - plug in a simulated adapter and open its first channel
+ *
+ * \return handle, negative canStatus on error
+ */
+static CanHandle benchSimOpen(
+		UInt16 productId,
+		UInt8 extendedMode,
+		int flags
+	)
+{
+CAN4OSX_SIM_ADAPTER_T adapter;
+CanHandle hnd;
+canStatus status;
+
+	memset(&adapter, 0, sizeof(adapter));
+	adapter.productId = productId;
+	adapter.extendedMode = extendedMode;
+
+	status = can4osxSimEnable();
+	if (status == canOK)  {
+		status = can4osxSimAddAdapter(&adapter);
+	}
+	if (status != canOK)  {
+		return(status);
+	}
+
+	canInitializeLibrary();
+
+	hnd = canOpenChannel(0, flags);
+	if (hnd < 0)  {
+		return(hnd);
+	}
+
+	status = canSetBusParams(hnd, canBITRATE_500K, 0, 0, 0, 0, 0);
+	if (status == canOK)  {
+		status = canBusOn(hnd);
+	}
+	if (status != canOK)  {
+		canClose(hnd);
+		return(status);
+	}
+
+	return(hnd);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief benchSimRx - received frames through the decoder of the adapter
+ *
+ * The adapter sends as fast as the driver reads, the sequence number in the
+ * data detects lost frames. zeroCopy reads with canReadAcquire instead of
+ * canReadBatch, filter looks every frame up in an acceptance filter of
+ * BENCH_FILTER_IDS ids. busRate sends at the rate of a saturated bus instead,
+ * CAN FD frames with 2 Mbit/s in the data phase, and no frame may get lost.
+ */
+static int benchSimRx(
+		UInt16 productId,
+		UInt32 frames,
+		UInt8 extendedMode,
+		UInt8 zeroCopy,
+		UInt8 filter,
+		UInt8 busRate,
+		UInt8 stats
+	)
+{
+BENCH_STATS_T poller;
+CAN4OSX_SIM_LOAD_T load;
+CanMsg msg[BENCH_BATCH_SIZE];
+const CanFrame *pFrame;
+const UInt8 *pData;
+canStatus status;
+CanHandle hnd;
+size_t got;
+size_t i;
+UInt32 received = 0u;
+UInt32 lost = 0u;
+UInt32 sequence;
+UInt64 start;
+UInt64 stop;
+
+	hnd = benchSimOpen(productId, extendedMode, (extendedMode != 0u) ? canOPEN_CAN_FD : 0);
+	if (hnd < 0)  {
+		printf("simulated adapter 0x%04x: open failed (%d)\n", productId, hnd);
+		return(1);
+	}
+
+	if (filter != 0u)  {
+		UInt32 ids[BENCH_FILTER_IDS];
+
+		// the odd 11 bit ids, the load sends 0x123
+		for (i = 0; i < BENCH_FILTER_IDS; i++)  {
+			ids[i] = (UInt32)(2u * i) + 1u;
+		}
+		canBusOff(hnd);
+		status = canAddAcceptanceIds(hnd, ids, BENCH_FILTER_IDS, 0);
+		if (status == canOK)  {
+			status = canBusOn(hnd);
+		}
+		if (status != canOK)  {
+			printf("simulated adapter 0x%04x: filter failed (%d)\n", productId, status);
+			return(1);
+		}
+	}
+
+	if ((busRate != 0u) && (extendedMode != 0u))  {
+		canBusOff(hnd);
+		status = canSetBusParamsFd(hnd, canFD_BITRATE_2M_80P, 0, 0, 0);
+		if (status == canOK)  {
+			status = canBusOn(hnd);
+		}
+		if (status != canOK)  {
+			printf("simulated adapter 0x%04x: data bit rate failed (%d)\n", productId, status);
+			return(1);
+		}
+	}
+
+	memset(&load, 0, sizeof(load));
+	load.framesPerSecond = (busRate != 0u) ? CAN4OSX_SIM_RATE_BUS : CAN4OSX_SIM_RATE_UNLIMITED;
+	load.frameCount = frames;
+	load.canId = 0x123;
+	load.canDlc = (extendedMode != 0u) ? 64u : 8u;
+	load.canFlags = (extendedMode != 0u) ? (canFDMSG_FDF | canFDMSG_BRS) : 0u;
+
+	if (stats != 0u)  {
+		memset(&poller, 0, sizeof(poller));
+		poller.hnd = hnd;
+		atomic_init(&poller.stop, 0u);
+		pthread_create(&poller.thread, NULL, benchStatsPoller, &poller);
+	}
+
+	start = CAN4OSX_GetNanoseconds();
+	can4osxSimSetLoad(hnd, &load);
+
+	while (received + lost < frames)  {
+		pFrame = NULL;
+		if (zeroCopy != 0u)  {
+			status = canReadAcquire(hnd, &pFrame, BENCH_BATCH_SIZE, &got);
+		} else {
+			status = canReadBatch(hnd, msg, BENCH_BATCH_SIZE, &got);
+		}
+		if (status != canOK)  {
+			UInt32 id;
+			UInt16 dlc;
+			UInt32 flag;
+			UInt32 time;
+
+			// nothing buffered, wait for the next transfer
+			if (canReadWait(hnd, &id, msg[0].canData, &dlc, &flag, &time, BENCH_TIMEOUT_MS) != canOK)  {
+				printf("simulated adapter 0x%04x: timeout after %u frames\n", productId, received);
+				break;
+			}
+			msg[0].canDlc = dlc;
+			pFrame = NULL;
+			got = 1;
+			status = canERR_NOMSG;
+		}
+		for (i = 0; i < got; i++)  {
+			if (pFrame != NULL)  {
+				pData = pFrame->canData;
+				pFrame = canFrameNext(pFrame);
+			} else {
+				pData = msg[i].canData;
+			}
+			memcpy(&sequence, pData, sizeof(sequence));
+			if (sequence != received + lost)  {
+				lost += sequence - (received + lost);
+			}
+			received++;
+		}
+		if ((zeroCopy != 0u) && (status == canOK))  {
+			canReadRelease(hnd, got);
+		}
+	}
+
+	stop = CAN4OSX_GetNanoseconds();
+
+	printf("simulated adapter 0x%04x rx%s%s%s: %12.0f frames/s, %u frames, %u lost\n", productId,
+		(zeroCopy != 0u) ? " zero copy" : "", (filter != 0u) ? " filtered" : "", (busRate != 0u) ? " bus rate" : "",
+		(double)received / benchSeconds(start, stop), received, lost);
+
+	if (stats != 0u)  {
+		atomic_store(&poller.stop, 1u);
+		pthread_join(poller.thread, NULL);
+
+		printf("  statistics: %u polls, slowest %.1f us\n", poller.polls, benchSeconds(0u, poller.pollMax) * 1e6);
+		printf("  std %lu ext %lu fd %lu remote %lu error %lu overruns %lu, %llu bytes, load %lu.%02lu %%\n",
+			poller.stat.stdData, poller.stat.extData, poller.stat.fdData,
+			poller.stat.stdRemote + poller.stat.extRemote, poller.stat.errFrame, poller.stat.overruns,
+			(unsigned long long)poller.stat.dataBytes, poller.stat.busLoad / 100u, poller.stat.busLoad % 100u);
+	}
+
+	canBusOff(hnd);
+	canClose(hnd);
+
+	return(lost != 0u);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief benchStatsPoller - what a dashboard does while the frames come in
+ *
+ * The counters add up over the run, the load is the one of the last period.
+ * With bus it comes out close to 100 %.
+ */
+static void* benchStatsPoller(
+		void *arg
+	)
+{
+BENCH_STATS_T *pPoller = (BENCH_STATS_T *)arg;
+UInt64 start;
+UInt64 took;
+UInt8 last = 0u;
+
+	while (last == 0u)  {
+		usleep(BENCH_STATS_PERIOD_MS * 1000u);
+		last = (UInt8)atomic_load(&pPoller->stop);
+
+		start = CAN4OSX_GetNanoseconds();
+		if ( (canRequestBusStatistics(pPoller->hnd) != canOK)
+				|| (canGetBusStatistics(pPoller->hnd, &pPoller->stat, sizeof(pPoller->stat)) != canOK) )  {
+			break;
+		}
+		took = CAN4OSX_GetNanoseconds() - start;
+		if (took > pPoller->pollMax)  {
+			pPoller->pollMax = took;
+		}
+		pPoller->polls++;
+	}
+
+	return(NULL);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief benchSimTx - transmitted frames through the encoder of the driver
+ *
+ * Finished when the adapter has seen all frames on its bulk out pipe.
+ */
+static int benchSimTx(
+		UInt16 productId,
+		UInt32 frames
+	)
+{
+CAN4OSX_SIM_STATISTICS_T statistics;
+CanTxStatistics txStatistics;
+CanMsg msg[BENCH_BATCH_SIZE];
+CanHandle hnd;
+size_t accepted;
+size_t i;
+UInt32 sent = 0u;
+UInt64 start;
+UInt64 stop;
+UInt64 timeout;
+
+	hnd = benchSimOpen(productId, 0u, 0);
+	if (hnd < 0)  {
+		printf("simulated adapter 0x%04x: open failed (%d)\n", productId, hnd);
+		return(1);
+	}
+
+	memset(msg, 0, sizeof(msg));
+	for (i = 0; i < BENCH_BATCH_SIZE; i++)  {
+		msg[i].canId = 0x100 + i;
+		msg[i].canDlc = 8u;
+		msg[i].canFlags = canMSG_STD;
+	}
+
+	start = CAN4OSX_GetNanoseconds();
+
+	while (sent < frames)  {
+		size_t n = ((frames - sent) < BENCH_BATCH_SIZE) ? (frames - sent) : BENCH_BATCH_SIZE;
+
+		// a full transmit buffer takes fewer frames, retry the rest
+		canWriteBatch(hnd, msg, n, &accepted);
+		sent += (UInt32)accepted;
+	}
+
+	timeout = CAN4OSX_GetNanoseconds();
+	do {
+		can4osxSimGetStatistics(hnd, &statistics);
+		stop = CAN4OSX_GetNanoseconds();
+	} while ((statistics.txFrames < frames) && (benchSeconds(timeout, stop) < (BENCH_TIMEOUT_MS / 1000u)));
+
+	printf("simulated adapter 0x%04x tx: %12.0f frames/s, %llu frames in %llu bulk out transfers\n", productId,
+		(double)statistics.txFrames / benchSeconds(start, stop), (unsigned long long)statistics.txFrames, (unsigned long long)statistics.bulkOutTransfers);
+
+	if (statistics.txFrames != 0u)  {
+		printf("simulated adapter 0x%04x tx: %llu bytes on the bus, %.1f bytes per frame\n", productId,
+			(unsigned long long)statistics.bulkOutBytes, (double)statistics.bulkOutBytes / (double)statistics.txFrames);
+	}
+
+	if (canGetTxStatistics(hnd, &txStatistics) == canOK)  {
+		printf("simulated adapter 0x%04x tx: %u transfers in flight max, latency avg %u us max %u us\n", productId,
+			txStatistics.inFlightMax, txStatistics.latencyAvg, txStatistics.latencyMax);
+	}
+
+	// the acks trail the frames on the bus
+	if ((canWriteSync(hnd, BENCH_TIMEOUT_MS) == canOK) && (canGetTxStatistics(hnd, &txStatistics) == canOK))  {
+		printf("simulated adapter 0x%04x tx: %llu acked, %llu lost, ack latency avg %u us max %u us\n", productId,
+			(unsigned long long)txStatistics.acked, (unsigned long long)txStatistics.lost,
+			txStatistics.ackLatencyAvg, txStatistics.ackLatencyMax);
+	}
+
+	canBusOff(hnd);
+	canClose(hnd);
+
+	return(statistics.txFrames != frames);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief benchSimSync - host alignment of two adapters with drifting clocks
+ *
+ * A Leaf Pro answers the clock reads, the IXXAT adapter has none and is
+ * aligned by its received frames. Both get a light load for the whole run.
+ */
+static int benchSimSync(
+		UInt32 seconds
+	)
+{
+static const CAN4OSX_SIM_ADAPTER_T adapter[BENCH_SYNC_ADAPTERS] = {
+	{ .productId = 0x0107, .clockDriftPpm = 40 },	// Kvaser Leaf Pro HS v.2
+	{ .productId = 0x0014, .clockDriftPpm = -25 },	// IXXAT USB-to-CAN FD compact
+};
+CAN4OSX_SIM_LOAD_T load;
+CanTimeSyncStatus sync;
+CanMsg msg[BENCH_BATCH_SIZE];
+CanHandle hnd[BENCH_SYNC_ADAPTERS];
+canStatus status = canOK;
+UInt64 start;
+size_t got;
+UInt32 loopCount;
+int failed = 0;
+
+	status = can4osxSimEnable();
+	for (loopCount = 0; (loopCount < BENCH_SYNC_ADAPTERS) && (status == canOK); loopCount++)  {
+		status = can4osxSimAddAdapter(&adapter[loopCount]);
+	}
+	if (status != canOK)  {
+		printf("simulated adapters: setup failed (%d)\n", status);
+		return(1);
+	}
+
+	canInitializeLibrary();
+
+	memset(&load, 0, sizeof(load));
+	load.framesPerSecond = 1000u;
+	load.canId = 0x100;
+	load.canDlc = 8u;
+
+	for (loopCount = 0; loopCount < BENCH_SYNC_ADAPTERS; loopCount++)  {
+		hnd[loopCount] = canOpenChannel((int)loopCount, 0);
+		if (hnd[loopCount] < 0)  {
+			printf("simulated adapter 0x%04x: open failed (%d)\n", adapter[loopCount].productId, hnd[loopCount]);
+			return(1);
+		}
+		canSetBusParams(hnd[loopCount], canBITRATE_500K, 0, 0, 0, 0, 0);
+		canBusOn(hnd[loopCount]);
+		can4osxSimSetLoad(hnd[loopCount], &load);
+	}
+
+	status = canSetTimeSync(BENCH_SYNC_PERIOD_MS);
+	if (status != canOK)  {
+		printf("canSetTimeSync failed (%d)\n", status);
+		failed = 1;
+	}
+
+	start = CAN4OSX_GetNanoseconds();
+	while (benchSeconds(start, CAN4OSX_GetNanoseconds()) < (double)seconds)  {
+		for (loopCount = 0; loopCount < BENCH_SYNC_ADAPTERS; loopCount++)  {
+			while (canReadBatch(hnd[loopCount], msg, BENCH_BATCH_SIZE, &got) == canOK)  {
+				// only the alignment is of interest
+			}
+		}
+		usleep(10000);
+	}
+
+	canSetTimeSync(0u);
+
+	printf("time sync, %u s, clock read every %u ms\n", seconds, BENCH_SYNC_PERIOD_MS);
+	for (loopCount = 0; loopCount < BENCH_SYNC_ADAPTERS; loopCount++)  {
+		if (canGetTimeSyncStatus(hnd[loopCount], &sync) != canOK)  {
+			printf("simulated adapter 0x%04x: no status\n", adapter[loopCount].productId);
+			failed = 1;
+		} else {
+			printf("simulated adapter 0x%04x: %3u samples, drift %+8.3f ppm (simulated %+4d ppm), residual rms %6u ns max %6u ns, rtt %7u ns, bound %7u ns\n",
+				adapter[loopCount].productId, sync.samples, -(double)sync.driftPpb / 1000.0, adapter[loopCount].clockDriftPpm,
+				sync.residualRms, sync.residualMax, sync.roundTrip, sync.errorBound);
+		}
+		canBusOff(hnd[loopCount]);
+		canClose(hnd[loopCount]);
+	}
+
+	return(failed);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief benchSimMerge - one ordered stream of four channels on two adapters
+ *
+ * Each channel of a Kvaser USBcan Pro 2xHS and an IXXAT USB-to-CAN FD
+ * Automotive receives a saturated bus, canMergeRead has to put them into
+ * host time order.
+ */
+static int benchSimMerge(
+		UInt32 frames
+	)
+{
+static const CAN4OSX_SIM_ADAPTER_T adapter[] = {
+	{ .productId = 0x0108, .clockDriftPpm = 30 },	// Kvaser USBcan Pro 2xHS v.2
+	{ .productId = 0x0017, .clockDriftPpm = -20 },	// IXXAT USB-to-CAN FD Automotive
+};
+CAN4OSX_SIM_LOAD_T load;
+CanMergeReader *pReader;
+CanHandle hnd[BENCH_MERGE_CHANNELS];
+CanHandle from;
+CanMsg msg;
+canStatus status = canOK;
+UInt64 time;
+UInt64 last = 0u;
+UInt64 start;
+UInt64 stop;
+UInt32 received = 0u;
+UInt32 reordered = 0u;
+UInt32 loopCount;
+
+	status = can4osxSimEnable();
+	for (loopCount = 0; (loopCount < (sizeof(adapter) / sizeof(adapter[0]))) && (status == canOK); loopCount++)  {
+		status = can4osxSimAddAdapter(&adapter[loopCount]);
+	}
+	if (status != canOK)  {
+		printf("simulated adapters: setup failed (%d)\n", status);
+		return(1);
+	}
+
+	canInitializeLibrary();
+	canSetTimeSync(100u);
+
+	memset(&load, 0, sizeof(load));
+	load.framesPerSecond = CAN4OSX_SIM_RATE_BUS;
+	load.canDlc = 8u;
+
+	for (loopCount = 0; loopCount < BENCH_MERGE_CHANNELS; loopCount++)  {
+		hnd[loopCount] = canOpenChannel((int)loopCount, 0);
+		if (hnd[loopCount] < 0)  {
+			printf("simulated channel %u: open failed (%d)\n", loopCount, hnd[loopCount]);
+			return(1);
+		}
+		canSetBusParams(hnd[loopCount], canBITRATE_500K, 0, 0, 0, 0, 0);
+		canBusOn(hnd[loopCount]);
+	}
+
+	if (canMergeOpen(hnd, BENCH_MERGE_CHANNELS, BENCH_MERGE_WINDOW_US, &pReader) != canOK)  {
+		printf("canMergeOpen failed\n");
+		return(1);
+	}
+
+	start = CAN4OSX_GetNanoseconds();
+	for (loopCount = 0; loopCount < BENCH_MERGE_CHANNELS; loopCount++)  {
+		load.canId = 0x100 + loopCount;
+		can4osxSimSetLoad(hnd[loopCount], &load);
+	}
+
+	while (received < frames)  {
+		status = canMergeRead(pReader, &msg, &from, &time, BENCH_TIMEOUT_MS);
+		if (status != canOK)  {
+			printf("canMergeRead: %d after %u frames\n", status, received);
+			break;
+		}
+		if (time < last)  {
+			reordered++;
+		}
+		last = time;
+		received++;
+	}
+
+	stop = CAN4OSX_GetNanoseconds();
+
+	printf("merge of %u channels, window %u us: %12.0f frames/s, %u frames, %u out of order\n", BENCH_MERGE_CHANNELS,
+		BENCH_MERGE_WINDOW_US, (double)received / benchSeconds(start, stop), received, reordered);
+
+	canMergeClose(pReader);
+	canSetTimeSync(0u);
+	for (loopCount = 0; loopCount < BENCH_MERGE_CHANNELS; loopCount++)  {
+		can4osxSimSetLoad(hnd[loopCount], NULL);
+		canBusOff(hnd[loopCount]);
+		canClose(hnd[loopCount]);
+	}
+
+	return((status != canOK) || (reordered != 0u));
+}
+
+
+/******************************************************************************/
+/**
+ * \brief benchSimHotplug - pull adapters while every channel is busy
+ *
+ * An IXXAT USB-to-CAN FD Automotive, a Kvaser USBcan Pro 2xHS and a Peak
+ * PCAN-USB FD are unplugged at random and come back shortly after, one
+ * thread per channel index writes and reads until its handle is rejected and
+ * then opens the index again. The handle of an unplugged adapter must stay
+ * invalid after another adapter got its slot. Every other read borrows the
+ * frames with canReadAcquire and holds them for a while, an unplug in between
+ * must leave them readable.
+ */
+static int benchSimHotplug(
+		UInt32 seconds
+	)
+{
+static const CAN4OSX_SIM_ADAPTER_T adapter[] = {
+	{ .productId = 0x0017 },	// IXXAT USB-to-CAN FD Automotive
+	{ .productId = 0x0108 },	// Kvaser USBcan Pro 2xHS v.2
+	{ .productId = 0x0012 },	// Peak USB FD
+};
+BENCH_HOTPLUG_T worker[BENCH_HOTPLUG_CHANNELS];
+atomic_uint stop = 0u;
+canStatus status = canOK;
+CanHandle stale;
+CanHandle fresh;
+UInt64 start;
+UInt64 rxFrames = 0u;
+UInt64 txFrames = 0u;
+UInt32 opens = 0u;
+UInt32 rejected = 0u;
+UInt32 held = 0u;
+UInt32 unplugs = 0u;
+UInt32 accepted = 0u;
+UInt32 flags;
+UInt32 wait;
+UInt32 loopCount;
+int index;
+
+	status = can4osxSimEnable();
+	for (loopCount = 0; (loopCount < (sizeof(adapter) / sizeof(adapter[0]))) && (status == canOK); loopCount++)  {
+		status = can4osxSimAddAdapter(&adapter[loopCount]);
+	}
+	if (status != canOK)  {
+		printf("simulated adapters: setup failed (%d)\n", status);
+		return(1);
+	}
+
+	canInitializeLibrary();
+
+	for (loopCount = 0; loopCount < BENCH_HOTPLUG_CHANNELS; loopCount++)  {
+		memset(&worker[loopCount], 0, sizeof(BENCH_HOTPLUG_T));
+		worker[loopCount].index = (int)loopCount;
+		worker[loopCount].pStop = &stop;
+		pthread_create(&worker[loopCount].thread, NULL, benchHotplugWorker, &worker[loopCount]);
+	}
+
+	srand(1);
+	start = CAN4OSX_GetNanoseconds();
+	while (benchSeconds(start, CAN4OSX_GetNanoseconds()) < (double)seconds)  {
+		usleep(BENCH_HOTPLUG_PERIOD_MS * 1000u);
+
+		index = rand() % (int)BENCH_HOTPLUG_CHANNELS;
+		stale = canOpenChannel(index, 0);
+		if (stale < 0)  {
+			continue;
+		}
+		if (can4osxSimUnplug(stale, BENCH_HOTPLUG_REPLUG_MS) != canOK)  {
+			continue;
+		}
+		unplugs++;
+
+		// the index is taken by the next adapter plugged in
+		for (wait = 0; wait < 1000u; wait++)  {
+			fresh = canOpenChannel(index, 0);
+			if ((fresh >= 0) && (fresh != stale))  {
+				break;
+			}
+			usleep(1000);
+		}
+		if (canReadStatus(stale, &flags) != canERR_INVHANDLE)  {
+			accepted++;
+		}
+	}
+
+	atomic_store(&stop, 1u);
+	for (loopCount = 0; loopCount < BENCH_HOTPLUG_CHANNELS; loopCount++)  {
+		pthread_join(worker[loopCount].thread, NULL);
+		rxFrames += worker[loopCount].rxFrames;
+		txFrames += worker[loopCount].txFrames;
+		opens += worker[loopCount].opens;
+		rejected += worker[loopCount].rejected;
+		held += worker[loopCount].held;
+	}
+
+	printf("hotplug, %u s: %u unplugs, %u opens, %u handles rejected, %llu frames received, %llu sent\n",
+		seconds, unplugs, opens, rejected, (unsigned long long)rxFrames, (unsigned long long)txFrames);
+	printf("  %u acquires outlived their adapter\n", held);
+	if (accepted != 0u)  {
+		printf("FAILED: %u handles of unplugged adapters still accepted\n", accepted);
+	}
+
+	return(accepted != 0u);
+}
+
+
+/******************************************************************************/
+static void* benchHotplugWorker(
+		void *arg
+	)
+{
+BENCH_HOTPLUG_T *pWorker = (BENCH_HOTPLUG_T *)arg;
+CAN4OSX_SIM_LOAD_T load;
+CanMsg msg[BENCH_BATCH_SIZE];
+CanMsg tx[BENCH_BATCH_SIZE];
+const CanFrame *pFrame;
+CanHandle hnd;
+canStatus status;
+size_t got;
+size_t accepted;
+UInt32 loopCount;
+UInt8 acquire = 0u;
+
+	memset(&load, 0, sizeof(load));
+	load.framesPerSecond = CAN4OSX_SIM_RATE_BUS;
+	load.canId = 0x100 + (UInt32)pWorker->index;
+	load.canDlc = 8u;
+
+	memset(tx, 0, sizeof(tx));
+	for (loopCount = 0; loopCount < BENCH_BATCH_SIZE; loopCount++)  {
+		tx[loopCount].canId = 0x200 + (UInt32)pWorker->index;
+		tx[loopCount].canDlc = 8u;
+	}
+
+	while (atomic_load(pWorker->pStop) == 0u)  {
+		hnd = canOpenChannel(pWorker->index, 0);
+		if (hnd < 0)  {
+			usleep(1000);
+			continue;
+		}
+		pWorker->opens++;
+
+		canSetBusParams(hnd, canBITRATE_500K, 0, 0, 0, 0, 0);
+		can4osxSimSetLoad(hnd, &load);
+		canBusOn(hnd);
+
+		status = canOK;
+		while ((status != canERR_INVHANDLE) && (atomic_load(pWorker->pStop) == 0u))  {
+			status = canWriteBatch(hnd, tx, BENCH_BATCH_SIZE, &accepted);
+			pWorker->txFrames += accepted;
+			if (status == canERR_INVHANDLE)  {
+				break;
+			}
+			acquire ^= 1u;
+			if (acquire == 0u)  {
+				status = canReadBatch(hnd, msg, BENCH_BATCH_SIZE, &got);
+				pWorker->rxFrames += got;
+			} else if (canReadAcquire(hnd, &pFrame, BENCH_BATCH_SIZE, &got) == canOK)  {
+				// the adapter may go away while the frames are held
+				usleep(BENCH_HOTPLUG_HOLD_US);
+				for (loopCount = 0; loopCount < got; loopCount++)  {
+					pWorker->idSum += pFrame->canId;
+					pFrame = canFrameNext(pFrame);
+				}
+				pWorker->rxFrames += got;
+				status = canReadRelease(hnd, got);
+				if (status == canERR_INVHANDLE)  {
+					pWorker->held++;
+				}
+			}
+		}
+
+		if (status == canERR_INVHANDLE)  {
+			pWorker->rejected++;
+		} else {
+			can4osxSimSetLoad(hnd, NULL);
+			canBusOff(hnd);
+			canClose(hnd);
+		}
+	}
+
+	return(NULL);
+}
+
+
+/******************************************************************************/
+static void* benchProducer(
+		void *arg
+	)
+{
+BENCH_RUN_T *pRun = arg;
+CanMsg msg;
+UInt32 i;
+UInt64 t0;
+UInt8 ok;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.canDlc = 8;
+
+	for (i = 0; i < pRun->frames; i++)  {
+		msg.canId = i;
+		/* a full buffer is retried, only the successful enqueue is measured */
+		do {
+			t0 = CAN4OSX_GetNanoseconds();
+			ok = pRun->write(pRun->bufferRef, msg);
+		} while (ok == 0);
+		pRun->latency[i] = CAN4OSX_GetNanoseconds() - t0;
+	}
+
+	return(NULL);
+}
+
+
+/******************************************************************************/
+static void* benchConsumer(
+		void *arg
+	)
+{
+BENCH_RUN_T *pRun = arg;
+CanMsg msg;
+UInt32 received = 0;
+
+	while (received < pRun->frames)  {
+		if (pRun->read(pRun->bufferRef, &msg) != 0)  {
+			if (msg.canId != received)  {
+				printf("%-14s: sequence error %u != %u\n", pRun->name, msg.canId, received);
+			}
+			received++;
+		}
+	}
+
+	return(NULL);
+}
+
+
+/******************************************************************************/
+static int benchCompare(
+		const void *a,
+		const void *b
+	)
+{
+UInt64 x = *(const UInt64 *)a;
+UInt64 y = *(const UInt64 *)b;
+
+	return((x > y) - (x < y));
+}
+
+
+/******************************************************************************/
+static UInt8 benchSpscWrite(
+		void *bufferRef,
+		CanMsg newEvent
+	)
+{
+	return(CAN4OSX_WriteCanEventBuffer(bufferRef, newEvent));
+}
+
+
+/******************************************************************************/
+static UInt8 benchSpscRead(
+		void *bufferRef,
+		CanMsg *readEvent
+	)
+{
+	return(CAN4OSX_ReadCanEventBuffer(bufferRef, readEvent));
+}
+
+
+/******************************************************************************/
+static BENCH_GCD_BUF_T* benchGcdCreate(
+		UInt32 bufferSize
+	)
+{
+BENCH_GCD_BUF_T* bufferRef = malloc(sizeof(BENCH_GCD_BUF_T));
+
+	if ( bufferRef == NULL )  {
+		return(NULL);
+	}
+
+	bufferRef->bufferSize = bufferSize;
+	bufferRef->bufferCount = 0;
+	bufferRef->bufferFirst = 0;
+	bufferRef->canMsgRef = malloc(bufferSize * sizeof(CanMsg));
+	bufferRef->bufferGDCqueueRef = dispatch_queue_create("com.can4osx.benchqueue", 0);
+
+	if ((bufferRef->canMsgRef == NULL) || (bufferRef->bufferGDCqueueRef == NULL))  {
+		benchGcdRelease(bufferRef);
+		return(NULL);
+	}
+
+	return(bufferRef);
+}
+
+
+/******************************************************************************/
+static void benchGcdRelease(
+		BENCH_GCD_BUF_T* bufferRef
+	)
+{
+	if ( bufferRef != NULL )  {
+		if (bufferRef->bufferGDCqueueRef != NULL)  {
+			dispatch_release(bufferRef->bufferGDCqueueRef);
+		}
+		free(bufferRef->canMsgRef);
+		free(bufferRef);
+	}
+}
+
+
+/******************************************************************************/
+static UInt8 benchGcdWrite(
+		void *ref,
+		CanMsg newEvent
+	)
+{
+BENCH_GCD_BUF_T* bufferRef = ref;
+__block UInt8 retval = 1;
+
+	dispatch_sync(bufferRef->bufferGDCqueueRef, ^{
+		if (bufferRef->bufferCount == bufferRef->bufferSize)  {
+			retval = 0;
+		} else {
+			bufferRef->canMsgRef[(bufferRef->bufferFirst + bufferRef->bufferCount++) % bufferRef->bufferSize] = newEvent;
+		}
+	});
+
+	return(retval);
+}
+
+
+/******************************************************************************/
+static UInt8 benchGcdRead(
+		void *ref,
+		CanMsg *readEvent
+	)
+{
+BENCH_GCD_BUF_T* bufferRef = ref;
+__block UInt8 retval = 1;
+
+	dispatch_sync(bufferRef->bufferGDCqueueRef, ^{
+		if (bufferRef->bufferCount == 0)  {
+			retval = 0;
+		} else {
+			bufferRef->bufferCount--;
+			*readEvent = bufferRef->canMsgRef[bufferRef->bufferFirst++ % bufferRef->bufferSize];
+		}
+	});
+
+	return(retval);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief benchSimStartup - time the start of the driver with slow adapters
+ *
+ * Every adapter takes BENCH_STARTUP_SETUP_MS to open, set up one after the
+ * other the start takes adapters times as long. lazy returns from
+ * canInitializeLibraryEx at once and opens the channels as they get ready.
+ *
+ * \return 0 if all channels could be opened
+ */
+static int benchSimStartup(
+		UInt32 adapters,
+		UInt8 lazy
+	)
+{
+CAN4OSX_SIM_ADAPTER_T adapter;
+canStatus status;
+CanHandle hnd;
+UInt64 start;
+UInt64 init;
+UInt64 ready;
+UInt32 failed = 0u;
+UInt32 loopCount;
+
+	memset(&adapter, 0, sizeof(adapter));
+	adapter.productId = 0x0120;		// Kvaser Leaf Light v.2, one channel each
+	adapter.setupMs = BENCH_STARTUP_SETUP_MS;
+
+	status = can4osxSimEnable();
+	for (loopCount = 0; (loopCount < adapters) && (status == canOK); loopCount++)  {
+		status = can4osxSimAddAdapter(&adapter);
+	}
+	if (status != canOK)  {
+		printf("simulated adapters: setup failed (%d)\n", status);
+		return(1);
+	}
+
+	start = CAN4OSX_GetNanoseconds();
+	(void)canInitializeLibraryEx((lazy != 0u) ? canINIT_NO_WAIT : 0u);
+	init = CAN4OSX_GetNanoseconds();
+
+	for (loopCount = 0; loopCount < adapters; loopCount++)  {
+		hnd = canOpenChannel((int)loopCount, 0);
+		if (hnd < 0)  {
+			failed++;
+			continue;
+		}
+		canClose(hnd);
+	}
+	ready = CAN4OSX_GetNanoseconds();
+
+	printf("startup, %u adapters of %u ms%s: init %.1f ms, all channels open %.1f ms, one by one %u ms\n",
+		adapters, BENCH_STARTUP_SETUP_MS, (lazy != 0u) ? ", lazy" : "",
+		benchSeconds(start, init) * 1000.0, benchSeconds(start, ready) * 1000.0, adapters * BENCH_STARTUP_SETUP_MS);
+	if (failed != 0u)  {
+		printf("FAILED: %u channels could not be opened\n", failed);
+	}
+
+	return(failed != 0u);
+}
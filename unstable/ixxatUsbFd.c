@@ -46,12 +46,9 @@
 /* header of standard C - libraries
 ------------------------------------------------------------------------------*/
 #include <stdio.h>
-
-#include <CoreFoundation/CoreFoundation.h>
-#include <IOKit/IOKitLib.h>
-#include <IOKit/IOMessage.h>
-#include <IOKit/IOCFPlugIn.h>
-#include <IOKit/usb/IOUSBLib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <pthread.h>
 
@@ -94,7 +91,6 @@ typedef struct {
     UInt8   fd_tseg1;
     UInt8   fd_tseg2;
     UInt8   fd_sjw;
-    pthread_mutex_t mutex;
 } IXXUSBFDPRIVATEDATA_T;
 
 
@@ -113,12 +109,24 @@ static canStatus usbFdCanSetBusParams (const CanHandle hnd, SInt32 freq,
 static canStatus usbFdCanSetBusParamsFd(const CanHandle hnd, SInt32 freq_brs,
         UInt32 tseg1, UInt32 tseg2, UInt32 sjw);
 
+static canStatus usbFdCanSetFilter(const CanHandle hnd);
+
 static canStatus usbFdCanRead (const CanHandle hnd, UInt32 *id, void *msg,
         UInt16 *dlc, UInt32 *flag, UInt32 *time);
 
+static canStatus usbFdCanReadBatch (const CanHandle hnd, CanMsg *pMsg,
+        size_t max, size_t *got);
+
 static canStatus usbFdCanWrite (const CanHandle hnd, UInt32 id, void *msg,
     	UInt16 dlc, UInt32 flag);
 
+static canStatus usbFdCanWriteBatch (const CanHandle hnd, const CanMsg *pMsg,
+        size_t n, size_t *accepted);
+
+static canStatus usbFdEncodeTxMessage (IXXUSBFDPRIVATEDATA_T *pPriv,
+        IXXUSBFDCANMSG_T *pCanMsg, UInt32 id, const void *msg, UInt16 dlc,
+        UInt32 flag);
+
 static canStatus usbFdCanTranslateBaud (SInt32 *const freq, unsigned int *const tseg1,
         unsigned int *const tseg2, unsigned int *const sjw, unsigned int *const nosamp,
         unsigned int *const syncMode);
@@ -129,13 +137,15 @@ static canStatus usbFdSetBitrates(Can4osxUsbDeviceHandleEntry *pSelf);
 
 static canStatus usbFdSendCmd(Can4osxUsbDeviceHandleEntry *pSelf, IXXUSBFDMSGREQHEAD_T *pCmd);
 static canStatus usbFdRecvCmd(Can4osxUsbDeviceHandleEntry *pSelf, IXXUSBFDMSGRESPHEAD_T *pCmd, int value);
+static canStatus usbFdWaitCmd(Can4osxUsbDeviceHandleEntry *pSelf, IXXUSBFDMSGRESPHEAD_T *pCmd, int value, UInt32 timeoutMs);
 
 static void usbFdBulkReadCompletion(void *refCon, IOReturn result, void *arg0);
-static IOReturn usbFdWriteToBulkPipe(Can4osxUsbDeviceHandleEntry *pSelf);
-static UInt16 usbFdFillBulkPipeBuffer(IXXUSBFDTRANSMITBUFFER_T *pBufferRef, UInt8 *pipe, UInt16 maxPipeSize);
-static void usbFdBulkWriteCompletion(void *refCon, IOReturn result, void *arg0);
+static UInt32 usbFdBulkWriteFill(Can4osxUsbDeviceHandleEntry *pSelf, UInt8 *pBuf, UInt32 size, UInt32 *pFrames);
+static UInt32 usbFdBulkWriteQueued(Can4osxUsbDeviceHandleEntry *pSelf);
+static UInt16 usbFdFillBulkPipeBuffer(IXXUSBFDTRANSMITBUFFER_T *pBufferRef, UInt8 *pipe, UInt16 maxPipeSize, UInt32 *pMsgs);
 
 static UInt8 usbFdWriteTransmitBuffer(IXXUSBFDTRANSMITBUFFER_T* pBuffer, IXXUSBFDCANMSG_T newMsg);
+static UInt32 usbFdWriteTransmitBufferBatch(IXXUSBFDTRANSMITBUFFER_T* pBuffer, const IXXUSBFDCANMSG_T *pMsgs, UInt32 count);
 static UInt8 usbFdReadCommandBuffer(IXXUSBFDTRANSMITBUFFER_T* pBuffer, IXXUSBFDCANMSG_T* pCanMsg);
 
 static char* usbFdGetDeviceName(UInt16 productId);
@@ -151,8 +161,12 @@ CAN4OSX_HW_FUNC_T ixxUsbFdHardwareFunctions = {
     .can4osxhwCanBusOnRef = usbFdCanStartChip,
     .can4osxhwCanBusOffRef = usbFdCanStopChip,
     .can4osxhwCanWriteRef = usbFdCanWrite,
+    .can4osxhwCanWriteBatchRef = usbFdCanWriteBatch,
     .can4osxhwCanReadRef = usbFdCanRead,
+    .can4osxhwCanReadBatchRef = usbFdCanReadBatch,
     .can4osxhwCanCloseRef = usbFdCanClose,
+    .can4osxhwReadClockRef = NULL,
+    .can4osxhwCanSetFilterRef = usbFdCanSetFilter,
 };
 
 
@@ -183,7 +197,7 @@ static canStatus usbFdInitHardware(
 		UInt16 productId
     )
 {
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hnd);
 char* pDevName;
 	
 	pSelf->privateData = calloc(1,sizeof(IXXUSBFDPRIVATEDATA_T));
@@ -196,7 +210,6 @@ char* pDevName;
 		pPriv->pTransBuff.bufferCount = 0u;
         pPriv->pTransBuff.bufferFirst = 0u;
         pPriv->pTransBuff.bufferSize = IXXCOMMANDBUF_SIZE;
-        pthread_mutex_init(&(pPriv->mutex), NULL);
     
     } else {
         return(canERR_NOMEM);
@@ -205,10 +218,10 @@ char* pDevName;
     if (pSelf->deviceChannelCount == 0u)  {
     	usbFdSetPowerMode(pSelf, 0);
     	usbFdGetDeviceCaps(pSelf);
+    	/* the channels share the clock of the device */
+    	CAN4OSX_SetTimestampClock(pSelf->pTimestamp, IXXUSBFD_TIMESTAMP_HZ, IXXUSBFD_TIMESTAMP_BITS);
     } else {
-    	/* create new endpoint buffer */
-        pSelf->endpointBufferBulkInRef = calloc( 1 , pSelf->endpointMaxSizeBulkIn);
-    	pSelf->endpointBufferBulkOutRef = calloc( 1 , pSelf->endpointMaxSizeBulkOut);
+    	/* the endpoint buffers are set up by CAN4OSX_DeviceAttach and the read */
     }
 
 	pDevName = usbFdGetDeviceName(productId);
@@ -226,6 +239,10 @@ char* pDevName;
     pSelf->endpointNumberBulkOut += 2;
     pSelf->endpointNumberBulkIn += 2;
     pSelf->usbFunctions.bulkReadCompletion  = usbFdBulkReadCompletion;
+    pSelf->usbFunctions.bulkWriteFill  = usbFdBulkWriteFill;
+    pSelf->usbFunctions.bulkWriteQueued  = usbFdBulkWriteQueued;
+    /* the adapter reports no TX acks, a frame is done with its transfer */
+    pSelf->txTrack.byTransfer = true;
 
 
     /* Trigger the read */
@@ -257,7 +274,7 @@ static CanHandle usbFdCanOpenChannel(
         int flags
     )
 {
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[channel];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(channel);
 IXXUSBFDPRIVATEDATA_T *pPriv = (IXXUSBFDPRIVATEDATA_T *)pSelf->privateData;
     
     // set CAN Mode
@@ -276,7 +293,7 @@ static canStatus usbFdCanClose(
 		const CanHandle hnd
     )
 {
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hnd);
     
     if (pSelf->privateData != NULL)  {
         IXXUSBFDPRIVATEDATA_T *pPriv = (IXXUSBFDPRIVATEDATA_T *)pSelf->privateData;
@@ -302,7 +319,7 @@ static canStatus usbFdCanSetBusParams(
         unsigned int syncmode
     )
 {
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hnd);
 IXXUSBFDPRIVATEDATA_T *pPriv = (IXXUSBFDPRIVATEDATA_T *)pSelf->privateData;
     
     CAN4OSX_DEBUG_PRINT("ixxat usb fd: _set_busparam\n");
@@ -328,6 +345,7 @@ IXXUSBFDPRIVATEDATA_T *pPriv = (IXXUSBFDPRIVATEDATA_T *)pSelf->privateData;
     }
 
 	usbFdSetBitrates(pSelf);
+	CAN4OSX_SetBusStatisticsBitrate(&pSelf->busStats, pPriv->brp, pPriv->fd_brp);
 
     return(canOK);
 }
@@ -342,7 +360,7 @@ static canStatus usbFdCanSetBusParamsFd(
         UInt32 sjw
     )
 {
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hnd);
 IXXUSBFDPRIVATEDATA_T *pPriv = (IXXUSBFDPRIVATEDATA_T *)pSelf->privateData;
 unsigned int dummy;
     
@@ -361,16 +379,46 @@ unsigned int dummy;
     pPriv->fd_tseg2 = tseg2;
 
     usbFdSetBitrates(pSelf);
+    CAN4OSX_SetBusStatisticsBitrate(&pSelf->busStats, 0u, pPriv->fd_brp);
 	return(canOK);
 }
 
 
+/******************************************************************************/
+/**
+ * \brief usbFdCanSetFilter - the id types the controller receives
+ *
+ * The adapter has no id filter we can program here, but it can ignore all
+ * 11 or 29 bit frames. That goes with the bitrates, so without them it waits
+ * for usbFdCanSetBusParams.
+ *
+ * \return canStatus
+ */
+static canStatus usbFdCanSetFilter(
+		const CanHandle hnd
+    )
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hnd);
+IXXUSBFDPRIVATEDATA_T *pPriv = (IXXUSBFDPRIVATEDATA_T *)pSelf->privateData;
+
+    if (pPriv == NULL)  {
+        return(canERR_INTERNAL);
+    }
+
+    if (pPriv->brp == 0u)  {
+        return(canOK);
+    }
+
+    return(usbFdSetBitrates(pSelf));
+}
+
+
 /******************************************************************************/
 static canStatus usbFdCanStartChip(
         CanHandle hdl
     )
 {
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hdl];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hdl);
 UInt8 data[IXXUSBFD_CMD_BUFFER_SIZE] = {0};
 IXXUSBFDCANSTARTREQ_T *pReq;
 IXXUSBFDCANSTARTRESP_T *pResp;
@@ -404,7 +452,7 @@ static canStatus usbFdCanStopChip(
         CanHandle hdl
     )
 {
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hdl];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hdl);
 UInt8 data[IXXUSBFD_CMD_BUFFER_SIZE] = {0};
 IXXUSBFDCANSTOPREQ_T *pReq;
 IXXUSBFDCANSTOPRESP_T *pResp;
@@ -443,15 +491,17 @@ static canStatus usbFdCanRead (
         UInt32  *time
     )
 {
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
-CanMsg canMsg;
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hnd);
+CAN_EVENT_MSG_BUF_T *pBuffer = CAN4OSX_GetCanEventBuffer(pSelf);
+CanFrame *pFrame;
     
-    if ( CAN4OSX_ReadCanEventBuffer(pSelf->canEventMsgBuff, &canMsg) ) {
-        *id = canMsg.canId;
-        *dlc = canMsg.canDlc;
-        *time =canMsg.canTimestamp;
-        *flag = canMsg.canFlags;
-        memcpy(msg, canMsg.canData, *dlc);
+    if ( CAN4OSX_AcquireCanEventBuffer(pBuffer, &pFrame, 1u) != 0u ) {
+        *id = pFrame->canId;
+        *dlc = pFrame->canDlc;
+        *time = (UInt32)(pFrame->canTimestamp / 1000u);
+        *flag = pFrame->canFlags;
+        memcpy(msg, pFrame->canData, *dlc);
+        CAN4OSX_ReleaseCanEventBufferEvents(pBuffer, 1u);
         
         return(canOK);
     } else {
@@ -462,6 +512,77 @@ CanMsg canMsg;
 }
 
 
+/******************************************************************************/
+static canStatus usbFdCanReadBatch (
+        const   CanHandle hnd,
+        CanMsg  *pMsg,
+        size_t  max,
+        size_t  *got
+    )
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hnd);
+
+    if (max > UINT32_MAX)  {
+        max = UINT32_MAX;
+    }
+
+    *got = CAN4OSX_ReadCanEventBufferBatch(CAN4OSX_GetCanEventBuffer(pSelf), pMsg, (UInt32)max);
+    if ( *got != 0 ) {
+        return(canOK);
+    } else {
+        return(canERR_NOMSG);
+    }
+}
+
+
+/******************************************************************************/
+static canStatus usbFdEncodeTxMessage (
+        IXXUSBFDPRIVATEDATA_T *pPriv,
+        IXXUSBFDCANMSG_T *pCanMsg,
+        UInt32 id,
+        const void *msg,
+        UInt16 dlc,
+        UInt32 flag
+    )
+{
+    if (pPriv->canFd == 0u)  {
+        if (dlc > 8u)  {
+             dlc = 8u;
+        }
+    }
+
+    memset(pCanMsg, 0, sizeof(IXXUSBFDCANMSG_T));
+
+    pCanMsg->canId = id;
+
+    pCanMsg->flags = CAN4OSX_encodeFdDlc(dlc);
+    /* no valid dlc found */
+    if (pCanMsg->flags == 0xfful)  {
+        return(canERR_PARAM);
+    }
+    pCanMsg->flags <<= 16u;
+
+    if ((flag & canMSG_EXT) == canMSG_EXT)  {
+        pCanMsg->flags |= IXXUSBFD_MSG_FLAG_EXT;
+    }
+    if ((flag & canMSG_RTR) == canMSG_RTR)  {
+        pCanMsg->flags |= IXXUSBFD_MSG_FLAG_RTR;
+    }
+    if ((flag & canFDMSG_FDF) == canFDMSG_FDF)  {
+        pCanMsg->flags |= IXXUSBFD_MSG_FLAG_EDL;
+        if (flag & canFDMSG_BRS)  {
+            pCanMsg->flags |= IXXUSBFD_MSG_FLAG_FDR;
+        }
+    }
+
+    memcpy(pCanMsg->data , msg, dlc);
+
+    pCanMsg->size = (sizeof(IXXUSBFDCANMSG_T) - 1u - 64u + dlc);
+
+    return(canOK);
+}
+
+
 /******************************************************************************/
 static canStatus usbFdCanWrite (
 		const CanHandle hnd,
@@ -471,45 +592,18 @@ static canStatus usbFdCanWrite (
         UInt32 flag
     )
 {
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hnd);
 UInt8 retVal = 0u;
+canStatus status;
     
     if ( pSelf->privateData != NULL )  {
     IXXUSBFDPRIVATEDATA_T *pPriv = (IXXUSBFDPRIVATEDATA_T *)pSelf->privateData;
-	IXXUSBFDCANMSG_T canMsg = {0};
+	IXXUSBFDCANMSG_T canMsg;
 	
-		if (pPriv->canFd == 0u)  {
-            if (dlc > 8u)  {
-                 dlc = 8u;
-            }
+        status = usbFdEncodeTxMessage(pPriv, &canMsg, id, msg, dlc, flag);
+        if (status != canOK)  {
+            return(status);
         }
-	
-		canMsg.canId = id;
-  
-  		canMsg.flags = 0u;
-    	canMsg.flags = CAN4OSX_encodeFdDlc(dlc);
-     	/* no valid dlc found */
-     	if (canMsg.flags == 0xfful)  {
-      		return(canERR_PARAM);
-        }
-     	canMsg.flags <<= 16u;
-  
-  		if ((flag & canMSG_EXT) == canMSG_EXT)  {
-    		canMsg.flags |= IXXUSBFD_MSG_FLAG_EXT;
-        }
-        if ((flag & canMSG_RTR) == canMSG_RTR)  {
-        	canMsg.flags |= IXXUSBFD_MSG_FLAG_RTR;
-        }
-        if ((flag & canFDMSG_FDF) == canFDMSG_FDF)  {
-        	canMsg.flags |= IXXUSBFD_MSG_FLAG_EDL;
-         	if (flag & canFDMSG_BRS)  {
-          		canMsg.flags |= IXXUSBFD_MSG_FLAG_FDR;
-            }
-        }
-        
-        memcpy(canMsg.data , msg, dlc);
-	
-		canMsg.size = (sizeof(canMsg) - 1u - 64u + dlc);
         
         retVal = usbFdWriteTransmitBuffer(&pPriv->pTransBuff, canMsg);
         
@@ -517,7 +611,7 @@ UInt8 retVal = 0u;
         	return(canERR_TXBUFOFL);
         }
         
-        usbFdWriteToBulkPipe(pSelf);
+        CAN4OSX_usbWriteToBulkOutPipe(pSelf);
         
         return(canOK);
         
@@ -528,6 +622,55 @@ UInt8 retVal = 0u;
 }
 
 
+/******************************************************************************/
+static canStatus usbFdCanWriteBatch (
+        const CanHandle hnd,
+        const CanMsg *pMsg,
+        size_t n,
+        size_t *accepted
+    )
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hnd);
+IXXUSBFDCANMSG_T canMsg[CAN4OSX_TX_BATCH_CHUNK];
+canStatus status = canOK;
+UInt32 chunk;
+UInt32 written;
+UInt32 i;
+
+    if ( pSelf->privateData == NULL )  {
+        return(canERR_INTERNAL);
+    }
+
+    IXXUSBFDPRIVATEDATA_T *pPriv = (IXXUSBFDPRIVATEDATA_T *)pSelf->privateData;
+
+    /* queue everything first, the bulk pipe is started only once */
+    while ( (*accepted < n) && (status == canOK) )  {
+        chunk = ((n - *accepted) > CAN4OSX_TX_BATCH_CHUNK) ? CAN4OSX_TX_BATCH_CHUNK : (UInt32)(n - *accepted);
+
+        for (i = 0u; i < chunk; i++)  {
+            const CanMsg *pFrame = &pMsg[*accepted + i];
+            status = usbFdEncodeTxMessage(pPriv, &canMsg[i], pFrame->canId, pFrame->canData, pFrame->canDlc, pFrame->canFlags);
+            if (status != canOK)  {
+                /* send what was valid up to here */
+                chunk = i;
+                break;
+            }
+        }
+
+        written = usbFdWriteTransmitBufferBatch(&pPriv->pTransBuff, canMsg, chunk);
+        *accepted += written;
+
+        if (written < chunk)  {
+            status = canERR_TXBUFOFL;
+        }
+    }
+
+    CAN4OSX_usbWriteToBulkOutPipe(pSelf);
+
+    return(status);
+}
+
+
 /******************************************************************************/
 // Translate from baud macro to bus params
 /******************************************************************************/
@@ -662,11 +805,10 @@ ixxUsbFdDevPowerResp_t *pPowerResp;
     
     pPowerResp->header.respSize = sizeof(ixxUsbFdDevPowerResp_t);
     pPowerResp->header.retSize = 0u;
-    pPowerResp->header.retCode = 0xffFFffFF;
+    pPowerResp->header.retCode = IXXUSBFD_RETCODE_PENDING;
     
     usbFdSendCmd(pSelf, (IXXUSBFDMSGREQHEAD_T *)pPowerReq);
-    usleep(500ul * 1000ul);
-    usbFdRecvCmd(pSelf, (IXXUSBFDMSGRESPHEAD_T *)pPowerResp, 0xffff);
+    usbFdWaitCmd(pSelf, (IXXUSBFDMSGRESPHEAD_T *)pPowerResp, 0xffff, IXXUSBFD_POWER_TIMEOUT_MS);
     
 	if (pPowerResp->header.retCode != 0u)  {
 		return(canERR_PARAM);
@@ -724,6 +866,8 @@ UInt8 data[IXXUSBFD_CMD_BUFFER_SIZE] = {0};
 IXXUSBFDPRIVATEDATA_T *pPriv = (IXXUSBFDPRIVATEDATA_T *)pSelf->privateData;
 IXXUSBFDCANINITREQ_T *pReq;
 IXXUSBFDCANINITRESP_T *pResp;
+bool standard;
+bool extended;
 
 	if (pPriv == NULL)  {
 		return(canERR_INTERNAL);
@@ -738,7 +882,16 @@ IXXUSBFDCANINITRESP_T *pResp;
     pReq->header.reqPort = pSelf->deviceChannel;
 
     pReq->exMode = 0u;
-    pReq->opMode = (IXXUSBFD_OPMODE_EXTENDED | IXXUSBFD_OPMODE_STANDARD);
+    /* id types the acceptance filter rejects completely are not received at
+     * all, if it is both the driver drops the 11 bit ones */
+    CAN4OSX_GetFilterIdTypes(&pSelf->rxFilter, &standard, &extended);
+    pReq->opMode = 0u;
+    if (standard || !extended)  {
+        pReq->opMode |= IXXUSBFD_OPMODE_STANDARD;
+    }
+    if (extended)  {
+        pReq->opMode |= IXXUSBFD_OPMODE_EXTENDED;
+    }
     if (pPriv->canFd)  {
     	pReq->exMode = (IXXUSBFD_EXMODE_EXTDATA | IXXUSBFD_EXMODE_ISOFD | IXXUSBFD_EXMODE_FASTDATA);
     }
@@ -777,10 +930,10 @@ static canStatus usbFdSendCmd(
         IXXUSBFDMSGREQHEAD_T *pCmd
     )
 {
-IOUSBDevRequest request;
+CAN4OSX_USB_CONTROL_T request;
 IOReturn retVal;
 
-	request.bmRequestType = USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBDevice);
+	request.bmRequestType = CAN4OSX_USB_DIR_OUT | CAN4OSX_USB_TYPE_VENDOR | CAN4OSX_USB_RECIP_DEVICE;
 	request.bRequest = 0xff;
 	request.wValue = pCmd->reqPort;
     request.wIndex = 0u;
@@ -788,7 +941,7 @@ IOReturn retVal;
 	request.pData = pCmd;
 
 	for (int i = 0; i < 10; i++)  {
-		retVal = (*(pSelf->can4osxDeviceInterface))->DeviceRequest(pSelf->can4osxDeviceInterface, &request);
+		retVal = CAN4OSX_usbControlRequest(pSelf, &request);
 		if (retVal == kIOReturnSuccess)  {
   			return(canOK);
         }
@@ -804,11 +957,11 @@ static canStatus usbFdRecvCmd(
         int value
     )
 {
-IOUSBDevRequest request;
+CAN4OSX_USB_CONTROL_T request;
 IOReturn retVal;
 UInt16 sizeToRead = pCmd->respSize;
 
-    request.bmRequestType = USBmakebmRequestType(kUSBIn, kUSBVendor, kUSBDevice);
+    request.bmRequestType = CAN4OSX_USB_DIR_IN | CAN4OSX_USB_TYPE_VENDOR | CAN4OSX_USB_RECIP_DEVICE;
     request.bRequest = 0xff;
     request.wLength = pCmd->respSize;
     request.wValue = value;
@@ -816,7 +969,7 @@ UInt16 sizeToRead = pCmd->respSize;
     request.pData = pCmd;
     
     for (int i = 0; i < 10; i++)  {
-        retVal = (*(pSelf->can4osxDeviceInterface))->DeviceRequest(pSelf->can4osxDeviceInterface, &request);
+        retVal = CAN4OSX_usbControlRequest(pSelf, &request);
         if (retVal == kIOReturnSuccess)  {
         	if (sizeToRead <= pCmd->retSize)  {
               	return(canOK);
@@ -828,55 +981,107 @@ UInt16 sizeToRead = pCmd->respSize;
 }
 
 
+/******************************************************************************/
+/**
+ * \internal
+ * \brief usbFdWaitCmd - read the response until the device has finished it
+ *
+ * The device keeps one response per port, there is nothing to pipeline.
+ * Instead of sleeping the worst case the response is polled.
+ */
+static canStatus usbFdWaitCmd(
+		Can4osxUsbDeviceHandleEntry *pSelf, /**< pointer to handle structure */
+        IXXUSBFDMSGRESPHEAD_T *pCmd,
+        int value,
+        UInt32 timeoutMs
+    )
+{
+UInt64 end = CAN$OSX_getMilliseconds() + timeoutMs;
+UInt32 respSize = pCmd->respSize;
+canStatus retVal;
+
+    for (;;)  {
+        pCmd->respSize = respSize;
+        pCmd->retCode = IXXUSBFD_RETCODE_PENDING;
+
+        retVal = usbFdRecvCmd(pSelf, pCmd, value);
+        if ((retVal == canOK) && (pCmd->retCode != IXXUSBFD_RETCODE_PENDING))  {
+            return(canOK);
+        }
+        if (CAN$OSX_getMilliseconds() >= end)  {
+            return(canERR_TIMEOUT);
+        }
+        usleep(IXXUSBFD_POLL_INTERVAL_US);
+    }
+}
+
+
 /******************************************************************************/
 static void usbFdDecodeMsg(
 		Can4osxUsbDeviceHandleEntry *pSelf,
         IXXUSBFDCANMSG_T* pMsg
     )
 {
-CanMsg canMsg;
-
-	memset(&canMsg, 0u, sizeof(canMsg));
+CAN_EVENT_MSG_BUF_T *pBuffer;
+CanFrame *pFrame;
+UInt8 len;
 
 	switch (pMsg->flags & IXXUSBFD_MSG_FLAG_TYPE)  {
     case IXXUSBFD_CAN_DATA:
-    	canMsg.canId = pMsg->canId;
-    	canMsg.canDlc = (pMsg->flags & IXXUSBFD_MSG_FLAG_DLC ) >> 16;
-    	canMsg.canDlc &= 0xf;
+    	len = (pMsg->flags & IXXUSBFD_MSG_FLAG_DLC ) >> 16;
+    	len &= 0xf;
      
         /* decode dlc to length */
-    	canMsg.canDlc = CAN4OSX_decodeFdDlc(canMsg.canDlc);
+    	len = CAN4OSX_decodeFdDlc(len);
+     	if (!(pMsg->flags & IXXUSBFD_MSG_FLAG_EDL) && (len > 8u))  {
+     		len = 8u;
+        }
+
+        CAN4OSX_CountBusFrame(&pSelf->busStats,
+                ((pMsg->flags & IXXUSBFD_MSG_FLAG_EXT) ? canMSG_EXT : canMSG_STD)
+                | ((pMsg->flags & IXXUSBFD_MSG_FLAG_RTR) ? canMSG_RTR : 0u)
+                | ((pMsg->flags & IXXUSBFD_MSG_FLAG_EDL) ? canFDMSG_FDF : 0u)
+                | ((pMsg->flags & IXXUSBFD_MSG_FLAG_FDR) ? canFDMSG_BRS : 0u), len);
+        if (pMsg->flags & IXXUSBFD_MSG_FLAG_OVR)  {
+            CAN4OSX_CountBusStat(&pSelf->busStats.overruns, 1u);
+        }
+
+        if (!CAN4OSX_FilterAccept(&pSelf->rxFilter, pMsg->canId,
+                (pMsg->flags & IXXUSBFD_MSG_FLAG_EXT) ? canMSG_EXT : canMSG_STD))  {
+            // dropped by the acceptance filter
+            break;
+        }
+
+        pBuffer = CAN4OSX_GetCanEventBuffer(pSelf);
+        pFrame = CAN4OSX_ReserveCanEventBuffer(pBuffer, len);
+        if (pFrame == NULL)  {
+            // receive buffer full, the message is dropped
+            break;
+        }
+
+    	pFrame->canId = pMsg->canId;
      
-     	canMsg.canFlags = 0u;
      	if (pMsg->flags & IXXUSBFD_MSG_FLAG_EDL)  {
-      		canMsg.canFlags |= canFDMSG_FDF;
-        } else {
-        	if (canMsg.canDlc > 8u)  {
-         		canMsg.canDlc = 8u;
-            }
+      		pFrame->canFlags |= canFDMSG_FDF;
         }
         if (pMsg->flags & IXXUSBFD_MSG_FLAG_FDR)  {
-            canMsg.canFlags |= canFDMSG_BRS;
+            pFrame->canFlags |= canFDMSG_BRS;
         }
         if (pMsg->flags & IXXUSBFD_MSG_FLAG_EXT)  {
-            canMsg.canFlags |= canMSG_EXT;
+            pFrame->canFlags |= canMSG_EXT;
         } else {
-            canMsg.canFlags |= canMSG_STD;
+            pFrame->canFlags |= canMSG_STD;
         }
         if (pMsg->flags & IXXUSBFD_MSG_FLAG_RTR)  {
-            canMsg.canFlags |= canMSG_RTR;
+            pFrame->canFlags |= canMSG_RTR;
         } else {
-        	memcpy(canMsg.canData, pMsg->data, canMsg.canDlc);
+        	memcpy(pFrame->canData, pMsg->data, len);
         }
         
-        canMsg.canTimestamp = pMsg->time;
+        pFrame->canTimestamp = CAN4OSX_RxTimestamp(pSelf->pTimestamp, pMsg->time, pSelf->rxHostTime);
       
-        CAN4OSX_WriteCanEventBuffer(pSelf->canEventMsgBuff,canMsg);
-        
-        if (pSelf->canNotification.notifacionCenter)  {
-                CFNotificationCenterPostNotification (pSelf->canNotification.notifacionCenter,
-                    pSelf->canNotification.notificationString, NULL, NULL, true);
-        }
+        CAN4OSX_CommitCanEventBuffer(pBuffer);
+        CAN4OSX_NotifyRx(pSelf);
      
      	break;
     case IXXUSBFD_CAN_STATUS:
@@ -888,6 +1093,12 @@ CanMsg canMsg;
             }
       	}
     	break;
+    case IXXUSBFD_CAN_ERROR:
+        CAN4OSX_CountBusFrame(&pSelf->busStats, canMSG_ERROR_FRAME, 0u);
+        break;
+    case IXXUSBFD_CAN_TIMERST:
+        CAN4OSX_RestartTimestamp(pSelf->pTimestamp);
+        break;
     default:
     	break;
     }
@@ -898,7 +1109,6 @@ CanMsg canMsg;
 static void usbFdBulkReadCompletion(void *refCon, IOReturn result, void *arg0)
 {
 Can4osxUsbDeviceHandleEntry *pSelf = (Can4osxUsbDeviceHandleEntry *)refCon;
-CAN4OSX_USB_INTERFACE **interface = pSelf->can4osxInterfaceInterface;
 UInt32 numBytesRead = (UInt32) arg0;
 UInt32 count = 0u;
 IXXUSBFDCANMSG_T *pMsg;
@@ -907,8 +1117,7 @@ IXXUSBFDCANMSG_T *pMsg;
     
     if (result != kIOReturnSuccess)  {
         CAN4OSX_DEBUG_PRINT("Error from async bulk read (%08x)\n", result);
-        (void) (*interface)->USBInterfaceClose(interface);
-        (void) (*interface)->Release(interface);
+        CAN4OSX_usbClose(pSelf);
     } else {
     
 	    while (count < numBytesRead)  {
@@ -918,41 +1127,46 @@ IXXUSBFDCANMSG_T *pMsg;
      		count++;
     	}
 
-    	CAN4OSX_usbReadFromBulkInPipe(pSelf);
+    	CAN4OSX_NotifyRxFlush(pSelf);
     }
 }
 
 
-static IOReturn usbFdWriteToBulkPipe(
-		Can4osxUsbDeviceHandleEntry *pSelf
+/******************************************************************************/
+/**
+ * \brief usbFdBulkWriteFill - next bulk out transfer from the transmit buffer
+ *
+ * \return number of bytes to send
+ */
+static UInt32 usbFdBulkWriteFill(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+        UInt8 *pBuf,
+        UInt32 size,
+        UInt32 *pFrames
     )
 {
-IOReturn retval = kIOReturnSuccess;
-CAN4OSX_USB_INTERFACE **interface = pSelf->can4osxInterfaceInterface;
 IXXUSBFDPRIVATEDATA_T *pPriv = (IXXUSBFDPRIVATEDATA_T *)pSelf->privateData;
-UInt16 size = 0u;
 
-    pthread_mutex_lock(&pPriv->mutex);
-    
-	if ( pSelf->endpoitBulkOutBusy == FALSE ) {
-        pSelf->endpoitBulkOutBusy = TRUE;
-        size = usbFdFillBulkPipeBuffer(&pPriv->pTransBuff, pSelf->endpointBufferBulkOutRef, pSelf->endpointMaxSizeBulkOut );
-        if (size > 0) {
+    if (pPriv == NULL)  {
+        return(0u);
+    }
 
-            retval = (*interface)->WritePipeAsync(interface, pSelf->endpointNumberBulkOut, pSelf->endpointBufferBulkOutRef, size, usbFdBulkWriteCompletion, (void*)pSelf);
-        
-            if (retval != kIOReturnSuccess) {
-                CAN4OSX_DEBUG_PRINT("Unable to perform asynchronous bulk write (%08x)\n", retval);
-                (void) (*interface)->USBInterfaceClose(interface);
-                (void) (*interface)->Release(interface);
-            }
-        } else {
-            pSelf->endpoitBulkOutBusy = FALSE;
-        }
+    return(usbFdFillBulkPipeBuffer(&pPriv->pTransBuff, pBuf, (UInt16)size, pFrames));
+}
+
+
+/******************************************************************************/
+static UInt32 usbFdBulkWriteQueued(
+		Can4osxUsbDeviceHandleEntry *pSelf
+    )
+{
+IXXUSBFDPRIVATEDATA_T *pPriv = (IXXUSBFDPRIVATEDATA_T *)pSelf->privateData;
+
+    if (pPriv == NULL)  {
+        return(0u);
     }
-    pthread_mutex_unlock(&pPriv->mutex);
-    
-    return(retval);
+
+    return((UInt32)pPriv->pTransBuff.bufferCount);
 }
 
 
@@ -960,7 +1174,8 @@ UInt16 size = 0u;
 static UInt16 usbFdFillBulkPipeBuffer(
 		IXXUSBFDTRANSMITBUFFER_T *pBufferRef,
         UInt8 *pipe,
-        UInt16 maxPipeSize
+        UInt16 maxPipeSize,
+        UInt32 *pMsgs
     )
 {
 UInt16 fillState = 0;
@@ -971,6 +1186,7 @@ UInt16 fillState = 0;
             memcpy(pipe, &cmd, cmd.size + 1);
             fillState += cmd.size + 1;
             pipe += cmd.size + 1;
+            (*pMsgs)++;
             //Will another command fir in the pipe?
             if ( (fillState + sizeof(IXXUSBFDCANMSG_T)) >= maxPipeSize ) {
                 *pipe = 0;
@@ -987,40 +1203,6 @@ UInt16 fillState = 0;
 }
 
 
-/******************************************************************************/
-static void usbFdBulkWriteCompletion(
-		void *refCon,
-        IOReturn result,
-        void *arg0
-    )
-{
-Can4osxUsbDeviceHandleEntry *pSelf = (Can4osxUsbDeviceHandleEntry *)refCon;
-CAN4OSX_USB_INTERFACE **interface = pSelf->can4osxInterfaceInterface;
-UInt32 numBytesWritten = (UInt32) arg0;
-IXXUSBFDPRIVATEDATA_T *pPriv = (IXXUSBFDPRIVATEDATA_T *)pSelf->privateData;
-
-    (void)numBytesWritten;
-    
-    CAN4OSX_DEBUG_PRINT("Asynchronous bulk write complete\n");
-    
-    if (result != kIOReturnSuccess) {
-        CAN4OSX_DEBUG_PRINT("error from asynchronous bulk write (%08x)\n", result);
-        (void) (*interface)->USBInterfaceClose(interface);
-        (void) (*interface)->Release(interface);
-        return;
-    }
- 
- 	pthread_mutex_lock(&pPriv->mutex);
-    pSelf->endpoitBulkOutBusy = FALSE;
-    pthread_mutex_unlock(&pPriv->mutex);
-
-    CAN4OSX_DEBUG_PRINT("Wrote %ld bytes to bulk endpoint\n", (long)numBytesWritten);
-    
-    usbFdWriteToBulkPipe(pSelf);
-    
-}
-
-
 /******************************************************************************/
 static UInt8 usbFdTestFullTransmitBuffer(
 		IXXUSBFDTRANSMITBUFFER_T * pBuffer
@@ -1067,6 +1249,25 @@ __block UInt8 retval = 1u;
 }
 
 
+/******************************************************************************/
+static UInt32 usbFdWriteTransmitBufferBatch(
+		IXXUSBFDTRANSMITBUFFER_T* pBuffer,
+        const IXXUSBFDCANMSG_T *pMsgs,
+        UInt32 count
+    )
+{
+__block UInt32 written = 0u;
+    
+    dispatch_sync(pBuffer->bufferGDCqueueRef, ^{
+        while ((written < count) && !usbFdTestFullTransmitBuffer(pBuffer))  {
+            pBuffer->msgData[(pBuffer->bufferFirst + pBuffer->bufferCount++) % pBuffer->bufferSize] = pMsgs[written++];
+        }
+    });
+    
+    return(written);
+}
+
+
 /******************************************************************************/
 static UInt8 usbFdReadCommandBuffer(
 		IXXUSBFDTRANSMITBUFFER_T* pBuffer,
@@ -56,6 +56,12 @@ extern CAN4OSX_USB_FUNC_T ixxUsbFdUsbFunctions;
 #define IXXUSBFD_CMD_STOP_CHIP	0x327
 #define IXXUSBFD_CMD_FREQ_CHIP	0x337
 
+/* return code of a response the device is still working on */
+#define IXXUSBFD_RETCODE_PENDING	0xffFFffFFu
+/* the power up of the device takes up to this, the response is polled */
+#define IXXUSBFD_POWER_TIMEOUT_MS	500u
+#define IXXUSBFD_POLL_INTERVAL_US	1000u
+
 #define IXXUSBFD_CAN_DATA             0x00
 #define IXXUSBFD_CAN_INFO             0x01
 #define IXXUSBFD_CAN_ERROR            0x02
@@ -64,6 +70,10 @@ extern CAN4OSX_USB_FUNC_T ixxUsbFdUsbFunctions;
 #define IXXUSBFD_CAN_TIMEOVR          0x05
 #define IXXUSBFD_CAN_TIMERST          0x06
 
+/* time of the messages, a free running us counter */
+#define IXXUSBFD_TIMESTAMP_HZ         1000000u
+#define IXXUSBFD_TIMESTAMP_BITS       32u
+
 /* reception of 11-bit id messages */
 #define IXXUSBFD_OPMODE_STANDARD         0x01
 /* reception of 29-bit id messages */
@@ -44,12 +44,8 @@
 
 
 #include <stdio.h>
-
-#include <CoreFoundation/CoreFoundation.h>
-#include <IOKit/IOKitLib.h>
-#include <IOKit/IOMessage.h>
-#include <IOKit/IOCFPlugIn.h>
-#include <IOKit/usb/IOUSBLib.h>
+#include <stdlib.h>
+#include <string.h>
 
 
 /* can4osx */
@@ -71,19 +67,24 @@ static canStatus LeafCanStopChip(CanHandle hdl);
 
 static canStatus LeafCanSetBusParams (const CanHandle hnd, SInt32 freq, UInt32 tseg1, UInt32 tseg2, UInt32 sjw, UInt32 noSamp, UInt32 syncmode);
 static canStatus LeafCanWrite (const CanHandle hnd,UInt32 id, void *msg, UInt16 dlc, UInt32 flag);
+static canStatus LeafCanWriteBatch (const CanHandle hnd, const CanMsg *pMsg, size_t n, size_t *accepted);
+static void LeafEncodeTxMessage(leafCmd *pCmd, UInt32 txId, UInt32 id, const void *msg, UInt16 dlc, UInt32 flag);
 static canStatus LeafCanRead (const CanHandle hnd, UInt32 *id, void *msg, UInt16 *dlc, UInt32 *flag, UInt32 *time);
+static canStatus LeafCanReadBatch (const CanHandle hnd, CanMsg *pMsg, size_t max, size_t *got);
 static canStatus LeafCanClose(const CanHandle hnd);
+static canStatus LeafReadClock(const CanHandle hnd);
 
 
 
 static LeafCommandMsgBuf* LeafCreateCommandBuffer( UInt32 bufferSize );
 static void LeafReleaseCommandBuffer( LeafCommandMsgBuf* bufferRef );
 static UInt8 LeafWriteCommandBuffer(LeafCommandMsgBuf* bufferRef, leafCmd newCommand);
+static UInt32 LeafWriteCommandBufferBatch(LeafCommandMsgBuf* bufferRef, const leafCmd *pCommands, UInt32 count);
 static UInt8 LeafReadCommandBuffer(LeafCommandMsgBuf* bufferRef, leafCmd* readCommand);
 
-static void LeafBulkWriteCompletion(void *refCon, IOReturn result, void *arg0);
-static IOReturn LeafWriteToBulkPipe(Can4osxUsbDeviceHandleEntry *self);
-static UInt16 LeafFillBulkPipeBuffer(LeafCommandMsgBuf* bufferRef, UInt8 *pipe, UInt16 maxPipeSize);
+static UInt32 LeafBulkWriteFill(Can4osxUsbDeviceHandleEntry *pSelf, UInt8 *pBuf, UInt32 size, UInt32 *pFrames);
+static UInt32 LeafBulkWriteQueued(Can4osxUsbDeviceHandleEntry *pSelf);
+static UInt16 LeafFillBulkPipeBuffer(LeafCommandMsgBuf* bufferRef, UInt8 *pipe, UInt16 maxPipeSize, UInt32 *pCommands);
 
 static void BulkReadCompletion(void *refCon, IOReturn result, void *arg0);
 
@@ -99,8 +100,12 @@ CAN4OSX_HW_FUNC_T leafHardwareFunctions = {
 	.can4osxhwCanBusOnRef = LeafCanStartChip,
 	.can4osxhwCanBusOffRef = LeafCanStopChip,
 	.can4osxhwCanWriteRef = LeafCanWrite,
+	.can4osxhwCanWriteBatchRef = LeafCanWriteBatch,
 	.can4osxhwCanReadRef = LeafCanRead,
+	.can4osxhwCanReadBatchRef = LeafCanReadBatch,
 	.can4osxhwCanCloseRef = LeafCanClose,
+	.can4osxhwReadClockRef = LeafReadClock,
+	.can4osxhwCanSetFilterRef = NULL,
 };
 
 
@@ -111,7 +116,7 @@ canStatus LeafInitHardware(
 		UInt16 productId
 	)
 {
-	Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+	Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hnd);
 	pSelf->privateData = calloc(1,sizeof(LeafPrivateData));
 
 	if ( pSelf->privateData != NULL )  {
@@ -123,13 +128,15 @@ canStatus LeafInitHardware(
 			return(canERR_NOMEM);
 		}
 
-		priv->semaTimeout = dispatch_semaphore_create(0);
-
 	} else {
 		return(canERR_NOMEM);
 	}
 
+	CAN4OSX_SetTimestampClock(pSelf->pTimestamp, LEAF_TIMESTAMP_HZ, LEAF_TIMESTAMP_BITS);
+
 	pSelf->usbFunctions.bulkReadCompletion = BulkReadCompletion;
+	pSelf->usbFunctions.bulkWriteFill = LeafBulkWriteFill;
+	pSelf->usbFunctions.bulkWriteQueued = LeafBulkWriteQueued;
 	
 	// Set some device Infos
 	sprintf((char*)pSelf->devInfo.deviceString, "%s",pDeviceString);
@@ -145,7 +152,7 @@ canStatus LeafInitHardware(
 static canStatus LeafCanClose(const CanHandle hnd)
 {
 
-	Can4osxUsbDeviceHandleEntry *self = &can4osxUsbDeviceHandle[hnd];
+	Can4osxUsbDeviceHandleEntry *self = CAN4OSX_GetChannel(hnd);
 
 	if ( self->privateData != NULL )  {
 		LeafPrivateData *priv = (LeafPrivateData *)self->privateData;
@@ -162,6 +169,51 @@ static canStatus LeafCanClose(const CanHandle hnd)
 }
 
 
+static void LeafEncodeTxMessage(
+		leafCmd *pCmd,
+		UInt32 txId,
+		UInt32 id,
+		const void *msg,
+		UInt16 dlc,
+		UInt32 flag
+	)
+{
+	pCmd->txCanMessage.channel = 0;
+	// comes back with the CMD_TX_ACKNOWLEDGE
+	pCmd->txCanMessage.transId = (UInt8)(txId & LEAF_TRANSACTION_ID_MASK);
+
+	pCmd->txCanMessage.cmdLen = sizeof(cmdTxCanMessage);
+
+	if ( flag & canMSG_EXT )  {
+		// Extended ID
+		pCmd->txCanMessage.cmdNo = CMD_TX_EXT_MESSAGE;
+
+		pCmd->txCanMessage.rawMessage[0] = (UInt8)((id >> 24) & 0x1f);
+		pCmd->txCanMessage.rawMessage[1] = (UInt8)((id >> 18) & 0x3f);
+		pCmd->txCanMessage.rawMessage[2] = (UInt8)((id >> 14) & 0x0f);
+		pCmd->txCanMessage.rawMessage[3] = (UInt8)((id >> 6 ) & 0xFF);
+		pCmd->txCanMessage.rawMessage[4] = (UInt8)((id      ) & 0x3f);
+	} else {
+		// Standard CAN
+		pCmd->txCanMessage.cmdNo = CMD_TX_STD_MESSAGE;
+
+		pCmd->txCanMessage.rawMessage[0] = (UInt8)((id >>  6) & 0x1F);
+		pCmd->txCanMessage.rawMessage[1] = (UInt8)((id      ) & 0x3F);
+	}
+
+	pCmd->txCanMessage.flags = 0;
+
+	// RTR Frame
+	if ( flag & canMSG_RTR )  {
+		pCmd->txCanMessage.flags |= LEAF_MSG_FLAG_REMOTE_FRAME;
+	}
+
+	// DLC and DATA
+	pCmd->txCanMessage.rawMessage[5]   = dlc & 0x0F;
+	memcpy(&pCmd->txCanMessage.rawMessage[6], msg, 8);
+}
+
+
 static canStatus LeafCanWrite(
 		const CanHandle hnd,
 		UInt32 id,
@@ -170,75 +222,123 @@ static canStatus LeafCanWrite(
 		UInt32 flag
 	)
 {
-Can4osxUsbDeviceHandleEntry *self = &can4osxUsbDeviceHandle[hnd];
+Can4osxUsbDeviceHandleEntry *self = CAN4OSX_GetChannel(hnd);
 
 	if ( self->privateData != NULL )  {
 		LeafPrivateData *priv = (LeafPrivateData *)self->privateData;
 
 		leafCmd cmd;
-		cmd.txCanMessage.channel = 0;
+		LeafEncodeTxMessage(&cmd, CAN4OSX_TX_FRAME_ID(&self->txTrack, 0u), id, msg, dlc, flag);
 
-		cmd.txCanMessage.cmdLen = sizeof(cmdTxCanMessage);
+		if ( LeafWriteCommandBuffer(priv->cmdBufferRef, cmd) == 0u )  {
+			return(canERR_TXBUFOFL);
+		}
 
-		if ( flag & canMSG_EXT )  {
-			// Extended ID
-			cmd.txCanMessage.cmdNo = CMD_TX_EXT_MESSAGE;
+		CAN4OSX_usbWriteToBulkOutPipe(self);
 
-			cmd.txCanMessage.rawMessage[0] = (UInt8)((id >> 24) & 0x1f);
-			cmd.txCanMessage.rawMessage[1] = (UInt8)((id >> 18) & 0x3f);
-			cmd.txCanMessage.rawMessage[2] = (UInt8)((id >> 14) & 0x0f);
-			cmd.txCanMessage.rawMessage[3] = (UInt8)((id >> 6 ) & 0xFF);
-			cmd.txCanMessage.rawMessage[4] = (UInt8)((id      ) & 0x3f);
-		} else {
-			// Standard CAN
-			cmd.txCanMessage.cmdNo = CMD_TX_STD_MESSAGE;
+		return(canOK);
 
-			cmd.txCanMessage.rawMessage[0] = (UInt8)((id >>  6) & 0x1F);
-			cmd.txCanMessage.rawMessage[1] = (UInt8)((id      ) & 0x3F);
-		}
+	} else {
+		return(canERR_INTERNAL);
+	}
 
-		cmd.txCanMessage.flags = 0;
+}
 
-		// RTR Frame
-		if ( flag & canMSG_RTR )  {
-			cmd.txCanMessage.flags |= LEAF_MSG_FLAG_REMOTE_FRAME;
-		}
 
-		// DLC and DATA
-		cmd.txCanMessage.rawMessage[5]   = dlc & 0x0F;
-		memcpy(&cmd.txCanMessage.rawMessage[6], msg, 8);
+static canStatus LeafCanWriteBatch(
+		const CanHandle hnd,
+		const CanMsg *pMsg,
+		size_t n,
+		size_t *accepted
+	)
+{
+Can4osxUsbDeviceHandleEntry *self = CAN4OSX_GetChannel(hnd);
+leafCmd cmd[CAN4OSX_TX_BATCH_CHUNK];
+UInt32 chunk;
+UInt32 written;
+UInt32 i;
 
-		LeafWriteCommandBuffer(priv->cmdBufferRef, cmd);
+	if ( self->privateData == NULL )  {
+		return(canERR_INTERNAL);
+	}
 
-		LeafWriteToBulkPipe(self);
+	LeafPrivateData *priv = (LeafPrivateData *)self->privateData;
 
-		return(canOK);
+	/* queue everything first, the bulk pipe is started only once */
+	while ( *accepted < n )  {
+		chunk = ((n - *accepted) > CAN4OSX_TX_BATCH_CHUNK) ? CAN4OSX_TX_BATCH_CHUNK : (UInt32)(n - *accepted);
 
-	} else {
-		return(canERR_INTERNAL);
+		for (i = 0; i < chunk; i++)  {
+			const CanMsg *pFrame = &pMsg[*accepted + i];
+			LeafEncodeTxMessage(&cmd[i], CAN4OSX_TX_FRAME_ID(&self->txTrack, *accepted + i),
+					pFrame->canId, pFrame->canData, pFrame->canDlc, pFrame->canFlags);
+		}
+
+		written = LeafWriteCommandBufferBatch(priv->cmdBufferRef, cmd, chunk);
+		*accepted += written;
+
+		if ( written < chunk )  {
+			break;
+		}
+	}
+
+	CAN4OSX_usbWriteToBulkOutPipe(self);
+
+	if ( *accepted < n )  {
+		return(canERR_TXBUFOFL);
 	}
 
+	return(canOK);
 }
 
 
 static canStatus LeafCanRead (const CanHandle hnd, UInt32 *id, void *msg, UInt16 *dlc, UInt32 *flag, UInt32 *time)
 {
-Can4osxUsbDeviceHandleEntry *self = &can4osxUsbDeviceHandle[hnd];
+Can4osxUsbDeviceHandleEntry *self = CAN4OSX_GetChannel(hnd);
 
 	if ( self->privateData != NULL )  {
 
-		CanMsg canMsg;
+		CAN_EVENT_MSG_BUF_T *pBuffer = CAN4OSX_GetCanEventBuffer(self);
+		CanFrame *pFrame;
+
+		if ( CAN4OSX_AcquireCanEventBuffer(pBuffer, &pFrame, 1u) != 0u )  {
+
+			*id = pFrame->canId;
+			*dlc = pFrame->canDlc;
+			*time = (UInt32)(pFrame->canTimestamp / 1000u);
+
+			memcpy(msg, pFrame->canData, *dlc);
+
+			*flag = pFrame->canFlags;
 
-		if ( CAN4OSX_ReadCanEventBuffer(self->canEventMsgBuff, &canMsg) )  {
+			CAN4OSX_ReleaseCanEventBufferEvents(pBuffer, 1u);
+
+			return(canOK);
+		} else {
+			return(canERR_NOMSG);
+		}
+	} else {
+		return(canERR_INTERNAL);
+	}
+}
 
-			*id = canMsg.canId;
-			*dlc = canMsg.canDlc;
-			*time =canMsg.canTimestamp;
 
-			memcpy(msg, canMsg.canData, *dlc);
+static canStatus LeafCanReadBatch (
+		const CanHandle hnd,
+		CanMsg *pMsg,
+		size_t max,
+		size_t *got
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hnd);
 
-			*flag = canMsg.canFlags;
+	if ( pSelf->privateData != NULL )  {
+		if (max > UINT32_MAX)  {
+			max = UINT32_MAX;
+		}
 
+		*got = CAN4OSX_ReadCanEventBufferBatch(CAN4OSX_GetCanEventBuffer(pSelf), pMsg, (UInt32)max);
+		if ( *got != 0 )  {
 			return(canOK);
 		} else {
 			return(canERR_NOMSG);
@@ -326,6 +426,21 @@ __block UInt8 retval = 1;
 }
 
 
+// Queues up to count commands with one trip to the buffer queue, returns how many fit
+static UInt32 LeafWriteCommandBufferBatch(LeafCommandMsgBuf* bufferRef, const leafCmd *pCommands, UInt32 count)
+{
+__block UInt32 written = 0;
+
+	dispatch_sync(bufferRef->bufferGDCqueueRef, ^{
+		while ( (written < count) && !LeafTestFullCommandBuffer(bufferRef) )  {
+			bufferRef->commandRef[(bufferRef->bufferFirst + bufferRef->bufferCount++) % bufferRef->bufferSize] = pCommands[written++];
+		}
+	});
+
+	return(written);
+}
+
+
 static UInt8 LeafReadCommandBuffer(LeafCommandMsgBuf* bufferRef, leafCmd* readCommand)
 {
 __block UInt8 retval = 1;
@@ -344,36 +459,13 @@ __block UInt8 retval = 1;
 }
 
 
-static UInt32 LeafCalculateTimeStamp(
-		UInt16 *timerRef,
-		unsigned int hires_timer_fq
-	)
-{
-unsigned long  ulTemp;
-UInt16 result[3];
-unsigned int   uiDivisor = 10 * hires_timer_fq;
-
-	result[0] = timerRef[2] / uiDivisor;
-	ulTemp	 = (timerRef[2] % uiDivisor) << 16;
-
-	if (result[0] > 0)  {
-	}
-
-	result[1] = (unsigned short)((ulTemp + timerRef[1]) / uiDivisor);
-	ulTemp = ((ulTemp + timerRef[1]) % uiDivisor) << 16;
-
-	result[2] = (unsigned short)((ulTemp + timerRef[0]) / uiDivisor);
-
-	return(((int)result[1] << 16) + result[2]);
-}
-
-
 void LeafDecodeCommand(
 		Can4osxUsbDeviceHandleEntry *self,
 		leafCmd *cmd
 	)
 {
 LeafPrivateData *priv = (LeafPrivateData *)self->privateData;
+CAN_EVENT_MSG_BUF_T *pBuffer;
 
 	switch (cmd->head.cmdNo) {
 
@@ -384,16 +476,45 @@ LeafPrivateData *priv = (LeafPrivateData *)self->privateData;
 
 		case CMD_LOG_MESSAGE:
 		{
-			CanMsg canMsg;
-            
-   			memset(&canMsg, 0u, sizeof(canMsg));
+			CanFrame *pFrame;
+			UInt32 busFlags;
+
+			if ( cmd->logMessage.dlc > 8 )  {
+				cmd->logMessage.dlc = 8;
+			}
+
+			busFlags = ((cmd->logMessage.ident & LEAF_EXT_MSG) ? canMSG_EXT : canMSG_STD)
+					| ((cmd->logMessage.flags & LEAF_MSG_FLAG_REMOTE_FRAME) ? canMSG_RTR : 0u)
+					| ((cmd->logMessage.flags & LEAF_MSG_FLAG_ERROR_FRAME) ? canMSG_ERROR_FRAME : 0u)
+					| ((cmd->logMessage.flags & LEAF_MSG_FLAG_TXACK) ? canMSG_TXACK : 0u);
+
+			// a transmit request is not on the bus yet, its TXACK follows
+			if ( !(cmd->logMessage.flags & LEAF_MSG_FLAG_TXRQ) )  {
+				CAN4OSX_CountBusFrame(&self->busStats, busFlags, cmd->logMessage.dlc);
+			}
+			if ( cmd->logMessage.flags & LEAF_MSG_FLAG_OVERRUN )  {
+				CAN4OSX_CountBusStat(&self->busStats.overruns, 1u);
+			}
+
+			if ( !CAN4OSX_FilterAccept(&self->rxFilter, cmd->logMessage.ident & ~LEAF_EXT_MSG,
+					busFlags & (canMSG_EXT | canMSG_STD | canMSG_ERROR_FRAME)) )  {
+				// dropped by the acceptance filter
+				break;
+			}
+
+			pBuffer = CAN4OSX_GetCanEventBuffer(self);
+			pFrame = CAN4OSX_ReserveCanEventBuffer(pBuffer, cmd->logMessage.dlc);
+			if ( pFrame == NULL )  {
+				// receive buffer full, the message is dropped
+				break;
+			}
 
 			if ( cmd->logMessage.ident & LEAF_EXT_MSG )  {
-				canMsg.canId = cmd->logMessage.ident & ~LEAF_EXT_MSG;
-				canMsg.canFlags = canMSG_EXT;
+				pFrame->canId = cmd->logMessage.ident & ~LEAF_EXT_MSG;
+				pFrame->canFlags = canMSG_EXT;
 			} else {
-				canMsg.canId = cmd->logMessage.ident;
-				canMsg.canFlags = canMSG_STD;
+				pFrame->canId = cmd->logMessage.ident;
+				pFrame->canFlags = canMSG_STD;
 			}
 
 			if (cmd->logMessage.flags & LEAF_MSG_FLAG_OVERRUN)  {
@@ -401,33 +522,27 @@ LeafPrivateData *priv = (LeafPrivateData *)self->privateData;
 				//event.eventTagData.canMsg.canFlags |= canMSGERR_HW_OVERRUN | canMSGERR_SW_OVERRUN;
 			}
 			if (cmd->logMessage.flags & LEAF_MSG_FLAG_REMOTE_FRAME)  {
-				canMsg.canFlags |= canMSG_RTR;
+				pFrame->canFlags |= canMSG_RTR;
 			}
 			if (cmd->logMessage.flags & LEAF_MSG_FLAG_ERROR_FRAME)  {
-				canMsg.canFlags |= canMSG_ERROR_FRAME;
+				pFrame->canFlags |= canMSG_ERROR_FRAME;
 			}
 			if (cmd->logMessage.flags & LEAF_MSG_FLAG_TXACK)  {
-				canMsg.canFlags |= canMSG_TXACK;
+				pFrame->canFlags |= canMSG_TXACK;
 			}
 			if (cmd->logMessage.flags & LEAF_MSG_FLAG_TXRQ)  {
-				canMsg.canFlags |= canMSG_TXRQ;
-			}
-
-			if ( cmd->logMessage.dlc > 8 )  {
-				cmd->logMessage.dlc = 8;
+				pFrame->canFlags |= canMSG_TXRQ;
 			}
 
-			canMsg.canDlc = cmd->logMessage.dlc;
+			memcpy(pFrame->canData, cmd->logMessage.data, cmd->logMessage.dlc);
 
-			memcpy(canMsg.canData, cmd->logMessage.data, cmd->logMessage.dlc);
+			pFrame->canTimestamp = CAN4OSX_RxTimestamp(self->pTimestamp,
+				cmd->logMessage.time[0] | ((UInt64)cmd->logMessage.time[1] << 16) | ((UInt64)cmd->logMessage.time[2] << 32),
+				self->rxHostTime);
 
-			canMsg.canTimestamp = LeafCalculateTimeStamp(cmd->logMessage.time, 24) * 10;
 
-
-			CAN4OSX_WriteCanEventBuffer(self->canEventMsgBuff,canMsg);
-			if (self->canNotification.notifacionCenter)  {
-				CFNotificationCenterPostNotification (self->canNotification.notifacionCenter, self->canNotification.notificationString, NULL, NULL, true);
-			}
+			CAN4OSX_CommitCanEventBuffer(pBuffer);
+			CAN4OSX_NotifyRx(self);
 
 			CAN4OSX_DEBUG_PRINT("CMD_LOG_MESSAGE Channel: %d Id: %X Flags: %X\n", cmd->logMessage.channel, cmd->logMessage.ident, cmd->logMessage.flags);
 
@@ -435,12 +550,14 @@ LeafPrivateData *priv = (LeafPrivateData *)self->privateData;
 		break;
 
 		case CMD_START_CHIP_RESP:
-			dispatch_semaphore_signal(priv->semaTimeout);
+			(void)CAN4OSX_CompleteTransaction(self->pTransactions,
+					LEAF_TRANSACTION_KEY(cmd->head.cmdNo, cmd->startChipReq.transId), cmd, cmd->head.cmdLen);
 			CAN4OSX_DEBUG_PRINT("CMD_START_CHIP_RESP\n");
 			break;
 
 		case CMD_STOP_CHIP_RESP:
-			dispatch_semaphore_signal(priv->semaTimeout);
+			(void)CAN4OSX_CompleteTransaction(self->pTransactions,
+					LEAF_TRANSACTION_KEY(cmd->head.cmdNo, cmd->startChipReq.transId), cmd, cmd->head.cmdLen);
 			CAN4OSX_DEBUG_PRINT("CMD_STOP_CHIP_RESP\n");
 			break;
 
@@ -488,7 +605,18 @@ LeafPrivateData *priv = (LeafPrivateData *)self->privateData;
 
 			break;
 
+		case CMD_READ_CLOCK_RESP:
+		{
+			UInt64 clock = (UInt64)cmd->readClockResp.time[0]
+					| ((UInt64)cmd->readClockResp.time[1] << 16)
+					| ((UInt64)cmd->readClockResp.time[2] << 32);
+
+			CAN4OSX_TimestampClockResponse(self->pTimestamp, clock);
+			break;
+		}
+
 		case CMD_GET_BUSLOAD_RESP:
+			// never asked for, the bus load is counted on the host, see CAN4OSX_CountBusFrame
 			CAN4OSX_DEBUG_PRINT("CMD_GET_BUSLOAD_RESP - Ignored\n");
 			break;
 
@@ -497,13 +625,25 @@ LeafPrivateData *priv = (LeafPrivateData *)self->privateData;
 			break;
 
 		case CMD_ERROR_EVENT:
-			CAN4OSX_DEBUG_PRINT("CMD_ERROR_EVENT - Ignored\n");
+			// an error of the firmware, e.g. its transmit queue ran over
+			CAN4OSX_CountBusStat(&self->busStats.errorEvents, 1u);
+			CAN4OSX_DEBUG_PRINT("CMD_ERROR_EVENT code: %d info: %d %d\n", cmd->errorEvent.errorCode,
+					cmd->errorEvent.info1, cmd->errorEvent.info2);
 			break;
 
 		case CMD_RESET_ERROR_COUNTER:
 			CAN4OSX_DEBUG_PRINT("CMD_RESET_ERROR_COUNTER - Ignored\n");
 			break;
 
+		case CMD_TX_ACKNOWLEDGE:
+			// the frame of transId is on the bus
+			CAN4OSX_CountBusStat(&self->busStats.txAck, 1u);
+			CAN4OSX_AckTxFrame(self, cmd->txAck.transId, LEAF_TRANSACTION_ID_MASK,
+				CAN4OSX_RxTimestamp(self->pTimestamp,
+					cmd->txAck.time[0] | ((UInt64)cmd->txAck.time[1] << 16) | ((UInt64)cmd->txAck.time[2] << 32),
+					self->rxHostTime));
+			break;
+
 		case CMD_USB_THROTTLE:
 			CAN4OSX_DEBUG_PRINT("CMD_USB_THROTTLE - Ignored\n");
 			break;
@@ -654,7 +794,8 @@ canStatus LeafCanTranslateBaud(
 static UInt16 LeafFillBulkPipeBuffer(
 		LeafCommandMsgBuf* bufferRef,
 		UInt8 *pipe,
-		UInt16 maxPipeSize
+		UInt16 maxPipeSize,
+		UInt32 *pCommands
 	)
 {
 	UInt16 fillState = 0;
@@ -665,6 +806,7 @@ static UInt16 LeafFillBulkPipeBuffer(
 			memcpy(pipe, &cmd, cmd.head.cmdLen);
 			fillState += cmd.head.cmdLen;
 			pipe += cmd.head.cmdLen;
+			(*pCommands)++;
 			//Will another command fir in the pipe?
 			if ( (fillState + sizeof(leafCmd)) >= maxPipeSize )  {
 				*pipe = 0;
@@ -680,64 +822,44 @@ static UInt16 LeafFillBulkPipeBuffer(
 	return(fillState);
 }
 
-static void LeafBulkWriteCompletion(
-		void *refCon,
-		IOReturn result,
-		void *arg0
+/******************************************************************************/
+/**
+ * \brief LeafBulkWriteFill - next bulk out transfer from the command buffer
+ *
+ * Only the filled commands are sent. The buffer is a single packet, so a
+ * short transfer ends the list and a full one needs no zero length packet.
+ *
+ * \return number of bytes to send
+ */
+static UInt32 LeafBulkWriteFill(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+		UInt8 *pBuf,
+		UInt32 size,
+		UInt32 *pFrames
 	)
 {
-Can4osxUsbDeviceHandleEntry *self = (Can4osxUsbDeviceHandleEntry *)refCon;
-CAN4OSX_USB_INTERFACE **interface = self->can4osxInterfaceInterface;
-
-	UInt32 numBytesWritten = (UInt32) arg0;
-
-	(void)numBytesWritten;
+LeafPrivateData *priv = (LeafPrivateData *)pSelf->privateData;
 
-	CAN4OSX_DEBUG_PRINT("Asynchronous bulk write complete\n");
-
-	if (result != kIOReturnSuccess)  {
-		CAN4OSX_DEBUG_PRINT("error from asynchronous bulk write (%08x)\n", result);
-		(void) (*interface)->USBInterfaceClose(interface);
-		(void) (*interface)->Release(interface);
-		return;
+	if ( priv == NULL )  {
+		return(0u);
 	}
 
-	self->endpoitBulkOutBusy = FALSE;
-
-	CAN4OSX_DEBUG_PRINT("Wrote %ld bytes to bulk endpoint\n", (long)numBytesWritten);
-
-	LeafWriteToBulkPipe(self);
-
+	return(LeafFillBulkPipeBuffer(priv->cmdBufferRef, pBuf, (UInt16)size, pFrames));
 }
 
 
-
-static IOReturn LeafWriteToBulkPipe(
+/******************************************************************************/
+static UInt32 LeafBulkWriteQueued(
 		Can4osxUsbDeviceHandleEntry *pSelf
 	)
 {
-IOReturn retval = kIOReturnSuccess;
-CAN4OSX_USB_INTERFACE **interface = pSelf->can4osxInterfaceInterface;
-	LeafPrivateData *priv = (LeafPrivateData *)pSelf->privateData;
-
-	if ( pSelf->endpoitBulkOutBusy == FALSE )  {
-		pSelf->endpoitBulkOutBusy = TRUE;
-
-		if (0 < LeafFillBulkPipeBuffer(priv->cmdBufferRef, pSelf->endpointBufferBulkOutRef, pSelf->endpointMaxSizeBulkOut ))  {
+LeafPrivateData *priv = (LeafPrivateData *)pSelf->privateData;
 
-			retval = (*interface)->WritePipeAsync(interface, pSelf->endpointNumberBulkOut, pSelf->endpointBufferBulkOutRef, pSelf->endpointMaxSizeBulkOut, LeafBulkWriteCompletion, (void*)pSelf);
-
-			if (retval != kIOReturnSuccess)  {
-				CAN4OSX_DEBUG_PRINT("Unable to perform asynchronous bulk write (%08x)\n", retval);
-				(void) (*interface)->USBInterfaceClose(interface);
-				(void) (*interface)->Release(interface);
-			}
-		} else {
-			pSelf->endpoitBulkOutBusy = FALSE;
-		}
+	if ( priv == NULL )  {
+		return(0u);
 	}
 
-	return(retval);
+	return((UInt32)priv->cmdBufferRef->bufferCount);
 }
 
 
@@ -748,20 +870,28 @@ static canStatus LeafCanStartChip(
 {
 int retVal = 0;
 leafCmd cmd;
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hdl];
-LeafPrivateData *priv = (LeafPrivateData*)pSelf->privateData;
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hdl);
+CAN4OSX_TRANSACTION_T *pTransaction;
+canStatus status;
 
 	CAN4OSX_DEBUG_PRINT("CAN BusOn Command %d\n", hdl);
 
 	cmd.head.cmdNo = CMD_START_CHIP_REQ;
 	cmd.startChipReq.cmdLen = sizeof(cmdStartChipReq);
 	cmd.startChipReq.channel = 0;
-	cmd.startChipReq.transId = 0;
+	cmd.startChipReq.transId = (UInt8)CAN4OSX_NextTransactionId(pSelf->pTransactions, LEAF_TRANSACTION_ID_MASK);
+
+	pTransaction = CAN4OSX_BeginTransaction(pSelf->pTransactions,
+			LEAF_TRANSACTION_KEY(CMD_START_CHIP_RESP, cmd.startChipReq.transId), NULL, NULL);
+	if ( pTransaction == NULL )  {
+		return(canERR_NOMEM);
+	}
 
 	retVal = CAN4OSX_usbSendCommand(pSelf, &cmd, cmd.head.cmdLen);
 
-	if ( dispatch_semaphore_wait(priv->semaTimeout, dispatch_time(DISPATCH_TIME_NOW, LEAF_TIMEOUT_TEN_MS)) )  {
-		return(canERR_TIMEOUT);
+	status = CAN4OSX_WaitTransaction(pSelf->pTransactions, pTransaction, LEAF_TIMEOUT_MS, NULL, 0u);
+	if ( status != canOK )  {
+		return(status);
 	} else {
 		return(retVal);
 	}
@@ -773,8 +903,9 @@ static canStatus LeafCanStopChip(CanHandle hdl)
 {
 	int retVal = 0;
 	leafCmd cmd;
-	Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hdl];
-	LeafPrivateData *priv = (LeafPrivateData*)pSelf->privateData;
+	Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hdl);
+	CAN4OSX_TRANSACTION_T *pTransaction;
+	canStatus status;
 
 
 	CAN4OSX_DEBUG_PRINT("CAN BusOff Command %d\n", hdl);
@@ -782,12 +913,19 @@ static canStatus LeafCanStopChip(CanHandle hdl)
 	cmd.head.cmdNo			= CMD_STOP_CHIP_REQ;
 	cmd.startChipReq.cmdLen   = sizeof(cmdStartChipReq);
 	cmd.startChipReq.channel  = 0;
-	cmd.startChipReq.transId  = 0;
+	cmd.startChipReq.transId  = (UInt8)CAN4OSX_NextTransactionId(pSelf->pTransactions, LEAF_TRANSACTION_ID_MASK);
+
+	pTransaction = CAN4OSX_BeginTransaction(pSelf->pTransactions,
+			LEAF_TRANSACTION_KEY(CMD_STOP_CHIP_RESP, cmd.startChipReq.transId), NULL, NULL);
+	if ( pTransaction == NULL )  {
+		return(canERR_NOMEM);
+	}
 
 	retVal = CAN4OSX_usbSendCommand(pSelf, &cmd, cmd.head.cmdLen);
 
-	if ( dispatch_semaphore_wait(priv->semaTimeout, dispatch_time(DISPATCH_TIME_NOW, LEAF_TIMEOUT_TEN_MS)) )  {
-		return(canERR_TIMEOUT);
+	status = CAN4OSX_WaitTransaction(pSelf->pTransactions, pTransaction, LEAF_TIMEOUT_MS, NULL, 0u);
+	if ( status != canOK )  {
+		return(status);
 	} else {
 		return(retVal);
 	}
@@ -796,6 +934,22 @@ static canStatus LeafCanStopChip(CanHandle hdl)
 }
 
 
+//Request the device clock, answered by CMD_READ_CLOCK_RESP
+static canStatus LeafReadClock(
+		const CanHandle hnd
+	)
+{
+leafCmd cmd;
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hnd);
+
+	memset(&cmd, 0u, sizeof(cmd));
+	cmd.head.cmdNo = CMD_READ_CLOCK_REQ;
+	cmd.readClockReq.cmdLen = sizeof(cmdReadClockReq);
+
+	return(CAN4OSX_usbSendCommand(pSelf, &cmd, cmd.head.cmdLen));
+}
+
+
 //Set bit timing
 static canStatus LeafCanSetBusParams ( const CanHandle hnd, SInt32 freq, unsigned int tseg1,
 							 unsigned int tseg2, unsigned int sjw,
@@ -804,7 +958,7 @@ static canStatus LeafCanSetBusParams ( const CanHandle hnd, SInt32 freq, unsigne
 	leafCmd		cmd;
 	UInt32		 tmp, PScl;
 	int			retVal;
-	Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+	Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hnd);
 
 	CAN4OSX_DEBUG_PRINT("leaf: _set_busparam\n");
 
@@ -839,6 +993,9 @@ static canStatus LeafCanSetBusParams ( const CanHandle hnd, SInt32 freq, unsigne
 	cmd.setBusparamsReq.noSamp  = 1; // qqq Can't be trusted: (BYTE) pi->chip_param.samp3
 
 	retVal = CAN4OSX_usbSendCommand(pSelf, &cmd, cmd.head.cmdLen);
+	if (retVal == canOK)  {
+		CAN4OSX_SetBusStatisticsBitrate(&pSelf->busStats, (UInt32)freq, 0u);
+	}
 
 	return(retVal);
 }
@@ -847,15 +1004,13 @@ static canStatus LeafCanSetBusParams ( const CanHandle hnd, SInt32 freq, unsigne
 static void BulkReadCompletion(void *refCon, IOReturn result, void *arg0)
 {
 Can4osxUsbDeviceHandleEntry *pSelf = (Can4osxUsbDeviceHandleEntry *)refCon;
-CAN4OSX_USB_INTERFACE **interface = pSelf->can4osxInterfaceInterface;
 UInt32 numBytesRead = (UInt32) arg0;
 
 	CAN4OSX_DEBUG_PRINT("Asynchronous bulk read complete (%ld)\n", (long)numBytesRead);
 
 	if (result != kIOReturnSuccess)  {
 		printf("Error from async bulk read (%08x)\n", result);
-		(void) (*interface)->USBInterfaceClose(interface);
-		(void) (*interface)->Release(interface);
+		CAN4OSX_usbClose(pSelf);
 		return;
 	}
 
@@ -878,8 +1033,9 @@ UInt32 numBytesRead = (UInt32) arg0;
 
 			LeafDecodeCommand(pSelf, cmd);
 		}
+
+		CAN4OSX_NotifyRxFlush(pSelf);
 	}
-	CAN4OSX_usbReadFromBulkInPipe(pSelf);
 }
 
 
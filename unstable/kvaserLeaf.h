@@ -184,8 +184,15 @@
 
 
 
-# define LEAF_TIMEOUT_ONE_MS 1000000
-# define LEAF_TIMEOUT_TEN_MS 10*LEAF_TIMEOUT_ONE_MS
+# define LEAF_TIMEOUT_MS 10u
+
+// a response carries the transaction id of its request
+# define LEAF_TRANSACTION_ID_MASK 0xffu
+# define LEAF_TRANSACTION_KEY(cmdNo, transId) (((UInt32)(cmdNo) << 8u) | ((UInt32)(transId) & LEAF_TRANSACTION_ID_MASK))
+
+// the time[3] counter of the log messages
+# define LEAF_TIMESTAMP_HZ   24000000u
+# define LEAF_TIMESTAMP_BITS 48u
 
 
 // Header for every command.
@@ -277,6 +284,16 @@ typedef struct {
     UInt8  flags;
 } __attribute__ ((packed)) cmdTxCanMessage;
 
+typedef struct {
+    UInt8  cmdLen;
+    UInt8  cmdNo;
+    UInt8  channel;
+    UInt8  transId;     // the one of the cmdTxCanMessage
+    UInt16 time[3];
+    UInt8  flags;
+    UInt8  timeOffset;
+} __attribute__ ((packed)) cmdTxAcknowledge;
+
 typedef struct {
     UInt8  cmdLen;
     UInt8  cmdNo;
@@ -290,12 +307,42 @@ typedef struct {
     UInt16 padding2;
 } __attribute__ ((packed)) cmdChipStateEvent;
 
+typedef struct {
+    UInt8 cmdLen;
+    UInt8 cmdNo;
+    UInt8 transId;
+    UInt8 flags;
+} __attribute__ ((packed)) cmdReadClockReq;
+
+typedef struct {
+    UInt8  cmdLen;
+    UInt8  cmdNo;
+    UInt8  transId;
+    UInt8  padding;
+    UInt16 time[3];
+    UInt16 padding2;
+} __attribute__ ((packed)) cmdReadClockResp;
+
+
+
+typedef struct {
+    UInt8  cmdLen;
+    UInt8  cmdNo;
+    UInt8  transId;
+    UInt8  errorCode;
+    UInt16 time[3];
+    UInt16 padding;
+    UInt16 info1;
+    UInt16 info2;
+} __attribute__ ((packed)) cmdErrorEvent;
+
 
 
 typedef union {
     cmdHead                 head;
     cmdLogMessage           logMessage;
     cmdTxCanMessage         txCanMessage;
+    cmdTxAcknowledge        txAck;
     cmdGetCardInfoReq       getCardInfoReq;
     cmdGetCardInfoResp      getCardInfoResp;
     cmdGetSoftwareInfoReq   getSoftwareReq;
@@ -303,6 +350,9 @@ typedef union {
     cmdSetBusparamsReq      setBusparamsReq;
     cmdStartChipReq         startChipReq;
     cmdChipStateEvent       chipStateEvent;
+    cmdReadClockReq         readClockReq;
+    cmdReadClockResp        readClockResp;
+    cmdErrorEvent           errorEvent;
 } __attribute__ ((packed)) leafCmd;
 
 
@@ -319,7 +369,6 @@ typedef struct {
 
 typedef struct {
     LeafCommandMsgBuf *cmdBufferRef;
-    dispatch_semaphore_t semaTimeout;
 } LeafPrivateData;
 
 
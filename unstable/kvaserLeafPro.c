@@ -45,12 +45,8 @@
 
 
 #include <stdio.h>
-
-#include <CoreFoundation/CoreFoundation.h>
-#include <IOKit/IOKitLib.h>
-#include <IOKit/IOMessage.h>
-#include <IOKit/IOCFPlugIn.h>
-#include <IOKit/usb/IOUSBLib.h>
+#include <stdlib.h>
+#include <string.h>
 
 
 /* can4osx */
@@ -61,43 +57,6 @@
 
 #include "kvaserLeafPro.h"
 
-#define LEAFPRO_COMMAND_SIZE 32u
-
-#define LEAFPRO_CMD_SET_BUSPARAMS_REQ           16u
-#define LEAFPRO_CMD_CHIP_STATE_EVENT            20u
-#define LEAFPRO_CMD_SET_DRIVERMODE_REQ          21u
-#define LEAFPRO_CMD_START_CHIP_REQ              26u
-#define LEAFPRO_CMD_START_CHIP_RESP             27u
-#define LEAFPRO_CMD_TX_CAN_MESSAGE              33u
-#define LEAFPRO_CMD_GET_CARD_INFO_REQ           34u
-#define LEAFPRO_CMD_GET_CARD_INFO_RESP          35u
-#define LEAFPRO_CMD_GET_SOFTWARE_INFO_REQ       38u
-#define LEAFPRO_CMD_GET_SOFTWARE_INFO_RESP      39u
-#define LEAFPRO_CMD_SET_BUSPARAMS_FD_REQ        69u
-#define LEAFPRO_CMD_SET_BUSPARAMS_FD_RESP       70u
-#define LEAFPRO_CMD_SET_BUSPARAMS_RESP          85u
-#define LEAFPRO_CMD_LOG_MESSAGE                 106u
-#define LEAFPRO_CMD_MAP_CHANNEL_REQ             200u
-#define LEAFPRO_CMD_MAP_CHANNEL_RESP            201u
-#define LEAFPRO_CMD_GET_SOFTWARE_DETAILS_REQ    202u
-#define LEAFPRO_CMD_GET_SOFTWARE_DETAILS_RESP   203u
-
-#define LEAFPRO_CMD_TX_MESSAGE_FD               224u
-#define LEAFPRO_CMD_TX_ACKNOWLEDGE_FD           225u
-#define LEAFPRO_CMD_RX_MESSAGE_FD               226u
-
-/* extended FD able command code */
-#define LEAFPRO_CMD_CAN_FD                      255u
-
-/* extended capabilty flag */
-#define LEASPRO_SUPPORT_EXTENDED                0x200u
-
-
-
-
-#define LEAFPRO_HE_ILLEGAL      0x3eu
-#define LEAFPRO_HE_ROUTER       0x00u
-
 #define LEAFPRO_TIMEOUT_ONE_MS 1000000
 #define LEAFPRO_TIMEOUT_TEN_MS 10*LEAFPRO_TIMEOUT_ONE_MS
 
@@ -111,8 +70,20 @@ static void LeafProDecodeCommandExt(Can4osxUsbDeviceHandleEntry *pSelf,
 								 proCommandExt_t *pCmd);
 
 static void LeafProMapChannels(Can4osxUsbDeviceHandleEntry *pSelf);
+static void LeafProMapChannelDone(void *refCon, canStatus status,
+			const void *pResponse, UInt32 size);
 
 static void LeafProGetCardInfo(Can4osxUsbDeviceHandleEntry *pSelf);
+static void LeafProCardInfoDone(void *refCon, canStatus status,
+			const void *pResponse, UInt32 size);
+
+static canStatus LeafProSendRequest(Can4osxUsbDeviceHandleEntry *pSelf,
+			proCommand_t *pCmd, UInt8 respNo,
+			CAN4OSX_TRANSACTION_CALLBACK_T callback, void *refCon);
+static canStatus LeafProPumpTransactions(Can4osxUsbDeviceHandleEntry *pSelf,
+			UInt32 timeoutMs);
+
+static canStatus LeafProReadClock(const CanHandle hnd);
 
 static canStatus LeafProCanSetBusParams (const CanHandle hnd, SInt32 freq,
 			unsigned int tseg1, unsigned int tseg2, unsigned int sjw,
@@ -124,36 +95,47 @@ static canStatus LeafProCanSetBusParamsFd(const CanHandle hnd, SInt32 freq_brs,
 static canStatus LeafProCanRead (const CanHandle hnd, UInt32 *id, void *msg,
 			UInt16 *dlc, UInt32 *flag, UInt32 *time);
 
+static canStatus LeafProCanReadBatch (const CanHandle hnd, CanMsg *pMsg,
+			size_t max, size_t *got);
+
 static canStatus LeafProCanWrite(const CanHandle hnd, UInt32 id, void *msg,
 			UInt16 dlc, UInt32 flag);
 
-static canStatus LeafProCanWriteExt(Can4osxUsbDeviceHandleEntry *pSelf,
-			UInt32 id, void *pMsg, UInt16 dlc, UInt32 flag);
+static canStatus LeafProCanWriteBatch(const CanHandle hnd, const CanMsg *pMsg,
+			size_t n, size_t *accepted);
+
+static canStatus LeafProEncodeTxMessage(Can4osxUsbDeviceHandleEntry *pSelf,
+			proCommand_t *pCmd, UInt32 txId, UInt32 id, const void *msg,
+			UInt16 dlc, UInt32 flag);
 
 static canStatus LeafProCanTranslateBaud (SInt32 *const freq,
 			unsigned int *const tseg1, unsigned int *const tseg2,
 			unsigned int *const sjw, unsigned int *const nosamp,
 			unsigned int *const syncMode);
 
-static IOReturn LeafProCommandWait(Can4osxUsbDeviceHandleEntry *pSelf,
-			proCommand_t *pCmd, UInt8 cmdNo);
-
 static LeafProCommandMsgBuf_t* LeafProCreateCommandBuffer(UInt32 bufferSize);
 static void LeafProReleaseCommandBuffer(LeafProCommandMsgBuf_t* pBufferRef);
 static UInt8 LeafProTestFullCommandBuffer(LeafProCommandMsgBuf_t* bufferRef);
 static UInt8 LeafProTestEmptyCommandBuffer(LeafProCommandMsgBuf_t* pBufferRef);
 static UInt8 LeafProWriteCommandBuffer(LeafProCommandMsgBuf_t* pBufferRef,
 									   proCommand_t newCommand);
+static UInt32 LeafProWriteCommandBufferBatch(LeafProCommandMsgBuf_t* pBufferRef,
+			const proCommand_t *pCommands, UInt32 count);
 
 static UInt16 LeafProFillBulkPipeBuffer(LeafProCommandMsgBuf_t* bufferRef,
-			UInt8 *pPipe, UInt16 maxPipeSize);
-static IOReturn LeafProWriteBulkPipe(Can4osxUsbDeviceHandleEntry *pSelf);
+			UInt8 *pPipe, UInt16 maxPipeSize, UInt32 *pCommands);
+static UInt32 LeafProBulkWriteFill(Can4osxUsbDeviceHandleEntry *pSelf,
+			UInt8 *pBuf, UInt32 size, UInt32 *pFrames);
+static UInt32 LeafProBulkWriteQueued(Can4osxUsbDeviceHandleEntry *pSelf);
 
+static void LeafProDecodeTransfer(Can4osxUsbDeviceHandleEntry *pSelf,
+			UInt8 *pBuf, UInt32 size);
 static void LeafProBulkReadCompletion(void *refCon, IOReturn result,
 			void *arg0);
 
 
 static UInt8 LeafProGetChanFromHe(Can4osxUsbDeviceHandleEntry *pSelf, UInt8 he);
+static Can4osxUsbDeviceHandleEntry* LeafProGetChannelFromHe(Can4osxUsbDeviceHandleEntry *pSelf, UInt8 he);
 static UInt8 LeafProGetHe(proCmdHead_t *pHeader);
 
 static char* leafProGetDeviceName(UInt16 productId);
@@ -174,8 +156,12 @@ CAN4OSX_HW_FUNC_T leafProHardwareFunctions = {
 	.can4osxhwCanBusOnRef = LeafProCanStartChip,
 	.can4osxhwCanBusOffRef = LeafProCanStopChip,
 	.can4osxhwCanWriteRef = LeafProCanWrite,
+	.can4osxhwCanWriteBatchRef = LeafProCanWriteBatch,
 	.can4osxhwCanReadRef = LeafProCanRead,
+	.can4osxhwCanReadBatchRef = LeafProCanReadBatch,
 	.can4osxhwCanCloseRef = NULL,
+	.can4osxhwReadClockRef = LeafProReadClock,
+	.can4osxhwCanSetFilterRef = NULL,
 };
 
 /* local defined variables
@@ -193,7 +179,7 @@ static canStatus LeafProInitHardware(
 		UInt16 productId
 	)
 {
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hnd);
 char* pDevName;
 
 	if (pSelf->deviceChannel == 0u)  {
@@ -216,18 +202,30 @@ char* pDevName;
 			return(canERR_NOMEM);
 		}
 
-		pPriv->semaTimeout = dispatch_semaphore_create(0);
+		/* the channels of a device need not have neighbouring handles */
+		if (pSelf->deviceChannel == 0u)  {
+			pPriv->pFirstChannel = pSelf;
+		}
+		if (pSelf->deviceChannel < LEAFPRO_MAX_CHANNELS)  {
+			((LeafProPrivateData_t *)pPriv->pFirstChannel->privateData)->pChannel[pSelf->deviceChannel] = pSelf;
+		}
 
 	} else {
 		return(canERR_NOMEM);
 	}
 
+	/* every channel sends its own transfers */
+	pSelf->usbFunctions.bulkWriteFill = LeafProBulkWriteFill;
+	pSelf->usbFunctions.bulkWriteQueued = LeafProBulkWriteQueued;
+
 	if (pSelf->deviceChannel == 0u)  {
-		/* Set up channels */
-		LeafProMapChannels(pSelf);
+		/* one clock for all channels, the decoding is done here */
+		CAN4OSX_SetTimestampClock(pSelf->pTimestamp, LEAFPRO_TIMESTAMP_HZ, LEAFPRO_TIMESTAMP_BITS);
 
-		/* Get channel info */
+		/* all setup requests go out at once, the answers come in any order */
+		LeafProMapChannels(pSelf);
 		LeafProGetCardInfo(pSelf);
+		(void)LeafProPumpTransactions(pSelf, LEAFPRO_INIT_TIMEOUT_MS);
 
 		/* Trigger next read */
 		pSelf->usbFunctions.bulkReadCompletion = LeafProBulkReadCompletion;
@@ -274,7 +272,7 @@ static CanHandle LeafProCanOpenChannel(
 		int flags
 	)
 {
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[channel];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(channel);
 LeafProPrivateData_t *pPriv = (LeafProPrivateData_t *)pSelf->privateData;
 
 	// set CAN Mode
@@ -303,7 +301,7 @@ proCommand_t   cmd;
 // FIXME UInt32         tmp, PScl;
 int retVal;
 
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hnd);
 LeafProPrivateData_t *pPriv = (LeafProPrivateData_t *)pSelf->privateData;
 
 	CAN4OSX_DEBUG_PRINT("leaf pro: _set_busparam\n");
@@ -346,6 +344,9 @@ LeafProPrivateData_t *pPriv = (LeafProPrivateData_t *)pSelf->privateData;
 
 	//retVal = LeafProWriteCommandWait( pSelf, cmd,LEAFPRO_CMD_SET_BUSPARAMS_RESP);
 	retVal = CAN4OSX_usbSendCommand(pSelf, &cmd, LEAFPRO_COMMAND_SIZE);
+	if (retVal == canOK)  {
+		CAN4OSX_SetBusStatisticsBitrate(&pSelf->busStats, (UInt32)freq, 0u);
+	}
 
 	/* save locally */
 	pPriv->freq = freq;
@@ -370,7 +371,7 @@ int				retVal;
 unsigned int	syncmode;
 unsigned int	noSamp;
 proCommand_t	cmd;
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hnd);
 LeafProPrivateData_t *pPriv = (LeafProPrivateData_t *)pSelf->privateData;
 
 	CAN4OSX_DEBUG_PRINT("leaf pro: _set_FD_busparam\n");
@@ -404,6 +405,9 @@ LeafProPrivateData_t *pPriv = (LeafProPrivateData_t *)pSelf->privateData;
 	cmd.proCmdSetBusparamsReq.noSampFd = 1;
 
 	retVal = CAN4OSX_usbSendCommand(pSelf, &cmd, LEAFPRO_COMMAND_SIZE);
+	if (retVal == canOK)  {
+		CAN4OSX_SetBusStatisticsBitrate(&pSelf->busStats, (UInt32)pPriv->freq, (UInt32)freq_brs);
+	}
 
 	/* save locally */
 	pPriv->fd_freq = freq_brs;
@@ -423,7 +427,7 @@ static canStatus LeafProCanStartChip(
 {
 int retVal = 0;
 proCommand_t cmd;
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hdl];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hdl);
 LeafProPrivateData_t *pPriv = (LeafProPrivateData_t *)pSelf->privateData;
 
 	memset(&cmd, 0u, sizeof(cmd));
@@ -465,21 +469,24 @@ static canStatus LeafProCanRead (
 		UInt32  *time
 	)
 {
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hnd);
 
 	if ( pSelf->privateData != NULL )  {
 
-		CanMsg canMsg;
+		CAN_EVENT_MSG_BUF_T *pBuffer = CAN4OSX_GetCanEventBuffer(pSelf);
+		CanFrame *pFrame;
 
-		if ( CAN4OSX_ReadCanEventBuffer(pSelf->canEventMsgBuff, &canMsg) )  {
+		if ( CAN4OSX_AcquireCanEventBuffer(pBuffer, &pFrame, 1u) != 0u )  {
 
-			*id = canMsg.canId;
-			*dlc = canMsg.canDlc;
-			*time =canMsg.canTimestamp;
+			*id = pFrame->canId;
+			*dlc = pFrame->canDlc;
+			*time = (UInt32)(pFrame->canTimestamp / 1000u);
 
-			memcpy(msg, canMsg.canData, *dlc);
+			memcpy(msg, pFrame->canData, *dlc);
 
-			*flag = canMsg.canFlags;
+			*flag = pFrame->canFlags;
+
+			CAN4OSX_ReleaseCanEventBufferEvents(pBuffer, 1u);
 
 			return(canOK);
 		} else {
@@ -493,90 +500,187 @@ Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
 
 
 /******************************************************************************/
-static canStatus LeafProCanWrite(
-		const CanHandle hnd,
-		UInt32 id,
-		void *msg,
-		UInt16 dlc,
-		UInt32 flag
+static canStatus LeafProCanReadBatch (
+		const   CanHandle hnd,
+		CanMsg  *pMsg,
+		size_t  max,
+		size_t  *got
 	)
 {
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hnd);
 
-	if ( pSelf->privateData == NULL )  {
+	if ( pSelf->privateData != NULL )  {
+		if (max > UINT32_MAX)  {
+			max = UINT32_MAX;
+		}
+
+		*got = CAN4OSX_ReadCanEventBufferBatch(CAN4OSX_GetCanEventBuffer(pSelf), pMsg, (UInt32)max);
+		if ( *got != 0 )  {
+			return(canOK);
+		} else {
+			return(canERR_NOMSG);
+		}
+	} else {
 		return(canERR_INTERNAL);
 	}
+}
 
-	LeafProPrivateData_t *pPriv = (LeafProPrivateData_t*)pSelf->privateData;
 
-	if (pPriv->extendedMode == 0u)  {
-		proCommand_t cmd;
+/******************************************************************************/
+static canStatus LeafProEncodeTxMessage(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+		proCommand_t *pCmd,
+		UInt32 txId,
+		UInt32 id,
+		const void *msg,
+		UInt16 dlc,
+		UInt32 flag
+	)
+{
+LeafProPrivateData_t *pPriv = (LeafProPrivateData_t*)pSelf->privateData;
 
+	if (pPriv->extendedMode == 0u)  {
 		if (flag & canMSG_EXT)  {
-			cmd.proCmdTxMessage.canId = LEAFPRO_EXT_MSG;
+			pCmd->proCmdTxMessage.canId = LEAFPRO_EXT_MSG;
 		} else {
-			cmd.proCmdTxMessage.canId = 0u;
+			pCmd->proCmdTxMessage.canId = 0u;
 		}
-		cmd.proCmdTxMessage.canId += id;
-		cmd.proCmdTxMessage.dlc = dlc & 0x0F;
-		memcpy(cmd.proCmdTxMessage.data, msg, 8);
+		pCmd->proCmdTxMessage.canId += id;
+		pCmd->proCmdTxMessage.dlc = dlc & 0x0F;
+		memcpy(pCmd->proCmdTxMessage.data, msg, 8);
 
-		cmd.proCmdTxMessage.flags = 0;
+		pCmd->proCmdTxMessage.flags = 0;
 
 		if ( flag & canMSG_RTR )  {
-			cmd.proCmdTxMessage.flags |= LEAFPRO_MSG_FLAG_REMOTE_FRAME;
+			pCmd->proCmdTxMessage.flags |= LEAFPRO_MSG_FLAG_REMOTE_FRAME;
 		}
 
-		cmd.proCmdHead.cmdNo = LEAFPRO_CMD_TX_CAN_MESSAGE;
-		cmd.proCmdHead.address = pPriv->chan2he[pSelf->deviceChannel];
-		cmd.proCmdHead.transitionId = 10;
+		pCmd->proCmdHead.cmdNo = LEAFPRO_CMD_TX_CAN_MESSAGE;
+		pCmd->proCmdHead.address = pPriv->chan2he[pSelf->deviceChannel];
+		// comes back with the TX ack
+		pCmd->proCmdHead.transitionId = (UInt16)(txId & LEAFPRO_TRANSACTION_ID_MASK);
+	} else {
+		/* in extended mode we alway use this kind of command */
 
-		LeafProWriteCommandBuffer(pPriv->cmdBufferRef, cmd);
+		memset(pCmd, 0u, sizeof(proCommand_t));
 
-		LeafProWriteBulkPipe(pSelf);
-	} else {
-		(void)LeafProCanWriteExt(pSelf, id, msg, dlc, flag);
+		pCmd->proCmdHead.cmdNo = LEAFPRO_CMD_CAN_FD;
+		pCmd->proCmdHead.address = pPriv->chan2he[pSelf->deviceChannel];
+		pCmd->proCmdHead.transitionId = (UInt16)(txId & LEAFPRO_TRANSACTION_ID_MASK);
+
+		pCmd->proCommandExt.proCmdFdHead.len = sizeof(proCommand_t) - 64 + dlc;
+		pCmd->proCommandExt.proCmdFdHead.cmd = LEAFPRO_CMD_TX_MESSAGE_FD;
+
+		pCmd->proCommandExt.proCmdFdTxMessage.databytes = dlc;
+		pCmd->proCommandExt.proCmdFdTxMessage.dlc = CAN4OSX_encodeFdDlc(dlc);
+		if (pCmd->proCommandExt.proCmdFdTxMessage.dlc == 0xff)  {
+			return(canERR_PARAM);
+		}
+		pCmd->proCommandExt.proCmdFdTxMessage.control = ((UInt32)dlc << 8) | 0x80000000;
+
+		pCmd->proCommandExt.proCmdFdTxMessage.canId = id | ((flag & canMSG_EXT) ? LEAFPRO_EXT_MSG : 0u);
+		if (flag & canMSG_RTR)  {
+			pCmd->proCommandExt.proCmdFdTxMessage.flags |= LEAFPRO_MSG_FLAG_REMOTE_FRAME;
+		}
+		if (flag & canFDMSG_FDF)  {
+			pCmd->proCommandExt.proCmdFdTxMessage.flags |= LEAFPRO_MSGFLAG_FDF;
+			if (flag & canFDMSG_BRS)  {
+				pCmd->proCommandExt.proCmdFdTxMessage.flags |= LEAFPRO_MSGFLAG_BRS;
+			}
+		}
+		if (msg != NULL)  {
+			memcpy(pCmd->proCommandExt.proCmdFdTxMessage.data, msg, dlc);
+		}
 	}
 
 	return(canOK);
 }
 
 
-static canStatus LeafProCanWriteExt(
-		Can4osxUsbDeviceHandleEntry *pSelf,
+/******************************************************************************/
+static canStatus LeafProCanWrite(
+		const CanHandle hnd,
 		UInt32 id,
-		void *pMsg,
+		void *msg,
 		UInt16 dlc,
 		UInt32 flag
 	)
 {
-LeafProPrivateData_t *pPriv = (LeafProPrivateData_t*)pSelf->privateData;
-proCommand_t extCmd;
-
-	/* in extended mode we alway use this kind of command */
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hnd);
+proCommand_t cmd;
+canStatus status;
 
-	memset(&extCmd, 0u, sizeof(proCommand_t));
+	if ( pSelf->privateData == NULL )  {
+		return(canERR_INTERNAL);
+	}
 
-	extCmd.proCmdHead.cmdNo = LEAFPRO_CMD_CAN_FD;
-	extCmd.proCmdHead.address = pPriv->chan2he[pSelf->deviceChannel];
+	LeafProPrivateData_t *pPriv = (LeafProPrivateData_t*)pSelf->privateData;
 
-	extCmd.proCommandExt.proCmdFdHead.len = sizeof(proCommand_t) - 64 + dlc;
-	extCmd.proCommandExt.proCmdFdHead.cmd = LEAFPRO_CMD_TX_MESSAGE_FD;
+	status = LeafProEncodeTxMessage(pSelf, &cmd, CAN4OSX_TX_FRAME_ID(&pSelf->txTrack, 0u), id, msg, dlc, flag);
+	if (status != canOK)  {
+		return(status);
+	}
 
-	extCmd.proCommandExt.proCmdFdTxMessage.databytes = dlc;
-	extCmd.proCommandExt.proCmdFdTxMessage.dlc = CAN4OSX_encodeFdDlc(dlc);
-	if (extCmd.proCommandExt.proCmdFdTxMessage.dlc == 0xff)  {
-		return(canERR_PARAM);
+	if (LeafProWriteCommandBuffer(pPriv->cmdBufferRef, cmd) == 0u)  {
+		return(canERR_TXBUFOFL);
 	}
-	extCmd.proCommandExt.proCmdFdTxMessage.control = ((UInt32)dlc << 8) | 0x80000000;
 
-	LeafProWriteCommandBuffer(pPriv->cmdBufferRef, extCmd);
+	CAN4OSX_usbWriteToBulkOutPipe(pSelf);
 
-	LeafProWriteBulkPipe(pSelf);
 	return(canOK);
 }
 
 
+/******************************************************************************/
+static canStatus LeafProCanWriteBatch(
+		const CanHandle hnd,
+		const CanMsg *pMsg,
+		size_t n,
+		size_t *accepted
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hnd);
+proCommand_t cmd[CAN4OSX_TX_BATCH_CHUNK];
+canStatus status = canOK;
+UInt32 chunk;
+UInt32 written;
+UInt32 i;
+
+	if ( pSelf->privateData == NULL )  {
+		return(canERR_INTERNAL);
+	}
+
+	LeafProPrivateData_t *pPriv = (LeafProPrivateData_t*)pSelf->privateData;
+
+	/* queue everything first, the bulk pipe is started only once */
+	while ( (*accepted < n) && (status == canOK) )  {
+		chunk = ((n - *accepted) > CAN4OSX_TX_BATCH_CHUNK) ? CAN4OSX_TX_BATCH_CHUNK : (UInt32)(n - *accepted);
+
+		for (i = 0u; i < chunk; i++)  {
+			const CanMsg *pFrame = &pMsg[*accepted + i];
+			status = LeafProEncodeTxMessage(pSelf, &cmd[i], CAN4OSX_TX_FRAME_ID(&pSelf->txTrack, *accepted + i),
+					pFrame->canId, pFrame->canData, pFrame->canDlc, pFrame->canFlags);
+			if (status != canOK)  {
+				/* send what was valid up to here */
+				chunk = i;
+				break;
+			}
+		}
+
+		written = LeafProWriteCommandBufferBatch(pPriv->cmdBufferRef, cmd, chunk);
+		*accepted += written;
+
+		if ( written < chunk )  {
+			status = canERR_TXBUFOFL;
+		}
+	}
+
+	CAN4OSX_usbWriteToBulkOutPipe(pSelf);
+
+	return(status);
+}
+
+
 /******************************************************************************/
 // Translate from baud macro to bus params
 /******************************************************************************/
@@ -742,70 +846,113 @@ static void LeafProDecodeCommand(
 		proCommand_t *pCmd
 	)
 {
-LeafProPrivateData_t *pPriv = (LeafProPrivateData_t *)pSelf->privateData;
-CanMsg canMsg;
+Can4osxUsbDeviceHandleEntry *pChannel;
+CAN_EVENT_MSG_BUF_T *pBuffer;
+CanFrame *pFrame;
+UInt32 busFlags;
 
 	CAN4OSX_DEBUG_PRINT("Pro-Decode cmd %d\n",(UInt8)pCmd->proCmdHead.cmdNo);
 
-	memset(&canMsg, 0u, sizeof(canMsg));
-
 	switch (pCmd->proCmdHead.cmdNo) {
 		case LEAFPRO_CMD_CAN_FD:
 			CAN4OSX_DEBUG_PRINT("LEAFPRO_CMD_CAN_FD\n");
 			LeafProDecodeCommandExt(pSelf, (proCommandExt_t *)pCmd);
 			break;
 		case LEAFPRO_CMD_LOG_MESSAGE:
+			/* all channels report through the first one */
+			pChannel = LeafProGetChannelFromHe(pSelf, LeafProGetHe(&pCmd->proCmdHead));
+			if (pChannel == NULL)  {
+				break;
+			}
+
+			/* classical CAN dlc */
+			if ( pCmd->proCmdLogMessage.dlc > 8u )  {
+				pCmd->proCmdLogMessage.dlc = 8u;
+			}
+
+			busFlags = ((pCmd->proCmdLogMessage.canId & LEAFPRO_EXT_MSG) ? canMSG_EXT : canMSG_STD)
+					| ((pCmd->proCmdLogMessage.flags & LEAFPRO_MSG_FLAG_REMOTE_FRAME) ? canMSG_RTR : 0u)
+					| ((pCmd->proCmdLogMessage.flags & LEAFPRO_MSG_FLAG_ERROR_FRAME) ? canMSG_ERROR_FRAME : 0u)
+					| ((pCmd->proCmdLogMessage.flags & LEAFPRO_MSG_FLAG_TXACK) ? canMSG_TXACK : 0u);
+
+			// a transmit request is not on the bus yet, its TXACK follows
+			if ( !(pCmd->proCmdLogMessage.flags & LEAFPRO_MSG_FLAG_TXRQ) )  {
+				CAN4OSX_CountBusFrame(&pChannel->busStats, busFlags, pCmd->proCmdLogMessage.dlc);
+			}
+			if ( pCmd->proCmdLogMessage.flags & LEAFPRO_MSG_FLAG_OVERRUN )  {
+				CAN4OSX_CountBusStat(&pChannel->busStats.overruns, 1u);
+			}
+
+			if ( !CAN4OSX_FilterAccept(&pChannel->rxFilter, pCmd->proCmdLogMessage.canId & ~LEAFPRO_EXT_MSG,
+					busFlags & (canMSG_EXT | canMSG_STD | canMSG_ERROR_FRAME)) )  {
+				// dropped by the acceptance filter
+				break;
+			}
+
+			pBuffer = CAN4OSX_GetCanEventBuffer(pChannel);
+			pFrame = CAN4OSX_ReserveCanEventBuffer(pBuffer, pCmd->proCmdLogMessage.dlc);
+			if (pFrame == NULL)  {
+				// receive buffer full, the message is dropped
+				break;
+			}
+
 			if ( pCmd->proCmdLogMessage.canId & LEAFPRO_EXT_MSG )  {
-				canMsg.canId = pCmd->proCmdLogMessage.canId & ~LEAFPRO_EXT_MSG;
-				canMsg.canFlags = canMSG_EXT;
+				pFrame->canId = pCmd->proCmdLogMessage.canId & ~LEAFPRO_EXT_MSG;
+				pFrame->canFlags = canMSG_EXT;
 			} else {
-				canMsg.canId = pCmd->proCmdLogMessage.canId;
-				canMsg.canFlags = canMSG_STD;
+				pFrame->canId = pCmd->proCmdLogMessage.canId;
+				pFrame->canFlags = canMSG_STD;
 			}
 
 			if (pCmd->proCmdLogMessage.flags & LEAFPRO_MSG_FLAG_OVERRUN)  {
 				//canMsg.canFlags |= canMSGERR_HW_OVERRUN | canMSGERR_SW_OVERRUN;
 			}
 			if (pCmd->proCmdLogMessage.flags & LEAFPRO_MSG_FLAG_REMOTE_FRAME)  {
-				canMsg.canFlags |= canMSG_RTR;
+				pFrame->canFlags |= canMSG_RTR;
 			}
 			if (pCmd->proCmdLogMessage.flags & LEAFPRO_MSG_FLAG_ERROR_FRAME)  {
-				canMsg.canFlags |= canMSG_ERROR_FRAME;
+				pFrame->canFlags |= canMSG_ERROR_FRAME;
 			}
 			if (pCmd->proCmdLogMessage.flags & LEAFPRO_MSG_FLAG_TXACK)  {
-				canMsg.canFlags |= canMSG_TXACK;
+				pFrame->canFlags |= canMSG_TXACK;
 			}
 			if (pCmd->proCmdLogMessage.flags & LEAFPRO_MSG_FLAG_TXRQ)  {
-				canMsg.canFlags |= canMSG_TXRQ;
-			}
-			/* classical CAN dlc */
-			if ( pCmd->proCmdLogMessage.dlc > 8u )  {
-				pCmd->proCmdLogMessage.dlc = 8u;
+				pFrame->canFlags |= canMSG_TXRQ;
 			}
 
-			canMsg.canDlc = pCmd->proCmdLogMessage.dlc;
-
-			memcpy(canMsg.canData, pCmd->proCmdLogMessage.data,
+			memcpy(pFrame->canData, pCmd->proCmdLogMessage.data,
 				   pCmd->proCmdLogMessage.dlc);
 
-			// FIXME canMsg.canTimestamp = LeafCalculateTimeStamp(pCmd->proCmdLogMessage.time, 24) * 10;
-
+			pFrame->canTimestamp = CAN4OSX_RxTimestamp(pSelf->pTimestamp,
+				pCmd->proCmdLogMessage.time[0] | ((UInt64)pCmd->proCmdLogMessage.time[1] << 16) | ((UInt64)pCmd->proCmdLogMessage.time[2] << 32),
+				pChannel->rxHostTime);
 
-			CAN4OSX_WriteCanEventBuffer(pSelf->canEventMsgBuff,canMsg);
-			if (pSelf->canNotification.notifacionCenter)  {
-				CFNotificationCenterPostNotification (pSelf->canNotification.notifacionCenter,
-													  pSelf->canNotification.notificationString, NULL, NULL, true);
-			}
+			CAN4OSX_CommitCanEventBuffer(pBuffer);
+			CAN4OSX_NotifyRx(pChannel);
 
 
 			CAN4OSX_DEBUG_PRINT("PRO_CMD_LOG_MESSAGE Channel: Id: %X Flags: %X\n",
 								pCmd->proCmdLogMessage.canId,
 								pCmd->proCmdLogMessage.flags);
 			break;
-		case LEAFPRO_CMD_GET_SOFTWARE_DETAILS_RESP:
-			printf("Software details: %x",pCmd->proCcmdGetSoftwareDetailsResp.swOptions);
+		case LEAFPRO_CMD_TX_ACKNOWLEDGE:
+			// the classic ack carries no time
+			pChannel = LeafProGetChannelFromHe(pSelf, LeafProGetHe(&pCmd->proCmdHead));
+			if (pChannel != NULL)  {
+				CAN4OSX_CountBusStat(&pChannel->busStats.txAck, 1u);
+				CAN4OSX_AckTxFrame(pChannel, pCmd->proCmdHead.transitionId, LEAFPRO_TRANSACTION_ID_MASK,
+						CAN4OSX_TX_TIME_UNKNOWN);
+			}
+			break;
+		case LEAFPRO_CMD_READ_CLOCK_RESP:
+			CAN4OSX_TimestampClockResponse(pSelf->pTimestamp,
+				pCmd->proCmdReadClockResp.time[0] | ((UInt64)pCmd->proCmdReadClockResp.time[1] << 16) | ((UInt64)pCmd->proCmdReadClockResp.time[2] << 32));
 			break;
 		default:
+			/* the answer to one of our requests */
+			(void)CAN4OSX_CompleteTransaction(pSelf->pTransactions,
+				LEAFPRO_TRANSACTION_KEY(pCmd->proCmdHead.cmdNo, pCmd->proCmdHead.transitionId),
+				pCmd, LEAFPRO_COMMAND_SIZE);
 			break;
 	}
 #if CAN4OSX_DEBUG
@@ -821,27 +968,42 @@ static void LeafProDecodeCommandExt(
 	)
 {
 LeafProPrivateData_t *pPriv = (LeafProPrivateData_t *)pSelf->privateData;
-CanMsg canMsg;
-UInt8 channel;
+Can4osxUsbDeviceHandleEntry *pChannel;
+CAN_EVENT_MSG_BUF_T *pBuffer;
+CanFrame *pFrame;
 UInt8 he;
+UInt8 len;
+UInt32 flags;
 
 	switch (pCmd->proCmdFdHead.cmd)  {
 		case LEAFPRO_CMD_TX_ACKNOWLEDGE_FD:
+			// carries no frame, the bus load misses our own FD frames
+			he = LeafProGetHe(&pCmd->proCmdFdHead.header);
+			pChannel = LeafProGetChannelFromHe(pSelf, he);
+			if (pChannel != NULL)  {
+				CAN4OSX_CountBusStat(&pChannel->busStats.txAck, 1u);
+				CAN4OSX_AckTxFrame(pChannel, pCmd->proCmdFdHead.header.transitionId, LEAFPRO_TRANSACTION_ID_MASK,
+						CAN4OSX_RxTimestamp(pSelf->pTimestamp, pCmd->proCmdFdTxAck.timestamp, pChannel->rxHostTime));
+			}
 			break;
 		case LEAFPRO_CMD_RX_MESSAGE_FD:
+			he = LeafProGetHe(&pCmd->proCmdFdHead.header);
+			pChannel = LeafProGetChannelFromHe(pSelf, he);
+			if (pChannel == NULL)  {
+				break;
+			}
+
+			if (pCmd->proCmdFdRxMessage.flags & LEAFPRO_MSG_FLAG_OVERRUN)  {
+				CAN4OSX_CountBusStat(&pChannel->busStats.overruns, 1u);
+			}
 			if (pCmd->proCmdFdRxMessage.flags & LEAFPRO_MSG_FLAG_ERROR_FRAME)  {
 				CAN4OSX_DEBUG_PRINT("LEAFPRO_MESSAGE ERROR_FRAME\n");
+				CAN4OSX_CountBusFrame(&pChannel->busStats, canMSG_ERROR_FRAME, 0u);
 				break;
 			}
 
-			memset(&canMsg, 0u, sizeof(canMsg));
-
-			canMsg.canTimestamp = pCmd->proCmdFdRxMessage.timestamp;
-
-			canMsg.canId = pCmd->proCmdFdRxMessage.canId & ~LEAFPRO_EXT_MSG;
-			canMsg.canDlc = (pCmd->proCmdFdRxMessage.control>>8u) & 0x0fu;
-
-			canMsg.canFlags = 0u;
+			len = (pCmd->proCmdFdRxMessage.control>>8u) & 0x0fu;
+			flags = 0u;
 
 			if (pCmd->proCmdFdRxMessage.flags & LEAFPRO_MSGFLAG_FDF)  {
 				/* insanity check */
@@ -849,41 +1011,55 @@ UInt8 he;
 					return;
 				}
 
-				canMsg.canFlags |= canFDMSG_FDF;
+				flags |= canFDMSG_FDF;
 
 				/* test for other FD flags */
 				if (pCmd->proCmdFdRxMessage.flags & LEAFPRO_MSGFLAG_BRS)  {
-					canMsg.canFlags |= canFDMSG_BRS;
+					flags |= canFDMSG_BRS;
 				}
 				/* decode dlc to length */
-				canMsg.canDlc = CAN4OSX_decodeFdDlc(canMsg.canDlc);
+				len = CAN4OSX_decodeFdDlc(len);
 
 			} else {
 				CAN4OSX_DEBUG_PRINT("LEAFPRO_MESSAGE CLASSIC\n");
-				if (canMsg.canDlc > 8u)  {
-					canMsg.canDlc = 8u;
+				if (len > 8u)  {
+					len = 8u;
 				}
 			}
 
 			if (pCmd->proCmdFdRxMessage.flags & LEAFPRO_MSG_FLAG_EXTENDED)  {
-				canMsg.canFlags |= canMSG_EXT;
+				flags |= canMSG_EXT;
 			} else {
 				CAN4OSX_DEBUG_PRINT("LEAFPRO_MESSAGE STD\n");
-				canMsg.canFlags |= canMSG_STD;
+				flags |= canMSG_STD;
 			}
 
-			memcpy(canMsg.canData, pCmd->proCmdFdRxMessage.data, canMsg.canDlc);
-
-			he = LeafProGetHe(&pCmd->proCmdFdHead.header);
-			channel = LeafProGetChanFromHe(pSelf, he);
+			CAN4OSX_CountBusFrame(&pChannel->busStats, flags
+					| ((pCmd->proCmdFdRxMessage.flags & LEAFPRO_MSG_FLAG_REMOTE_FRAME) ? canMSG_RTR : 0u)
+					| ((pCmd->proCmdFdRxMessage.flags & LEAFPRO_MSG_FLAG_TXACK) ? canMSG_TXACK : 0u), len);
 
-			CAN4OSX_WriteCanEventBuffer(pSelf[channel].canEventMsgBuff,canMsg);
+			if (!CAN4OSX_FilterAccept(&pChannel->rxFilter, pCmd->proCmdFdRxMessage.canId & ~LEAFPRO_EXT_MSG, flags))  {
+				// dropped by the acceptance filter
+				break;
+			}
 
-			if (pSelf->canNotification.notifacionCenter)  {
-				CFNotificationCenterPostNotification (pSelf->canNotification.notifacionCenter,
-					pSelf->canNotification.notificationString, NULL, NULL, true);
+			pBuffer = CAN4OSX_GetCanEventBuffer(pChannel);
+			pFrame = CAN4OSX_ReserveCanEventBuffer(pBuffer, len);
+			if (pFrame == NULL)  {
+				// receive buffer full, the message is dropped
+				break;
 			}
 
+			pFrame->canTimestamp = CAN4OSX_RxTimestamp(pSelf->pTimestamp,
+				pCmd->proCmdFdRxMessage.timestamp, pChannel->rxHostTime);
+			pFrame->canId = pCmd->proCmdFdRxMessage.canId & ~LEAFPRO_EXT_MSG;
+			pFrame->canFlags = flags;
+
+			memcpy(pFrame->canData, pCmd->proCmdFdRxMessage.data, len);
+
+			CAN4OSX_CommitCanEventBuffer(pBuffer);
+			CAN4OSX_NotifyRx(pChannel);
+
 			break;
 		default:
 			break;
@@ -897,97 +1073,152 @@ UInt8 he;
 /**************************** Mapping Stuff ***********************************/
 /******************************************************************************/
 /******************************************************************************/
+/**
+ * \brief LeafProMapChannels - ask for the hydra entities of the channels
+ *
+ * Only sends the requests, the answers fill chan2he.
+ */
 static void LeafProMapChannels(
 		Can4osxUsbDeviceHandleEntry *pSelf /**< pointer to my reference */
 	)
 {
 LeafProPrivateData_t *pPriv = (LeafProPrivateData_t *)pSelf->privateData;
 proCommand_t cmd;
-proCommand_t resp;
 UInt8 i = 0u;
-IOReturn retVal;
 
-	memset(&cmd, 0u, 32u);
+	memset(&cmd, 0u, sizeof(cmd));
 
 	cmd.proCmdHead.cmdNo = LEAFPRO_CMD_MAP_CHANNEL_REQ;
 	cmd.proCmdHead.address = LEAFPRO_HE_ROUTER;
-	cmd.proCmdMapChannelReq.channel = 0u;
 
 	strcpy(cmd.proCmdMapChannelReq.name, "CAN");
-	cmd.proCmdHead.transitionId = 0x40;
-	for (i = 0u ; i < 5u; i++)  {
-		cmd.proCmdHead.transitionId = 0x40 + i;
+	for (i = 0u ; i < LEAFPRO_MAX_CHANNELS; i++)  {
 		cmd.proCmdMapChannelReq.channel = i;
-		//LeafProWriteCommandWait(pSelf, cmd, LEAFPRO_CMD_MAP_CHANNEL_RESP);
-		CAN4OSX_usbSendCommand(pSelf, &cmd, LEAFPRO_COMMAND_SIZE);
-		retVal =LeafProCommandWait(pSelf, &resp, LEAFPRO_CMD_MAP_CHANNEL_RESP);
-		if (retVal == kIOReturnSuccess)  {
-			pPriv->chan2he[resp.proCmdHead.transitionId & 0xF] = resp.proCmdMapChannelResp.heAddress;
-		}
+		(void)LeafProSendRequest(pSelf, &cmd, LEAFPRO_CMD_MAP_CHANNEL_RESP, LeafProMapChannelDone, &pPriv->chan2he[i]);
 	}
 
 	/* do we really need that? */
 	strcpy(cmd.proCmdMapChannelReq.name, "SYSDBG");
 	cmd.proCmdMapChannelReq.channel = 0;
-	cmd.proCmdHead.transitionId = 0x61;
-	//LeafProWriteCommandWait(pSelf, cmd, LEAFPRO_CMD_MAP_CHANNEL_RESP);
-	CAN4OSX_usbSendCommand(pSelf, &cmd, LEAFPRO_COMMAND_SIZE);
-	LeafProCommandWait(pSelf, &resp, LEAFPRO_CMD_MAP_CHANNEL_RESP);
+	(void)LeafProSendRequest(pSelf, &cmd, LEAFPRO_CMD_MAP_CHANNEL_RESP, LeafProMapChannelDone, NULL);
 
 	return;
 }
 
 
+/******************************************************************************/
+/**
+ * \brief LeafProMapChannelDone - answer to a map request
+ *
+ * refCon is the entry of chan2he or NULL.
+ */
+static void LeafProMapChannelDone(
+		void *refCon,
+		canStatus status,
+		const void *pResponse,
+		UInt32 size
+	)
+{
+const proCommand_t *pResp = (const proCommand_t *)pResponse;
+
+	(void)size;
+
+	if ((status == canOK) && (refCon != NULL))  {
+		*(UInt8 *)refCon = pResp->proCmdMapChannelResp.heAddress;
+	}
+}
+
+
 #pragma mark card info request
 /******************************************************************************/
+/**
+ * \brief LeafProGetCardInfo - ask for the channel count and the firmware
+ *
+ * Only sends the requests, see LeafProCardInfoDone.
+ */
 static void LeafProGetCardInfo(
 		Can4osxUsbDeviceHandleEntry *pSelf /**< pointer to my reference */
 	)
 {
-LeafProPrivateData_t *pPriv = (LeafProPrivateData_t *)pSelf->privateData;
 proCommand_t cmd;
-proCommand_t resp;
-IOReturn retVal;
 
 	memset(&cmd, 0u, sizeof(cmd));
 	cmd.proCmdHead.address = LEAFPRO_HE_ILLEGAL;
-	cmd.proCmdHead.transitionId = 5;
 
 	cmd.proCmdHead.cmdNo = LEAFPRO_CMD_GET_CARD_INFO_REQ;
-	//LeafProWriteCommandWait(pSelf, cmd, LEAFPRO_CMD_GET_CARD_INFO_RESP);
-	CAN4OSX_usbSendCommand(pSelf, &cmd, LEAFPRO_COMMAND_SIZE);
-	retVal = LeafProCommandWait(pSelf, &resp, LEAFPRO_CMD_GET_CARD_INFO_RESP);
-	if (retVal == kIOReturnSuccess)  {
-		pSelf->deviceChannelCount = resp.proCmdCardInfoResp.nchannels;
-	}
-
-	cmd.proCmdHead.transitionId ++;
+	(void)LeafProSendRequest(pSelf, &cmd, LEAFPRO_CMD_GET_CARD_INFO_RESP, LeafProCardInfoDone, pSelf);
 
 	cmd.proCmdHead.cmdNo = LEAFPRO_CMD_GET_SOFTWARE_INFO_REQ;
 	cmd.proCmdGetSoftwareDetailsReq.useExt = 1u;
-	//LeafProWriteCommandWait(pSelf, cmd, LEAFPRO_CMD_GET_SOFTWARE_INFO_RESP);
-	CAN4OSX_usbSendCommand(pSelf, &cmd, LEAFPRO_COMMAND_SIZE);
-	retVal = LeafProCommandWait(pSelf, &resp, LEAFPRO_CMD_GET_SOFTWARE_INFO_RESP);
-	if (retVal == kIOReturnSuccess)  {
-		//pSelf->deviceChannelCount = resp.proCmdCardInfoResp.nchannels;
-	}
+	(void)LeafProSendRequest(pSelf, &cmd, LEAFPRO_CMD_GET_SOFTWARE_INFO_RESP, LeafProCardInfoDone, pSelf);
 
-	cmd.proCmdHead.transitionId ++;
+	cmd.proCmdHead.cmdNo = LEAFPRO_CMD_GET_SOFTWARE_DETAILS_REQ;
+	(void)LeafProSendRequest(pSelf, &cmd, LEAFPRO_CMD_GET_SOFTWARE_DETAILS_RESP, LeafProCardInfoDone, pSelf);
 
+	return;
+}
 
-	cmd.proCmdHead.cmdNo = LEAFPRO_CMD_GET_SOFTWARE_DETAILS_REQ;
-	//LeafProWriteCommandWait(pSelf, cmd, LEAFPRO_CMD_GET_SOFTWARE_INFO_RESP);
-	CAN4OSX_usbSendCommand(pSelf, &cmd, LEAFPRO_COMMAND_SIZE);
-	retVal = LeafProCommandWait(pSelf, &resp, LEAFPRO_CMD_GET_SOFTWARE_DETAILS_RESP);
-	if (retVal == kIOReturnSuccess)  {
-		//pSelf->deviceChannelCount = resp.proCmdCardInfoResp.nchannels;
-		if ((resp.proCmdSwDetailResp.flags & (1<<9)) == (1<<9))  {
-			pPriv->extendedMode = 1;
-		}
 
+/******************************************************************************/
+/**
+ * \brief LeafProCardInfoDone - answer to one of the card info requests
+ */
+static void LeafProCardInfoDone(
+		void *refCon,
+		canStatus status,
+		const void *pResponse,
+		UInt32 size
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = (Can4osxUsbDeviceHandleEntry *)refCon;
+LeafProPrivateData_t *pPriv = (LeafProPrivateData_t *)pSelf->privateData;
+const proCommand_t *pResp = (const proCommand_t *)pResponse;
+
+	(void)size;
+
+	if (status != canOK)  {
+		return;
 	}
 
-	return;
+	switch (pResp->proCmdHead.cmdNo)  {
+		case LEAFPRO_CMD_GET_CARD_INFO_RESP:
+			pSelf->deviceChannelCount = pResp->proCmdCardInfoResp.nchannels;
+			if (pSelf->deviceChannelCount > LEAFPRO_MAX_CHANNELS)  {
+				pSelf->deviceChannelCount = LEAFPRO_MAX_CHANNELS;
+			}
+			break;
+		case LEAFPRO_CMD_GET_SOFTWARE_DETAILS_RESP:
+			if ((pResp->proCmdSwDetailResp.flags & LEASPRO_SUPPORT_EXTENDED) == LEASPRO_SUPPORT_EXTENDED)  {
+				pPriv->extendedMode = 1;
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * \brief LeafProReadClock - request the device clock
+ *
+ * The clock belongs to the whole device, the answer is decoded by
+ * LeafProDecodeCommand like every other command.
+ *
+ * \return canStatus
+ */
+static canStatus LeafProReadClock(
+		const CanHandle hnd
+	)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hnd);
+proCommand_t cmd;
+
+	memset(&cmd, 0u, sizeof(cmd));
+	cmd.proCmdHead.cmdNo = LEAFPRO_CMD_READ_CLOCK_REQ;
+	cmd.proCmdHead.address = LEAFPRO_HE_ILLEGAL;
+
+	return(CAN4OSX_usbSendCommand(pSelf, &cmd, LEAFPRO_COMMAND_SIZE));
 }
 
 
@@ -1014,12 +1245,34 @@ static UInt8 LeafProGetChanFromHe(
 {
 LeafProPrivateData_t *pPriv = (LeafProPrivateData_t *)pSelf->privateData;
 
-	for(UInt8 i = 0u; i < pSelf->deviceChannelCount; i++)  {
+	for(UInt8 i = 0u; (i < pSelf->deviceChannelCount) && (i < LEAFPRO_MAX_CHANNELS); i++)  {
 		if (pPriv->chan2he[i] == he)  {
 			return(i);
 		}
 	}
-	return(0u);
+	return(LEAFPRO_NO_CHANNEL);
+}
+
+
+/******************************************************************************/
+/**
+ * \internal
+ * \brief LeafProGetChannelFromHe - the channel a message of he belongs to
+ *
+ * \return the handle entry or NULL for an entity no channel is mapped to
+ */
+static Can4osxUsbDeviceHandleEntry* LeafProGetChannelFromHe(
+		Can4osxUsbDeviceHandleEntry *pSelf, /**< pointer to my reference */
+		UInt8 he
+	)
+{
+LeafProPrivateData_t *pPriv = (LeafProPrivateData_t *)pSelf->privateData;
+UInt8 chan = LeafProGetChanFromHe(pSelf, he);
+
+	if (chan >= LEAFPRO_MAX_CHANNELS)  {
+		return(NULL);
+	}
+	return(pPriv->pChannel[chan]);
 }
 
 
@@ -1094,6 +1347,32 @@ __block UInt8 retval = 1u;
 }
 
 
+/******************************************************************************/
+/**
+ * \brief LeafProWriteCommandBufferBatch - queue several commands at once
+ *
+ * \return number of commands that fitted into the buffer
+ */
+static UInt32 LeafProWriteCommandBufferBatch(
+		LeafProCommandMsgBuf_t* pBufferRef,
+		const proCommand_t *pCommands,
+		UInt32 count
+	)
+{
+__block UInt32 written = 0u;
+
+	dispatch_sync(pBufferRef->bufferGDCqueueRef, ^{
+		while ((written < count) && !LeafProTestFullCommandBuffer(pBufferRef))  {
+			pBufferRef->commandRef[(pBufferRef->bufferFirst +
+									pBufferRef->bufferCount++)
+								   % pBufferRef->bufferSize] = pCommands[written++];
+		}
+	});
+
+	return(written);
+}
+
+
 /******************************************************************************/
 static UInt8 LeafReadCommandBuffer(
 		LeafProCommandMsgBuf_t* pBufferRef,
@@ -1151,65 +1430,43 @@ static UInt8 LeafProTestEmptyCommandBuffer(
 /******************************************************************************/
 
 /******************************************************************************/
-static void LeafProBulkWriteCompletion(
-		void *refCon,
-		IOReturn result,
-		void *arg0
+/**
+ * \brief LeafProBulkWriteFill - next bulk out transfer from the command buffer
+ *
+ * Only the filled commands are sent. The buffer is a single packet, so a
+ * short transfer ends the list and a full one needs no zero length packet.
+ *
+ * \return number of bytes to send
+ */
+static UInt32 LeafProBulkWriteFill(
+		Can4osxUsbDeviceHandleEntry *pSelf, /**< pointer to my reference */
+		UInt8 *pBuf,
+		UInt32 size,
+		UInt32 *pFrames
 	)
 {
-Can4osxUsbDeviceHandleEntry *self = (Can4osxUsbDeviceHandleEntry *)refCon;
-CAN4OSX_USB_INTERFACE **interface = self->can4osxInterfaceInterface;
-UInt32 numBytesWritten = (UInt32)arg0;
-
-	(void)numBytesWritten;
+LeafProPrivateData_t *pPriv = (LeafProPrivateData_t *)pSelf->privateData;
 
-	if (result != kIOReturnSuccess)  {
-		CAN4OSX_DEBUG_PRINT("error from asynchronous bulk write (%08x)\n", result);
-		(void)(*interface)->USBInterfaceClose(interface);
-		(void)(*interface)->Release(interface);
-		return;
+	if (pPriv == NULL)  {
+		return(0u);
 	}
 
-	self->endpoitBulkOutBusy = FALSE;
-
-	LeafProWriteBulkPipe(self);
+	return(LeafProFillBulkPipeBuffer(pPriv->cmdBufferRef, pBuf, (UInt16)size, pFrames));
 }
 
 
 /******************************************************************************/
-static IOReturn LeafProWriteBulkPipe(
+static UInt32 LeafProBulkWriteQueued(
 		Can4osxUsbDeviceHandleEntry *pSelf /**< pointer to my reference */
 	)
 {
-IOReturn retval = kIOReturnSuccess;
-CAN4OSX_USB_INTERFACE **interface = pSelf->can4osxInterfaceInterface;
 LeafProPrivateData_t *pPriv = (LeafProPrivateData_t *)pSelf->privateData;
 
-	if ( pSelf->endpoitBulkOutBusy == FALSE )  {
-		pSelf->endpoitBulkOutBusy = TRUE;
-
-		if (0 < LeafProFillBulkPipeBuffer(pPriv->cmdBufferRef,
-									   pSelf->endpointBufferBulkOutRef,
-									   pSelf->endpointMaxSizeBulkOut )) {
-
-			retval = (*interface)->WritePipeAsync(interface,
-												  pSelf->endpointNumberBulkOut,
-												  pSelf->endpointBufferBulkOutRef,
-												  pSelf->endpointMaxSizeBulkOut,
-												  LeafProBulkWriteCompletion,
-												  (void*)pSelf);
-
-			if (retval != kIOReturnSuccess)  {
-				CAN4OSX_DEBUG_PRINT("Unable to perform asynchronous bulk write (%08x)\n", retval);
-				(void) (*interface)->USBInterfaceClose(interface);
-				(void) (*interface)->Release(interface);
-			}
-		} else {
-			pSelf->endpoitBulkOutBusy = FALSE;
-		}
+	if (pPriv == NULL)  {
+		return(0u);
 	}
 
-	return(retval);
+	return((UInt32)pPriv->cmdBufferRef->bufferCount);
 }
 
 
@@ -1217,7 +1474,8 @@ LeafProPrivateData_t *pPriv = (LeafProPrivateData_t *)pSelf->privateData;
 static UInt16 LeafProFillBulkPipeBuffer(
 		LeafProCommandMsgBuf_t* bufferRef,
 		UInt8 *pPipe,
-		UInt16 maxPipeSize
+		UInt16 maxPipeSize,
+		UInt32 *pCommands
 	)
 {
 UInt16 fillState = 0u;
@@ -1234,6 +1492,7 @@ UInt16 fillState = 0u;
 				fillState += cmd.proCommandExt.proCmdFdHead.len;
 				pPipe += cmd.proCommandExt.proCmdFdHead.len;
 			}
+			(*pCommands)++;
 			//Will another command for in the pipe?
 			if ( (fillState + sizeof(proCommand_t)) >= maxPipeSize )  {
 				*pPipe = 0u;
@@ -1250,27 +1509,113 @@ UInt16 fillState = 0u;
 }
 
 /******************************************************************************/
-static IOReturn LeafProCommandWait(
+/**
+ * \brief LeafProSendRequest - send a command that is answered with respNo
+ *
+ * The command gets the next transaction id, the answer goes to callback.
+ *
+ * \return canStatus
+ */
+static canStatus LeafProSendRequest(
 		Can4osxUsbDeviceHandleEntry *pSelf,  /**< pointer to my reference */
 		proCommand_t *pCmd,
-		UInt8 cmdNo
+		UInt8 respNo,
+		CAN4OSX_TRANSACTION_CALLBACK_T callback,
+		void *refCon
 	)
 {
-IOReturn retVal = kIOReturnSuccess;
-CAN4OSX_USB_INTERFACE **interface = pSelf->can4osxInterfaceInterface;
+	if (pSelf->pTransactions == NULL)  {
+		return(canERR_NOMEM);
+	}
 
-UInt32 size = LEAFPRO_COMMAND_SIZE;
-UInt64 timeout;
+	pCmd->proCmdHead.transitionId = (UInt16)CAN4OSX_NextTransactionId(pSelf->pTransactions, LEAFPRO_TRANSACTION_ID_MASK);
+	if (CAN4OSX_BeginTransaction(pSelf->pTransactions, LEAFPRO_TRANSACTION_KEY(respNo, pCmd->proCmdHead.transitionId), callback, refCon) == NULL)  {
+		return(canERR_NOMEM);
+	}
+
+	// a failed send is cancelled with the others that are not answered
+	return(CAN4OSX_usbSendCommand(pSelf, pCmd, LEAFPRO_COMMAND_SIZE));
+}
+
+
+/******************************************************************************/
+/**
+ * \brief LeafProPumpTransactions - read the answers of the setup requests
+ *
+ * The device is set up by hwInitRef on a worker of queueCan4osxSetup before
+ * the asynchronous reads are started, so the bulk in pipe is read here until
+ * every request is answered and the decoder runs on that worker. It is the
+ * only producer of the channel meanwhile, no read of the driver thread is
+ * queued before CAN4OSX_usbReadFromBulkInPipe, the channel is activated only
+ * after hwInitRef and the other channels of the adapter do not exist yet.
+ * The requests left after timeoutMs are cancelled.
+ *
+ * \return canOK or canERR_TIMEOUT
+ */
+static canStatus LeafProPumpTransactions(
+		Can4osxUsbDeviceHandleEntry *pSelf,  /**< pointer to my reference */
+		UInt32 timeoutMs
+	)
+{
+UInt64 timeout = CAN$OSX_getMilliseconds() + timeoutMs;
+UInt64 now;
+UInt8 *pBuf;
+UInt32 size;
+canStatus status = canOK;
+
+	pBuf = malloc(pSelf->endpointMaxSizeBulkIn);
+	if (pBuf == NULL)  {
+		CAN4OSX_CancelTransactions(pSelf->pTransactions, canERR_NOMEM);
+		return(canERR_NOMEM);
+	}
 
-	timeout = CAN$OSX_getMilliseconds() + (100);
-	do {
-		 (*interface)->ReadPipe(interface, pSelf->endpointNumberBulkIn, pCmd, &size);
-		if(pCmd->proCmdHead.cmdNo == cmdNo)  {
-			return(retVal);
+	while (CAN4OSX_GetPendingTransactions(pSelf->pTransactions) != 0u)  {
+		now = CAN$OSX_getMilliseconds();
+		if (now >= timeout)  {
+			status = canERR_TIMEOUT;
+			break;
+		}
+		size = (UInt32)pSelf->endpointMaxSizeBulkIn;
+		if (CAN4OSX_usbReadPipe(pSelf, pSelf->endpointNumberBulkIn, pBuf, &size, (UInt32)(timeout - now)) == kIOReturnSuccess)  {
+			LeafProDecodeTransfer(pSelf, pBuf, size);
 		}
-	} while(CAN$OSX_getMilliseconds() < timeout);
+	}
+
+	free(pBuf);
+	CAN4OSX_CancelTransactions(pSelf->pTransactions, canERR_TIMEOUT);
 
-	return(kIOReturnError);
+	return(status);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief LeafProDecodeTransfer - decode the commands of one bulk in transfer
+ */
+static void LeafProDecodeTransfer(
+		Can4osxUsbDeviceHandleEntry *pSelf,  /**< pointer to my reference */
+		UInt8 *pBuf,
+		UInt32 size
+	)
+{
+UInt32 count = 0u;
+proCommand_t *pCmd;
+int loopCounter = pSelf->endpointMaxSizeBulkIn;
+
+	while ( count < size )  {
+		if (loopCounter-- == 0) break;
+
+		pCmd = (proCommand_t *)&pBuf[count];
+
+		if (pCmd->proCmdHead.cmdNo != 0u)  {
+			count += getCommandSize(pCmd);
+			LeafProDecodeCommand(pSelf, pCmd);
+		} else {
+			/* No command */
+			count += pSelf->endpointMaxSizeBulkIn;
+			count &= -pSelf->endpointMaxSizeBulkIn;
+		}
+	}
 }
 
 
@@ -1283,44 +1628,24 @@ static void LeafProBulkReadCompletion(
 {
 Can4osxUsbDeviceHandleEntry *pSelf = (Can4osxUsbDeviceHandleEntry *)refCon;
 LeafProPrivateData_t *pPriv = (LeafProPrivateData_t *)pSelf->privateData;
-CAN4OSX_USB_INTERFACE **interface = pSelf->can4osxInterfaceInterface;
 UInt32 numBytesRead = (UInt32) arg0;
+int channel;
 
 	if (result != kIOReturnSuccess)  {
-		(void)(*interface)->USBInterfaceClose(interface);
-		(void)(*interface)->Release(interface);
+		CAN4OSX_usbClose(pSelf);
 		return;
 	}
 
 	if (numBytesRead > 0u)  {
-	int count = 0;
-	proCommand_t *pCmd;
-	int loopCounter = pSelf->endpointMaxSizeBulkIn;
-
-		while ( count < numBytesRead )  {
-			if (loopCounter-- == 0) break;
-
-			pCmd = (proCommand_t *)&(pSelf->endpointBufferBulkInRef[count]);
+		LeafProDecodeTransfer(pSelf, (UInt8 *)pSelf->endpointBufferBulkInRef, numBytesRead);
 
-			if (pCmd->proCmdHead.cmdNo != 0u)  {
-				count += getCommandSize(pCmd);
-				LeafProDecodeCommand(pSelf, pCmd);
-			} else {
-				/* No command */
-				count += pSelf->endpointMaxSizeBulkIn;;
-				count &= -pSelf->endpointMaxSizeBulkIn;
-			}
-
-			/* See if we had to wait */
-			if (pCmd->proCmdHead.cmdNo == pPriv->timeOutReason)  {
-				pPriv->timeOutReason = 0;
-				dispatch_semaphore_signal(pPriv->semaTimeout);
+		/* frames of all channels arrive here */
+		for (channel = 0; channel < LEAFPRO_MAX_CHANNELS; channel++)  {
+			if (pPriv->pChannel[channel] != NULL)  {
+				CAN4OSX_NotifyRxFlush(pPriv->pChannel[channel]);
 			}
 		}
 	}
-
-	/* Trigger next read */
-	CAN4OSX_usbReadFromBulkInPipe(pSelf);
 }
 
 
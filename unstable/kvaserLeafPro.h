@@ -48,6 +48,58 @@
 
 extern CAN4OSX_HW_FUNC_T leafProHardwareFunctions;
 
+#define LEAFPRO_COMMAND_SIZE 32u
+
+/* counter of the log message time[3] and the low part of the FD timestamp */
+#define LEAFPRO_TIMESTAMP_HZ    24000000u
+#define LEAFPRO_TIMESTAMP_BITS  48u
+
+#define LEAFPRO_CMD_SET_BUSPARAMS_REQ           16u
+#define LEAFPRO_CMD_CHIP_STATE_EVENT            20u
+#define LEAFPRO_CMD_SET_DRIVERMODE_REQ          21u
+#define LEAFPRO_CMD_START_CHIP_REQ              26u
+#define LEAFPRO_CMD_START_CHIP_RESP             27u
+#define LEAFPRO_CMD_READ_CLOCK_REQ              30u
+#define LEAFPRO_CMD_READ_CLOCK_RESP             31u
+#define LEAFPRO_CMD_TX_CAN_MESSAGE              33u
+#define LEAFPRO_CMD_GET_CARD_INFO_REQ           34u
+#define LEAFPRO_CMD_GET_CARD_INFO_RESP          35u
+#define LEAFPRO_CMD_GET_SOFTWARE_INFO_REQ       38u
+#define LEAFPRO_CMD_GET_SOFTWARE_INFO_RESP      39u
+#define LEAFPRO_CMD_TX_ACKNOWLEDGE              50u
+#define LEAFPRO_CMD_SET_BUSPARAMS_FD_REQ        69u
+#define LEAFPRO_CMD_SET_BUSPARAMS_FD_RESP       70u
+#define LEAFPRO_CMD_SET_BUSPARAMS_RESP          85u
+#define LEAFPRO_CMD_LOG_MESSAGE                 106u
+#define LEAFPRO_CMD_MAP_CHANNEL_REQ             200u
+#define LEAFPRO_CMD_MAP_CHANNEL_RESP            201u
+#define LEAFPRO_CMD_GET_SOFTWARE_DETAILS_REQ    202u
+#define LEAFPRO_CMD_GET_SOFTWARE_DETAILS_RESP   203u
+
+#define LEAFPRO_CMD_TX_MESSAGE_FD               224u
+#define LEAFPRO_CMD_TX_ACKNOWLEDGE_FD           225u
+#define LEAFPRO_CMD_RX_MESSAGE_FD               226u
+
+/* extended FD able command code */
+#define LEAFPRO_CMD_CAN_FD                      255u
+
+/* extended capabilty flag */
+#define LEASPRO_SUPPORT_EXTENDED                0x200u
+
+#define LEAFPRO_HE_ILLEGAL      0x3eu
+#define LEAFPRO_HE_ROUTER       0x00u
+/* channels a map request is sent for, the device has at most as many */
+#define LEAFPRO_MAX_CHANNELS    5u
+/* returned by LeafProGetChanFromHe for an entity that is no channel */
+#define LEAFPRO_NO_CHANNEL      0xffu
+
+/* a response carries the transaction id of its request, the bits above
+ * belong to the hydra entity */
+#define LEAFPRO_TRANSACTION_ID_MASK     0x0fffu
+#define LEAFPRO_TRANSACTION_KEY(cmdNo, transId) (((UInt32)(cmdNo) << 16u) | ((UInt32)(transId) & LEAFPRO_TRANSACTION_ID_MASK))
+/* the setup requests are sent at once, all answers within this time */
+#define LEAFPRO_INIT_TIMEOUT_MS         100u
+
 
 # define LEAFPRO_MSG_FLAG_ERROR_FRAME   0x01
 # define LEAFPRO_MSG_FLAG_OVERRUN       0x02
@@ -86,6 +138,12 @@ typedef struct {
     UInt8       flags;
 } __attribute__ ((packed)) proCmdReadClockReq_t;
 
+typedef struct {
+    proCmdHead_t    header;
+    UInt16          time[3];
+    UInt16          padding2;
+} __attribute__ ((packed)) proCmdReadClockResp_t;
+
 typedef struct {
     proCmdHead_t    header;
     char            name[16];
@@ -198,6 +256,14 @@ typedef struct {
     UInt8           data[64];
 } __attribute__ ((packed)) proCmdFdTxMessage_t;
 
+/* the transaction id of the header is the one of the sent frame */
+typedef struct {
+    proCmdFdHead_t  fdHeader;
+    UInt32          flags;
+    UInt8           reserved[4];
+    UInt64          timestamp;
+} __attribute__ ((packed)) proCmdFdTxAck_t;
+
 typedef struct {
     proCmdHead_t    header;
     UInt8           useExt;
@@ -224,6 +290,7 @@ typedef union  {
     proCmdFdHead_t      proCmdFdHead;
     proCmdFdRxMessage_t proCmdFdRxMessage;
     proCmdFdTxMessage_t proCmdFdTxMessage;
+    proCmdFdTxAck_t     proCmdFdTxAck;
 } __attribute__ ((packed)) proCommandExt_t;
 
 
@@ -232,6 +299,7 @@ typedef union {
     proCmdHead_t					proCmdHead;
     proCmdRaw_t						proCmdRaw;
     proCmdReadClockReq_t			proCmdReadClockReq;
+    proCmdReadClockResp_t			proCmdReadClockResp;
     proCmdMapChannelReq_t			proCmdMapChannelReq;
     proCmdMapChannelResp_t			proCmdMapChannelResp;
     proCmdSetBusparamsReq_t			proCmdSetBusparamsReq;
@@ -257,9 +325,7 @@ typedef struct {
 
 typedef struct {
     LeafProCommandMsgBuf_t *cmdBufferRef;
-    dispatch_semaphore_t semaTimeout;
     UInt8   extendedMode;
-    UInt8   timeOutReason;
     //UInt8   address;
     UInt8   canFd;
     UInt32  freq;
@@ -272,7 +338,10 @@ typedef struct {
     UInt8   fd_tseg2;
     UInt8   fd_sjw;
     UInt8   fd_nosamp;
-    UInt8	chan2he[5];
+    UInt8	chan2he[LEAFPRO_MAX_CHANNELS];
+    /* the decoder of the first channel hands the frames to the others */
+    Can4osxUsbDeviceHandleEntry *pFirstChannel;
+    Can4osxUsbDeviceHandleEntry *pChannel[LEAFPRO_MAX_CHANNELS];
 } LeafProPrivateData_t;
 
 #endif /* can4osx_kvaserLeafPro_h */
@@ -46,12 +46,8 @@
 /* header of standard C - libraries
 ------------------------------------------------------------------------------*/
 #include <stdio.h>
-
-#include <CoreFoundation/CoreFoundation.h>
-#include <IOKit/IOKitLib.h>
-#include <IOKit/IOMessage.h>
-#include <IOKit/IOCFPlugIn.h>
-#include <IOKit/usb/IOUSBLib.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <pthread.h>
 
@@ -62,31 +58,111 @@
 #include "can4osx_debug.h"
 #include "can4osx_internal.h"
 #include "can4osx_usb_core.h"
+/* peak functions */
+#include "peakUsbFd.h"
 
 
 /* constant definitions
 ------------------------------------------------------------------------------*/
 
+#define PEAKCOMMANDBUF_SIZE (1000 * 10)
+
 /* local defined data types
 ------------------------------------------------------------------------------*/
+/* holds the actual buffer */
+typedef struct {
+    int bufferSize;
+    int bufferFirst;
+    int bufferCount;
+    dispatch_queue_t bufferGDCqueueRef;
+    PEAKUSBFDTXMSG_T msgData[PEAKCOMMANDBUF_SIZE];
+} PEAKUSBFDTRANSMITBUFFER_T;
+
+typedef struct {
+	PEAKUSBFDTRANSMITBUFFER_T pTransBuff;
+	Can4osxUsbDeviceHandleEntry *pParent;
+    UInt8   cmdPipeOut;
+    UInt8   canFd;
+    UInt32  brp;
+    UInt16  tseg1;
+    UInt16  tseg2;
+    UInt16  sjw;
+    UInt32  fd_brp;
+    UInt16  fd_tseg1;
+    UInt16  fd_tseg2;
+    UInt16  fd_sjw;
+} PEAKUSBFDPRIVATEDATA_T;
+
 
 /* list of local defined functions
 ------------------------------------------------------------------------------*/
 static canStatus usbFdInitHardware(const CanHandle hnd, UInt16 productId);
+static CanHandle usbFdCanOpenChannel(int channel, int flags);
+static canStatus usbFdCanClose(const CanHandle hnd);
+static canStatus usbFdCanStartChip(CanHandle hdl);
+static canStatus usbFdCanStopChip(CanHandle hdl);
+
+static canStatus usbFdCanSetBusParams (const CanHandle hnd, SInt32 freq,
+        unsigned int tseg1, unsigned int tseg2, unsigned int sjw,
+        unsigned int noSamp, unsigned int syncmode);
+
+static canStatus usbFdCanSetBusParamsFd(const CanHandle hnd, SInt32 freq_brs,
+        UInt32 tseg1, UInt32 tseg2, UInt32 sjw);
+
+static canStatus usbFdCanRead (const CanHandle hnd, UInt32 *id, void *msg,
+        UInt16 *dlc, UInt32 *flag, UInt32 *time);
+
+static canStatus usbFdCanReadBatch (const CanHandle hnd, CanMsg *pMsg,
+        size_t max, size_t *got);
+
+static canStatus usbFdCanWrite (const CanHandle hnd, UInt32 id, void *msg,
+    	UInt16 dlc, UInt32 flag);
+
+static canStatus usbFdCanWriteBatch (const CanHandle hnd, const CanMsg *pMsg,
+        size_t n, size_t *accepted);
+
+static canStatus usbFdEncodeTxMessage (Can4osxUsbDeviceHandleEntry *pSelf,
+        PEAKUSBFDTXMSG_T *pCanMsg, UInt32 txId, UInt32 id, const void *msg,
+        UInt16 dlc, UInt32 flag);
+
+static canStatus usbFdCanTranslateBaud (SInt32 *const freq, unsigned int *const tseg1,
+        unsigned int *const tseg2, unsigned int *const sjw);
+
+static canStatus usbFdCalcPrescaler (SInt32 *const freq, unsigned int tseg1,
+        unsigned int tseg2);
+
+static canStatus usbFdSetDriverLoaded(Can4osxUsbDeviceHandleEntry *pSelf, UInt8 loaded);
+static canStatus usbFdSetFilterStd(Can4osxUsbDeviceHandleEntry *pSelf);
+static canStatus usbFdSendCmd(Can4osxUsbDeviceHandleEntry *pSelf, UInt8 *pCmds, UInt32 len);
+
+static void usbFdBulkReadCompletion(void *refCon, IOReturn result, void *arg0);
+static UInt32 usbFdBulkWriteFill(Can4osxUsbDeviceHandleEntry *pSelf, UInt8 *pBuf, UInt32 size, UInt32 *pFrames);
+static UInt32 usbFdBulkWriteQueued(Can4osxUsbDeviceHandleEntry *pSelf);
+static UInt32 usbFdFillBulkPipeBuffer(PEAKUSBFDTRANSMITBUFFER_T *pBufferRef, UInt8 *pipe, UInt32 maxPipeSize, UInt32 *pMsgs);
+
+static UInt8 usbFdWriteTransmitBuffer(PEAKUSBFDTRANSMITBUFFER_T* pBuffer, const PEAKUSBFDTXMSG_T *pNewMsg);
+static UInt32 usbFdWriteTransmitBufferBatch(PEAKUSBFDTRANSMITBUFFER_T* pBuffer, const PEAKUSBFDTXMSG_T *pMsgs, UInt32 count);
+static UInt8 usbFdReadCommandBuffer(PEAKUSBFDTRANSMITBUFFER_T* pBuffer, PEAKUSBFDTXMSG_T* pCanMsg);
+
 static char* usbFdGetDeviceName(UInt16 productId);
 
 /* global variables
 ------------------------------------------------------------------------------*/
 CAN4OSX_HW_FUNC_T peakUsbFdHardwareFunctions = {
     .can4osxhwInitRef = usbFdInitHardware,
-    .can4osxhwCanOpenChannel = NULL,
-    .can4osxhwCanSetBusParamsRef = NULL,
-    .can4osxhwCanSetBusParamsFdRef = NULL,
-    .can4osxhwCanBusOnRef = NULL,
-    .can4osxhwCanBusOffRef = NULL,
-    .can4osxhwCanWriteRef = NULL,
-    .can4osxhwCanReadRef = NULL,
-    .can4osxhwCanCloseRef = NULL,
+    .can4osxhwCanOpenChannel = usbFdCanOpenChannel,
+    .can4osxhwCanSetBusParamsRef = usbFdCanSetBusParams,
+    .can4osxhwCanSetBusParamsFdRef = usbFdCanSetBusParamsFd,
+    .can4osxhwCanBusOnRef = usbFdCanStartChip,
+    .can4osxhwCanBusOffRef = usbFdCanStopChip,
+    .can4osxhwCanWriteRef = usbFdCanWrite,
+    .can4osxhwCanWriteBatchRef = usbFdCanWriteBatch,
+    .can4osxhwCanReadRef = usbFdCanRead,
+    .can4osxhwCanReadBatchRef = usbFdCanReadBatch,
+    .can4osxhwCanCloseRef = usbFdCanClose,
+    .can4osxhwReadClockRef = NULL,
+    /* the filter goes to the adapter with the bus on, see usbFdSetFilterStd */
+    .can4osxhwCanSetFilterRef = NULL,
 };
 
 
@@ -98,33 +174,72 @@ static CAN4OSX_DEVICE_NAME_T prId2Name[] = {
 };
 
 
+/*-**************************************************************************-*/
+/**
+*
+* \brief usbFdInitHardware - initialze internal data structures
+*
+* The adapter has a pair of command pipes and a pair of message pipes behind
+* them. Commands are written synchronously to the command pipe, the message
+* pipes run the asynchronous bulk transfers of the core.
+*
+* \return canStatus
+*
+*/
 static canStatus usbFdInitHardware(
 		const CanHandle hnd,
 		UInt16 productId
     )
 {
-Can4osxUsbDeviceHandleEntry *pSelf = &can4osxUsbDeviceHandle[hnd];
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hnd);
+PEAKUSBFDPRIVATEDATA_T *pPriv;
 char* pDevName;
-#if 0
-	pSelf->privateData = calloc(1,sizeof(IXXUSBFDPRIVATEDATA_T));
+unsigned int tseg1;
+unsigned int tseg2;
+unsigned int sjw;
+SInt32 freq;
+
+	pSelf->privateData = calloc(1,sizeof(PEAKUSBFDPRIVATEDATA_T));
 
     if ( pSelf->privateData != NULL ) {
-    	IXXUSBFDPRIVATEDATA_T *pPriv = (IXXUSBFDPRIVATEDATA_T *)pSelf->privateData;
+    	pPriv = (PEAKUSBFDPRIVATEDATA_T *)pSelf->privateData;
      	pPriv->pParent = pSelf;
 
-      	pPriv->pTransBuff.bufferGDCqueueRef = dispatch_queue_create("com.can4osx.ixxusbfdmsgqueue", 0);
+      	pPriv->pTransBuff.bufferGDCqueueRef = dispatch_queue_create("com.can4osx.peakusbfdmsgqueue", 0);
 		pPriv->pTransBuff.bufferCount = 0u;
         pPriv->pTransBuff.bufferFirst = 0u;
-        pPriv->pTransBuff.bufferSize = IXXCOMMANDBUF_SIZE;
-        pthread_mutex_init(&(pPriv->mutex), NULL);
+        pPriv->pTransBuff.bufferSize = PEAKCOMMANDBUF_SIZE;
 
     } else {
         return(canERR_NOMEM);
     }
-#endif
-	/* create new endpoint buffer */
-	pSelf->endpointBufferBulkInRef = calloc( 1 , pSelf->endpointMaxSizeBulkIn);
-	pSelf->endpointBufferBulkOutRef = calloc( 1 , pSelf->endpointMaxSizeBulkOut);
+
+    /* the commands keep the first pipe */
+    pPriv->cmdPipeOut = pSelf->endpointNumberBulkOut;
+
+    /* until canSetBusParams the adapter runs with 500 kbit/s and 2 Mbit/s */
+    freq = canBITRATE_500K;
+    (void)usbFdCanTranslateBaud(&freq, &tseg1, &tseg2, &sjw);
+    pPriv->brp = (UInt32)freq;
+    pPriv->tseg1 = tseg1;
+    pPriv->tseg2 = tseg2;
+    pPriv->sjw = sjw;
+    freq = canFD_BITRATE_2M_80P;
+    (void)usbFdCanTranslateBaud(&freq, &tseg1, &tseg2, &sjw);
+    pPriv->fd_brp = (UInt32)freq;
+    pPriv->fd_tseg1 = tseg1;
+    pPriv->fd_tseg2 = tseg2;
+    pPriv->fd_sjw = sjw;
+    CAN4OSX_SetBusStatisticsBitrate(&pSelf->busStats,
+            PEAKUSBFD_BITRATE(pPriv->brp, pPriv->tseg1, pPriv->tseg2),
+            PEAKUSBFD_BITRATE(pPriv->fd_brp, pPriv->fd_tseg1, pPriv->fd_tseg2));
+
+    if (pSelf->deviceChannelCount == 0u)  {
+    	/* a single channel */
+    	pSelf->deviceChannelCount = 1u;
+    	usbFdSetDriverLoaded(pSelf, 1u);
+    	CAN4OSX_SetTimestampClock(pSelf->pTimestamp, PEAKUSBFD_TIMESTAMP_HZ, PEAKUSBFD_TIMESTAMP_BITS);
+    }
 
 	pDevName = usbFdGetDeviceName(productId);
 
@@ -134,6 +249,16 @@ char* pDevName;
     pSelf->devInfo.capability = 0u;
     pSelf->devInfo.capability |= canCHANNEL_CAP_CAN_FD;
 
+    /* the message pipes follow the command pipes */
+    pSelf->endpointNumberBulkOut += 2;
+    pSelf->endpointNumberBulkIn += 2;
+    pSelf->usbFunctions.bulkReadCompletion  = usbFdBulkReadCompletion;
+    pSelf->usbFunctions.bulkWriteFill  = usbFdBulkWriteFill;
+    pSelf->usbFunctions.bulkWriteQueued  = usbFdBulkWriteQueued;
+
+    /* Trigger the read */
+    CAN4OSX_usbReadFromBulkInPipe(pSelf);
+
     return(canOK);
 }
 
@@ -144,13 +269,998 @@ static char* usbFdGetDeviceName(
 {
 char* pRetName = NULL;
 
-	for (UInt i = 0; i < sizeof(prId2Name); i++)  {
+	for (UInt i = 0; i < (sizeof(prId2Name) / sizeof(prId2Name[0])); i++)  {
+		pRetName = prId2Name[i].pName;
 		if (productId == prId2Name[i].productId)  {
-			pRetName = prId2Name[i].pName;
 			break;
 		}
-		pRetName = prId2Name[i].pName;;
 	}
 
 	return(pRetName);
 }
+
+
+/******************************************************************************/
+static CanHandle usbFdCanOpenChannel(
+        int channel,
+        int flags
+    )
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(channel);
+PEAKUSBFDPRIVATEDATA_T *pPriv = (PEAKUSBFDPRIVATEDATA_T *)pSelf->privateData;
+
+    if (pPriv == NULL)  {
+        return(canERR_INTERNAL);
+    }
+
+    // set CAN Mode
+    if ((flags & canOPEN_CAN_FD) == canOPEN_CAN_FD) {
+        pPriv->canFd = 1;
+    } else {
+        pPriv->canFd = 0;
+    }
+
+    return((CanHandle)channel);
+}
+
+
+/*-****************************************************************************/
+static canStatus usbFdCanClose(
+		const CanHandle hnd
+    )
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hnd);
+
+    if (pSelf->privateData == NULL)  {
+        return(canERR_NOMEM);
+    }
+
+    return(canOK);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief usbFdCanSetBusParams - nominal bit timing
+ *
+ * Takes the canBITRATE_xxx constants or a bit rate with the segments, the
+ * prescaler has to come out without remainder. Sent with the bus on.
+ *
+ * \return canStatus
+ */
+static canStatus usbFdCanSetBusParams(
+        const CanHandle hnd,
+        SInt32 freq,
+        unsigned int tseg1,
+        unsigned int tseg2,
+        unsigned int sjw,
+        unsigned int noSamp,
+        unsigned int syncmode
+    )
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hnd);
+PEAKUSBFDPRIVATEDATA_T *pPriv = (PEAKUSBFDPRIVATEDATA_T *)pSelf->privateData;
+canStatus status;
+
+    (void)noSamp;
+    (void)syncmode;
+
+    CAN4OSX_DEBUG_PRINT("peak usb fd: _set_busparam\n");
+
+    if (pPriv == NULL)  {
+        return(canERR_INTERNAL);
+    }
+
+    if (freq < 0)  {
+        status = usbFdCanTranslateBaud(&freq, &tseg1, &tseg2, &sjw);
+    } else {
+        status = usbFdCalcPrescaler(&freq, tseg1, tseg2);
+    }
+    if ( (status != canOK) || (freq > 1024) || (tseg1 > 256u) || (tseg2 > 128u)
+            || (sjw == 0u) || (sjw > tseg2) ) {
+        CAN4OSX_DEBUG_PRINT(" can4osx strange bitrate\n");
+        return(canERR_PARAM);
+    }
+
+    /* save locally */
+    pPriv->brp = (UInt32)freq;
+    pPriv->sjw = sjw;
+    pPriv->tseg1 = tseg1;
+    pPriv->tseg2 = tseg2;
+    CAN4OSX_SetBusStatisticsBitrate(&pSelf->busStats, PEAKUSBFD_BITRATE(pPriv->brp, tseg1, tseg2), 0u);
+
+    return(canOK);
+}
+
+
+/******************************************************************************/
+static canStatus usbFdCanSetBusParamsFd(
+		const CanHandle hnd,
+        SInt32 freq_brs,
+        UInt32 tseg1,
+        UInt32 tseg2,
+        UInt32 sjw
+    )
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hnd);
+PEAKUSBFDPRIVATEDATA_T *pPriv = (PEAKUSBFDPRIVATEDATA_T *)pSelf->privateData;
+unsigned int fdTseg1 = tseg1;
+unsigned int fdTseg2 = tseg2;
+unsigned int fdSjw = sjw;
+canStatus status;
+
+    if (pPriv == NULL)  {
+        return(canERR_INTERNAL);
+    }
+
+    if (freq_brs < 0)  {
+        status = usbFdCanTranslateBaud(&freq_brs, &fdTseg1, &fdTseg2, &fdSjw);
+    } else {
+        status = usbFdCalcPrescaler(&freq_brs, fdTseg1, fdTseg2);
+    }
+    if ( (status != canOK) || (freq_brs > 1024) || (fdTseg1 > 32u) || (fdTseg2 > 16u)
+            || (fdSjw == 0u) || (fdSjw > fdTseg2) ) {
+        CAN4OSX_DEBUG_PRINT(" can4osx strange bitrate\n");
+        return(canERR_PARAM);
+    }
+
+    /* save locally */
+    pPriv->fd_brp = (UInt32)freq_brs;
+    pPriv->fd_sjw = fdSjw;
+    pPriv->fd_tseg1 = fdTseg1;
+    pPriv->fd_tseg2 = fdTseg2;
+    CAN4OSX_SetBusStatisticsBitrate(&pSelf->busStats, 0u, PEAKUSBFD_BITRATE(pPriv->fd_brp, fdTseg1, fdTseg2));
+
+	return(canOK);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief usbFdCanStartChip - bus on
+ *
+ * One list with the options, the bit timing and the mode. The acceptance
+ * filter goes ahead of it, it only changes while the bus is off.
+ *
+ * \return canStatus
+ */
+static canStatus usbFdCanStartChip(
+        CanHandle hdl
+    )
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hdl);
+PEAKUSBFDPRIVATEDATA_T *pPriv = (PEAKUSBFDPRIVATEDATA_T *)pSelf->privateData;
+UInt8 data[PEAKUSBFD_CMD_BUFFER_SIZE] = {0};
+PEAKUSBFD_CMD_T *pCmd = (PEAKUSBFD_CMD_T *)data;
+canStatus status;
+
+    if (pPriv == NULL)  {
+        return(canERR_INTERNAL);
+    }
+
+    status = usbFdSetFilterStd(pSelf);
+    if (status != canOK)  {
+        return(status);
+    }
+
+    pCmd->options.opcodeChannel = PEAKUSBFD_CMD_OPCODE(pSelf->deviceChannel, PEAKUSBFD_CMD_SET_EN_OPTION);
+    pCmd->options.options = PEAKUSBFD_OPTION_ERROR;
+    if (pPriv->canFd)  {
+        pCmd->options.options |= PEAKUSBFD_OPTION_CANDFDISO;
+    }
+    pCmd++;
+
+    /* the adapter takes all values minus one */
+    pCmd->timingSlow.opcodeChannel = PEAKUSBFD_CMD_OPCODE(pSelf->deviceChannel, PEAKUSBFD_CMD_TIMING_SLOW);
+    pCmd->timingSlow.ewl = 96u;
+    pCmd->timingSlow.sjw = (UInt8)((pPriv->sjw - 1u) & 0x7f);
+    pCmd->timingSlow.tseg2 = (UInt8)((pPriv->tseg2 - 1u) & 0x7f);
+    pCmd->timingSlow.tseg1 = (UInt8)(pPriv->tseg1 - 1u);
+    pCmd->timingSlow.brp = (UInt16)((pPriv->brp - 1u) & 0x3ff);
+    pCmd++;
+
+    if (pPriv->canFd)  {
+        pCmd->timingFast.opcodeChannel = PEAKUSBFD_CMD_OPCODE(pSelf->deviceChannel, PEAKUSBFD_CMD_TIMING_FAST);
+        pCmd->timingFast.sjw = (UInt8)((pPriv->fd_sjw - 1u) & 0x0f);
+        pCmd->timingFast.tseg2 = (UInt8)((pPriv->fd_tseg2 - 1u) & 0x0f);
+        pCmd->timingFast.tseg1 = (UInt8)((pPriv->fd_tseg1 - 1u) & 0x1f);
+        pCmd->timingFast.brp = (UInt16)((pPriv->fd_brp - 1u) & 0x3ff);
+        pCmd++;
+    }
+
+    pCmd->std.opcodeChannel = PEAKUSBFD_CMD_OPCODE(pSelf->deviceChannel, PEAKUSBFD_CMD_NORMAL_MODE);
+    pCmd++;
+
+	return(usbFdSendCmd(pSelf, data, (UInt32)((UInt8 *)pCmd - data)));
+}
+
+
+/******************************************************************************/
+static canStatus usbFdCanStopChip(
+        CanHandle hdl
+    )
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hdl);
+UInt8 data[PEAKUSBFD_CMD_BUFFER_SIZE] = {0};
+PEAKUSBFD_CMD_T *pCmd = (PEAKUSBFD_CMD_T *)data;
+
+    pCmd->std.opcodeChannel = PEAKUSBFD_CMD_OPCODE(pSelf->deviceChannel, PEAKUSBFD_CMD_RESET_MODE);
+
+	return(usbFdSendCmd(pSelf, data, sizeof(PEAKUSBFD_CMD_T)));
+}
+
+
+/******************************************************************************/
+static canStatus usbFdCanRead (
+        const   CanHandle hnd,
+        UInt32  *id,
+        void    *msg,
+        UInt16  *dlc,
+        UInt32  *flag,
+        UInt32  *time
+    )
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hnd);
+CAN_EVENT_MSG_BUF_T *pBuffer = CAN4OSX_GetCanEventBuffer(pSelf);
+CanFrame *pFrame;
+
+    if ( CAN4OSX_AcquireCanEventBuffer(pBuffer, &pFrame, 1u) != 0u ) {
+        *id = pFrame->canId;
+        *dlc = pFrame->canDlc;
+        *time = (UInt32)(pFrame->canTimestamp / 1000u);
+        *flag = pFrame->canFlags;
+        memcpy(msg, pFrame->canData, *dlc);
+        CAN4OSX_ReleaseCanEventBufferEvents(pBuffer, 1u);
+
+        return(canOK);
+    }
+
+    return(canERR_NOMSG);
+}
+
+
+/******************************************************************************/
+static canStatus usbFdCanReadBatch (
+        const   CanHandle hnd,
+        CanMsg  *pMsg,
+        size_t  max,
+        size_t  *got
+    )
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hnd);
+
+    if (max > UINT32_MAX)  {
+        max = UINT32_MAX;
+    }
+
+    *got = CAN4OSX_ReadCanEventBufferBatch(CAN4OSX_GetCanEventBuffer(pSelf), pMsg, (UInt32)max);
+    if ( *got != 0 ) {
+        return(canOK);
+    } else {
+        return(canERR_NOMSG);
+    }
+}
+
+
+/******************************************************************************/
+static canStatus usbFdEncodeTxMessage (
+        Can4osxUsbDeviceHandleEntry *pSelf,
+        PEAKUSBFDTXMSG_T *pCanMsg,
+        UInt32 txId,
+        UInt32 id,
+        const void *msg,
+        UInt16 dlc,
+        UInt32 flag
+    )
+{
+PEAKUSBFDPRIVATEDATA_T *pPriv = (PEAKUSBFDPRIVATEDATA_T *)pSelf->privateData;
+UInt8 code;
+
+    if ((pPriv->canFd == 0u) || ((flag & canFDMSG_FDF) == 0u))  {
+        if (dlc > 8u)  {
+             dlc = 8u;
+        }
+    }
+
+    code = CAN4OSX_encodeFdDlc((UInt8)dlc);
+    /* no valid dlc found */
+    if ((dlc > 64u) || (code == 0xffu))  {
+        return(canERR_PARAM);
+    }
+
+    memset(pCanMsg, 0, PEAKUSBFD_TX_MSG_HEAD_SIZE);
+
+    pCanMsg->size = (UInt16)PEAKUSBFD_MSG_ALIGN(PEAKUSBFD_TX_MSG_HEAD_SIZE + dlc);
+    pCanMsg->type = PEAKUSBFD_MSG_CAN_TX;
+    pCanMsg->channelDlc = PEAKUSBFD_MSG_CHANNEL_DLC(pSelf->deviceChannel, code);
+    pCanMsg->canId = id;
+    /* received back as TX ack */
+    pCanMsg->client = (UInt8)(txId & PEAKUSBFD_MSG_CLIENT_MASK);
+    pCanMsg->flags = PEAKUSBFD_MSG_FLAG_SELF_RECEIVE;
+
+    if ((flag & canMSG_EXT) == canMSG_EXT)  {
+        pCanMsg->flags |= PEAKUSBFD_MSG_FLAG_EXT_ID;
+    }
+    if ((flag & canMSG_RTR) == canMSG_RTR)  {
+        pCanMsg->flags |= PEAKUSBFD_MSG_FLAG_RTR;
+    }
+    if ((pPriv->canFd != 0u) && ((flag & canFDMSG_FDF) == canFDMSG_FDF))  {
+        pCanMsg->flags |= PEAKUSBFD_MSG_FLAG_EXT_DATA_LEN;
+        if (flag & canFDMSG_BRS)  {
+            pCanMsg->flags |= PEAKUSBFD_MSG_FLAG_BRS;
+        }
+    }
+
+    /* the padding of the record is sent as well */
+    if (dlc & 3u)  {
+        memset(&pCanMsg->data[dlc & ~3u], 0, 4u);
+    }
+    memcpy(pCanMsg->data, msg, dlc);
+
+    return(canOK);
+}
+
+
+/******************************************************************************/
+static canStatus usbFdCanWrite (
+		const CanHandle hnd,
+        UInt32 id,
+        void *msg,
+        UInt16 dlc,
+        UInt32 flag
+    )
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hnd);
+UInt8 retVal = 0u;
+canStatus status;
+
+    if ( pSelf->privateData != NULL )  {
+    PEAKUSBFDPRIVATEDATA_T *pPriv = (PEAKUSBFDPRIVATEDATA_T *)pSelf->privateData;
+	PEAKUSBFDTXMSG_T canMsg;
+
+        status = usbFdEncodeTxMessage(pSelf, &canMsg, CAN4OSX_TX_FRAME_ID(&pSelf->txTrack, 0u), id, msg, dlc, flag);
+        if (status != canOK)  {
+            return(status);
+        }
+
+        retVal = usbFdWriteTransmitBuffer(&pPriv->pTransBuff, &canMsg);
+
+        if (retVal == 0u)  {
+        	return(canERR_TXBUFOFL);
+        }
+
+        CAN4OSX_usbWriteToBulkOutPipe(pSelf);
+
+        return(canOK);
+
+    } else {
+        return(canERR_INTERNAL);
+    }
+}
+
+
+/******************************************************************************/
+static canStatus usbFdCanWriteBatch (
+        const CanHandle hnd,
+        const CanMsg *pMsg,
+        size_t n,
+        size_t *accepted
+    )
+{
+Can4osxUsbDeviceHandleEntry *pSelf = CAN4OSX_GetChannel(hnd);
+PEAKUSBFDTXMSG_T canMsg[CAN4OSX_TX_BATCH_CHUNK];
+canStatus status = canOK;
+UInt32 chunk;
+UInt32 written;
+UInt32 i;
+
+    if ( pSelf->privateData == NULL )  {
+        return(canERR_INTERNAL);
+    }
+
+    PEAKUSBFDPRIVATEDATA_T *pPriv = (PEAKUSBFDPRIVATEDATA_T *)pSelf->privateData;
+
+    /* queue everything first, the bulk pipe is started only once */
+    while ( (*accepted < n) && (status == canOK) )  {
+        chunk = ((n - *accepted) > CAN4OSX_TX_BATCH_CHUNK) ? CAN4OSX_TX_BATCH_CHUNK : (UInt32)(n - *accepted);
+
+        for (i = 0u; i < chunk; i++)  {
+            const CanMsg *pFrame = &pMsg[*accepted + i];
+            status = usbFdEncodeTxMessage(pSelf, &canMsg[i], CAN4OSX_TX_FRAME_ID(&pSelf->txTrack, *accepted + i),
+                    pFrame->canId, pFrame->canData, pFrame->canDlc, pFrame->canFlags);
+            if (status != canOK)  {
+                /* send what was valid up to here */
+                chunk = i;
+                break;
+            }
+        }
+
+        written = usbFdWriteTransmitBufferBatch(&pPriv->pTransBuff, canMsg, chunk);
+        *accepted += written;
+
+        if (written < chunk)  {
+            status = canERR_TXBUFOFL;
+        }
+    }
+
+    CAN4OSX_usbWriteToBulkOutPipe(pSelf);
+
+    return(status);
+}
+
+
+/******************************************************************************/
+// Translate from baud macro to bus params, 80 MHz clock
+/******************************************************************************/
+static canStatus usbFdCanTranslateBaud (
+        SInt32 *const pPrescaler,
+        unsigned int *const tseg1,
+        unsigned int *const tseg2,
+        unsigned int *const sjw
+    )
+{
+    switch (*pPrescaler) {
+
+        case canFD_BITRATE_8M_60P:
+            *pPrescaler = 1L;
+            *tseg1      = 5;
+            *tseg2      = 4;
+            *sjw        = 2;
+            break;
+
+        case canFD_BITRATE_4M_80P:
+            *pPrescaler = 1L;
+            *tseg1      = 15;
+            *tseg2      = 4;
+            *sjw        = 4;
+            break;
+
+        case canFD_BITRATE_2M_80P:
+            *pPrescaler = 2L;
+            *tseg1      = 15;
+            *tseg2      = 4;
+            *sjw        = 4;
+            break;
+
+        case canFD_BITRATE_1M_80P:
+            *pPrescaler = 4L;
+            *tseg1      = 15;
+            *tseg2      = 4;
+            *sjw        = 4;
+            break;
+
+        case canFD_BITRATE_500K_80P:
+            *pPrescaler = 8L;
+            *tseg1      = 15;
+            *tseg2      = 4;
+            *sjw        = 4;
+            break;
+
+        case canBITRATE_1M:
+            *pPrescaler = 2L;
+            *tseg1      = 31;
+            *tseg2      = 8;
+            *sjw        = 8;
+            break;
+
+        case canBITRATE_500K:
+            *pPrescaler = 4L;
+            *tseg1      = 31;
+            *tseg2      = 8;
+            *sjw        = 8;
+            break;
+
+        case canBITRATE_250K:
+            *pPrescaler = 8L;
+            *tseg1      = 31;
+            *tseg2      = 8;
+            *sjw        = 8;
+            break;
+
+        case canBITRATE_125K:
+            *pPrescaler = 16L;
+            *tseg1      = 31;
+            *tseg2      = 8;
+            *sjw        = 8;
+            break;
+
+        case canBITRATE_100K:
+            *pPrescaler = 20L;
+            *tseg1      = 31;
+            *tseg2      = 8;
+            *sjw        = 8;
+            break;
+
+        case canBITRATE_83K:
+            *pPrescaler = 24L;
+            *tseg1      = 31;
+            *tseg2      = 8;
+            *sjw        = 8;
+            break;
+
+        case canBITRATE_62K:
+            *pPrescaler = 32L;
+            *tseg1      = 31;
+            *tseg2      = 8;
+            *sjw        = 8;
+            break;
+
+        case canBITRATE_50K:
+            *pPrescaler = 40L;
+            *tseg1      = 31;
+            *tseg2      = 8;
+            *sjw        = 8;
+            break;
+
+        case canBITRATE_10K:
+            *pPrescaler = 200L;
+            *tseg1      = 31;
+            *tseg2      = 8;
+            *sjw        = 8;
+            break;
+
+        default:
+            return(canERR_PARAM);
+    }
+
+    return(canOK);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief usbFdCalcPrescaler - prescaler of a bit rate in bit/s
+ *
+ * \return canStatus, canERR_PARAM if the clock does not divide down to it
+ */
+static canStatus usbFdCalcPrescaler (
+        SInt32 *const pFreq,
+        unsigned int tseg1,
+        unsigned int tseg2
+    )
+{
+UInt32 bitClock;
+
+    if ((*pFreq <= 0) || (tseg1 == 0u) || (tseg2 == 0u))  {
+        return(canERR_PARAM);
+    }
+
+    bitClock = (UInt32)*pFreq * (1u + tseg1 + tseg2);
+    if ((bitClock > PEAKUSBFD_CLOCK_HZ) || ((PEAKUSBFD_CLOCK_HZ % bitClock) != 0u))  {
+        return(canERR_PARAM);
+    }
+
+    *pFreq = (SInt32)(PEAKUSBFD_CLOCK_HZ / bitClock);
+
+    return(canOK);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief usbFdSetDriverLoaded - tells the adapter a driver is using it
+ *
+ * \return canStatus
+ */
+static canStatus usbFdSetDriverLoaded(
+		Can4osxUsbDeviceHandleEntry *pSelf, /**< pointer to handle structure */
+        UInt8 loaded
+    )
+{
+CAN4OSX_USB_CONTROL_T request;
+UInt8 data[PEAKUSBFD_FCT_DRVLD_LEN] = {0};
+
+    data[1] = (loaded != 0u) ? 1u : 0u;
+
+	request.bmRequestType = CAN4OSX_USB_DIR_OUT | CAN4OSX_USB_TYPE_VENDOR | CAN4OSX_USB_RECIP_OTHER;
+	request.bRequest = PEAKUSBFD_REQ_FCT;
+	request.wValue = PEAKUSBFD_FCT_DRVLD;
+    request.wIndex = 0u;
+	request.wLength = sizeof(data);
+	request.pData = data;
+
+	if (CAN4OSX_usbControlRequest(pSelf, &request) != kIOReturnSuccess)  {
+		CAN4OSX_DEBUG_PRINT("peak usb fd: driver loaded request failed\n");
+		return(canERR_INTERNAL);
+	}
+
+	return(canOK);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief usbFdSetFilterStd - acceptance filter of the 11 bit ids
+ *
+ * The adapter has a bit per 11 bit id and gets the ids the acceptance filter
+ * lets pass, the others do not load the usb. The 29 bit ones are left to the
+ * driver.
+ *
+ * \return canStatus
+ */
+static canStatus usbFdSetFilterStd(
+		Can4osxUsbDeviceHandleEntry *pSelf /**< pointer to handle structure */
+    )
+{
+UInt8 data[PEAKUSBFD_CMD_BUFFER_SIZE] = {0};
+PEAKUSBFDFILTERSTD_T *pCmd = (PEAKUSBFDFILTERSTD_T *)data;
+UInt32 row;
+UInt32 bit;
+
+	for (row = 0u; row < PEAKUSBFD_FILTER_STD_ROWS; row++)  {
+		pCmd[row].opcodeChannel = PEAKUSBFD_CMD_OPCODE(pSelf->deviceChannel, PEAKUSBFD_CMD_FILTER_STD);
+		pCmd[row].idx = (UInt16)row;
+		pCmd[row].mask = 0xFFFFFFFFu;
+		if (pSelf->rxFilter.active)  {
+			pCmd[row].mask = 0u;
+			for (bit = 0u; bit < 32u; bit++)  {
+				if (CAN4OSX_FilterMatch(&pSelf->rxFilter, (row << 5) | bit, canMSG_STD))  {
+					pCmd[row].mask |= (1u << bit);
+				}
+			}
+		}
+	}
+
+	return(usbFdSendCmd(pSelf, data, PEAKUSBFD_FILTER_STD_ROWS * sizeof(PEAKUSBFDFILTERSTD_T)));
+}
+
+
+/******************************************************************************/
+/**
+ * \brief usbFdSendCmd - a list of commands to the command pipe
+ *
+ * pCmds is a buffer of PEAKUSBFD_CMD_BUFFER_SIZE, the end of the list is
+ * added if there is room.
+ *
+ * \return canStatus
+ */
+static canStatus usbFdSendCmd(
+		Can4osxUsbDeviceHandleEntry *pSelf, /**< pointer to handle structure */
+        UInt8 *pCmds,
+        UInt32 len
+    )
+{
+PEAKUSBFDPRIVATEDATA_T *pPriv = (PEAKUSBFDPRIVATEDATA_T *)pSelf->privateData;
+IOReturn retVal;
+
+	if (pPriv == NULL)  {
+		return(canERR_INTERNAL);
+	}
+
+	if ((len + PEAKUSBFD_CMD_SIZE) <= PEAKUSBFD_CMD_BUFFER_SIZE)  {
+		memset(&pCmds[len], 0xff, PEAKUSBFD_CMD_SIZE);
+		len += PEAKUSBFD_CMD_SIZE;
+	}
+
+	CAN4OSX_usbLockCommand(pSelf);
+	retVal = CAN4OSX_usbWritePipe(pSelf, pPriv->cmdPipeOut, pCmds, len, PEAKUSBFD_CMD_TIMEOUT_MS);
+	CAN4OSX_usbUnlockCommand(pSelf);
+	if (retVal != kIOReturnSuccess)  {
+		CAN4OSX_DEBUG_PRINT("peak usb fd: command failed (%08x)\n", retVal);
+		return(canERR_INTERNAL);
+	}
+
+	return(canOK);
+}
+
+
+/******************************************************************************/
+static void usbFdDecodeMsg(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+        const PEAKUSBFDMSGHEAD_T *pHead
+    )
+{
+CAN_EVENT_MSG_BUF_T *pBuffer;
+CanFrame *pFrame;
+UInt64 raw = pHead->tsLow | ((UInt64)pHead->tsHigh << 32);
+UInt8 len;
+
+	switch (pHead->type)  {
+    case PEAKUSBFD_MSG_CAN_RX:
+        {
+        const PEAKUSBFDRXMSG_T *pMsg = (const PEAKUSBFDRXMSG_T *)pHead;
+
+            if (PEAKUSBFD_MSG_CHANNEL(pMsg->channelDlc) != pSelf->deviceChannel)  {
+                break;
+            }
+
+            /* decode dlc to length */
+            len = CAN4OSX_decodeFdDlc(PEAKUSBFD_MSG_DLC(pMsg->channelDlc));
+            if (!(pMsg->flags & PEAKUSBFD_MSG_FLAG_EXT_DATA_LEN) && (len > 8u))  {
+                len = 8u;
+            }
+            if (!(pMsg->flags & PEAKUSBFD_MSG_FLAG_RTR) && ((PEAKUSBFD_RX_MSG_HEAD_SIZE + len) > pMsg->head.size))  {
+                // shorter than its dlc
+                break;
+            }
+
+            CAN4OSX_CountBusFrame(&pSelf->busStats,
+                    ((pMsg->flags & PEAKUSBFD_MSG_FLAG_EXT_ID) ? canMSG_EXT : canMSG_STD)
+                    | ((pMsg->flags & PEAKUSBFD_MSG_FLAG_RTR) ? canMSG_RTR : 0u)
+                    | ((pMsg->flags & PEAKUSBFD_MSG_FLAG_EXT_DATA_LEN) ? canFDMSG_FDF : 0u)
+                    | ((pMsg->flags & PEAKUSBFD_MSG_FLAG_BRS) ? canFDMSG_BRS : 0u)
+                    | ((pMsg->flags & PEAKUSBFD_MSG_FLAG_SELF_RECEIVE) ? canMSG_TXACK : 0u), len);
+            if (pMsg->flags & PEAKUSBFD_MSG_FLAG_SELF_RECEIVE)  {
+                /* our own frame, canIOCTL_SET_TXACK decides if it is received */
+                CAN4OSX_AckTxFrame(pSelf, pMsg->client, PEAKUSBFD_MSG_CLIENT_MASK,
+                        CAN4OSX_RxTimestamp(pSelf->pTimestamp, raw, pSelf->rxHostTime));
+                break;
+            }
+
+            if (!CAN4OSX_FilterAccept(&pSelf->rxFilter, pMsg->canId,
+                    (pMsg->flags & PEAKUSBFD_MSG_FLAG_EXT_ID) ? canMSG_EXT : canMSG_STD))  {
+                // dropped by the acceptance filter
+                break;
+            }
+
+            pBuffer = CAN4OSX_GetCanEventBuffer(pSelf);
+            pFrame = CAN4OSX_ReserveCanEventBuffer(pBuffer, len);
+            if (pFrame == NULL)  {
+                // receive buffer full, the message is dropped
+                break;
+            }
+
+            pFrame->canId = pMsg->canId;
+
+            if (pMsg->flags & PEAKUSBFD_MSG_FLAG_EXT_DATA_LEN)  {
+                pFrame->canFlags |= canFDMSG_FDF;
+            }
+            if (pMsg->flags & PEAKUSBFD_MSG_FLAG_BRS)  {
+                pFrame->canFlags |= canFDMSG_BRS;
+            }
+            if (pMsg->flags & PEAKUSBFD_MSG_FLAG_ESI)  {
+                pFrame->canFlags |= canFDMSG_ESI;
+            }
+            if (pMsg->flags & PEAKUSBFD_MSG_FLAG_EXT_ID)  {
+                pFrame->canFlags |= canMSG_EXT;
+            } else {
+                pFrame->canFlags |= canMSG_STD;
+            }
+            if (pMsg->flags & PEAKUSBFD_MSG_FLAG_RTR)  {
+                pFrame->canFlags |= canMSG_RTR;
+            } else {
+                memcpy(pFrame->canData, pMsg->data, len);
+            }
+
+            pFrame->canTimestamp = CAN4OSX_RxTimestamp(pSelf->pTimestamp, raw, pSelf->rxHostTime);
+
+            CAN4OSX_CommitCanEventBuffer(pBuffer);
+            CAN4OSX_NotifyRx(pSelf);
+        }
+        break;
+    case PEAKUSBFD_MSG_ERROR:
+        {
+        const PEAKUSBFDERRORMSG_T *pMsg = (const PEAKUSBFDERRORMSG_T *)pHead;
+
+            if (PEAKUSBFD_MSG_CHANNEL(pMsg->channelTypeD) == pSelf->deviceChannel)  {
+                // sent for each bus error, as close to an error frame as we get
+                CAN4OSX_CountBusFrame(&pSelf->busStats, canMSG_ERROR_FRAME, 0u);
+                pSelf->canState.txErrorCounter = pMsg->txErrorCounter;
+                pSelf->canState.rxErrorCounter = pMsg->rxErrorCounter;
+            }
+        }
+        break;
+    case PEAKUSBFD_MSG_STATUS:
+        {
+        const PEAKUSBFDSTATUSMSG_T *pMsg = (const PEAKUSBFDSTATUSMSG_T *)pHead;
+
+            if (PEAKUSBFD_MSG_CHANNEL(pMsg->channelPWB) != pSelf->deviceChannel)  {
+                break;
+            }
+            if (pMsg->channelPWB & PEAKUSBFD_STATUS_BUSOFF)  {
+                pSelf->canState.canState = CHIPSTAT_BUSOFF;
+            } else if (pMsg->channelPWB & PEAKUSBFD_STATUS_PASSIVE)  {
+                pSelf->canState.canState = CHIPSTAT_ERROR_PASSIVE;
+            } else if (pMsg->channelPWB & PEAKUSBFD_STATUS_WARNING)  {
+                pSelf->canState.canState = CHIPSTAT_ERROR_WARNING;
+            } else {
+                pSelf->canState.canState = CHIPSTAT_ERROR_ACTIVE;
+            }
+        }
+        break;
+    case PEAKUSBFD_MSG_OVERRUN:
+        CAN4OSX_DEBUG_PRINT("peak usb fd: receive overrun of the adapter\n");
+        CAN4OSX_CountBusStat(&pSelf->busStats.overruns, 1u);
+        break;
+    default:
+    	break;
+    }
+}
+
+
+/******************************************************************************/
+/**
+ * \brief usbFdBulkReadCompletion - records of a bulk in transfer
+ *
+ * The records are 32 bit aligned and carry their size, a size of 0 ends the
+ * transfer early.
+ */
+static void usbFdBulkReadCompletion(void *refCon, IOReturn result, void *arg0)
+{
+Can4osxUsbDeviceHandleEntry *pSelf = (Can4osxUsbDeviceHandleEntry *)refCon;
+UInt32 numBytesRead = (UInt32) arg0;
+UInt32 count = 0u;
+PEAKUSBFDMSGHEAD_T *pHead;
+
+    CAN4OSX_DEBUG_PRINT("Asynchronous bulk read complete (%ld)\n", (long)numBytesRead);
+
+    if (result != kIOReturnSuccess)  {
+        CAN4OSX_DEBUG_PRINT("Error from async bulk read (%08x)\n", result);
+        CAN4OSX_usbClose(pSelf);
+    } else {
+
+	    while ((count + sizeof(PEAKUSBFDMSGHEAD_T)) <= numBytesRead)  {
+    		pHead = (PEAKUSBFDMSGHEAD_T *)&(pSelf->endpointBufferBulkInRef[count]);
+    		if ((pHead->size < sizeof(PEAKUSBFDMSGHEAD_T)) || ((count + pHead->size) > numBytesRead))  {
+    			break;
+    		}
+     		usbFdDecodeMsg(pSelf, pHead);
+    		count += pHead->size;
+    	}
+
+    	CAN4OSX_NotifyRxFlush(pSelf);
+    }
+}
+
+
+/******************************************************************************/
+/**
+ * \brief usbFdBulkWriteFill - next bulk out transfer from the transmit buffer
+ *
+ * \return number of bytes to send
+ */
+static UInt32 usbFdBulkWriteFill(
+		Can4osxUsbDeviceHandleEntry *pSelf,
+        UInt8 *pBuf,
+        UInt32 size,
+        UInt32 *pFrames
+    )
+{
+PEAKUSBFDPRIVATEDATA_T *pPriv = (PEAKUSBFDPRIVATEDATA_T *)pSelf->privateData;
+
+    if (pPriv == NULL)  {
+        return(0u);
+    }
+
+    return(usbFdFillBulkPipeBuffer(&pPriv->pTransBuff, pBuf, size, pFrames));
+}
+
+
+/******************************************************************************/
+static UInt32 usbFdBulkWriteQueued(
+		Can4osxUsbDeviceHandleEntry *pSelf
+    )
+{
+PEAKUSBFDPRIVATEDATA_T *pPriv = (PEAKUSBFDPRIVATEDATA_T *)pSelf->privateData;
+
+    if (pPriv == NULL)  {
+        return(0u);
+    }
+
+    return((UInt32)pPriv->pTransBuff.bufferCount);
+}
+
+
+/******************************************************************************/
+/**
+ * \brief usbFdFillBulkPipeBuffer - packs the records into a transfer
+ *
+ * Stops before a record of the largest size might not fit, a record of size 0
+ * ends the transfer if there is room for it.
+ *
+ * \return number of bytes
+ */
+static UInt32 usbFdFillBulkPipeBuffer(
+		PEAKUSBFDTRANSMITBUFFER_T *pBufferRef,
+        UInt8 *pipe,
+        UInt32 maxPipeSize,
+        UInt32 *pMsgs
+    )
+{
+UInt32 fillState = 0u;
+PEAKUSBFDTXMSG_T msg;
+
+    while ((fillState + sizeof(PEAKUSBFDTXMSG_T)) <= maxPipeSize)  {
+        if (usbFdReadCommandBuffer(pBufferRef, &msg) == 0u)  {
+            break;
+        }
+        memcpy(&pipe[fillState], &msg, msg.size);
+        fillState += msg.size;
+        (*pMsgs)++;
+    }
+
+    if ((fillState != 0u) && ((fillState + sizeof(UInt32)) <= maxPipeSize))  {
+        memset(&pipe[fillState], 0, sizeof(UInt32));
+        fillState += sizeof(UInt32);
+    }
+
+    return(fillState);
+}
+
+
+/******************************************************************************/
+static UInt8 usbFdTestFullTransmitBuffer(
+		PEAKUSBFDTRANSMITBUFFER_T * pBuffer
+	)
+{
+    if (pBuffer->bufferCount >= pBuffer->bufferSize)  {
+        return(1u);
+    } else {
+        return(0u);
+    }
+}
+
+
+/******************************************************************************/
+static UInt8 usbFdTestEmptyTransmitBuffer(
+        PEAKUSBFDTRANSMITBUFFER_T * pBuffer
+    )
+{
+    if ( pBuffer->bufferCount == 0 )  {
+        return(1u);
+    } else {
+        return(0u);
+    }
+}
+
+
+/******************************************************************************/
+static UInt8 usbFdWriteTransmitBuffer(
+		PEAKUSBFDTRANSMITBUFFER_T* pBuffer,
+        const PEAKUSBFDTXMSG_T *pNewMsg
+    )
+{
+__block UInt8 retval = 1u;
+
+    dispatch_sync(pBuffer->bufferGDCqueueRef, ^{
+        if (usbFdTestFullTransmitBuffer(pBuffer)) {
+            retval = 0u;
+        } else {
+            memcpy(&pBuffer->msgData[(pBuffer->bufferFirst + pBuffer->bufferCount++) % pBuffer->bufferSize], pNewMsg, pNewMsg->size);
+        }
+    });
+
+    return(retval);
+}
+
+
+/******************************************************************************/
+static UInt32 usbFdWriteTransmitBufferBatch(
+		PEAKUSBFDTRANSMITBUFFER_T* pBuffer,
+        const PEAKUSBFDTXMSG_T *pMsgs,
+        UInt32 count
+    )
+{
+__block UInt32 written = 0u;
+
+    dispatch_sync(pBuffer->bufferGDCqueueRef, ^{
+        while ((written < count) && !usbFdTestFullTransmitBuffer(pBuffer))  {
+            memcpy(&pBuffer->msgData[(pBuffer->bufferFirst + pBuffer->bufferCount++) % pBuffer->bufferSize], &pMsgs[written], pMsgs[written].size);
+            written++;
+        }
+    });
+
+    return(written);
+}
+
+
+/******************************************************************************/
+static UInt8 usbFdReadCommandBuffer(
+		PEAKUSBFDTRANSMITBUFFER_T* pBuffer,
+		PEAKUSBFDTXMSG_T* pCanMsg
+    )
+{
+__block UInt8 retval = 1u;
+
+    dispatch_sync(pBuffer->bufferGDCqueueRef, ^{
+        if (usbFdTestEmptyTransmitBuffer(pBuffer)) {
+            retval = 0u;
+        } else {
+            PEAKUSBFDTXMSG_T *pMsg = &pBuffer->msgData[pBuffer->bufferFirst++ % pBuffer->bufferSize];
+            pBuffer->bufferCount--;
+            memcpy(pCanMsg, pMsg, pMsg->size);
+        }
+    });
+
+    return(retval);
+}
@@ -48,6 +48,171 @@
 extern CAN4OSX_HW_FUNC_T peakUsbFdHardwareFunctions;
 extern CAN4OSX_USB_FUNC_T peakUsbFdUsbFunctions;
 
+/* the commands are collected in a list of 8 byte records on the command pipe,
+ * a record of 0xff bytes ends the list if it does not fill the buffer */
+#define PEAKUSBFD_CMD_BUFFER_SIZE	512
+#define PEAKUSBFD_CMD_SIZE			8
+#define PEAKUSBFD_CMD_TIMEOUT_MS	1000u
+
+#define PEAKUSBFD_CMD_OPCODE(ch, op)	((UInt16)(((ch) << 12) | ((op) & 0x3ff)))
+#define PEAKUSBFD_CMD_GET_OPCODE(oc)	((oc) & 0x3ff)
+#define PEAKUSBFD_CMD_GET_CHANNEL(oc)	((oc) >> 12)
+
+#define PEAKUSBFD_CMD_NOP				0x000
+#define PEAKUSBFD_CMD_RESET_MODE		0x001
+#define PEAKUSBFD_CMD_NORMAL_MODE		0x002
+#define PEAKUSBFD_CMD_LISTEN_ONLY_MODE	0x003
+#define PEAKUSBFD_CMD_TIMING_SLOW		0x004
+#define PEAKUSBFD_CMD_TIMING_FAST		0x005
+#define PEAKUSBFD_CMD_FILTER_STD		0x008
+#define PEAKUSBFD_CMD_SET_EN_OPTION		0x00b
+#define PEAKUSBFD_CMD_CLR_DIS_OPTION	0x00c
+#define PEAKUSBFD_CMD_END_OF_COLLECTION	0x3ff
+
+/* options of PEAKUSBFD_CMD_SET_EN_OPTION / PEAKUSBFD_CMD_CLR_DIS_OPTION */
+#define PEAKUSBFD_OPTION_ERROR			0x0001
+#define PEAKUSBFD_OPTION_BUSLOAD		0x0002
+#define PEAKUSBFD_OPTION_CANDFDISO		0x0004
+
+/* one bit per 11 bit id, 64 rows of 32 ids */
+#define PEAKUSBFD_FILTER_STD_ROWS		64u
+
+/* vendor request telling the adapter a driver is loaded */
+#define PEAKUSBFD_REQ_FCT				2
+#define PEAKUSBFD_FCT_DRVLD				5
+#define PEAKUSBFD_FCT_DRVLD_LEN			16
+
+/* the CAN core runs with 80 MHz */
+#define PEAKUSBFD_CLOCK_HZ				80000000u
+#define PEAKUSBFD_BITRATE(brp, tseg1, tseg2)	(PEAKUSBFD_CLOCK_HZ / ((brp) * (1u + (tseg1) + (tseg2))))
+
+/* time of the records, a 64 bit us counter */
+#define PEAKUSBFD_TIMESTAMP_HZ			1000000u
+#define PEAKUSBFD_TIMESTAMP_BITS		64u
+
+/* record types on the message pipes */
+#define PEAKUSBFD_MSG_CAN_RX			0x0001
+#define PEAKUSBFD_MSG_ERROR				0x0002
+#define PEAKUSBFD_MSG_STATUS			0x0003
+#define PEAKUSBFD_MSG_BUSLOAD			0x0004
+#define PEAKUSBFD_MSG_CALIBRATION		0x0100
+#define PEAKUSBFD_MSG_OVERRUN			0x0101
+#define PEAKUSBFD_MSG_CAN_TX			0x1000
+
+/* flags of PEAKUSBFDRXMSG_T and PEAKUSBFDTXMSG_T */
+#define PEAKUSBFD_MSG_FLAG_RTR			0x0001
+#define PEAKUSBFD_MSG_FLAG_EXT_ID		0x0002
+#define PEAKUSBFD_MSG_FLAG_LOOPED_BACK	0x0004
+#define PEAKUSBFD_MSG_FLAG_SINGLE_SHOT	0x0008
+#define PEAKUSBFD_MSG_FLAG_EXT_DATA_LEN	0x0010
+#define PEAKUSBFD_MSG_FLAG_BRS			0x0020
+#define PEAKUSBFD_MSG_FLAG_ESI			0x0040
+#define PEAKUSBFD_MSG_FLAG_SELF_RECEIVE	0x0080
+
+/* a self received frame is the TX ack, it returns the client byte it was sent with */
+#define PEAKUSBFD_MSG_CLIENT_MASK		0xffu
+
+#define PEAKUSBFD_MSG_CHANNEL(cd)		((cd) & 0x0f)
+#define PEAKUSBFD_MSG_DLC(cd)			((cd) >> 4)
+#define PEAKUSBFD_MSG_CHANNEL_DLC(c, d)	((UInt8)(((d) << 4) | ((c) & 0x0f)))
+
+/* bus state of PEAKUSBFDSTATUSMSG_T */
+#define PEAKUSBFD_STATUS_PASSIVE		0x20
+#define PEAKUSBFD_STATUS_WARNING		0x40
+#define PEAKUSBFD_STATUS_BUSOFF			0x80
+
+/* records are 32 bit aligned, a size of 0 ends the transfer */
+#define PEAKUSBFD_MSG_ALIGN(len)		(((len) + 3u) & ~3u)
+
+typedef struct {
+	UInt16 opcodeChannel;
+	UInt8  unused[6];
+} __attribute__ ((packed)) PEAKUSBFDSTDCMD_T;
+
+typedef struct {
+	UInt16 opcodeChannel;
+	UInt8  ewl;
+	UInt8  sjw;
+	UInt8  tseg2;
+	UInt8  tseg1;
+	UInt16 brp;
+} __attribute__ ((packed)) PEAKUSBFDTIMINGSLOW_T;
+
+typedef struct {
+	UInt16 opcodeChannel;
+	UInt8  unused;
+	UInt8  sjw;
+	UInt8  tseg2;
+	UInt8  tseg1;
+	UInt16 brp;
+} __attribute__ ((packed)) PEAKUSBFDTIMINGFAST_T;
+
+typedef struct {
+	UInt16 opcodeChannel;
+	UInt16 idx;
+	UInt32 mask;
+} __attribute__ ((packed)) PEAKUSBFDFILTERSTD_T;
+
+typedef struct {
+	UInt16 opcodeChannel;
+	UInt16 options;
+	UInt32 unused;
+} __attribute__ ((packed)) PEAKUSBFDOPTIONS_T;
+
+typedef union {
+	PEAKUSBFDSTDCMD_T		std;
+	PEAKUSBFDTIMINGSLOW_T	timingSlow;
+	PEAKUSBFDTIMINGFAST_T	timingFast;
+	PEAKUSBFDFILTERSTD_T	filterStd;
+	PEAKUSBFDOPTIONS_T		options;
+} __attribute__ ((packed)) PEAKUSBFD_CMD_T;
+
+typedef struct {
+	UInt16 size;
+	UInt16 type;
+	UInt32 tsLow;
+	UInt32 tsHigh;
+} __attribute__ ((packed)) PEAKUSBFDMSGHEAD_T;
+
+typedef struct {
+	PEAKUSBFDMSGHEAD_T head;
+	UInt32 tagLow;
+	UInt32 tagHigh;
+	UInt8  channelDlc;
+	UInt8  client;
+	UInt16 flags;
+	UInt32 canId;
+	UInt8  data[64];
+} __attribute__ ((packed)) PEAKUSBFDRXMSG_T;
+
+typedef struct {
+	PEAKUSBFDMSGHEAD_T head;
+	UInt8  channelTypeD;
+	UInt8  codeG;
+	UInt8  txErrorCounter;
+	UInt8  rxErrorCounter;
+} __attribute__ ((packed)) PEAKUSBFDERRORMSG_T;
+
+typedef struct {
+	PEAKUSBFDMSGHEAD_T head;
+	UInt8  channelPWB;
+	UInt8  unused[3];
+} __attribute__ ((packed)) PEAKUSBFDSTATUSMSG_T;
+
+typedef struct {
+	UInt16 size;
+	UInt16 type;
+	UInt32 tagLow;
+	UInt32 tagHigh;
+	UInt8  channelDlc;
+	UInt8  client;
+	UInt16 flags;
+	UInt32 canId;
+	UInt8  data[64];
+} __attribute__ ((packed)) PEAKUSBFDTXMSG_T;
+
+#define PEAKUSBFD_RX_MSG_HEAD_SIZE		(sizeof(PEAKUSBFDRXMSG_T) - 64u)
+#define PEAKUSBFD_TX_MSG_HEAD_SIZE		(sizeof(PEAKUSBFDTXMSG_T) - 64u)
 
 
 